@@ -0,0 +1,22 @@
+/*
+ * littlefs_bd.h
+ *
+ *  Block device of the littlefs test on the HSPI NOR flash
+ */
+
+#ifndef INC_LITTLEFS_BD_H_
+#define INC_LITTLEFS_BD_H_
+
+#include "lfs.h"
+
+// Erases issued so far, the benches report the difference
+extern uint32_t bdEraseCount;
+
+// Block device operations of the lfs_config. Erases run in the background
+// and are suspended for reads, the DWT cycle counter must be enabled.
+int user_provided_block_device_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size);
+int user_provided_block_device_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size);
+int user_provided_block_device_erase(const struct lfs_config *c, lfs_block_t block);
+int user_provided_block_device_sync(const struct lfs_config *c);
+
+#endif /* INC_LITTLEFS_BD_H_ */
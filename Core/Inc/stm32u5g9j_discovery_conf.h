@@ -46,6 +46,7 @@ extern "C" {
 /* IRQ priorities (Default is 15 as lowest priority level) */
 #define BSP_BUTTON_USER_IT_PRIORITY         15U
 #define BSP_TS_IT_PRIORITY                  15U
+#define BSP_HSPI_NOR_IT_PRIORITY            15U
 
 #ifdef __cplusplus
 }
@@ -63,7 +63,7 @@ void I2C2_ER_IRQHandler(void);
 void USART1_IRQHandler(void);
 void LTDC_IRQHandler(void);
 /* USER CODE BEGIN EFP */
-
+void HSPI1_IRQHandler(void);
 /* USER CODE END EFP */
 
 #ifdef __cplusplus
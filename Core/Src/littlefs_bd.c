@@ -0,0 +1,180 @@
+/*
+ * littlefs_bd.c
+ *
+ *  Block device of the littlefs test on the HSPI NOR flash
+ */
+
+#include "main.h"
+#include "stm32u5g9j_discovery_hspi.h"
+#include "mx66uw1g45g.h"
+#include "littlefs_bd.h"
+
+// Erases are left running when the erase callback returns, the next prog or
+// erase waits for them. A read that comes in meanwhile suspends the erase,
+// reads and resumes it, so reads don't wait for up to the full erase time.
+// The erase only makes progress while it is resumed, so a read that comes
+// in less than BD_ERASE_RESUME_MIN_US after the last resume, timed with the
+// DWT cycle counter, doesn't suspend it again. Like a read of the block
+// being erased, it waits for the end of the erase in the interrupt-driven
+// wait of the BSP, which yields through BSP_HSPI_NOR_WaitCallback, rather
+// than spinning until the erase may be suspended. A burst of reads, such as
+// copying a block before programming it, so costs one suspend and the rest
+// of the erase, which the prog that follows would have waited for anyway.
+#define BD_ERASE_RESUME_MIN_US 300
+static uint8_t bdErasing = 0;
+static uint32_t bdEraseAddr;
+static uint32_t bdResumeCycles;
+uint32_t bdEraseCount;
+
+// Wait for the running erase to finish
+static int bd_erase_wait(void)
+{
+	bdErasing = 0;
+	if(BSP_HSPI_NOR_WaitForMemoryReady(0) != BSP_ERROR_NONE)
+	{
+		return LFS_ERR_IO;
+	}
+	return 0;
+}
+
+// Suspend the running erase, if any, before reading [addr, addr+size).
+// Returns 1 if the erase was suspended and must be resumed after the read.
+static int bd_erase_suspend(const struct lfs_config *c, uint32_t addr, lfs_size_t size)
+{
+	int32_t status;
+
+	if(!bdErasing)
+	{
+		return 0;
+	}
+
+	if(addr < bdEraseAddr + c->block_size && bdEraseAddr < addr + size)
+	{
+		return bd_erase_wait();
+	}
+
+	// too soon after the last resume for the erase to have made progress
+	if(DWT->CYCCNT - bdResumeCycles < BD_ERASE_RESUME_MIN_US*(SystemCoreClock/1000000))
+	{
+		return bd_erase_wait();
+	}
+
+	if(BSP_HSPI_NOR_SuspendErase(0) == BSP_ERROR_NONE)
+	{
+		return 1;
+	}
+
+	// the erase may have finished before the suspend got through
+	status = BSP_HSPI_NOR_GetStatus(0);
+	if(status == BSP_ERROR_HSPI_SUSPENDED)
+	{
+		return 1;
+	}
+	else if(status != BSP_ERROR_NONE)
+	{
+		return LFS_ERR_IO;
+	}
+	bdErasing = 0;
+	return 0;
+}
+
+static int bd_erase_resume(void)
+{
+	if(BSP_HSPI_NOR_ResumeErase(0) != BSP_ERROR_NONE)
+	{
+		// the erase may have completed right after the resume
+		if(BSP_HSPI_NOR_GetStatus(0) != BSP_ERROR_NONE)
+		{
+			return LFS_ERR_IO;
+		}
+		bdErasing = 0;
+	}
+	bdResumeCycles = DWT->CYCCNT;
+	return 0;
+}
+
+// Read a region in a block. Negative error codes are propagated to the user.
+// With read_span_max set the region may continue into the following blocks.
+int user_provided_block_device_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+	uint32_t readAddr;
+	int suspended;
+	int err = 0;
+
+	readAddr = (c->block_size * block) + off;
+	suspended = bd_erase_suspend(c, readAddr, size);
+	if(suspended < 0)
+	{
+		return suspended;
+	}
+	//sFLASH_ReadBuffer(buffer, readAddr, size);
+	//printf("LSF READ: addr=%d, size=%d\n\r", readAddr, size);
+	if(BSP_HSPI_NOR_Read(0, buffer, readAddr, size) != BSP_ERROR_NONE)
+	{
+		printf("Read : Failed\r\n");
+	}
+	if(suspended)
+	{
+		err = bd_erase_resume();
+	}
+	return err;
+}
+
+// Program a region in a block. The block must have previously
+// been erased. Negative error codes are propagated to the user.
+// May return LFS_ERR_CORRUPT if the block should be considered bad.
+int user_provided_block_device_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+	uint32_t writeAddr;
+
+	writeAddr = (c->block_size * block) + off;
+	if(bdErasing && bd_erase_wait() < 0)
+	{
+		return LFS_ERR_IO;
+	}
+	//sFLASH_WriteBuffer((uint8_t*)buffer, writeAddr, size);
+	//printf("LSF WRITE: addr=%d, size=%d\n\r", writeAddr, size);
+	if(BSP_HSPI_NOR_Write(0, (uint8_t*)buffer, writeAddr, size) != BSP_ERROR_NONE)
+	{
+		printf("Write : Failed\r\n");
+	}
+	return 0;
+}
+
+// Erase a block. A block must be erased before being programmed.
+// The state of an erased block is undefined. Negative error codes
+// are propagated to the user.
+// May return LFS_ERR_CORRUPT if the block should be considered bad.
+int user_provided_block_device_erase(const struct lfs_config *c, lfs_block_t block)
+{
+	uint32_t eraseAddr;
+
+	eraseAddr = (c->block_size * block);
+
+	//sFLASH_EraseSector(eraseAddr);
+	//printf("LSF ERASE: addr=%d\n\r", eraseAddr);
+	if(bdErasing && bd_erase_wait() < 0)
+	{
+		return LFS_ERR_IO;
+	}
+	if(BSP_HSPI_NOR_Erase_Block(0, eraseAddr, MX66UW1G45G_ERASE_4K) != BSP_ERROR_NONE)
+	{
+		printf("Erase Sector 4K: Failed\r\n");
+	}
+	else
+	{
+		bdErasing = 1;
+		bdEraseAddr = eraseAddr;
+		bdResumeCycles = DWT->CYCCNT;
+		bdEraseCount++;
+	}
+	return 0;
+}
+
+
+// Sync the state of the underlying block device. Negative error codes
+// are propagated to the user.
+int user_provided_block_device_sync(const struct lfs_config *c)
+{
+	return 0;
+}
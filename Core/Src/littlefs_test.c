@@ -37,137 +37,1695 @@
 #define TEST_HSPI_NOR_FLASH_HW 1
 #else
 #include "lfs.h"
+#include "lfs_zfile.h"
+#include "littlefs_bd.h"
 // variables used by the filesystem
 lfs_t lfs;
 lfs_file_t file;
 uint8_t doTest = 0;
 
-int user_provided_block_device_sync(const struct lfs_config *c);
-int user_provided_block_device_erase(const struct lfs_config *c, lfs_block_t block);
-int user_provided_block_device_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size);
-int user_provided_block_device_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size);
+// configuration of the filesystem is provided by this struct, fetch_size
+// is filled in by lfs_tune_fetch before mounting
+struct lfs_config cfg = {
+    // block device operations
+    .read  = user_provided_block_device_read,
+    .prog  = user_provided_block_device_prog,
+    .erase = user_provided_block_device_erase,
+    .sync  = user_provided_block_device_sync,
+
+    // block device configuration
+    // the NOR reads at any granularity, 16 keeps DTR reads word aligned
+    .read_size = 16,
+    // program a page at a time, so small commits only program the pages
+    // they touch
+    .prog_size = MX66UW1G45G_PAGE_SIZE,
+    .block_size = 4096,
+    .block_count = 32768,
+    .cache_size = 4096,
+    .lookahead_size = 4096,
+    //.block_cycles = 512,
+	.block_cycles = -1,
+    // keep metadata pairs in the first 16 64K sectors (1 MiB)
+    .metadata_zone = 16*(MX66UW1G45G_BLOCK_64K/4096),
+    // the NOR is linearly addressed, so reads can run across blocks
+    .read_span_max = 64*1024,
+    // read/prog caches, lookahead, the file caches and the compaction
+    // index without heap churn
+    .cache_pool_count = 3 + 4 + 1,
+    // open files share 4 caches
+    .file_cache_max = 4,
+    // files too big to inline could share pack blocks, this is left off
+    // since the first packed file marks the volume v2.2, which firmware
+    // from before packing can't mount
+    .pack_max = 0,
+    // records up to 1000 bytes stay in their metadata pair while it has room
+    .inline_adapt_max = 1000,
+};
+
+// Pick fetch_size from the measured cost of reads in the configured HSPI
+// mode. A read costs about overhead + size*perByte, so fetching more than
+// asked for pays off as long as the extra bytes cost less than a command.
+// We fetch the bytes the bus moves in one command's overhead, rounded down
+// to a power of two between read_size and cache_size. Each read is timed
+// a few times with the DWT cycle counter and the fastest run is kept, so
+// interrupts don't skew the result.
+#define LFS_TUNE_READ_SIZE 1024
+#define LFS_TUNE_RUNS      4
+
+static uint8_t tuneBuffer[LFS_TUNE_READ_SIZE];
+
+static uint32_t lfs_tune_time(lfs_size_t size) {
+    uint32_t best = UINT32_MAX;
+    for (int i = 0; i < LFS_TUNE_RUNS; i++) {
+        uint32_t start = DWT->CYCCNT;
+        if (BSP_HSPI_NOR_Read(0, tuneBuffer, 0, size) != BSP_ERROR_NONE) {
+            return 0;
+        }
+        best = lfs_min(best, DWT->CYCCNT - start);
+    }
+
+    return best;
+}
+
+void lfs_tune_fetch(struct lfs_config *c) {
+    uint32_t small = lfs_tune_time(c->read_size);
+    uint32_t large = lfs_tune_time(LFS_TUNE_READ_SIZE);
+    if (!small || large <= small) {
+        // can't tell, fetch whole caches like before
+        c->fetch_size = c->cache_size;
+        printf("lfs fetch_size %lu (untuned)\r\n",
+                (unsigned long)c->fetch_size);
+        return;
+    }
+
+    // cycles per byte in 1/256ths, the DTR modes move more than a byte
+    // per cycle
+    uint32_t perByte = ((large - small) << 8)
+            / (LFS_TUNE_READ_SIZE - c->read_size);
+    uint32_t overhead = small - lfs_min(small, (c->read_size*perByte) >> 8);
+    uint32_t fetch = (perByte) ? (overhead << 8) / perByte : c->cache_size;
+
+    fetch = lfs_max(fetch, c->read_size);
+    fetch = lfs_min(fetch, c->cache_size);
+    c->fetch_size = 1U << (lfs_npw2(fetch+1) - 1);
+
+    printf("lfs fetch_size %lu (overhead %lu cycles, %lu/256 cycles/byte)"
+            "\r\n", (unsigned long)c->fetch_size,
+            (unsigned long)overhead, (unsigned long)perByte);
+}
+
+// entries read per lfs_dir_readbatch call
+#define LFS_LS_BATCH 8
+static struct lfs_info lsInfo[LFS_LS_BATCH];
+
+int lfs_ls(lfs_t *lfs, const char *path) {
+    lfs_dir_t dir;
+    int err = lfs_dir_open(lfs, &dir, path);
+    if (err) {
+        return err;
+    }
+
+    while (true) {
+        lfs_ssize_t res = lfs_dir_readbatch(lfs, &dir, lsInfo, LFS_LS_BATCH,
+                NULL);
+        if (res < 0) {
+            lfs_dir_close(lfs, &dir);
+            return res;
+        }
+
+        if (res == 0) {
+            break;
+        }
+
+        for (lfs_ssize_t j = 0; j < res; j++) {
+            struct lfs_info *info = &lsInfo[j];
+            switch (info->type) {
+                case LFS_TYPE_REG: printf("reg "); break;
+                case LFS_TYPE_DIR: printf("dir "); break;
+                default:           printf("?   "); break;
+            }
+
+            static const char *prefixes[] = {"", "K", "M", "G"};
+            for (int i = sizeof(prefixes)/sizeof(prefixes[0])-1; i >= 0; i--) {
+                if (info->size >= (1 << 10*i)-1) {
+                    printf("%*u%sB ", 4-(i != 0), info->size >> 10*i,
+                            prefixes[i]);
+                    break;
+                }
+            }
+
+            printf("%s\r\n", info->name);
+        }
+    }
+
+    err = lfs_dir_close(lfs, &dir);
+    if (err) {
+        return err;
+    }
+
+    return 0;
+}
+
+// Uncomment to run the littlefs benchmark once after mount. Cycle counts
+// come from the DWT cycle counter. The project fixes the geometry at compile
+// time (LFS_READ_SIZE, LFS_PROG_SIZE, LFS_BLOCK_SIZE, LFS_CACHE_SIZE), drop
+// these symbols to compare against the runtime cfg build. The passes, in the
+// order they run:
+//
+// - seqwrite, seqread: a LFS_BENCH_FILE_SIZE file written and read back
+// - randread: small reads at pseudo-random offsets
+// - openclose: open/close cycles
+// - clone: a file copied through read/write and cloned
+// - commit: small synced overwrites of an inlined file
+// - erase: erases with a background task running in the flash waits
+// - list: a directory listed entry by entry and in batches as it fills up
+// - zfile: records written to a plain file and to a zfile
+// - pack: many small files with and without packing
+// - inline: small records and a small synced file with and without
+//   adaptive inlining
+// - snapshot: logs appended to with and without a snapshot held
+// - snapscan: allocation scans with and without a snapshot held
+// - sparse: a 1% populated file zero filled, left sparse, then filled
+// - index: random seeks in a capture file with and without a seek index
+// - logs: appends to 1, 8 and LFS_BENCH_FILES_MAX open logs
+// - seqwrite, seqread: again with a size hint, then with the file reserved
+//   up front
+//#define TEST_LFS_BENCH
+#if defined TEST_LFS_BENCH
+#define LFS_BENCH_FILE_SIZE   (256*1024)
+#define LFS_BENCH_CHUNK_SIZE  1024
+#define LFS_BENCH_READ_SIZE   (32*1024)
+#define LFS_BENCH_SEEKS       1024
+#define LFS_BENCH_FILES_MAX   64
+#define LFS_BENCH_LOG_SIZE    (16*1024)
+#define LFS_BENCH_LOG_CHUNK   256
+#define LFS_BENCH_COMMITS     256
+#define LFS_BENCH_COMMIT_SIZE 20
+#define LFS_BENCH_ERASES      100
+#define LFS_BENCH_IDLE_SIZE   64
+#define LFS_BENCH_LIST_MAX    1024
+#define LFS_BENCH_RECORD_SIZE 16
+#define LFS_BENCH_PACK_FILES  10000
+#define LFS_BENCH_PACK_DIRS   100
+#define LFS_BENCH_PACK_SIZE   1024
+#define LFS_BENCH_PACK_GCS    64
+#define LFS_BENCH_INLINE_DIRS 16
+#define LFS_BENCH_INLINE_RECS 2
+#define LFS_BENCH_INLINE_SIZE 1000
+#define LFS_BENCH_INLINE_REWRITES 8
+#define LFS_BENCH_INLINE_SYNCS 64
+#define LFS_BENCH_SNAP_FILES  16
+#define LFS_BENCH_SNAP_ROUNDS 16
+#define LFS_BENCH_SCAN_LOOKAHEAD 48
+#define LFS_BENCH_SCAN_WINDOWS 4
+#define LFS_BENCH_SPARSE_SIZE (16*1024*1024)
+#define LFS_BENCH_SPARSE_WRITES \
+    (LFS_BENCH_SPARSE_SIZE/100/LFS_BENCH_CHUNK_SIZE)
+#define LFS_BENCH_INDEX_SIZE  (4*1024*1024)
+#define LFS_BENCH_INDEX_SYNC  (16*1024)
+#define LFS_BENCH_INDEX_COUNT 128
+
+static uint8_t benchBuffer[LFS_BENCH_CHUNK_SIZE];
+static uint8_t benchReadBuffer[LFS_BENCH_READ_SIZE];
+static lfs_file_t benchFiles[LFS_BENCH_FILES_MAX];
+static uint8_t benchZBuffer[LFS_ZFILE_BUFFER_SIZE(4096, LFS_ZFILE_INDEX_COUNT)];
+static uint8_t benchSnapBuffer[LFS_SNAPSHOT_BUFFER_SIZE(4096, 32768)];
+static uint8_t benchSparseBuffer[4096/8];
+static uint8_t benchIndexBuffer[LFS_INDEX_BUFFER_SIZE(LFS_BENCH_INDEX_COUNT)];
+
+static uint32_t benchIdleCycles;
+static uint32_t benchIdleCrc;
+
+// stands in for other work, say rendering, while the flash is busy, the
+// waits call this in small slices until the status match interrupt
+void BSP_HSPI_NOR_WaitCallback(uint32_t Instance) {
+    uint32_t start = DWT->CYCCNT;
+    benchIdleCrc = lfs_crc(benchIdleCrc, benchBuffer, LFS_BENCH_IDLE_SIZE);
+    benchIdleCycles += DWT->CYCCNT - start;
+}
+
+// the cycle counter is never reset, the block device uses it to time
+// erase suspends, so passes are timed with deltas from the start
+static uint32_t benchStartCycles;
+
+static void lfs_bench_start(void) {
+    benchStartCycles = DWT->CYCCNT;
+}
+
+static uint32_t lfs_bench_cycles(void) {
+    return DWT->CYCCNT - benchStartCycles;
+}
+
+// prints a pass's cycles and time, and its throughput if it moved bytes
+static void lfs_bench_report(const char *name, uint32_t cycles,
+        uint32_t bytes) {
+    uint32_t us = cycles / (SystemCoreClock / 1000000);
+    printf("bench %-10s %10lu cycles %8lu us", name,
+            (unsigned long)cycles, (unsigned long)us);
+    if (bytes && us) {
+        printf(" %6lu KiB/s", (unsigned long)(((uint64_t)bytes*1000000
+                / us) >> 10));
+    }
+    printf("\r\n");
+}
+
+// writes a file in order, syncing every sync bytes so metadata commits are
+// interleaved with the data, set .metadata_zone = 0 to compare without a
+// metadata zone. hint is the file's size hint, compare with and without it
+// for extent allocation, which matters most once the free space is
+// fragmented. With reserve the file is reserved and pre-erased first, timed
+// on its own, so the write shows the program-only throughput
+int lfs_bench_seqwrite(lfs_t *lfs, const char *path, lfs_size_t size,
+        lfs_size_t sync, lfs_size_t hint, bool reserve) {
+    lfs_file_t file;
+    struct lfs_file_config fcfg = {.size_hint = hint};
+    int err = lfs_file_opencfg(lfs, &file, path,
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC, &fcfg);
+    if (err) {
+        return err;
+    }
+
+    if (reserve) {
+        lfs_bench_start();
+        err = lfs_file_reserve(lfs, &file, size, LFS_R_ERASE);
+        lfs_bench_report("reserve", lfs_bench_cycles(), size);
+        if (err) {
+            lfs_file_close(lfs, &file);
+            return err;
+        }
+    }
+
+    lfs_bench_start();
+    for (lfs_size_t i = 0; i < size; i += sizeof(benchBuffer)) {
+        memset(benchBuffer, (uint8_t)(i / sizeof(benchBuffer)),
+                sizeof(benchBuffer));
+        lfs_ssize_t res = lfs_file_write(lfs, &file,
+                benchBuffer, sizeof(benchBuffer));
+        if (res < 0) {
+            lfs_file_close(lfs, &file);
+            return res;
+        }
+
+        if (sync && (i + sizeof(benchBuffer)) % sync == 0) {
+            err = lfs_file_sync(lfs, &file);
+            if (err) {
+                lfs_file_close(lfs, &file);
+                return err;
+            }
+        }
+    }
+
+    err = lfs_file_close(lfs, &file);
+    lfs_bench_report("seqwrite", lfs_bench_cycles(), size);
+    return err;
+}
+
+// reads a file in large reads and reports the extents it is in, set
+// .read_span_max = 0 to compare against reading block by block
+int lfs_bench_seqread(lfs_t *lfs, const char *path) {
+    lfs_file_t file;
+    int err = lfs_file_open(lfs, &file, path, LFS_O_RDONLY);
+    if (err) {
+        return err;
+    }
+
+    lfs_size_t size = 0;
+    lfs_bench_start();
+    while (true) {
+        lfs_ssize_t res = lfs_file_read(lfs, &file,
+                benchReadBuffer, sizeof(benchReadBuffer));
+        if (res < 0) {
+            lfs_file_close(lfs, &file);
+            return res;
+        }
+
+        if (res == 0) {
+            break;
+        }
+
+        size += res;
+    }
+    lfs_bench_report("seqread", lfs_bench_cycles(), size);
+    printf("bench %-10s %10ld extents\r\n", path,
+            (long)lfs_file_extents(lfs, &file));
+
+    return lfs_file_close(lfs, &file);
+}
+
+// open/close cycles, this is dominated by the metadata lookup and the
+// file cache allocation, set .cache_pool_count = 0 to compare against
+// allocating from the heap
+int lfs_bench_openclose(lfs_t *lfs, const char *path) {
+    lfs_bench_start();
+    for (int i = 0; i < LFS_BENCH_SEEKS; i++) {
+        lfs_file_t file;
+        int err = lfs_file_open(lfs, &file, path, LFS_O_RDONLY);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_file_close(lfs, &file);
+        if (err) {
+            return err;
+        }
+    }
+    lfs_bench_report("openclose", lfs_bench_cycles() / LFS_BENCH_SEEKS, 0);
+
+    struct lfs_allocstat stat;
+    int err = lfs_fs_allocstat(lfs, &stat);
+    if (err) {
+        return err;
+    }
+
+    printf("bench pool %lu/%lu peak %lu, heap %lu peak %lu bytes, "
+            "%lu/%lu allocs from heap\r\n",
+            (unsigned long)stat.pool_used, (unsigned long)stat.pool_count,
+            (unsigned long)stat.pool_peak,
+            (unsigned long)stat.heap_used, (unsigned long)stat.heap_peak,
+            (unsigned long)stat.heap_allocs, (unsigned long)stat.allocs);
+    return 0;
+}
+
+// copies a file through read/write and clones it, the clone is a single
+// metadata commit whatever the size of the file
+int lfs_bench_clone(lfs_t *lfs, const char *path) {
+    lfs_file_t src;
+    int err = lfs_file_open(lfs, &src, path, LFS_O_RDONLY);
+    if (err) {
+        return err;
+    }
+
+    lfs_file_t dst;
+    err = lfs_file_open(lfs, &dst, "bench_copy",
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    if (err) {
+        lfs_file_close(lfs, &src);
+        return err;
+    }
+
+    lfs_size_t size = 0;
+    lfs_bench_start();
+    while (true) {
+        lfs_ssize_t res = lfs_file_read(lfs, &src,
+                benchReadBuffer, sizeof(benchReadBuffer));
+        if (res > 0) {
+            res = lfs_file_write(lfs, &dst, benchReadBuffer, res);
+        }
+        if (res <= 0) {
+            err = res;
+            break;
+        }
+        size += res;
+    }
+
+    int cerr = lfs_file_close(lfs, &dst);
+    lfs_bench_report("copy", lfs_bench_cycles(), size);
+    lfs_file_close(lfs, &src);
+    if (err) {
+        return err;
+    }
+    if (cerr) {
+        return cerr;
+    }
+
+    lfs_bench_start();
+    err = lfs_file_clone(lfs, path, "bench_clone");
+    lfs_bench_report("clone", lfs_bench_cycles(), 0);
+    if (err) {
+        return err;
+    }
+
+    // appending to the clone copies only its last block
+    err = lfs_file_open(lfs, &dst, "bench_clone",
+            LFS_O_WRONLY | LFS_O_APPEND);
+    if (err) {
+        return err;
+    }
+
+    lfs_ssize_t res = lfs_file_write(lfs, &dst, benchBuffer,
+            LFS_BENCH_RECORD_SIZE);
+    err = lfs_file_close(lfs, &dst);
+    if (res < 0) {
+        return res;
+    }
+    if (err) {
+        return err;
+    }
+
+    struct lfs_info info;
+    err = lfs_stat(lfs, path, &info);
+    if (err) {
+        return err;
+    }
+
+    if (info.size != size) {
+        printf("bench clone changed %s\r\n", path);
+        return LFS_ERR_CORRUPT;
+    }
+
+    err = lfs_remove(lfs, "bench_copy");
+    if (err) {
+        return err;
+    }
+
+    return lfs_remove(lfs, "bench_clone");
+}
+
+// appends to count open log files round-robin, with shared file caches
+// only .file_cache_max caches are used however many files are open, set
+// .file_cache_max = 0 to compare against a cache per file
+int lfs_bench_logs(lfs_t *lfs, int count) {
+    char path[16];
+    for (int i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "log%d", i);
+        int err = lfs_file_open(lfs, &benchFiles[i], path,
+                LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+        if (err) {
+            return err;
+        }
+    }
+
+    struct lfs_allocstat before;
+    int err = lfs_fs_allocstat(lfs, &before);
+    if (err) {
+        return err;
+    }
+
+    memset(benchBuffer, 0x55, LFS_BENCH_LOG_CHUNK);
+    lfs_bench_start();
+    for (lfs_size_t off = 0; off < LFS_BENCH_LOG_SIZE;
+            off += LFS_BENCH_LOG_CHUNK) {
+        for (int i = 0; i < count; i++) {
+            lfs_ssize_t res = lfs_file_write(lfs, &benchFiles[i],
+                    benchBuffer, LFS_BENCH_LOG_CHUNK);
+            if (res < 0) {
+                return res;
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        err = lfs_file_close(lfs, &benchFiles[i]);
+        if (err) {
+            return err;
+        }
+    }
+    lfs_bench_report("logs", lfs_bench_cycles(), count*LFS_BENCH_LOG_SIZE);
+
+    struct lfs_allocstat after;
+    err = lfs_fs_allocstat(lfs, &after);
+    if (err) {
+        return err;
+    }
+
+    lfs_size_t caches = (cfg.file_cache_max)
+            ? lfs_min(count, cfg.file_cache_max)
+            : (lfs_size_t)count;
+    printf("bench %3d files %7lu cache bytes %6lu evictions\r\n", count,
+            (unsigned long)(caches*cfg.cache_size),
+            (unsigned long)(after.file_evictions - before.file_evictions));
+
+    for (int i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "log%d", i);
+        err = lfs_remove(lfs, path);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+// small reads at pseudo-random offsets, this is dominated by the
+// ctz skip-list walk and the block device cache checks
+int lfs_bench_randread(lfs_t *lfs, const char *path) {
+    lfs_file_t file;
+    int err = lfs_file_open(lfs, &file, path, LFS_O_RDONLY);
+    if (err) {
+        return err;
+    }
+
+    lfs_soff_t size = lfs_file_size(lfs, &file);
+    uint32_t seed = 1;
+    lfs_bench_start();
+    for (int i = 0; i < LFS_BENCH_SEEKS; i++) {
+        seed = seed*1103515245 + 12345;
+        lfs_file_seek(lfs, &file, (seed >> 8) % size, LFS_SEEK_SET);
+        lfs_ssize_t res = lfs_file_read(lfs, &file, benchBuffer, 16);
+        if (res < 0) {
+            lfs_file_close(lfs, &file);
+            return res;
+        }
+    }
+    lfs_bench_report("randread", lfs_bench_cycles(), 0);
+
+    return lfs_file_close(lfs, &file);
+}
+
+// small synced overwrites of an inlined file, each is one metadata commit,
+// set .prog_size and LFS_PROG_SIZE to 4096 to compare against programming
+// whole blocks, the padding then shows up as skipped all-0xFF pages
+int lfs_bench_commit(lfs_t *lfs, const char *path) {
+    lfs_file_t file;
+    int err = lfs_file_open(lfs, &file, path, LFS_O_WRONLY | LFS_O_CREAT);
+    if (err) {
+        return err;
+    }
+
+    memset(benchBuffer, 0x5a, LFS_BENCH_COMMIT_SIZE);
+    BSP_HSPI_NOR_ResetStats(0);
+    lfs_bench_start();
+    for (int i = 0; i < LFS_BENCH_COMMITS; i++) {
+        err = lfs_file_rewind(lfs, &file);
+        if (err) {
+            lfs_file_close(lfs, &file);
+            return err;
+        }
+
+        lfs_ssize_t res = lfs_file_write(lfs, &file, benchBuffer,
+                LFS_BENCH_COMMIT_SIZE);
+        if (res < 0) {
+            lfs_file_close(lfs, &file);
+            return res;
+        }
+
+        err = lfs_file_sync(lfs, &file);
+        if (err) {
+            lfs_file_close(lfs, &file);
+            return err;
+        }
+    }
+    lfs_bench_report("commit", lfs_bench_cycles() / LFS_BENCH_COMMITS, 0);
+
+    BSP_HSPI_NOR_Stats_t stats;
+    BSP_HSPI_NOR_GetStats(0, &stats);
+    printf("bench %-10s %10lu pages %8lu skipped\r\n", path,
+            (unsigned long)stats.ProgrammedPages,
+            (unsigned long)stats.SkippedPages);
+
+    err = lfs_file_close(lfs, &file);
+    if (err) {
+        return err;
+    }
+
+    return lfs_remove(lfs, path);
+}
+
+// erases through a reservation, the cycles the background task got are
+// the time the CPU was free during the erases
+int lfs_bench_erase(lfs_t *lfs, const char *path) {
+    lfs_file_t file;
+    int err = lfs_file_open(lfs, &file, path,
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    if (err) {
+        return err;
+    }
+
+    lfs_bench_start();
+    benchIdleCycles = 0;
+    err = lfs_file_reserve(lfs, &file,
+            LFS_BENCH_ERASES*lfs->cfg->block_size, LFS_R_ERASE);
+    if (!err && BSP_HSPI_NOR_WaitForMemoryReady(0) != BSP_ERROR_NONE) {
+        err = LFS_ERR_IO;
+    }
+    uint32_t cycles = lfs_bench_cycles();
+    if (err) {
+        lfs_file_close(lfs, &file);
+        return err;
+    }
+    lfs_bench_report("erase", cycles / LFS_BENCH_ERASES, 0);
+
+    uint32_t busy = cycles - benchIdleCycles;
+    printf("bench %-10s %10lu cycles busy %5lu%% cpu\r\n", path,
+            (unsigned long)busy,
+            (unsigned long)(((uint64_t)busy*100) / cycles));
+
+    err = lfs_file_close(lfs, &file);
+    if (err) {
+        return err;
+    }
+
+    return lfs_remove(lfs, path);
+}
+
+// list a directory of n files, once with lfs_dir_read and once in batches
+static int lfs_bench_listone(lfs_t *lfs, const char *path, int n,
+        bool batch) {
+    lfs_dir_t dir;
+    int err = lfs_dir_open(lfs, &dir, path);
+    if (err) {
+        return err;
+    }
+
+    lfs_bench_start();
+    while (true) {
+        lfs_ssize_t res = (batch)
+                ? lfs_dir_readbatch(lfs, &dir, lsInfo, LFS_LS_BATCH, NULL)
+                : lfs_dir_read(lfs, &dir, &lsInfo[0]);
+        if (res < 0) {
+            lfs_dir_close(lfs, &dir);
+            return res;
+        }
+
+        if (res == 0) {
+            break;
+        }
+    }
+    uint32_t cycles = lfs_bench_cycles();
+
+    printf("bench %-10s %10lu cycles %5d entries %s\r\n", path,
+            (unsigned long)cycles, n, (batch) ? "batch" : "read");
+    return lfs_dir_close(lfs, &dir);
+}
+
+// fills a directory with LFS_BENCH_LIST_MAX files, listing it at each power
+// of two
+int lfs_bench_list(lfs_t *lfs, const char *path) {
+    int err = lfs_mkdir(lfs, path);
+    if (err) {
+        return err;
+    }
+
+    char name[32];
+    for (int n = 1; n <= LFS_BENCH_LIST_MAX; n++) {
+        lfs_file_t file;
+        sprintf(name, "%s/Statistic_%d", path, n);
+        err = lfs_file_open(lfs, &file, name, LFS_O_WRONLY | LFS_O_CREAT);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_file_close(lfs, &file);
+        if (err) {
+            return err;
+        }
+
+        // time at powers of two
+        if ((n & (n-1)) == 0 && n >= 16) {
+            err = lfs_bench_listone(lfs, path, n, false);
+            if (err) {
+                return err;
+            }
+
+            err = lfs_bench_listone(lfs, path, n, true);
+            if (err) {
+                return err;
+            }
+        }
+    }
+
+    for (int n = 1; n <= LFS_BENCH_LIST_MAX; n++) {
+        sprintf(name, "%s/Statistic_%d", path, n);
+        err = lfs_remove(lfs, name);
+        if (err) {
+            return err;
+        }
+    }
+
+    return lfs_remove(lfs, path);
+}
+
+// telemetry-like records, a timestamp, two slowly changing readings and
+// mostly constant flags
+static void lfs_bench_records(uint32_t chunk) {
+    for (lfs_size_t i = 0; i < sizeof(benchBuffer);
+            i += LFS_BENCH_RECORD_SIZE) {
+        uint32_t n = chunk*(sizeof(benchBuffer)/LFS_BENCH_RECORD_SIZE)
+                + i/LFS_BENCH_RECORD_SIZE;
+        uint32_t timestamp = n*100;
+        uint16_t temp = 2000 + (n*7) % 50;
+        uint16_t humidity = 450 + (n*3) % 20;
+        memset(&benchBuffer[i], 0, LFS_BENCH_RECORD_SIZE);
+        memcpy(&benchBuffer[i+0], &timestamp, 4);
+        memcpy(&benchBuffer[i+4], &temp, 2);
+        memcpy(&benchBuffer[i+6], &humidity, 2);
+        benchBuffer[i+8] = n & 1;
+    }
+}
+
+// writes the same records to a plain file and to a zfile, the zfile
+// throughput is in uncompressed bytes
+int lfs_bench_zfile(lfs_t *lfs, const char *path) {
+    lfs_file_t file;
+    int err = lfs_file_open(lfs, &file, path,
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    if (err) {
+        return err;
+    }
+
+    lfs_bench_start();
+    for (lfs_size_t i = 0; i < LFS_BENCH_FILE_SIZE; i += sizeof(benchBuffer)) {
+        lfs_bench_records(i / sizeof(benchBuffer));
+        lfs_ssize_t res = lfs_file_write(lfs, &file,
+                benchBuffer, sizeof(benchBuffer));
+        if (res < 0) {
+            lfs_file_close(lfs, &file);
+            return res;
+        }
+    }
+    err = lfs_file_close(lfs, &file);
+    lfs_bench_report("rawwrite", lfs_bench_cycles(), LFS_BENCH_FILE_SIZE);
+    if (err) {
+        return err;
+    }
+
+    err = lfs_remove(lfs, path);
+    if (err) {
+        return err;
+    }
+
+    lfs_zfile_t zfile;
+    struct lfs_zfile_config zcfg = {
+        .frame_size = 4096,
+        .buffer = benchZBuffer,
+    };
+    err = lfs_zfile_opencfg(lfs, &zfile, path,
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC, &zcfg);
+    if (err) {
+        return err;
+    }
+
+    lfs_bench_start();
+    for (lfs_size_t i = 0; i < LFS_BENCH_FILE_SIZE; i += sizeof(benchBuffer)) {
+        lfs_bench_records(i / sizeof(benchBuffer));
+        lfs_ssize_t res = lfs_zfile_write(lfs, &zfile,
+                benchBuffer, sizeof(benchBuffer));
+        if (res < 0) {
+            lfs_zfile_close(lfs, &zfile);
+            return res;
+        }
+    }
+    lfs_soff_t stored = lfs_zfile_storedsize(lfs, &zfile);
+    err = lfs_zfile_close(lfs, &zfile);
+    lfs_bench_report("zwrite", lfs_bench_cycles(), LFS_BENCH_FILE_SIZE);
+    if (err) {
+        return err;
+    }
+
+    printf("bench %-10s %10lu stored %8lu bytes %3lu%%\r\n", "zratio",
+            (unsigned long)LFS_BENCH_FILE_SIZE, (unsigned long)stored,
+            (unsigned long)(100*(uint64_t)stored / LFS_BENCH_FILE_SIZE));
+
+    err = lfs_zfile_opencfg(lfs, &zfile, path, LFS_O_RDONLY, &zcfg);
+    if (err) {
+        return err;
+    }
+
+    lfs_size_t size = 0;
+    lfs_bench_start();
+    while (true) {
+        lfs_ssize_t res = lfs_zfile_read(lfs, &zfile,
+                benchReadBuffer, sizeof(benchReadBuffer));
+        if (res < 0) {
+            lfs_zfile_close(lfs, &zfile);
+            return res;
+        }
+
+        if (res == 0) {
+            break;
+        }
+
+        size += res;
+    }
+    lfs_bench_report("zread", lfs_bench_cycles(), size);
+
+    uint32_t seed = 1;
+    lfs_bench_start();
+    for (int i = 0; i < LFS_BENCH_SEEKS; i++) {
+        seed = seed*1103515245 + 12345;
+        lfs_zfile_seek(lfs, &zfile, (seed >> 8) % size, LFS_SEEK_SET);
+        lfs_ssize_t res = lfs_zfile_read(lfs, &zfile, benchBuffer, 16);
+        if (res < 0) {
+            lfs_zfile_close(lfs, &zfile);
+            return res;
+        }
+    }
+    lfs_bench_report("zrandread", lfs_bench_cycles(), 0);
+
+    err = lfs_zfile_close(lfs, &zfile);
+    if (err) {
+        return err;
+    }
+
+    return lfs_remove(lfs, path);
+}
+
+// counts a block the first time it is seen, benchReadBuffer is the bitmap
+static int lfs_bench_usedblock(void *p, lfs_block_t block) {
+    lfs_size_t *used = p;
+    if (!(benchReadBuffer[block/8] & (1 << (block%8)))) {
+        benchReadBuffer[block/8] |= 1 << (block%8);
+        *used += 1;
+    }
+    return 0;
+}
+
+// blocks in use, unlike lfs_fs_size shared pack blocks are counted once
+static lfs_ssize_t lfs_bench_used(lfs_t *lfs) {
+    memset(benchReadBuffer, 0, sizeof(benchReadBuffer));
+    lfs_size_t used = 0;
+    int err = lfs_fs_traverse(lfs, lfs_bench_usedblock, &used);
+    if (err) {
+        return err;
+    }
+
+    return used;
+}
+
+// prints the blocks used, the share of them holding file data, and the
+// erases per 1k files
+static void lfs_bench_packreport(const char *name, lfs_size_t used,
+        lfs_size_t files, uint32_t erases) {
+    printf("bench %-10s %10lu blocks %3lu%% data %5lu erases/1k files\r\n",
+            name, (unsigned long)used,
+            (unsigned long)((100*(uint64_t)files*LFS_BENCH_PACK_SIZE)
+                / ((uint64_t)used*cfg.block_size)),
+            (unsigned long)((1000*(uint64_t)erases) / files));
+}
+
+// lfs reads its configuration while mounted, so passes that compare
+// configurations change it between an unmount and a mount, which also
+// checks the new values
+static int lfs_bench_remount(lfs_t *lfs, lfs_size_t packMax,
+        lfs_size_t adaptMax) {
+    int err = lfs_unmount(lfs);
+    if (err) {
+        return err;
+    }
+
+    cfg.pack_max = packMax;
+    cfg.inline_adapt_max = adaptMax;
+    return lfs_mount(lfs, &cfg);
+}
+
+// writes LFS_BENCH_PACK_FILES files spread over directories, then removes 3
+// of 4 files and runs lfs_fs_gc to repack
+static int lfs_bench_packone(lfs_t *lfs, const char *path,
+        lfs_size_t packMax) {
+    int err = lfs_bench_remount(lfs, packMax, cfg.inline_adapt_max);
+    if (err) {
+        return err;
+    }
+
+    lfs_ssize_t base = lfs_bench_used(lfs);
+    if (base < 0) {
+        return base;
+    }
+
+    err = lfs_mkdir(lfs, path);
+    if (err) {
+        return err;
+    }
+
+    char name[32];
+    for (int d = 0; d < LFS_BENCH_PACK_DIRS; d++) {
+        sprintf(name, "%s/%d", path, d);
+        err = lfs_mkdir(lfs, name);
+        if (err) {
+            return err;
+        }
+    }
+
+    memset(benchBuffer, 0x5a, LFS_BENCH_PACK_SIZE);
+    uint32_t erases = bdEraseCount;
+    lfs_bench_start();
+    for (int n = 0; n < LFS_BENCH_PACK_FILES; n++) {
+        lfs_file_t file;
+        sprintf(name, "%s/%d/%d", path, n % LFS_BENCH_PACK_DIRS, n);
+        err = lfs_file_open(lfs, &file, name, LFS_O_WRONLY | LFS_O_CREAT);
+        if (err) {
+            return err;
+        }
+
+        lfs_ssize_t res = lfs_file_write(lfs, &file,
+                benchBuffer, LFS_BENCH_PACK_SIZE);
+        err = lfs_file_close(lfs, &file);
+        if (res < 0) {
+            return res;
+        }
+        if (err) {
+            return err;
+        }
+    }
+    lfs_bench_report(path, lfs_bench_cycles(),
+            LFS_BENCH_PACK_FILES*LFS_BENCH_PACK_SIZE);
+
+    lfs_ssize_t used = lfs_bench_used(lfs);
+    if (used < 0) {
+        return used;
+    }
+    lfs_bench_packreport(path, used - base, LFS_BENCH_PACK_FILES,
+            bdEraseCount - erases);
+
+    // leave a quarter of the files and let gc repack them
+    for (int n = 0; n < LFS_BENCH_PACK_FILES; n++) {
+        if (n % 4 != 0) {
+            sprintf(name, "%s/%d/%d", path, n % LFS_BENCH_PACK_DIRS, n);
+            err = lfs_remove(lfs, name);
+            if (err) {
+                return err;
+            }
+        }
+    }
+
+    erases = bdEraseCount;
+    lfs_bench_start();
+    for (int i = 0; i < LFS_BENCH_PACK_GCS; i++) {
+        err = lfs_fs_gc(lfs);
+        if (err) {
+            return err;
+        }
+
+        // stop once gc stops freeing blocks
+        lfs_ssize_t nused = lfs_bench_used(lfs);
+        if (nused < 0) {
+            return nused;
+        }
+
+        if (nused == used) {
+            break;
+        }
+        used = nused;
+    }
+    lfs_bench_report("packgc", lfs_bench_cycles(), 0);
+    lfs_bench_packreport(path, used - base, LFS_BENCH_PACK_FILES/4,
+            bdEraseCount - erases);
+
+    for (int n = 0; n < LFS_BENCH_PACK_FILES; n += 4) {
+        sprintf(name, "%s/%d/%d", path, n % LFS_BENCH_PACK_DIRS, n);
+        err = lfs_remove(lfs, name);
+        if (err) {
+            return err;
+        }
+    }
+
+    for (int d = 0; d < LFS_BENCH_PACK_DIRS; d++) {
+        sprintf(name, "%s/%d", path, d);
+        err = lfs_remove(lfs, name);
+        if (err) {
+            return err;
+        }
+    }
+
+    return lfs_remove(lfs, path);
+}
+
+// many small files, each taking a whole block unpacked
+int lfs_bench_pack(lfs_t *lfs) {
+    lfs_size_t packMax = cfg.pack_max;
+    int err = lfs_bench_packone(lfs, "bench_small", 0);
+    if (!err) {
+        err = lfs_bench_packone(lfs, "bench_pack", 4096);
+    }
+
+    int err2 = lfs_bench_remount(lfs, packMax, cfg.inline_adapt_max);
+    return (err) ? err : err2;
+}
+
+// prints the blocks used and the erases per 1k writes
+static void lfs_bench_inlinereport(const char *name, lfs_size_t used,
+        uint32_t writes, uint32_t erases) {
+    printf("bench %-10s %10lu blocks %5lu erases/1k writes\r\n",
+            name, (unsigned long)used,
+            (unsigned long)((1000*(uint64_t)erases) / writes));
+}
+
+// rewrites records spread over a few directories, then syncs a small
+// growing file
+static int lfs_bench_inlineone(lfs_t *lfs, const char *path,
+        lfs_size_t adaptMax) {
+    int err = lfs_bench_remount(lfs, 0, adaptMax);
+    if (err) {
+        return err;
+    }
+
+    lfs_ssize_t base = lfs_bench_used(lfs);
+    if (base < 0) {
+        return base;
+    }
+
+    err = lfs_mkdir(lfs, path);
+    if (err) {
+        return err;
+    }
+
+    char name[32];
+    for (int d = 0; d < LFS_BENCH_INLINE_DIRS; d++) {
+        sprintf(name, "%s/%d", path, d);
+        err = lfs_mkdir(lfs, name);
+        if (err) {
+            return err;
+        }
+    }
+
+    // records rewritten whole
+    uint32_t erases = bdEraseCount;
+    lfs_bench_start();
+    for (int r = 0; r < LFS_BENCH_INLINE_REWRITES; r++) {
+        memset(benchBuffer, r, LFS_BENCH_INLINE_SIZE);
+        for (int n = 0; n < LFS_BENCH_INLINE_DIRS*LFS_BENCH_INLINE_RECS;
+                n++) {
+            lfs_file_t file;
+            sprintf(name, "%s/%d/%d", path, n % LFS_BENCH_INLINE_DIRS, n);
+            err = lfs_file_open(lfs, &file, name,
+                    LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+            if (err) {
+                return err;
+            }
+
+            lfs_ssize_t res = lfs_file_write(lfs, &file,
+                    benchBuffer, LFS_BENCH_INLINE_SIZE);
+            err = lfs_file_close(lfs, &file);
+            if (res < 0) {
+                return res;
+            }
+            if (err) {
+                return err;
+            }
+        }
+    }
+    lfs_bench_report(path, lfs_bench_cycles(),
+            LFS_BENCH_INLINE_REWRITES*LFS_BENCH_INLINE_DIRS
+                * LFS_BENCH_INLINE_RECS*LFS_BENCH_INLINE_SIZE);
+
+    lfs_ssize_t used = lfs_bench_used(lfs);
+    if (used < 0) {
+        return used;
+    }
+    lfs_bench_inlinereport(path, used - base,
+            LFS_BENCH_INLINE_REWRITES*LFS_BENCH_INLINE_DIRS
+                * LFS_BENCH_INLINE_RECS,
+            bdEraseCount - erases);
+
+    // a small file growing in one open, synced after every append
+    lfs_file_t file;
+    sprintf(name, "%s/0/hot", path);
+    err = lfs_file_open(lfs, &file, name, LFS_O_WRONLY | LFS_O_CREAT);
+    if (err) {
+        return err;
+    }
+
+    erases = bdEraseCount;
+    lfs_bench_start();
+    for (int i = 0; i < LFS_BENCH_INLINE_SYNCS; i++) {
+        lfs_ssize_t res = lfs_file_write(lfs, &file,
+                benchBuffer, LFS_BENCH_RECORD_SIZE);
+        if (res < 0) {
+            lfs_file_close(lfs, &file);
+            return res;
+        }
+
+        err = lfs_file_sync(lfs, &file);
+        if (err) {
+            lfs_file_close(lfs, &file);
+            return err;
+        }
+    }
+    lfs_bench_report("hotsync", lfs_bench_cycles(),
+            LFS_BENCH_INLINE_SYNCS*LFS_BENCH_RECORD_SIZE);
+
+    err = lfs_file_close(lfs, &file);
+    if (err) {
+        return err;
+    }
+    lfs_bench_inlinereport("hotsync", 0, LFS_BENCH_INLINE_SYNCS,
+            bdEraseCount - erases);
+
+    err = lfs_remove(lfs, name);
+    if (err) {
+        return err;
+    }
+
+    for (int n = 0; n < LFS_BENCH_INLINE_DIRS*LFS_BENCH_INLINE_RECS; n++) {
+        sprintf(name, "%s/%d/%d", path, n % LFS_BENCH_INLINE_DIRS, n);
+        err = lfs_remove(lfs, name);
+        if (err) {
+            return err;
+        }
+    }
+
+    for (int d = 0; d < LFS_BENCH_INLINE_DIRS; d++) {
+        sprintf(name, "%s/%d", path, d);
+        err = lfs_remove(lfs, name);
+        if (err) {
+            return err;
+        }
+    }
+
+    return lfs_remove(lfs, path);
+}
+
+// records just too big for the static inline limit, packing is left off so
+// only inlining is compared
+int lfs_bench_inline(lfs_t *lfs) {
+    lfs_size_t adaptMax = cfg.inline_adapt_max;
+    lfs_size_t packMax = cfg.pack_max;
+    int err = lfs_bench_inlineone(lfs, "bench_noinl", 0);
+    if (!err) {
+        err = lfs_bench_inlineone(lfs, "bench_inl", LFS_BENCH_INLINE_SIZE);
+    }
+
+    int err2 = lfs_bench_remount(lfs, packMax, adaptMax);
+    return (err) ? err : err2;
+}
+
+// appends a chunk to each of the snapshot pass's logs, round times over
+static int lfs_bench_snapappend(lfs_t *lfs, const char *path, int rounds) {
+    char name[32];
+    memset(benchBuffer, 0xa5, LFS_BENCH_LOG_CHUNK);
+    for (int r = 0; r < rounds; r++) {
+        for (int n = 0; n < LFS_BENCH_SNAP_FILES; n++) {
+            lfs_file_t file;
+            sprintf(name, "%s/%d", path, n);
+            int err = lfs_file_open(lfs, &file, name,
+                    LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND);
+            if (err) {
+                return err;
+            }
+
+            lfs_ssize_t res = lfs_file_write(lfs, &file,
+                    benchBuffer, LFS_BENCH_LOG_CHUNK);
+            err = lfs_file_close(lfs, &file);
+            if (res < 0) {
+                return res;
+            }
+            if (err) {
+                return err;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// logging with a snapshot held for a backup, the first write to each
+// metadata pair the snapshot holds moves it, and the blocks the logs
+// leave behind stay in use until the snapshot is released
+int lfs_bench_snapshot(lfs_t *lfs, const char *path) {
+    int err = lfs_mkdir(lfs, path);
+    if (err) {
+        return err;
+    }
 
-// configuration of the filesystem is provided by this struct
-const struct lfs_config cfg = {
-    // block device operations
-    .read  = user_provided_block_device_read,
-    .prog  = user_provided_block_device_prog,
-    .erase = user_provided_block_device_erase,
-    .sync  = user_provided_block_device_sync,
+    err = lfs_bench_snapappend(lfs, path, LFS_BENCH_SNAP_ROUNDS);
+    if (err) {
+        return err;
+    }
 
-    // block device configuration
-    .read_size = 4096,
-    .prog_size = 4096,
-    .block_size = 4096,
-    .block_count = 32768,
-    .cache_size = 4096,
-    .lookahead_size = 4096,
-    //.block_cycles = 512,
-	.block_cycles = -1,
-};
+    uint32_t writes = LFS_BENCH_SNAP_ROUNDS*LFS_BENCH_SNAP_FILES;
+    uint32_t erases = bdEraseCount;
+    lfs_bench_start();
+    err = lfs_bench_snapappend(lfs, path, LFS_BENCH_SNAP_ROUNDS);
+    if (err) {
+        return err;
+    }
+    lfs_bench_report("nosnap", lfs_bench_cycles(),
+            writes*LFS_BENCH_LOG_CHUNK);
+    lfs_bench_inlinereport("nosnap", 0, writes, bdEraseCount - erases);
+
+    lfs_snapshot_t snap;
+    struct lfs_snapshot_config scfg = {.buffer = benchSnapBuffer};
+    lfs_bench_start();
+    err = lfs_snapshot_create(lfs, &snap, &scfg);
+    lfs_bench_report("snapcreate", lfs_bench_cycles(), 0);
+    if (err) {
+        return err;
+    }
 
-// Read a region in a block. Negative error codes are propagated to the user.
-int user_provided_block_device_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
-{
-	uint32_t readAddr;
+    erases = bdEraseCount;
+    lfs_bench_start();
+    err = lfs_bench_snapappend(lfs, path, LFS_BENCH_SNAP_ROUNDS);
+    if (err) {
+        lfs_snapshot_release(lfs, &snap);
+        return err;
+    }
+    lfs_bench_report("snapheld", lfs_bench_cycles(),
+            writes*LFS_BENCH_LOG_CHUNK);
+    lfs_bench_inlinereport("snapheld", snap.count, writes,
+            bdEraseCount - erases);
+
+    // blocks only the snapshot still holds
+    lfs_ssize_t used = lfs_bench_used(lfs);
+    if (used < 0) {
+        lfs_snapshot_release(lfs, &snap);
+        return used;
+    }
 
-	readAddr = (c->block_size * block) + off;
-	//sFLASH_ReadBuffer(buffer, readAddr, size);
-	//printf("LSF READ: addr=%d, size=%d\n\r", readAddr, size);
-	if(BSP_HSPI_NOR_Read(0, buffer, readAddr, size) != BSP_ERROR_NONE)
-	{
-		printf("Read : Failed\r\n");
-	}
-	return 0;
+    lfs_size_t extra = 0;
+    lfs_size_t size = 0;
+    lfs_bench_start();
+    for (lfs_block_t block = 0;; block++) {
+        err = lfs_snapshot_next(lfs, &snap, &block);
+        if (err) {
+            break;
+        }
+
+        if (!(benchReadBuffer[block/8] & (1 << (block%8)))) {
+            extra += 1;
+        }
+
+        for (lfs_off_t off = 0; off < cfg.block_size;
+                off += sizeof(benchBuffer)) {
+            err = lfs_snapshot_read(lfs, &snap, block, off,
+                    benchBuffer, sizeof(benchBuffer));
+            if (err) {
+                lfs_snapshot_release(lfs, &snap);
+                return err;
+            }
+        }
+        size += cfg.block_size;
+    }
+    lfs_bench_report("snapread", lfs_bench_cycles(), size);
+    printf("bench snapshot %lu blocks, %lu held for it alone\r\n",
+            (unsigned long)snap.count, (unsigned long)extra);
+
+    lfs_snapshot_release(lfs, &snap);
+    if (err != LFS_ERR_NOENT) {
+        return err;
+    }
+
+    char name[32];
+    for (int n = 0; n < LFS_BENCH_SNAP_FILES; n++) {
+        sprintf(name, "%s/%d", path, n);
+        err = lfs_remove(lfs, name);
+        if (err) {
+            return err;
+        }
+    }
+
+    return lfs_remove(lfs, path);
 }
 
-// Program a region in a block. The block must have previously
-// been erased. Negative error codes are propagated to the user.
-// May return LFS_ERR_CORRUPT if the block should be considered bad.
-int user_provided_block_device_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
-{
-	uint32_t writeAddr;
+// reserves a few lookahead windows of blocks for a file, with a small
+// lookahead this is mostly allocation scans, and unlike writing it doesn't
+// wait on the flash
+static int lfs_bench_scanone(lfs_t *lfs, const char *path,
+        const char *name) {
+    // the metadata zone takes the first bytes of the lookahead buffer
+    lfs_size_t window = 8*(LFS_BENCH_SCAN_LOOKAHEAD
+            - (cfg.metadata_zone+7)/8);
+    lfs_file_t file;
+    int err = lfs_file_open(lfs, &file, path,
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    if (err) {
+        return err;
+    }
 
-	writeAddr = (c->block_size * block) + off;
-	//sFLASH_WriteBuffer((uint8_t*)buffer, writeAddr, size);
-	//printf("LSF WRITE: addr=%d, size=%d\n\r", writeAddr, size);
-	if(BSP_HSPI_NOR_Write(0, (uint8_t*)buffer, writeAddr, size) != BSP_ERROR_NONE)
-	{
-		printf("Write : Failed\r\n");
-	}
-	return 0;
+    lfs_bench_start();
+    err = lfs_file_reserve(lfs, &file,
+            LFS_BENCH_SCAN_WINDOWS*window*cfg.block_size, 0);
+    uint32_t cycles = lfs_bench_cycles();
+    int err2 = lfs_file_close(lfs, &file);
+    if (err) {
+        return err;
+    }
+    if (err2) {
+        return err2;
+    }
+    lfs_bench_report(name, cycles / LFS_BENCH_SCAN_WINDOWS, 0);
+
+    return lfs_remove(lfs, path);
 }
 
-// Erase a block. A block must be erased before being programmed.
-// The state of an erased block is undefined. Negative error codes
-// are propagated to the user.
-// May return LFS_ERR_CORRUPT if the block should be considered bad.
-int user_provided_block_device_erase(const struct lfs_config *c, lfs_block_t block)
-{
-	uint32_t eraseAddr;
+// the cost of an allocation scan with and without a snapshot held, each
+// scan also checks every block in the lookahead window against the blocks
+// held by snapshots
+int lfs_bench_snapscan(lfs_t *lfs, const char *path) {
+    lfs_size_t lookahead = cfg.lookahead_size;
+    int err = lfs_unmount(lfs);
+    if (err) {
+        return err;
+    }
+
+    cfg.lookahead_size = LFS_BENCH_SCAN_LOOKAHEAD;
+    err = lfs_mount(lfs, &cfg);
+    if (err) {
+        cfg.lookahead_size = lookahead;
+        return err;
+    }
 
-	eraseAddr = (c->block_size * block);
+    err = lfs_bench_scanone(lfs, path, "scan");
+    if (!err) {
+        lfs_snapshot_t snap;
+        struct lfs_snapshot_config scfg = {.buffer = benchSnapBuffer};
+        err = lfs_snapshot_create(lfs, &snap, &scfg);
+        if (!err) {
+            err = lfs_bench_scanone(lfs, path, "snapscan");
+            int err2 = lfs_snapshot_release(lfs, &snap);
+            err = (err) ? err : err2;
+        }
+    }
 
-	//sFLASH_EraseSector(eraseAddr);
-	//printf("LSF ERASE: addr=%d\n\r", eraseAddr);
-	if(BSP_HSPI_NOR_Erase_Block(0, eraseAddr, MX66UW1G45G_ERASE_4K) != BSP_ERROR_NONE)
-	{
-		printf("Erase Sector 4K: Failed\r\n");
-	}
-	return 0;
+    int err2 = lfs_unmount(lfs);
+    cfg.lookahead_size = lookahead;
+    if (!err2) {
+        err2 = lfs_mount(lfs, &cfg);
+    }
+    return (err) ? err : err2;
 }
 
+// writes chunks spread evenly over the file in order
+static int lfs_bench_sparsespread(lfs_t *lfs, lfs_file_t *file) {
+    lfs_off_t stride = (LFS_BENCH_SPARSE_SIZE / LFS_BENCH_SPARSE_WRITES)
+            / sizeof(benchBuffer) * sizeof(benchBuffer);
+    memset(benchBuffer, 0x3c, sizeof(benchBuffer));
+    for (int i = 0; i < LFS_BENCH_SPARSE_WRITES; i++) {
+        lfs_soff_t res = lfs_file_seek(lfs, file, i*stride, LFS_SEEK_SET);
+        if (res >= 0) {
+            res = lfs_file_write(lfs, file, benchBuffer, sizeof(benchBuffer));
+        }
+        if (res < 0) {
+            return res;
+        }
+    }
 
-// Sync the state of the underlying block device. Negative error codes
-// are propagated to the user.
-int user_provided_block_device_sync(const struct lfs_config *c)
-{
-	return 0;
+    return 0;
 }
 
-int lfs_ls(lfs_t *lfs, const char *path) {
-    lfs_dir_t dir;
-    int err = lfs_dir_open(lfs, &dir, path);
+// writes chunks spread evenly over the file, the holes between them are
+// zero filled unless the file is sparse
+static int lfs_bench_sparseone(lfs_t *lfs, const char *path, int flags) {
+    lfs_ssize_t base = lfs_bench_used(lfs);
+    if (base < 0) {
+        return base;
+    }
+
+    lfs_file_t file;
+    struct lfs_file_config fcfg = {.sparse_buffer = benchSparseBuffer};
+    int err = lfs_file_opencfg(lfs, &file, path,
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC | flags, &fcfg);
     if (err) {
         return err;
     }
 
-    struct lfs_info info;
-    while (true) {
-        int res = lfs_dir_read(lfs, &dir, &info);
+    uint32_t erases = bdEraseCount;
+    lfs_bench_start();
+    err = lfs_bench_sparsespread(lfs, &file);
+    if (err) {
+        lfs_file_close(lfs, &file);
+        return err;
+    }
+
+    err = lfs_file_truncate(lfs, &file, LFS_BENCH_SPARSE_SIZE);
+    if (err) {
+        lfs_file_close(lfs, &file);
+        return err;
+    }
+
+    err = lfs_file_close(lfs, &file);
+    if (err) {
+        return err;
+    }
+    lfs_bench_report(path, lfs_bench_cycles(),
+            LFS_BENCH_SPARSE_WRITES*sizeof(benchBuffer));
+
+    lfs_ssize_t used = lfs_bench_used(lfs);
+    if (used < 0) {
+        return used;
+    }
+    lfs_bench_inlinereport(path, used - base, LFS_BENCH_SPARSE_WRITES,
+            bdEraseCount - erases);
+
+    return lfs_remove(lfs, path);
+}
+
+// writes a sparse file with 1% of it populated, then writes all of it in
+// order, part way through the chunk map runs out of room and the file is
+// rewritten as a normal file
+static int lfs_bench_sparsefill(lfs_t *lfs, const char *path) {
+    lfs_ssize_t base = lfs_bench_used(lfs);
+    if (base < 0) {
+        return base;
+    }
+
+    lfs_file_t file;
+    struct lfs_file_config fcfg = {.sparse_buffer = benchSparseBuffer};
+    int err = lfs_file_opencfg(lfs, &file, path,
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC | LFS_O_SPARSE, &fcfg);
+    if (err) {
+        return err;
+    }
+
+    err = lfs_bench_sparsespread(lfs, &file);
+    if (err) {
+        lfs_file_close(lfs, &file);
+        return err;
+    }
+
+    lfs_soff_t res = lfs_file_seek(lfs, &file, 0, LFS_SEEK_SET);
+    if (res < 0) {
+        lfs_file_close(lfs, &file);
+        return res;
+    }
+
+    uint32_t erases = bdEraseCount;
+    lfs_bench_start();
+    for (int i = 0; i < LFS_BENCH_SPARSE_SIZE/LFS_BENCH_CHUNK_SIZE; i++) {
+        res = lfs_file_write(lfs, &file, benchBuffer, sizeof(benchBuffer));
         if (res < 0) {
+            lfs_file_close(lfs, &file);
             return res;
         }
+    }
 
-        if (res == 0) {
-            break;
+    err = lfs_file_close(lfs, &file);
+    if (err) {
+        return err;
+    }
+    lfs_bench_report(path, lfs_bench_cycles(), LFS_BENCH_SPARSE_SIZE);
+
+    lfs_ssize_t used = lfs_bench_used(lfs);
+    if (used < 0) {
+        return used;
+    }
+    lfs_bench_inlinereport(path, used - base,
+            LFS_BENCH_SPARSE_SIZE/LFS_BENCH_CHUNK_SIZE, bdEraseCount - erases);
+
+    return lfs_remove(lfs, path);
+}
+
+// the 1% populated file with its holes zero filled, left sparse, and then
+// written in full
+int lfs_bench_sparse(lfs_t *lfs) {
+    int err = lfs_bench_sparseone(lfs, "bench_dense", 0);
+    if (err) {
+        return err;
+    }
+
+    err = lfs_bench_sparseone(lfs, "bench_sparse", LFS_O_SPARSE);
+    if (err) {
+        return err;
+    }
+
+    return lfs_bench_sparsefill(lfs, "bench_sparsefill");
+}
+
+// appends a capture file with periodic syncs, then times small reads at
+// pseudo-random offsets after reopening it, as after a reboot
+static int lfs_bench_indexone(lfs_t *lfs, const char *path,
+        lfs_size_t count) {
+    lfs_ssize_t base = lfs_bench_used(lfs);
+    if (base < 0) {
+        return base;
+    }
+
+    lfs_file_t file;
+    struct lfs_file_config fcfg = {
+        .index_count = count,
+        .index_buffer = benchIndexBuffer,
+    };
+    int err = lfs_file_opencfg(lfs, &file, path,
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC, &fcfg);
+    if (err) {
+        return err;
+    }
+
+    memset(benchBuffer, 0xa5, sizeof(benchBuffer));
+    uint32_t erases = bdEraseCount;
+    lfs_bench_start();
+    for (lfs_off_t off = 0; off < LFS_BENCH_INDEX_SIZE;
+            off += sizeof(benchBuffer)) {
+        lfs_ssize_t res = lfs_file_write(lfs, &file,
+                benchBuffer, sizeof(benchBuffer));
+        if (res >= 0 && (off + sizeof(benchBuffer))
+                % LFS_BENCH_INDEX_SYNC == 0) {
+            res = lfs_file_sync(lfs, &file);
+        }
+        if (res < 0) {
+            lfs_file_close(lfs, &file);
+            return res;
         }
+    }
+
+    err = lfs_file_close(lfs, &file);
+    if (err) {
+        return err;
+    }
+    lfs_bench_report(path, lfs_bench_cycles(), LFS_BENCH_INDEX_SIZE);
+
+    lfs_ssize_t used = lfs_bench_used(lfs);
+    if (used < 0) {
+        return used;
+    }
+    lfs_bench_inlinereport(path, used - base,
+            LFS_BENCH_INDEX_SIZE / LFS_BENCH_INDEX_SYNC,
+            bdEraseCount - erases);
 
-        switch (info.type) {
-            case LFS_TYPE_REG: printf("reg "); break;
-            case LFS_TYPE_DIR: printf("dir "); break;
-            default:           printf("?   "); break;
+    err = lfs_file_opencfg(lfs, &file, path, LFS_O_RDONLY, &fcfg);
+    if (err) {
+        return err;
+    }
+
+    uint32_t seed = 1;
+    lfs_bench_start();
+    for (int i = 0; i < LFS_BENCH_SEEKS; i++) {
+        seed = seed*1103515245 + 12345;
+        lfs_file_seek(lfs, &file, (seed >> 8) % LFS_BENCH_INDEX_SIZE,
+                LFS_SEEK_SET);
+        lfs_ssize_t res = lfs_file_read(lfs, &file, benchBuffer, 16);
+        if (res < 0) {
+            lfs_file_close(lfs, &file);
+            return res;
         }
+    }
+    lfs_bench_report("ixseek", lfs_bench_cycles() / LFS_BENCH_SEEKS, 0);
 
-        static const char *prefixes[] = {"", "K", "M", "G"};
-        for (int i = sizeof(prefixes)/sizeof(prefixes[0])-1; i >= 0; i--) {
-            if (info.size >= (1 << 10*i)-1) {
-                printf("%*u%sB ", 4-(i != 0), info.size >> 10*i, prefixes[i]);
-                break;
-            }
+    err = lfs_file_close(lfs, &file);
+    if (err) {
+        return err;
+    }
+
+    return lfs_remove(lfs, path);
+}
+
+// the capture file without and with a seek index
+int lfs_bench_index(lfs_t *lfs) {
+    int err = lfs_bench_indexone(lfs, "bench_noix", 0);
+    if (err) {
+        return err;
+    }
+
+    return lfs_bench_indexone(lfs, "bench_ix", LFS_BENCH_INDEX_COUNT);
+}
+
+// runs the passes in the order listed at the top, then removes the files
+// they share
+int lfs_bench(lfs_t *lfs) {
+    int err = lfs_bench_seqwrite(lfs, "bench", LFS_BENCH_FILE_SIZE, 4096, 0,
+            false);
+    if (err) {
+        return err;
+    }
+
+    err = lfs_bench_seqread(lfs, "bench");
+    if (err) {
+        return err;
+    }
+
+    err = lfs_bench_randread(lfs, "bench");
+    if (err) {
+        return err;
+    }
+
+    err = lfs_bench_openclose(lfs, "bench");
+    if (err) {
+        return err;
+    }
+
+    err = lfs_bench_clone(lfs, "bench");
+    if (err) {
+        return err;
+    }
+
+    err = lfs_bench_commit(lfs, "bench_commit");
+    if (err) {
+        return err;
+    }
+
+    err = lfs_bench_erase(lfs, "bench_erase");
+    if (err) {
+        return err;
+    }
+
+    err = lfs_bench_list(lfs, "bench_list");
+    if (err) {
+        return err;
+    }
+
+    err = lfs_bench_zfile(lfs, "bench_zfile");
+    if (err) {
+        return err;
+    }
+
+    err = lfs_bench_pack(lfs);
+    if (err) {
+        return err;
+    }
+
+    err = lfs_bench_inline(lfs);
+    if (err) {
+        return err;
+    }
+
+    err = lfs_bench_snapshot(lfs, "bench_snap");
+    if (err) {
+        return err;
+    }
+
+    err = lfs_bench_snapscan(lfs, "bench_scan");
+    if (err) {
+        return err;
+    }
+
+    err = lfs_bench_sparse(lfs);
+    if (err) {
+        return err;
+    }
+
+    err = lfs_bench_index(lfs);
+    if (err) {
+        return err;
+    }
+
+    static const int logCounts[] = {1, 8, LFS_BENCH_FILES_MAX};
+    for (size_t i = 0; i < sizeof(logCounts)/sizeof(logCounts[0]); i++) {
+        err = lfs_bench_logs(lfs, logCounts[i]);
+        if (err) {
+            return err;
         }
+    }
 
-        printf("%s\r\n", info.name);
+    err = lfs_bench_seqwrite(lfs, "bench_hint", LFS_BENCH_FILE_SIZE, 4096,
+            LFS_BENCH_FILE_SIZE, false);
+    if (err) {
+        return err;
     }
 
-    err = lfs_dir_close(lfs, &dir);
+    err = lfs_bench_seqread(lfs, "bench_hint");
     if (err) {
         return err;
     }
 
-    return 0;
+    err = lfs_bench_seqwrite(lfs, "bench_reserve", LFS_BENCH_FILE_SIZE, 4096,
+            0, true);
+    if (err) {
+        return err;
+    }
+
+    err = lfs_remove(lfs, "bench_reserve");
+    if (err) {
+        return err;
+    }
+
+    err = lfs_remove(lfs, "bench");
+    if (err) {
+        return err;
+    }
+
+    return lfs_remove(lfs, "bench_hint");
 }
 #endif
+#endif
 
 #define HSPI_NOR_BUFFER_SIZE     ((uint32_t)0x0200)
 #define HSPI_NOR_WRITE_READ_ADDR ((uint32_t)0x0050)
@@ -578,12 +2136,19 @@ int32_t littlefs_test(MX66UW1G45G_TestMode_t mymode)
 		Error_Handler();
 	}
 
+	// the block device times erase suspends with the DWT cycle counter
+	DCB->DEMCR |= DCB_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
 	if(BSP_HSPI_NOR_ReadID(0, flashID) != BSP_ERROR_NONE)
 	{
 		Error_Handler();
 	}
 	printf("Statistic Flash MX66LM1G45G [0x%06x]\r\n", (flashID[0] << 16) | (flashID[1] << 8) | flashID[2]);
 
+	// size the read cache fetches for this HSPI mode
+	lfs_tune_fetch(&cfg);
+
 	// mount the filesystem
 	err = lfs_mount(&lfs, &cfg);
 
@@ -597,6 +2162,13 @@ int32_t littlefs_test(MX66UW1G45G_TestMode_t mymode)
 		printf("lfs mount!\r\n");
 	}
 
+#if defined TEST_LFS_BENCH
+	err = lfs_bench(&lfs);
+	if (err) {
+		printf("lfs bench error %d\r\n", err);
+	}
+#endif
+
 	for(;;)
 	{
 		if(doTest == 1)
@@ -22,6 +22,7 @@
 #include "stm32u5xx_it.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "stm32u5g9j_discovery_hspi.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -300,4 +301,12 @@ void LTDC_IRQHandler(void)
 
 /* USER CODE BEGIN 1 */
 
+/**
+  * @brief This function handles HSPI1 global interrupt.
+  */
+void HSPI1_IRQHandler(void)
+{
+  BSP_HSPI_NOR_IRQHandler(0);
+}
+
 /* USER CODE END 1 */
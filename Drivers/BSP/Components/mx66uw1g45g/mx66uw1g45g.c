@@ -49,6 +49,15 @@
   * @{
   */
 
+/** @defgroup MX66UW1G45G_Private_Functions MX66UW1G45G Private Functions
+  * @{
+  */
+static int32_t MX66UW1G45G_MemReadyCommand(XSPI_HandleTypeDef *Ctx, MX66UW1G45G_Interface_t Mode,
+                                          MX66UW1G45G_Transfer_t Rate, XSPI_AutoPollingTypeDef *pConfig);
+/**
+  * @}
+  */
+
 /** @defgroup MX66UW1G45G_Exported_Functions MX66UW1G45G Exported Functions
   * @{
   */
@@ -85,63 +94,40 @@ int32_t MX66UW1G45G_GetFlashInfo(MX66UW1G45G_Info_t *pInfo)
 int32_t MX66UW1G45G_AutoPollingMemReady(XSPI_HandleTypeDef *Ctx, MX66UW1G45G_Interface_t Mode,
                                         MX66UW1G45G_Transfer_t Rate)
 {
-  XSPI_RegularCmdTypeDef s_command = {0};
   XSPI_AutoPollingTypeDef s_config = {0};
 
-  /* SPI mode and DTR transfer not supported by memory */
-  if ((Mode == MX66UW1G45G_SPI_MODE) && (Rate == MX66UW1G45G_DTR_TRANSFER))
+  if (MX66UW1G45G_MemReadyCommand(Ctx, Mode, Rate, &s_config) != MX66UW1G45G_OK)
   {
     return MX66UW1G45G_ERROR;
   }
 
-  /* Configure automatic polling mode to wait for memory ready */
-  s_command.OperationType = HAL_XSPI_OPTYPE_COMMON_CFG;
-  s_command.InstructionMode = (Mode == MX66UW1G45G_SPI_MODE)
-                                  ? HAL_XSPI_INSTRUCTION_1_LINE
-                                  : HAL_XSPI_INSTRUCTION_8_LINES;
-  s_command.InstructionDTRMode = (Rate == MX66UW1G45G_DTR_TRANSFER)
-                                     ? HAL_XSPI_INSTRUCTION_DTR_ENABLE
-                                     : HAL_XSPI_INSTRUCTION_DTR_DISABLE;
-  s_command.InstructionWidth = (Mode == MX66UW1G45G_SPI_MODE)
-                                   ? HAL_XSPI_INSTRUCTION_8_BITS
-                                   : HAL_XSPI_INSTRUCTION_16_BITS;
-  s_command.Instruction = (Mode == MX66UW1G45G_SPI_MODE)
-                              ? MX66UW1G45G_READ_STATUS_REG_CMD
-                              : MX66UW1G45G_OCTA_READ_STATUS_REG_CMD;
-  s_command.AddressMode = (Mode == MX66UW1G45G_SPI_MODE) ? HAL_XSPI_ADDRESS_NONE : HAL_XSPI_ADDRESS_8_LINES;
-  s_command.AddressDTRMode = (Rate == MX66UW1G45G_DTR_TRANSFER)
-                                 ? HAL_XSPI_ADDRESS_DTR_ENABLE
-                                 : HAL_XSPI_ADDRESS_DTR_DISABLE;
-  s_command.AddressWidth = HAL_XSPI_ADDRESS_32_BITS;
-  s_command.Address = 0U;
-  s_command.AlternateBytesMode = HAL_XSPI_ALT_BYTES_NONE;
-  s_command.DataMode = (Mode == MX66UW1G45G_SPI_MODE) ? HAL_XSPI_DATA_1_LINE : HAL_XSPI_DATA_8_LINES;
-  s_command.DataDTRMode = (Rate == MX66UW1G45G_DTR_TRANSFER)
-                              ? HAL_XSPI_DATA_DTR_ENABLE
-                              : HAL_XSPI_DATA_DTR_DISABLE;
-  s_command.DummyCycles = (Mode == MX66UW1G45G_SPI_MODE)
-                              ? 0U
-                              : ((Rate == MX66UW1G45G_DTR_TRANSFER)
-                                     ? DUMMY_CYCLES_REG_OCTAL_DTR
-                                     : DUMMY_CYCLES_REG_OCTAL);
-  s_command.DataLength = (Rate == MX66UW1G45G_DTR_TRANSFER) ? 2U : 1U;
-  s_command.DQSMode = (Rate == MX66UW1G45G_DTR_TRANSFER) ? HAL_XSPI_DQS_ENABLE : HAL_XSPI_DQS_DISABLE;
- #if defined (XSPI_CCR_SIOO)
-  s_command.SIOOMode            = HAL_XSPI_SIOO_INST_EVERY_CMD;
- #endif
+  if (HAL_XSPI_AutoPolling(Ctx, &s_config, HAL_XSPI_TIMEOUT_DEFAULT_VALUE) != HAL_OK)
+  {
+    return MX66UW1G45G_ERROR;
+  }
 
-  s_config.MatchValue = 0U;
-  s_config.MatchMask = MX66UW1G45G_SR_WIP;
-  s_config.MatchMode = HAL_XSPI_MATCH_MODE_AND;
-  s_config.IntervalTime = MX66UW1G45G_AUTOPOLLING_INTERVAL_TIME;
-  s_config.AutomaticStop = HAL_XSPI_AUTOMATIC_STOP_ENABLE;
+  return MX66UW1G45G_OK;
+}
 
-  if (HAL_XSPI_Command(Ctx, &s_command, HAL_XSPI_TIMEOUT_DEFAULT_VALUE) != HAL_OK)
+/**
+  * @brief  Start polling WIP(Write In Progress) bit in interrupt mode, the XSPI status
+  *         match callback is called once the memory is ready
+  * @param  Ctx Component object pointer
+  * @param  Mode Interface mode
+  * @param  Rate Transfer rate STR or DTR
+  * @retval error status
+  */
+int32_t MX66UW1G45G_AutoPollingMemReady_IT(XSPI_HandleTypeDef *Ctx, MX66UW1G45G_Interface_t Mode,
+                                           MX66UW1G45G_Transfer_t Rate)
+{
+  XSPI_AutoPollingTypeDef s_config = {0};
+
+  if (MX66UW1G45G_MemReadyCommand(Ctx, Mode, Rate, &s_config) != MX66UW1G45G_OK)
   {
     return MX66UW1G45G_ERROR;
   }
 
-  if (HAL_XSPI_AutoPolling(Ctx, &s_config, HAL_XSPI_TIMEOUT_DEFAULT_VALUE) != HAL_OK)
+  if (HAL_XSPI_AutoPolling_IT(Ctx, &s_config) != HAL_OK)
   {
     return MX66UW1G45G_ERROR;
   }
@@ -1750,6 +1736,84 @@ int32_t MX66UW1G45G_EnterPowerDown(XSPI_HandleTypeDef *Ctx, MX66UW1G45G_Interfac
   return MX66UW1G45G_OK;
 }
 
+/**
+  * @}
+  */
+
+/** @addtogroup MX66UW1G45G_Private_Functions
+  * @{
+  */
+
+/**
+  * @brief  Send the read status register command used to poll WIP(Write In Progress) bit
+  *         and fill the matching automatic polling configuration
+  * @param  Ctx Component object pointer
+  * @param  Mode Interface mode
+  * @param  Rate Transfer rate STR or DTR
+  * @param  pConfig Automatic polling configuration to fill
+  * @retval error status
+  */
+static int32_t MX66UW1G45G_MemReadyCommand(XSPI_HandleTypeDef *Ctx, MX66UW1G45G_Interface_t Mode,
+                                          MX66UW1G45G_Transfer_t Rate, XSPI_AutoPollingTypeDef *pConfig)
+{
+  XSPI_RegularCmdTypeDef s_command = {0};
+
+  /* SPI mode and DTR transfer not supported by memory */
+  if ((Mode == MX66UW1G45G_SPI_MODE) && (Rate == MX66UW1G45G_DTR_TRANSFER))
+  {
+    return MX66UW1G45G_ERROR;
+  }
+
+  /* Configure automatic polling mode to wait for memory ready */
+  s_command.OperationType = HAL_XSPI_OPTYPE_COMMON_CFG;
+  s_command.InstructionMode = (Mode == MX66UW1G45G_SPI_MODE)
+                                  ? HAL_XSPI_INSTRUCTION_1_LINE
+                                  : HAL_XSPI_INSTRUCTION_8_LINES;
+  s_command.InstructionDTRMode = (Rate == MX66UW1G45G_DTR_TRANSFER)
+                                     ? HAL_XSPI_INSTRUCTION_DTR_ENABLE
+                                     : HAL_XSPI_INSTRUCTION_DTR_DISABLE;
+  s_command.InstructionWidth = (Mode == MX66UW1G45G_SPI_MODE)
+                                   ? HAL_XSPI_INSTRUCTION_8_BITS
+                                   : HAL_XSPI_INSTRUCTION_16_BITS;
+  s_command.Instruction = (Mode == MX66UW1G45G_SPI_MODE)
+                              ? MX66UW1G45G_READ_STATUS_REG_CMD
+                              : MX66UW1G45G_OCTA_READ_STATUS_REG_CMD;
+  s_command.AddressMode = (Mode == MX66UW1G45G_SPI_MODE) ? HAL_XSPI_ADDRESS_NONE : HAL_XSPI_ADDRESS_8_LINES;
+  s_command.AddressDTRMode = (Rate == MX66UW1G45G_DTR_TRANSFER)
+                                 ? HAL_XSPI_ADDRESS_DTR_ENABLE
+                                 : HAL_XSPI_ADDRESS_DTR_DISABLE;
+  s_command.AddressWidth = HAL_XSPI_ADDRESS_32_BITS;
+  s_command.Address = 0U;
+  s_command.AlternateBytesMode = HAL_XSPI_ALT_BYTES_NONE;
+  s_command.DataMode = (Mode == MX66UW1G45G_SPI_MODE) ? HAL_XSPI_DATA_1_LINE : HAL_XSPI_DATA_8_LINES;
+  s_command.DataDTRMode = (Rate == MX66UW1G45G_DTR_TRANSFER)
+                              ? HAL_XSPI_DATA_DTR_ENABLE
+                              : HAL_XSPI_DATA_DTR_DISABLE;
+  s_command.DummyCycles = (Mode == MX66UW1G45G_SPI_MODE)
+                              ? 0U
+                              : ((Rate == MX66UW1G45G_DTR_TRANSFER)
+                                     ? DUMMY_CYCLES_REG_OCTAL_DTR
+                                     : DUMMY_CYCLES_REG_OCTAL);
+  s_command.DataLength = (Rate == MX66UW1G45G_DTR_TRANSFER) ? 2U : 1U;
+  s_command.DQSMode = (Rate == MX66UW1G45G_DTR_TRANSFER) ? HAL_XSPI_DQS_ENABLE : HAL_XSPI_DQS_DISABLE;
+ #if defined (XSPI_CCR_SIOO)
+  s_command.SIOOMode            = HAL_XSPI_SIOO_INST_EVERY_CMD;
+ #endif
+
+  pConfig->MatchValue = 0U;
+  pConfig->MatchMask = MX66UW1G45G_SR_WIP;
+  pConfig->MatchMode = HAL_XSPI_MATCH_MODE_AND;
+  pConfig->IntervalTime = MX66UW1G45G_AUTOPOLLING_INTERVAL_TIME;
+  pConfig->AutomaticStop = HAL_XSPI_AUTOMATIC_STOP_ENABLE;
+
+  if (HAL_XSPI_Command(Ctx, &s_command, HAL_XSPI_TIMEOUT_DEFAULT_VALUE) != HAL_OK)
+  {
+    return MX66UW1G45G_ERROR;
+  }
+
+  return MX66UW1G45G_OK;
+}
+
 /**
   * @}
   */
@@ -60,6 +60,7 @@ extern "C" {
 #define MX66UW1G45G_BLOCK_ERASE_MAX_TIME         1000U
 #define MX66UW1G45G_BLOCK_4K_ERASE_MAX_TIME     400U
 #define MX66UW1G45G_WRITE_REG_MAX_TIME           40U
+#define MX66UW1G45G_PAGE_PROG_MAX_TIME           2U
 
 #define MX66UW1G45G_RESET_MAX_TIME               100U                 /* when SWreset during erase operation */
 
@@ -307,6 +308,8 @@ typedef enum
 int32_t MX66UW1G45G_GetFlashInfo(MX66UW1G45G_Info_t *pInfo);
 int32_t MX66UW1G45G_AutoPollingMemReady(XSPI_HandleTypeDef *Ctx, MX66UW1G45G_Interface_t Mode,
                                          MX66UW1G45G_Transfer_t Rate);
+int32_t MX66UW1G45G_AutoPollingMemReady_IT(XSPI_HandleTypeDef *Ctx, MX66UW1G45G_Interface_t Mode,
+                                            MX66UW1G45G_Transfer_t Rate);
 
 /* Read/Write Array Commands **************************************************/
 int32_t MX66UW1G45G_ReadSTR(XSPI_HandleTypeDef *Ctx, MX66UW1G45G_Interface_t Mode,
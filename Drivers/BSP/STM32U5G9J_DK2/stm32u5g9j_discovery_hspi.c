@@ -47,6 +47,20 @@
             function BSP_HSPI_NOR_DisableMemoryMapped() should be used.
        (++) The erase operation can be suspend and resume with using functions
             BSP_HSPI_NOR_SuspendErase() and BSP_HSPI_NOR_ResumeErase()
+       (++) Waits for the memory to be ready are done with the status polling in interrupt
+            mode, so HSPI1_IRQHandler() must call BSP_HSPI_NOR_IRQHandler(). Meanwhile the
+            weak function BSP_HSPI_NOR_WaitCallback() is called, it sleeps until the next
+            interrupt by default and can be overridden to yield to a scheduler.
+            BSP_HSPI_NOR_ReadyCallback() is called from the interrupt when the memory is ready.
+            BSP_HSPI_NOR_WaitForMemoryReady() waits for the end of an erase.
+            With USE_HAL_XSPI_REGISTER_CALLBACKS set to 1, BSP_HSPI_NOR_Init() registers the
+            status match and error callbacks of the HSPI handle. Otherwise this driver defines
+            HAL_XSPI_StatusMatchCallback() and HAL_XSPI_ErrorCallback() and owns them for every
+            XSPI instance, the application must not define them. Set
+            USE_HAL_XSPI_REGISTER_CALLBACKS to 1 if another XSPI instance needs them.
+       (++) BSP_HSPI_NOR_Write() skips pages that only hold 0xFF, as programming them leaves
+            the erased memory unchanged. BSP_HSPI_NOR_GetStats() returns the number of pages
+            programmed and skipped, BSP_HSPI_NOR_ResetStats() clears them.
        (++) It is possible to put the memory in deep power-down mode to reduce its consumption.
             For this, the function BSP_HSPI_NOR_EnterDeepPowerDown() should be called. To leave
             the deep power-down mode, the function BSP_HSPI_NOR_LeaveDeepPowerDown() should be called.
@@ -104,6 +118,8 @@ static HSPI_NOR_Ctx_t HSPI_Nor_Ctx[HSPI_NOR_INSTANCES_NUMBER]  = {{
 #if (USE_HAL_XSPI_REGISTER_CALLBACKS == 1U)
 static uint32_t HSPINor_IsMspCbValid[HSPI_NOR_INSTANCES_NUMBER] = {0};
 #endif /* (USE_HAL_XSPI_REGISTER_CALLBACKS == 1) */
+static BSP_HSPI_NOR_Stats_t HSPI_Nor_Stats[HSPI_NOR_INSTANCES_NUMBER] = {0};
+static __IO int32_t HSPI_Nor_ItStatus[HSPI_NOR_INSTANCES_NUMBER] = {0};
 
 /**
   * @}
@@ -121,6 +137,16 @@ static int32_t HSPI_NOR_ResetMemory(uint32_t Instance);
 static int32_t HSPI_NOR_EnterDOPIMode(uint32_t Instance);
 static int32_t HSPI_NOR_EnterSOPIMode(uint32_t Instance);
 static int32_t HSPI_NOR_ExitOPIMode(uint32_t Instance);
+static uint32_t HSPI_NOR_IsErasedValue(const uint8_t *pData, uint32_t Size);
+static uint32_t HSPI_NOR_NextPage(uint32_t Instance, uint32_t *pAddr, uint8_t **ppData, uint32_t EndAddr);
+static int32_t HSPI_NOR_ProgramPage(uint32_t Instance, uint8_t *pData, uint32_t WriteAddr, uint32_t Size);
+static int32_t HSPI_NOR_StartMemReady_IT(uint32_t Instance);
+static void    HSPI_NOR_StatusMatchCallback(XSPI_HandleTypeDef *hhspi);
+static void    HSPI_NOR_ErrorCallback(XSPI_HandleTypeDef *hhspi);
+#if (USE_HAL_XSPI_REGISTER_CALLBACKS == 1U)
+static int32_t HSPI_NOR_RegisterItCallbacks(uint32_t Instance);
+#endif /* (USE_HAL_XSPI_REGISTER_CALLBACKS == 1) */
+static int32_t HSPI_NOR_WaitMemReady_IT(uint32_t Instance, uint32_t Timeout);
 /**
   * @}
   */
@@ -181,6 +207,13 @@ int32_t BSP_HSPI_NOR_Init(uint32_t Instance, BSP_HSPI_NOR_Init_t *Init)
       {
         ret = BSP_ERROR_PERIPH_FAILURE;
       }
+#if (USE_HAL_XSPI_REGISTER_CALLBACKS == 1U)
+      /* The HAL resets the callbacks on init, register the status polling ones after it */
+      else if (HSPI_NOR_RegisterItCallbacks(Instance) != BSP_ERROR_NONE)
+      {
+        ret = BSP_ERROR_PERIPH_FAILURE;
+      }
+#endif /* (USE_HAL_XSPI_REGISTER_CALLBACKS == 1) */
 
       if (MX_HSPI_ClockConfig(&hhspi_nor[Instance]) != HAL_OK)
       {
@@ -490,6 +523,11 @@ int32_t BSP_HSPI_NOR_Read(uint32_t Instance, uint8_t *pData, uint32_t ReadAddr,
 
 /**
   * @brief  Writes an amount of data to the HSPI memory.
+  * @note   The end of each page program is polled in interrupt mode: while the memory
+  *         programs a page, the next page is scanned for 0xFF, then
+  *         BSP_HSPI_NOR_WaitCallback() is called until the status match interrupt.
+  *         Pages that only hold 0xFF are skipped. Must not be called with interrupts
+  *         disabled.
   * @param  Instance  HSPI instance
   * @param  pData     Pointer to data to be written
   * @param  WriteAddr Write start address
@@ -502,7 +540,7 @@ int32_t BSP_HSPI_NOR_Write(uint32_t Instance, uint8_t *pData, uint32_t WriteAddr
   uint32_t end_addr;
   uint32_t current_size;
   uint32_t current_addr;
-  uint32_t data_addr;
+  uint8_t *current_data;
 
   /* Check if the instance is supported */
   if (Instance >= HSPI_NOR_INSTANCES_NUMBER)
@@ -511,76 +549,44 @@ int32_t BSP_HSPI_NOR_Write(uint32_t Instance, uint8_t *pData, uint32_t WriteAddr
   }
   else
   {
-    /* Calculation of the size between the write address and the end of the page */
-    current_size = MX66UW1G45G_PAGE_SIZE - (WriteAddr % MX66UW1G45G_PAGE_SIZE);
-
-    /* Check if the size of the data is less than the remaining place in the page */
-    if (current_size > Size)
-    {
-      current_size = Size;
-    }
-
     /* Initialize the address variables */
     current_addr = WriteAddr;
+    current_data = pData;
     end_addr = WriteAddr + Size;
-    data_addr = (uint32_t)pData;
+
+    /* Find the first page to program */
+    current_size = HSPI_NOR_NextPage(Instance, &current_addr, &current_data, end_addr);
+
+    /* Check if Flash busy ? */
+    if ((current_size != 0U) && (BSP_HSPI_NOR_WaitForMemoryReady(Instance) != BSP_ERROR_NONE))
+    {
+      ret = BSP_ERROR_COMPONENT_FAILURE;
+    }
 
     /* Perform the write page by page */
-    do
+    while ((current_size != 0U) && (ret == BSP_ERROR_NONE))
     {
-      /* Check if Flash busy ? */
-      if (MX66UW1G45G_AutoPollingMemReady(&hhspi_nor[Instance], HSPI_Nor_Ctx[Instance].InterfaceMode,
-                                          HSPI_Nor_Ctx[Instance].TransferRate) != MX66UW1G45G_OK)
+      if (HSPI_NOR_ProgramPage(Instance, current_data, current_addr, current_size) != BSP_ERROR_NONE)
       {
         ret = BSP_ERROR_COMPONENT_FAILURE;
-      }/* Enable write operations */
-      else if (MX66UW1G45G_WriteEnable(&hhspi_nor[Instance], HSPI_Nor_Ctx[Instance].InterfaceMode,
-                                       HSPI_Nor_Ctx[Instance].TransferRate) != MX66UW1G45G_OK)
+      }/* Configure automatic polling mode to signal the end of program */
+      else if (HSPI_NOR_StartMemReady_IT(Instance) != BSP_ERROR_NONE)
       {
         ret = BSP_ERROR_COMPONENT_FAILURE;
       }
       else
       {
-        if (HSPI_Nor_Ctx[Instance].TransferRate == BSP_HSPI_NOR_STR_TRANSFER)
-        {
-          /* Issue page program command */
-          if (MX66UW1G45G_PageProgram(&hhspi_nor[Instance], HSPI_Nor_Ctx[Instance].InterfaceMode,
-                                      MX66UW1G45G_4BYTES_SIZE, (uint8_t *)data_addr, current_addr,
-                                      current_size) != MX66UW1G45G_OK)
-          {
-            ret = BSP_ERROR_COMPONENT_FAILURE;
-          }
-        }
-        else
-        {
-          /* Issue page program command */
-          if (MX66UW1G45G_PageProgramDTR(&hhspi_nor[Instance], (uint8_t *)data_addr, current_addr,
-                                         current_size) != MX66UW1G45G_OK)
-          {
-            ret = BSP_ERROR_COMPONENT_FAILURE;
-          }
-        }
+        HSPI_Nor_Stats[Instance].ProgrammedPages++;
 
-        if (ret == BSP_ERROR_NONE)
-        {
-          /* Configure automatic polling mode to wait for end of program */
-          if (MX66UW1G45G_AutoPollingMemReady(&hhspi_nor[Instance], HSPI_Nor_Ctx[Instance].InterfaceMode,
-                                              HSPI_Nor_Ctx[Instance].TransferRate) != MX66UW1G45G_OK)
-          {
-            ret = BSP_ERROR_COMPONENT_FAILURE;
-          }
-          else
-          {
-            /* Update the address and size variables for next page programming */
-            current_addr += current_size;
-            data_addr += current_size;
-            current_size = ((current_addr + MX66UW1G45G_PAGE_SIZE) > end_addr)
-                           ? (end_addr - current_addr)
-                           : MX66UW1G45G_PAGE_SIZE;
-          }
-        }
+        /* Find the next page while the memory is busy */
+        current_addr += current_size;
+        current_data += current_size;
+        current_size = HSPI_NOR_NextPage(Instance, &current_addr, &current_data, end_addr);
+
+        /* Wait for end of program */
+        ret = HSPI_NOR_WaitMemReady_IT(Instance, MX66UW1G45G_PAGE_PROG_MAX_TIME);
       }
-    } while ((current_addr < end_addr) && (ret == BSP_ERROR_NONE));
+    }
   }
 
   /* Return BSP status */
@@ -606,8 +612,7 @@ int32_t BSP_HSPI_NOR_Erase_Block(uint32_t Instance, uint32_t BlockAddress, BSP_H
   else
   {
     /* Check Flash busy ? */
-    if (MX66UW1G45G_AutoPollingMemReady(&hhspi_nor[Instance], HSPI_Nor_Ctx[Instance].InterfaceMode,
-                                        HSPI_Nor_Ctx[Instance].TransferRate) != MX66UW1G45G_OK)
+    if (BSP_HSPI_NOR_WaitForMemoryReady(Instance) != BSP_ERROR_NONE)
     {
       ret = BSP_ERROR_COMPONENT_FAILURE;
     }/* Enable write operations */
@@ -649,8 +654,7 @@ int32_t BSP_HSPI_NOR_Erase_Chip(uint32_t Instance)
   else
   {
     /* Check Flash busy ? */
-    if (MX66UW1G45G_AutoPollingMemReady(&hhspi_nor[Instance], HSPI_Nor_Ctx[Instance].InterfaceMode,
-                                        HSPI_Nor_Ctx[Instance].TransferRate) != MX66UW1G45G_OK)
+    if (BSP_HSPI_NOR_WaitForMemoryReady(Instance) != BSP_ERROR_NONE)
     {
       ret = BSP_ERROR_COMPONENT_FAILURE;
     }/* Enable write operations */
@@ -674,6 +678,35 @@ int32_t BSP_HSPI_NOR_Erase_Chip(uint32_t Instance)
   return ret;
 }
 
+/**
+  * @brief  Waits until the HSPI memory is ready, for example for the end of an erase.
+  * @note   The status is polled by the HSPI in interrupt mode, BSP_HSPI_NOR_WaitCallback()
+  *         is called repeatedly meanwhile. Must not be called with interrupts disabled.
+  * @param  Instance  HSPI instance
+  * @retval BSP status
+  */
+int32_t BSP_HSPI_NOR_WaitForMemoryReady(uint32_t Instance)
+{
+  int32_t ret;
+
+  /* Check if the instance is supported */
+  if (Instance >= HSPI_NOR_INSTANCES_NUMBER)
+  {
+    ret = BSP_ERROR_WRONG_PARAM;
+  }
+  else if (HSPI_NOR_StartMemReady_IT(Instance) != BSP_ERROR_NONE)
+  {
+    ret = BSP_ERROR_COMPONENT_FAILURE;
+  }
+  else
+  {
+    ret = HSPI_NOR_WaitMemReady_IT(Instance, HAL_XSPI_TIMEOUT_DEFAULT_VALUE);
+  }
+
+  /* Return BSP status */
+  return ret;
+}
+
 /**
   * @brief  Reads current status of the HSPI memory.
   * @param  Instance  HSPI instance
@@ -968,6 +1001,12 @@ int32_t BSP_HSPI_NOR_SuspendErase(uint32_t Instance)
   {
     ret = BSP_ERROR_COMPONENT_FAILURE;
   }
+  /* The memory clears the write in progress bit once suspended, after the suspend latency */
+  else if (MX66UW1G45G_AutoPollingMemReady(&hhspi_nor[Instance], HSPI_Nor_Ctx[Instance].InterfaceMode,
+                                           HSPI_Nor_Ctx[Instance].TransferRate) != MX66UW1G45G_OK)
+  {
+    ret = BSP_ERROR_COMPONENT_FAILURE;
+  }
   else if (BSP_HSPI_NOR_GetStatus(Instance) != BSP_ERROR_HSPI_SUSPENDED)
   {
     ret = BSP_ERROR_COMPONENT_FAILURE;
@@ -1083,6 +1122,133 @@ int32_t BSP_HSPI_NOR_LeaveDeepPowerDown(uint32_t Instance)
   /* Return BSP status */
   return ret;
 }
+
+/**
+  * @brief  Handles HSPI interrupt request.
+  * @param  Instance  HSPI instance
+  * @retval None
+  */
+void BSP_HSPI_NOR_IRQHandler(uint32_t Instance)
+{
+  HAL_XSPI_IRQHandler(&hhspi_nor[Instance]);
+}
+
+#if (USE_HAL_XSPI_REGISTER_CALLBACKS == 0U)
+/**
+  * @brief  Status match callback of all XSPI instances, owned by this driver.
+  * @param  hhspi HSPI handle
+  * @retval None
+  */
+void HAL_XSPI_StatusMatchCallback(XSPI_HandleTypeDef *hhspi)
+{
+  HSPI_NOR_StatusMatchCallback(hhspi);
+}
+
+/**
+  * @brief  Transfer error callback of all XSPI instances, owned by this driver.
+  * @param  hhspi HSPI handle
+  * @retval None
+  */
+void HAL_XSPI_ErrorCallback(XSPI_HandleTypeDef *hhspi)
+{
+  HSPI_NOR_ErrorCallback(hhspi);
+}
+#endif /* (USE_HAL_XSPI_REGISTER_CALLBACKS == 0) */
+
+/**
+  * @brief  BSP HSPI NOR wait callback, called repeatedly while waiting for the memory.
+  * @note   The default implementation sleeps until the next interrupt. It can be
+  *         implemented by the user application to yield to a scheduler instead, for
+  *         example by waiting on a semaphore given in BSP_HSPI_NOR_ReadyCallback().
+  *         BSP_HSPI_NOR_IsBusy() tells if the wait is over.
+  * @param  Instance  HSPI instance
+  * @retval None
+  */
+__weak void BSP_HSPI_NOR_WaitCallback(uint32_t Instance)
+{
+  /* Interrupts are masked while the status is checked, so the status match can't
+     slip in between the check and the WFI, the pending interrupt still wakes the core */
+  __disable_irq();
+  if (HSPI_Nor_ItStatus[Instance] == BSP_ERROR_BUSY)
+  {
+    __WFI();
+  }
+  __enable_irq();
+}
+
+/**
+  * @brief  BSP HSPI NOR ready callback, called from interrupt context when the memory
+  *         becomes ready or the status polling fails.
+  * @param  Instance  HSPI instance
+  * @retval None
+  */
+__weak void BSP_HSPI_NOR_ReadyCallback(uint32_t Instance)
+{
+  /* Prevent unused argument(s) compilation warning */
+  UNUSED(Instance);
+  /* This function should be implemented by the user application.
+     It is called into this driver when the memory becomes ready. */
+}
+
+/**
+  * @brief  Tells if a wait for the HSPI memory is still pending.
+  * @param  Instance  HSPI instance
+  * @retval 1 while the memory is busy, 0 otherwise
+  */
+uint32_t BSP_HSPI_NOR_IsBusy(uint32_t Instance)
+{
+  return (HSPI_Nor_ItStatus[Instance] == BSP_ERROR_BUSY) ? 1U : 0U;
+}
+
+/**
+  * @brief  Get the page program counters of the HSPI memory.
+  * @param  Instance  HSPI instance
+  * @param  pStats    Pointer to the counters
+  * @retval BSP status
+  */
+int32_t BSP_HSPI_NOR_GetStats(uint32_t Instance, BSP_HSPI_NOR_Stats_t *pStats)
+{
+  int32_t ret;
+
+  /* Check if the instance is supported */
+  if (Instance >= HSPI_NOR_INSTANCES_NUMBER)
+  {
+    ret = BSP_ERROR_WRONG_PARAM;
+  }
+  else
+  {
+    *pStats = HSPI_Nor_Stats[Instance];
+    ret = BSP_ERROR_NONE;
+  }
+
+  /* Return BSP status */
+  return ret;
+}
+
+/**
+  * @brief  Reset the page program counters of the HSPI memory.
+  * @param  Instance  HSPI instance
+  * @retval BSP status
+  */
+int32_t BSP_HSPI_NOR_ResetStats(uint32_t Instance)
+{
+  int32_t ret;
+
+  /* Check if the instance is supported */
+  if (Instance >= HSPI_NOR_INSTANCES_NUMBER)
+  {
+    ret = BSP_ERROR_WRONG_PARAM;
+  }
+  else
+  {
+    HSPI_Nor_Stats[Instance].ProgrammedPages = 0;
+    HSPI_Nor_Stats[Instance].SkippedPages    = 0;
+    ret = BSP_ERROR_NONE;
+  }
+
+  /* Return BSP status */
+  return ret;
+}
 /**
   * @}
   */
@@ -1182,6 +1348,10 @@ static void HSPI_NOR_MspInit(XSPI_HandleTypeDef *hhspi)
   GPIO_InitStruct.Pin       = HSPI_NOR_D7_PIN;
   GPIO_InitStruct.Alternate = HSPI_NOR_D7_PIN_AF;
   HAL_GPIO_Init(HSPI_NOR_D7_GPIO_PORT, &GPIO_InitStruct);
+
+  /* Configure the NVIC for the status match interrupt */
+  HAL_NVIC_SetPriority(HSPI_NOR_IRQn, BSP_HSPI_NOR_IT_PRIORITY, 0);
+  HAL_NVIC_EnableIRQ(HSPI_NOR_IRQn);
 #else
   printf("HSPI_NOR_MspInit STUBBED !!!\r\n");
 #endif
@@ -1198,6 +1368,9 @@ static void HSPI_NOR_MspDeInit(XSPI_HandleTypeDef *hhspi)
   /* hhspi unused argument(s) compilation warning */
   UNUSED(hhspi);
 
+  /* Disable the HSPI interrupt */
+  HAL_NVIC_DisableIRQ(HSPI_NOR_IRQn);
+
   /* HSPI GPIO pins de-configuration  */
   HAL_GPIO_DeInit(HSPI_NOR_CLK_GPIO_PORT, HSPI_NOR_CLK_PIN);
   HAL_GPIO_DeInit(HSPI_NOR_DQS_GPIO_PORT, HSPI_NOR_DQS_PIN);
@@ -1490,6 +1663,229 @@ static int32_t HSPI_NOR_ExitOPIMode(uint32_t Instance)
   return ret;
 }
 
+/**
+  * @brief  Check if a buffer only holds the erased value of the memory (0xFF).
+  * @param  pData  Pointer to the data
+  * @param  Size   Size of the data
+  * @retval 1 if all bytes are 0xFF, 0 otherwise
+  */
+static uint32_t HSPI_NOR_IsErasedValue(const uint8_t *pData, uint32_t Size)
+{
+  const uint8_t *end = &pData[Size];
+  uint32_t ret = 1U;
+
+  /* Check the bytes up to the first word boundary */
+  while ((ret == 1U) && (pData < end) && (((uint32_t)pData & 3U) != 0U))
+  {
+    ret = (*pData == 0xFFU) ? 1U : 0U;
+    pData++;
+  }
+
+  /* Check the aligned words, 4 at a time */
+  while ((ret == 1U) && ((uint32_t)(end - pData) >= 16U))
+  {
+    const uint32_t *word = (const uint32_t *)pData;
+    ret = ((word[0] & word[1] & word[2] & word[3]) == 0xFFFFFFFFU) ? 1U : 0U;
+    pData += 16U;
+  }
+
+  /* Check the remaining bytes */
+  while ((ret == 1U) && (pData < end))
+  {
+    ret = (*pData == 0xFFU) ? 1U : 0U;
+    pData++;
+  }
+
+  return ret;
+}
+
+/**
+  * @brief  Find the next page to program, pages that only hold 0xFF are skipped.
+  * @param  Instance  HSPI instance
+  * @param  pAddr     Pointer to the write address, updated past the skipped pages
+  * @param  ppData    Pointer to the data pointer, updated past the skipped pages
+  * @param  EndAddr   End address of the write
+  * @retval Size of the page to program, 0 if there is nothing left to program
+  */
+static uint32_t HSPI_NOR_NextPage(uint32_t Instance, uint32_t *pAddr, uint8_t **ppData, uint32_t EndAddr)
+{
+  uint32_t size = 0U;
+
+  while ((size == 0U) && (*pAddr < EndAddr))
+  {
+    /* Calculation of the size between the write address and the end of the page */
+    size = MX66UW1G45G_PAGE_SIZE - (*pAddr % MX66UW1G45G_PAGE_SIZE);
+    if (size > (EndAddr - *pAddr))
+    {
+      size = EndAddr - *pAddr;
+    }
+
+    /* Programming 0xFF leaves erased memory unchanged, skip pages that hold nothing else */
+    if (HSPI_NOR_IsErasedValue(*ppData, size) == 1U)
+    {
+      HSPI_Nor_Stats[Instance].SkippedPages++;
+      *pAddr += size;
+      *ppData += size;
+      size = 0U;
+    }
+  }
+
+  return size;
+}
+
+/**
+  * @brief  Enable write operations and issue the page program command.
+  * @param  Instance  HSPI instance
+  * @param  pData     Pointer to data to be written
+  * @param  WriteAddr Write start address
+  * @param  Size      Size of data to write, must not cross a page
+  * @retval BSP status
+  */
+static int32_t HSPI_NOR_ProgramPage(uint32_t Instance, uint8_t *pData, uint32_t WriteAddr, uint32_t Size)
+{
+  int32_t ret = BSP_ERROR_NONE;
+
+  /* Enable write operations */
+  if (MX66UW1G45G_WriteEnable(&hhspi_nor[Instance], HSPI_Nor_Ctx[Instance].InterfaceMode,
+                              HSPI_Nor_Ctx[Instance].TransferRate) != MX66UW1G45G_OK)
+  {
+    ret = BSP_ERROR_COMPONENT_FAILURE;
+  }
+  else if (HSPI_Nor_Ctx[Instance].TransferRate == BSP_HSPI_NOR_STR_TRANSFER)
+  {
+    /* Issue page program command */
+    if (MX66UW1G45G_PageProgram(&hhspi_nor[Instance], HSPI_Nor_Ctx[Instance].InterfaceMode,
+                                MX66UW1G45G_4BYTES_SIZE, pData, WriteAddr, Size) != MX66UW1G45G_OK)
+    {
+      ret = BSP_ERROR_COMPONENT_FAILURE;
+    }
+  }
+  else
+  {
+    /* Issue page program command */
+    if (MX66UW1G45G_PageProgramDTR(&hhspi_nor[Instance], pData, WriteAddr, Size) != MX66UW1G45G_OK)
+    {
+      ret = BSP_ERROR_COMPONENT_FAILURE;
+    }
+  }
+
+  return ret;
+}
+
+/**
+  * @brief  Start polling the memory status in interrupt mode, the status match callback
+  *         marks the memory ready.
+  * @param  Instance  HSPI instance
+  * @retval BSP status
+  */
+static int32_t HSPI_NOR_StartMemReady_IT(uint32_t Instance)
+{
+  int32_t ret = BSP_ERROR_NONE;
+
+  HSPI_Nor_ItStatus[Instance] = BSP_ERROR_BUSY;
+  if (MX66UW1G45G_AutoPollingMemReady_IT(&hhspi_nor[Instance], HSPI_Nor_Ctx[Instance].InterfaceMode,
+                                         HSPI_Nor_Ctx[Instance].TransferRate) != MX66UW1G45G_OK)
+  {
+    HSPI_Nor_ItStatus[Instance] = BSP_ERROR_NONE;
+    ret = BSP_ERROR_COMPONENT_FAILURE;
+  }
+
+  return ret;
+}
+
+/**
+  * @brief  Wait for the status polling started by HSPI_NOR_StartMemReady_IT.
+  * @note   BSP_HSPI_NOR_WaitCallback() is called until the memory is ready.
+  * @param  Instance  HSPI instance
+  * @param  Timeout   Timeout in ms
+  * @retval BSP status
+  */
+static int32_t HSPI_NOR_WaitMemReady_IT(uint32_t Instance, uint32_t Timeout)
+{
+  int32_t ret;
+  uint32_t tickstart = HAL_GetTick();
+
+  while ((HSPI_Nor_ItStatus[Instance] == BSP_ERROR_BUSY) && ((HAL_GetTick() - tickstart) <= Timeout))
+  {
+    BSP_HSPI_NOR_WaitCallback(Instance);
+  }
+
+  ret = HSPI_Nor_ItStatus[Instance];
+  if (ret == BSP_ERROR_BUSY)
+  {
+    /* Stop the polling on timeout */
+    (void)HAL_XSPI_Abort(&hhspi_nor[Instance]);
+    HSPI_Nor_ItStatus[Instance] = BSP_ERROR_NONE;
+    ret = BSP_ERROR_COMPONENT_FAILURE;
+  }
+
+  return ret;
+}
+
+/**
+  * @brief  Status match callback, the memory is ready.
+  * @param  hhspi HSPI handle
+  * @retval None
+  */
+static void HSPI_NOR_StatusMatchCallback(XSPI_HandleTypeDef *hhspi)
+{
+  uint32_t i;
+
+  for (i = 0U; i < HSPI_NOR_INSTANCES_NUMBER; i++)
+  {
+    if (hhspi == &hhspi_nor[i])
+    {
+      HSPI_Nor_ItStatus[i] = BSP_ERROR_NONE;
+      BSP_HSPI_NOR_ReadyCallback(i);
+    }
+  }
+}
+
+/**
+  * @brief  Transfer error callback, the status polling failed.
+  * @param  hhspi HSPI handle
+  * @retval None
+  */
+static void HSPI_NOR_ErrorCallback(XSPI_HandleTypeDef *hhspi)
+{
+  uint32_t i;
+
+  for (i = 0U; i < HSPI_NOR_INSTANCES_NUMBER; i++)
+  {
+    if (hhspi == &hhspi_nor[i])
+    {
+      HSPI_Nor_ItStatus[i] = BSP_ERROR_PERIPH_FAILURE;
+      BSP_HSPI_NOR_ReadyCallback(i);
+    }
+  }
+}
+
+#if (USE_HAL_XSPI_REGISTER_CALLBACKS == 1U)
+/**
+  * @brief  Register the status match and error callbacks of the HSPI handle.
+  * @note   The handle must be initialized, the HAL only accepts them in ready state.
+  * @param  Instance  HSPI instance
+  * @retval BSP status
+  */
+static int32_t HSPI_NOR_RegisterItCallbacks(uint32_t Instance)
+{
+  int32_t ret = BSP_ERROR_NONE;
+
+  if (HAL_XSPI_RegisterCallback(&hhspi_nor[Instance], HAL_XSPI_STATUS_MATCH_CB_ID,
+                                HSPI_NOR_StatusMatchCallback) != HAL_OK)
+  {
+    ret = BSP_ERROR_PERIPH_FAILURE;
+  }
+  else if (HAL_XSPI_RegisterCallback(&hhspi_nor[Instance], HAL_XSPI_ERROR_CB_ID,
+                                     HSPI_NOR_ErrorCallback) != HAL_OK)
+  {
+    ret = BSP_ERROR_PERIPH_FAILURE;
+  }
+
+  return ret;
+}
+#endif /* (USE_HAL_XSPI_REGISTER_CALLBACKS == 1) */
+
 /**
   * @}
   */
@@ -92,6 +92,12 @@ typedef struct
   BSP_HSPI_NOR_Interface_t   InterfaceMode;      /*!<  Current Flash Interface mode */
   BSP_HSPI_NOR_Transfer_t    TransferRate;       /*!<  Current Flash Transfer rate  */
 } BSP_HSPI_NOR_Init_t;
+
+typedef struct
+{
+  uint32_t                   ProgrammedPages;    /*!<  Pages programmed by BSP_HSPI_NOR_Write     */
+  uint32_t                   SkippedPages;       /*!<  Pages only holding 0xFF, not programmed    */
+} BSP_HSPI_NOR_Stats_t;
 /**
   * @}
   */
@@ -120,6 +126,9 @@ typedef struct
 #define HSPI_NOR_FORCE_RESET()                __HAL_RCC_HSPI1_FORCE_RESET()
 #define HSPI_NOR_RELEASE_RESET()              __HAL_RCC_HSPI1_RELEASE_RESET()
 
+/* Definition for HSPI NOR interrupt */
+#define HSPI_NOR_IRQn                         HSPI1_IRQn
+
 /* Definition for NOR HSPI Pins */
 /* HSPI_CLK */
 #define HSPI_NOR_CLK_PIN                      GPIO_PIN_3
@@ -210,6 +219,7 @@ int32_t BSP_HSPI_NOR_Read(uint32_t Instance, uint8_t *pData, uint32_t ReadAddr,
 int32_t BSP_HSPI_NOR_Write(uint32_t Instance, uint8_t *pData, uint32_t WriteAddr, uint32_t Size);
 int32_t BSP_HSPI_NOR_Erase_Block(uint32_t Instance, uint32_t BlockAddress, BSP_HSPI_NOR_Erase_t BlockSize);
 int32_t BSP_HSPI_NOR_Erase_Chip(uint32_t Instance);
+int32_t BSP_HSPI_NOR_WaitForMemoryReady(uint32_t Instance);
 int32_t BSP_HSPI_NOR_GetStatus(uint32_t Instance);
 int32_t BSP_HSPI_NOR_GetInfo(uint32_t Instance, BSP_HSPI_NOR_Info_t *pInfo);
 int32_t BSP_HSPI_NOR_EnableMemoryMappedMode(uint32_t Instance);
@@ -220,6 +230,12 @@ int32_t BSP_HSPI_NOR_SuspendErase(uint32_t Instance);
 int32_t BSP_HSPI_NOR_ResumeErase(uint32_t Instance);
 int32_t BSP_HSPI_NOR_EnterDeepPowerDown(uint32_t Instance);
 int32_t BSP_HSPI_NOR_LeaveDeepPowerDown(uint32_t Instance);
+void    BSP_HSPI_NOR_IRQHandler(uint32_t Instance);
+uint32_t BSP_HSPI_NOR_IsBusy(uint32_t Instance);
+void    BSP_HSPI_NOR_WaitCallback(uint32_t Instance);
+void    BSP_HSPI_NOR_ReadyCallback(uint32_t Instance);
+int32_t BSP_HSPI_NOR_GetStats(uint32_t Instance, BSP_HSPI_NOR_Stats_t *pStats);
+int32_t BSP_HSPI_NOR_ResetStats(uint32_t Instance);
 
 /**
   * @}
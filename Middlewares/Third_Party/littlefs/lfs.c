@@ -13,6 +13,21 @@
 #define LFS_BLOCK_NULL ((lfs_block_t)-1)
 #define LFS_BLOCK_INLINE ((lfs_block_t)-2)
 
+// sparse files map block sized chunks, the map follows a header of the
+// ctz reference, the file size, and the chunk size, and is a list of runs
+// of 16-bit entries, the first chunk of the run with LFS_SPARSE_RUN set if
+// an entry with the run's count follows, runs of freed chunks start with
+// LFS_SPARSE_NULL
+#define LFS_SPARSE_NULL 0x7fff
+#define LFS_SPARSE_RUN 0x8000
+#define LFS_SPARSE_HEADER 16
+
+// syncs since opening after which a file is synced too often to be kept
+// adaptively inlined, see inline_adapt_max
+#ifndef LFS_INLINE_HOT_SYNCS
+#define LFS_INLINE_HOT_SYNCS 4
+#endif
+
 enum {
     LFS_OK_RELOCATED = 1,
     LFS_OK_DROPPED   = 2,
@@ -25,6 +40,77 @@ enum {
     LFS_CMP_GT = 2,
 };
 
+// block device geometry, if LFS_READ_SIZE, LFS_PROG_SIZE, LFS_BLOCK_SIZE
+// or LFS_CACHE_SIZE are defined these become compile-time constants, which
+// lets the compiler fold the divisions/modulos in the hot paths into
+// shifts and masks
+#ifdef LFS_READ_SIZE
+#define LFS_CFG_READ_SIZE(lfs) ((void)(lfs), (lfs_size_t)(LFS_READ_SIZE))
+#else
+#define LFS_CFG_READ_SIZE(lfs) ((lfs)->cfg->read_size)
+#endif
+
+#ifdef LFS_PROG_SIZE
+#define LFS_CFG_PROG_SIZE(lfs) ((void)(lfs), (lfs_size_t)(LFS_PROG_SIZE))
+#else
+#define LFS_CFG_PROG_SIZE(lfs) ((lfs)->cfg->prog_size)
+#endif
+
+#ifdef LFS_BLOCK_SIZE
+#define LFS_CFG_BLOCK_SIZE(lfs) ((void)(lfs), (lfs_size_t)(LFS_BLOCK_SIZE))
+#else
+#define LFS_CFG_BLOCK_SIZE(lfs) ((lfs)->cfg->block_size)
+#endif
+
+#ifdef LFS_CACHE_SIZE
+#define LFS_CFG_CACHE_SIZE(lfs) ((void)(lfs), (lfs_size_t)(LFS_CACHE_SIZE))
+#else
+#define LFS_CFG_CACHE_SIZE(lfs) ((lfs)->cfg->cache_size)
+#endif
+
+
+/// Buffer allocation ///
+
+// buffers of cache_size come from the buffer pool if there is one, free
+// buffers are kept in a list threaded through the buffers themselves so
+// alloc and free are O(1), anything else falls back to lfs_malloc
+static void *lfs_buffer_alloc(lfs_t *lfs, lfs_size_t size) {
+    lfs->pool.allocs += 1;
+    if (size == LFS_CFG_CACHE_SIZE(lfs) && lfs->pool.free) {
+        void *buffer = lfs->pool.free;
+        memcpy(&lfs->pool.free, buffer, sizeof(void*));
+        lfs->pool.used += 1;
+        lfs->pool.peak = lfs_max(lfs->pool.peak, lfs->pool.used);
+        return buffer;
+    }
+
+    void *buffer = lfs_malloc(size);
+    if (buffer) {
+        lfs->pool.heap_allocs += 1;
+        lfs->pool.heap_used += size;
+        lfs->pool.heap_peak = lfs_max(lfs->pool.heap_peak,
+                lfs->pool.heap_used);
+    }
+    return buffer;
+}
+
+static void lfs_buffer_free(lfs_t *lfs, void *buffer, lfs_size_t size) {
+    if (lfs->pool.buffer
+            && (uint8_t*)buffer >= lfs->pool.buffer
+            && (uint8_t*)buffer < lfs->pool.buffer
+                + lfs->cfg->cache_pool_count*LFS_CFG_CACHE_SIZE(lfs)) {
+        memcpy(buffer, &lfs->pool.free, sizeof(void*));
+        lfs->pool.free = buffer;
+        lfs->pool.used -= 1;
+        return;
+    }
+
+    if (buffer) {
+        lfs->pool.heap_used -= size;
+    }
+    lfs_free(buffer);
+}
+
 
 /// Caching block device operations ///
 
@@ -37,16 +123,44 @@ static inline void lfs_cache_drop(lfs_t *lfs, lfs_cache_t *rcache) {
 
 static inline void lfs_cache_zero(lfs_t *lfs, lfs_cache_t *pcache) {
     // zero to avoid information leak
-    memset(pcache->buffer, 0xff, lfs->cfg->cache_size);
+    memset(pcache->buffer, 0xff, LFS_CFG_CACHE_SIZE(lfs));
     pcache->block = LFS_BLOCK_NULL;
 }
 
+// load the rcache with the data at off and up to hint bytes after it
+static int lfs_bd_fetch(lfs_t *lfs,
+        lfs_cache_t *rcache, lfs_size_t hint,
+        lfs_block_t block, lfs_off_t off) {
+    // fetch in units of fetch_size if we have one, below that the
+    // command overhead costs more than the extra bytes, since the fetch is
+    // aligned a scan running backwards with a small hint still gets the
+    // bytes before off, only forward scans should hint to the end of what
+    // they read
+    lfs_size_t align = (lfs->cfg->fetch_size)
+            ? lfs->cfg->fetch_size
+            : LFS_CFG_READ_SIZE(lfs);
+
+    LFS_ASSERT(!lfs->block_count || block < lfs->block_count);
+    rcache->block = block;
+    rcache->off = lfs_aligndown(off, align);
+    rcache->size = lfs_min(
+            lfs_min(
+                lfs_alignup(off+hint, align),
+                LFS_CFG_BLOCK_SIZE(lfs))
+            - rcache->off,
+            LFS_CFG_CACHE_SIZE(lfs));
+    int err = lfs->cfg->read(lfs->cfg, rcache->block,
+            rcache->off, rcache->buffer, rcache->size);
+    LFS_ASSERT(err <= 0);
+    return err;
+}
+
 static int lfs_bd_read(lfs_t *lfs,
         const lfs_cache_t *pcache, lfs_cache_t *rcache, lfs_size_t hint,
         lfs_block_t block, lfs_off_t off,
         void *buffer, lfs_size_t size) {
     uint8_t *data = buffer;
-    if (off+size > lfs->cfg->block_size
+    if (off+size > LFS_CFG_BLOCK_SIZE(lfs)
             || (lfs->block_count && block >= lfs->block_count)) {
         return LFS_ERR_CORRUPT;
     }
@@ -88,10 +202,10 @@ static int lfs_bd_read(lfs_t *lfs,
             diff = lfs_min(diff, rcache->off-off);
         }
 
-        if (size >= hint && off % lfs->cfg->read_size == 0 &&
-                size >= lfs->cfg->read_size) {
+        if (size >= hint && off % LFS_CFG_READ_SIZE(lfs) == 0 &&
+                size >= LFS_CFG_READ_SIZE(lfs)) {
             // bypass cache?
-            diff = lfs_aligndown(diff, lfs->cfg->read_size);
+            diff = lfs_aligndown(diff, LFS_CFG_READ_SIZE(lfs));
             int err = lfs->cfg->read(lfs->cfg, block, off, data, diff);
             if (err) {
                 return err;
@@ -104,18 +218,7 @@ static int lfs_bd_read(lfs_t *lfs,
         }
 
         // load to cache, first condition can no longer fail
-        LFS_ASSERT(!lfs->block_count || block < lfs->block_count);
-        rcache->block = block;
-        rcache->off = lfs_aligndown(off, lfs->cfg->read_size);
-        rcache->size = lfs_min(
-                lfs_min(
-                    lfs_alignup(off+hint, lfs->cfg->read_size),
-                    lfs->cfg->block_size)
-                - rcache->off,
-                lfs->cfg->cache_size);
-        int err = lfs->cfg->read(lfs->cfg, rcache->block,
-                rcache->off, rcache->buffer, rcache->size);
-        LFS_ASSERT(err <= 0);
+        int err = lfs_bd_fetch(lfs, rcache, hint, block, off);
         if (err) {
             return err;
         }
@@ -124,6 +227,71 @@ static int lfs_bd_read(lfs_t *lfs,
     return 0;
 }
 
+// find the data at off in the caches without copying it out, loading the
+// rcache on a miss, *buffer then points to *size bytes of the data, fewer
+// than asked for if the data continues in the other cache or past the end
+// of the rcache
+static int lfs_bd_peek(lfs_t *lfs,
+        const lfs_cache_t *pcache, lfs_cache_t *rcache, lfs_size_t hint,
+        lfs_block_t block, lfs_off_t off,
+        const uint8_t **buffer, lfs_size_t *size) {
+    if (off+*size > LFS_CFG_BLOCK_SIZE(lfs)
+            || (lfs->block_count && block >= lfs->block_count)) {
+        return LFS_ERR_CORRUPT;
+    }
+
+    while (true) {
+        lfs_size_t diff = *size;
+
+        if (pcache && block == pcache->block &&
+                off < pcache->off + pcache->size) {
+            if (off >= pcache->off) {
+                // is already in pcache?
+                *buffer = &pcache->buffer[off-pcache->off];
+                *size = lfs_min(diff, pcache->size - (off-pcache->off));
+                return 0;
+            }
+
+            // pcache takes priority
+            diff = lfs_min(diff, pcache->off-off);
+        }
+
+        if (block == rcache->block &&
+                off < rcache->off + rcache->size &&
+                off >= rcache->off) {
+            // is already in rcache?
+            *buffer = &rcache->buffer[off-rcache->off];
+            *size = lfs_min(diff, rcache->size - (off-rcache->off));
+            return 0;
+        }
+
+        // load to cache, first condition can no longer fail
+        int err = lfs_bd_fetch(lfs, rcache, hint, block, off);
+        if (err) {
+            return err;
+        }
+    }
+}
+
+// read a region that may continue past the end of the block into the
+// following physically contiguous blocks, this bypasses the caches so
+// the caller needs to make sure the region is not in the pcache
+static int lfs_bd_readspan(lfs_t *lfs,
+        lfs_block_t block, lfs_off_t off,
+        void *buffer, lfs_size_t size) {
+    LFS_ASSERT(off % LFS_CFG_READ_SIZE(lfs) == 0);
+    LFS_ASSERT(size % LFS_CFG_READ_SIZE(lfs) == 0);
+    LFS_ASSERT(size <= lfs->cfg->read_span_max);
+    lfs_block_t last = block + (off+size-1) / LFS_CFG_BLOCK_SIZE(lfs);
+    if (last < block || (lfs->block_count && last >= lfs->block_count)) {
+        return LFS_ERR_CORRUPT;
+    }
+
+    int err = lfs->cfg->read(lfs->cfg, block, off, buffer, size);
+    LFS_ASSERT(err <= 0);
+    return err;
+}
+
 static int lfs_bd_cmp(lfs_t *lfs,
         const lfs_cache_t *pcache, lfs_cache_t *rcache, lfs_size_t hint,
         lfs_block_t block, lfs_off_t off,
@@ -131,13 +299,13 @@ static int lfs_bd_cmp(lfs_t *lfs,
     const uint8_t *data = buffer;
     lfs_size_t diff = 0;
 
+    // compare in place in the caches, a span at a time
     for (lfs_off_t i = 0; i < size; i += diff) {
-        uint8_t dat[8];
-
-        diff = lfs_min(size-i, sizeof(dat));
-        int err = lfs_bd_read(lfs,
+        const uint8_t *dat;
+        diff = size-i;
+        int err = lfs_bd_peek(lfs,
                 pcache, rcache, hint-i,
-                block, off+i, &dat, diff);
+                block, off+i, &dat, &diff);
         if (err) {
             return err;
         }
@@ -156,17 +324,18 @@ static int lfs_bd_crc(lfs_t *lfs,
         lfs_block_t block, lfs_off_t off, lfs_size_t size, uint32_t *crc) {
     lfs_size_t diff = 0;
 
+    // crc in place in the caches, a span at a time
     for (lfs_off_t i = 0; i < size; i += diff) {
-        uint8_t dat[8];
-        diff = lfs_min(size-i, sizeof(dat));
-        int err = lfs_bd_read(lfs,
+        const uint8_t *dat;
+        diff = size-i;
+        int err = lfs_bd_peek(lfs,
                 pcache, rcache, hint-i,
-                block, off+i, &dat, diff);
+                block, off+i, &dat, &diff);
         if (err) {
             return err;
         }
 
-        *crc = lfs_crc(*crc, &dat, diff);
+        *crc = lfs_crc(*crc, dat, diff);
     }
 
     return 0;
@@ -177,7 +346,7 @@ static int lfs_bd_flush(lfs_t *lfs,
         lfs_cache_t *pcache, lfs_cache_t *rcache, bool validate) {
     if (pcache->block != LFS_BLOCK_NULL && pcache->block != LFS_BLOCK_INLINE) {
         LFS_ASSERT(pcache->block < lfs->block_count);
-        lfs_size_t diff = lfs_alignup(pcache->size, lfs->cfg->prog_size);
+        lfs_size_t diff = lfs_alignup(pcache->size, LFS_CFG_PROG_SIZE(lfs));
         int err = lfs->cfg->prog(lfs->cfg, pcache->block,
                 pcache->off, pcache->buffer, diff);
         LFS_ASSERT(err <= 0);
@@ -230,15 +399,15 @@ static int lfs_bd_prog(lfs_t *lfs,
         const void *buffer, lfs_size_t size) {
     const uint8_t *data = buffer;
     LFS_ASSERT(block == LFS_BLOCK_INLINE || block < lfs->block_count);
-    LFS_ASSERT(off + size <= lfs->cfg->block_size);
+    LFS_ASSERT(off + size <= LFS_CFG_BLOCK_SIZE(lfs));
 
     while (size > 0) {
         if (block == pcache->block &&
                 off >= pcache->off &&
-                off < pcache->off + lfs->cfg->cache_size) {
+                off < pcache->off + LFS_CFG_CACHE_SIZE(lfs)) {
             // already fits in pcache?
             lfs_size_t diff = lfs_min(size,
-                    lfs->cfg->cache_size - (off-pcache->off));
+                    LFS_CFG_CACHE_SIZE(lfs) - (off-pcache->off));
             memcpy(&pcache->buffer[off-pcache->off], data, diff);
 
             data += diff;
@@ -246,7 +415,7 @@ static int lfs_bd_prog(lfs_t *lfs,
             size -= diff;
 
             pcache->size = lfs_max(pcache->size, off - pcache->off);
-            if (pcache->size == lfs->cfg->cache_size) {
+            if (pcache->size == LFS_CFG_CACHE_SIZE(lfs)) {
                 // eagerly flush out pcache if we fill up
                 int err = lfs_bd_flush(lfs, pcache, rcache, validate);
                 if (err) {
@@ -263,7 +432,7 @@ static int lfs_bd_prog(lfs_t *lfs,
 
         // prepare pcache, first condition can no longer fail
         pcache->block = block;
-        pcache->off = lfs_aligndown(off, lfs->cfg->prog_size);
+        pcache->off = lfs_aligndown(off, LFS_CFG_PROG_SIZE(lfs));
         pcache->size = 0;
     }
 
@@ -471,6 +640,85 @@ static void lfs_ctz_tole32(struct lfs_ctz *ctz) {
 }
 #endif
 
+static void lfs_pack_fromle32(struct lfs_pack *pack) {
+    pack->block = lfs_fromle32(pack->block);
+    pack->off   = lfs_fromle32(pack->off);
+    pack->size  = lfs_fromle32(pack->size);
+}
+
+#ifndef LFS_READONLY
+static void lfs_pack_tole32(struct lfs_pack *pack) {
+    pack->block = lfs_tole32(pack->block);
+    pack->off   = lfs_tole32(pack->off);
+    pack->size  = lfs_tole32(pack->size);
+}
+#endif
+
+// a run of stored chunks holding consecutive chunks of a sparse file
+struct lfs_sparse_run {
+    lfs_size_t chunk;
+    lfs_size_t count;
+};
+
+static inline lfs_size_t lfs_sparse_get(const lfs_file_t *file,
+        lfs_size_t i) {
+    const uint8_t *p = &file->sparse.buffer[LFS_SPARSE_HEADER + 2*i];
+    return (lfs_size_t)p[0] | ((lfs_size_t)p[1] << 8);
+}
+
+// read the run at entry i, returns the number of entries it takes
+static inline lfs_size_t lfs_sparse_getrun(const lfs_file_t *file,
+        lfs_size_t i, struct lfs_sparse_run *run) {
+    lfs_size_t entry = lfs_sparse_get(file, i);
+    run->chunk = entry & ~LFS_SPARSE_RUN;
+    run->count = (entry & LFS_SPARSE_RUN) ? lfs_sparse_get(file, i+1) : 1;
+    return (entry & LFS_SPARSE_RUN) ? 2 : 1;
+}
+
+#ifndef LFS_READONLY
+static inline void lfs_sparse_set(lfs_file_t *file,
+        lfs_size_t i, lfs_size_t entry) {
+    uint8_t *p = &file->sparse.buffer[LFS_SPARSE_HEADER + 2*i];
+    p[0] = (uint8_t)(entry >> 0);
+    p[1] = (uint8_t)(entry >> 8);
+}
+
+static inline lfs_size_t lfs_sparse_runsize(
+        const struct lfs_sparse_run *run) {
+    return (run->count > 1) ? 2 : 1;
+}
+
+// write a run at entry i, returns the number of entries it takes
+static inline lfs_size_t lfs_sparse_setrun(lfs_file_t *file,
+        lfs_size_t i, const struct lfs_sparse_run *run) {
+    if (run->count > 1) {
+        lfs_sparse_set(file, i, run->chunk | LFS_SPARSE_RUN);
+        lfs_sparse_set(file, i+1, run->count);
+        return 2;
+    }
+
+    lfs_sparse_set(file, i, run->chunk);
+    return 1;
+}
+#endif
+
+static inline lfs_block_t lfs_index_get(const lfs_file_t *file,
+        lfs_size_t k) {
+    uint32_t block;
+    memcpy(&block, &file->index.buffer[LFS_INDEX_BUFFER_SIZE(k)],
+            sizeof(block));
+    return lfs_fromle32(block);
+}
+
+#ifndef LFS_READONLY
+static inline void lfs_index_set(lfs_file_t *file,
+        lfs_size_t k, lfs_block_t block) {
+    block = lfs_tole32(block);
+    memcpy(&file->index.buffer[LFS_INDEX_BUFFER_SIZE(k)], &block,
+            sizeof(block));
+}
+#endif
+
 static inline void lfs_superblock_fromle32(lfs_superblock_t *superblock) {
     superblock->version     = lfs_fromle32(superblock->version);
     superblock->block_size  = lfs_fromle32(superblock->block_size);
@@ -540,6 +788,12 @@ static uint16_t lfs_fs_disk_version_minor(lfs_t *lfs) {
     return 0xffff & (lfs_fs_disk_version(lfs) >> 0);
 }
 
+// the version written until a newer on-disk struct is first committed, so
+// volumes that don't use newer features stay readable by older drivers
+static uint32_t lfs_fs_disk_version_base(lfs_t *lfs) {
+    return lfs_min(lfs_fs_disk_version(lfs), 0x00020001);
+}
+
 
 /// Internal operations predeclared here ///
 #ifndef LFS_READONLY
@@ -552,9 +806,9 @@ static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
         const void *buffer, lfs_size_t size);
 static lfs_ssize_t lfs_file_write_(lfs_t *lfs, lfs_file_t *file,
         const void *buffer, lfs_size_t size);
+static int lfs_file_truncate_(lfs_t *lfs, lfs_file_t *file, lfs_off_t size);
 static int lfs_file_sync_(lfs_t *lfs, lfs_file_t *file);
 static int lfs_file_outline(lfs_t *lfs, lfs_file_t *file);
-static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file);
 
 static int lfs_fs_deorphan(lfs_t *lfs, bool powerloss);
 static int lfs_fs_preporphans(lfs_t *lfs, int8_t orphans);
@@ -568,6 +822,9 @@ static int lfs_fs_forceconsistency(lfs_t *lfs);
 #endif
 
 static void lfs_fs_prepsuperblock(lfs_t *lfs, bool needssuperblock);
+#ifndef LFS_READONLY
+static int lfs_fs_upgrade(lfs_t *lfs, uint32_t version);
+#endif
 
 #ifdef LFS_MIGRATE
 static int lfs1_traverse(lfs_t *lfs,
@@ -581,6 +838,7 @@ static lfs_ssize_t lfs_file_flushedread(lfs_t *lfs, lfs_file_t *file,
 static lfs_ssize_t lfs_file_read_(lfs_t *lfs, lfs_file_t *file,
         void *buffer, lfs_size_t size);
 static int lfs_file_close_(lfs_t *lfs, lfs_file_t *file);
+static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file);
 static lfs_soff_t lfs_file_size_(lfs_t *lfs, lfs_file_t *file);
 
 static lfs_ssize_t lfs_fs_size_(lfs_t *lfs);
@@ -594,12 +852,31 @@ static int lfs_unmount_(lfs_t *lfs);
 
 /// Block allocator ///
 
+// the allocator is split into two zones, blocks [0, metadata_zone) are
+// reserved for metadata pairs and the remaining blocks are used for file
+// data, each zone is scanned with its own lookahead window
+//
+// with metadata_zone=0 the metadata window is unused and the data window
+// covers the whole device
+static inline lfs_block_t lfs_alloc_base(lfs_t *lfs,
+        const struct lfs_lookahead *lookahead) {
+    return (lookahead == &lfs->mlookahead) ? 0 : lfs->cfg->metadata_zone;
+}
+
+static inline lfs_block_t lfs_alloc_count(lfs_t *lfs,
+        const struct lfs_lookahead *lookahead) {
+    return (lookahead == &lfs->mlookahead)
+            ? lfs->cfg->metadata_zone
+            : lfs->block_count - lfs->cfg->metadata_zone;
+}
+
 // allocations should call this when all allocated blocks are committed to
 // the filesystem
 //
 // after a checkpoint, the block allocator may realloc any untracked blocks
 static void lfs_alloc_ckpoint(lfs_t *lfs) {
-    lfs->lookahead.ckpoint = lfs->block_count;
+    lfs->lookahead.ckpoint = lfs_alloc_count(lfs, &lfs->lookahead);
+    lfs->mlookahead.ckpoint = lfs_alloc_count(lfs, &lfs->mlookahead);
 }
 
 // drop the lookahead buffer, this is done during mounting and failed
@@ -607,17 +884,93 @@ static void lfs_alloc_ckpoint(lfs_t *lfs) {
 static void lfs_alloc_drop(lfs_t *lfs) {
     lfs->lookahead.size = 0;
     lfs->lookahead.next = 0;
+    lfs->mlookahead.size = 0;
+    lfs->mlookahead.next = 0;
+    lfs->mlookahead.full = false;
     lfs_alloc_ckpoint(lfs);
 }
 
 #ifndef LFS_READONLY
+// a metadata pair may have been freed, so a full metadata zone is worth
+// scanning again
+static inline void lfs_alloc_metafree(lfs_t *lfs) {
+    lfs->mlookahead.full = false;
+}
+#endif
+
+#ifndef LFS_READONLY
+// blocks held by a snapshot can't be allocated or erased, even once the
+// filesystem no longer uses them
+static bool lfs_snapshot_ispinned(lfs_t *lfs, lfs_block_t block) {
+    for (lfs_snapshot_t *s = lfs->snapshots; s; s = s->next) {
+        if (block < s->block_count
+                && (s->pins[block / 8] & (1U << (block % 8)))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// mark blocks held by snapshots as in-use in a lookahead window, this
+// runs after every scan while a snapshot is held and costs about as much
+// as a scan of a small filesystem, so runs of unpinned blocks are skipped
+// a byte of pins at a time
+static void lfs_alloc_pin(lfs_t *lfs, struct lfs_lookahead *lookahead) {
+    if (!lfs->snapshots || lookahead->next >= lookahead->size) {
+        return;
+    }
+
+    lfs_block_t base = lfs_alloc_base(lfs, lookahead);
+    lfs_block_t count = lfs_alloc_count(lfs, lookahead);
+    for (lfs_snapshot_t *s = lfs->snapshots; s; s = s->next) {
+        lfs_block_t block = base
+                + (lookahead->start + lookahead->next) % count;
+        lfs_block_t off = lookahead->next;
+        while (off < lookahead->size) {
+            // skip to the end of the window, the zone, or the next pinned
+            // byte, whichever comes first
+            if (block % 8 == 0 && block+8 <= base+count
+                    && off+8 <= lookahead->size
+                    && (block >= s->block_count || !s->pins[block / 8])) {
+                off += 8;
+                block += 8;
+            } else {
+                if (block < s->block_count
+                        && (s->pins[block / 8] & (1U << (block % 8)))) {
+                    lookahead->buffer[off / 8] |= 1U << (off % 8);
+                }
+                off += 1;
+                block += 1;
+            }
+
+            if (block == base+count) {
+                block = base;
+            }
+        }
+    }
+}
+#endif
+
+#ifndef LFS_READONLY
+struct lfs_alloc_lookahead {
+    lfs_t *lfs;
+    struct lfs_lookahead *lookahead;
+};
+
 static int lfs_alloc_lookahead(void *p, lfs_block_t block) {
-    lfs_t *lfs = (lfs_t*)p;
-    lfs_block_t off = ((block - lfs->lookahead.start)
-            + lfs->block_count) % lfs->block_count;
+    struct lfs_alloc_lookahead *alloc = (struct lfs_alloc_lookahead*)p;
+    lfs_t *lfs = alloc->lfs;
+    struct lfs_lookahead *lookahead = alloc->lookahead;
+    lfs_block_t base = lfs_alloc_base(lfs, lookahead);
+    lfs_block_t count = lfs_alloc_count(lfs, lookahead);
+    if (block < base || block - base >= count) {
+        return 0;
+    }
 
-    if (off < lfs->lookahead.size) {
-        lfs->lookahead.buffer[off / 8] |= 1U << (off % 8);
+    lfs_block_t off = ((block - base - lookahead->start) + count) % count;
+    if (off < lookahead->size) {
+        lookahead->buffer[off / 8] |= 1U << (off % 8);
     }
 
     return 0;
@@ -625,57 +978,61 @@ static int lfs_alloc_lookahead(void *p, lfs_block_t block) {
 #endif
 
 #ifndef LFS_READONLY
-static int lfs_alloc_scan(lfs_t *lfs) {
+static int lfs_alloc_scan(lfs_t *lfs, struct lfs_lookahead *lookahead) {
     // move lookahead buffer to the first unused block
     //
     // note we limit the lookahead buffer to at most the amount of blocks
     // checkpointed, this prevents the math in lfs_alloc from underflowing
-    lfs->lookahead.start = (lfs->lookahead.start + lfs->lookahead.next) 
-            % lfs->block_count;
-    lfs->lookahead.next = 0;
-    lfs->lookahead.size = lfs_min(
-            8*lfs->cfg->lookahead_size,
-            lfs->lookahead.ckpoint);
+    lookahead->start = (lookahead->start + lookahead->next)
+            % lfs_alloc_count(lfs, lookahead);
+    lookahead->next = 0;
+    lookahead->size = lfs_min(
+            8*lookahead->buffer_size,
+            lookahead->ckpoint);
 
     // find mask of free blocks from tree
-    memset(lfs->lookahead.buffer, 0, lfs->cfg->lookahead_size);
-    int err = lfs_fs_traverse_(lfs, lfs_alloc_lookahead, lfs, true);
+    memset(lookahead->buffer, 0, lookahead->buffer_size);
+    struct lfs_alloc_lookahead alloc = {lfs, lookahead};
+    int err = lfs_fs_traverse_(lfs, lfs_alloc_lookahead, &alloc, true);
     if (err) {
         lfs_alloc_drop(lfs);
         return err;
     }
 
+    lfs_alloc_pin(lfs, lookahead);
     return 0;
 }
 #endif
 
 #ifndef LFS_READONLY
-static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
+static int lfs_alloc_(lfs_t *lfs, struct lfs_lookahead *lookahead,
+        lfs_block_t *block) {
+    lfs_block_t base = lfs_alloc_base(lfs, lookahead);
+    lfs_block_t count = lfs_alloc_count(lfs, lookahead);
     while (true) {
         // scan our lookahead buffer for free blocks
-        while (lfs->lookahead.next < lfs->lookahead.size) {
-            if (!(lfs->lookahead.buffer[lfs->lookahead.next / 8]
-                    & (1U << (lfs->lookahead.next % 8)))) {
+        while (lookahead->next < lookahead->size) {
+            if (!(lookahead->buffer[lookahead->next / 8]
+                    & (1U << (lookahead->next % 8)))) {
                 // found a free block
-                *block = (lfs->lookahead.start + lfs->lookahead.next)
-                        % lfs->block_count;
+                *block = base + (lookahead->start + lookahead->next) % count;
 
                 // eagerly find next free block to maximize how many blocks
                 // lfs_alloc_ckpoint makes available for scanning
                 while (true) {
-                    lfs->lookahead.next += 1;
-                    lfs->lookahead.ckpoint -= 1;
+                    lookahead->next += 1;
+                    lookahead->ckpoint -= 1;
 
-                    if (lfs->lookahead.next >= lfs->lookahead.size
-                            || !(lfs->lookahead.buffer[lfs->lookahead.next / 8]
-                                & (1U << (lfs->lookahead.next % 8)))) {
+                    if (lookahead->next >= lookahead->size
+                            || !(lookahead->buffer[lookahead->next / 8]
+                                & (1U << (lookahead->next % 8)))) {
                         return 0;
                     }
                 }
             }
 
-            lfs->lookahead.next += 1;
-            lfs->lookahead.ckpoint -= 1;
+            lookahead->next += 1;
+            lookahead->ckpoint -= 1;
         }
 
         // In order to keep our block allocator from spinning forever when our
@@ -683,18 +1040,15 @@ static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
         // allocations with a checkpoint before starting a set of allocations.
         //
         // If we've looked at all blocks since the last checkpoint, we report
-        // the filesystem as out of storage.
+        // the zone as out of storage.
         //
-        if (lfs->lookahead.ckpoint <= 0) {
-            LFS_ERROR("No more free space 0x%"PRIx32,
-                    (lfs->lookahead.start + lfs->lookahead.next)
-                        % lfs->block_count);
+        if (lookahead->ckpoint <= 0) {
             return LFS_ERR_NOSPC;
         }
 
         // No blocks in our lookahead buffer, we need to scan the filesystem for
         // unused blocks in the next lookahead window.
-        int err = lfs_alloc_scan(lfs);
+        int err = lfs_alloc_scan(lfs, lookahead);
         if(err) {
             return err;
         }
@@ -702,6 +1056,109 @@ static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
 }
 #endif
 
+#ifndef LFS_READONLY
+static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
+    int err = lfs_alloc_(lfs, &lfs->lookahead, block);
+    if (err == LFS_ERR_NOSPC) {
+        LFS_ERROR("No more free space 0x%"PRIx32,
+                lfs_alloc_base(lfs, &lfs->lookahead)
+                    + (lfs->lookahead.start + lfs->lookahead.next)
+                        % lfs_alloc_count(lfs, &lfs->lookahead));
+    }
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+// allocate a block for a metadata pair, these come from the metadata zone
+// if there is one, falling back to the data zone when the metadata zone
+// is full
+static int lfs_alloc_meta(lfs_t *lfs, lfs_block_t *block) {
+    if (lfs->cfg->metadata_zone && !lfs->mlookahead.full) {
+        int err = lfs_alloc_(lfs, &lfs->mlookahead, block);
+        if (err != LFS_ERR_NOSPC) {
+            return err;
+        }
+
+        // the whole zone was scanned, don't scan it again after every
+        // checkpoint until a metadata pair is freed
+        lfs->mlookahead.full = true;
+    }
+
+    return lfs_alloc(lfs, block);
+}
+#endif
+
+#ifndef LFS_READONLY
+// allocate a run of up to count physically contiguous data blocks, this
+// returns the length of the run found, which may be shorter if the
+// lookahead window has no run that is long enough, but is at least min
+// blocks, moving on to the next lookahead window if needed
+//
+// the run is marked as in-use in the lookahead buffer, like any other
+// allocation it is up to the caller to track it until it is committed
+static lfs_ssize_t lfs_alloc_extent(lfs_t *lfs,
+        lfs_block_t count, lfs_block_t min,
+        lfs_block_t *block) {
+    struct lfs_lookahead *lookahead = &lfs->lookahead;
+    lfs_block_t base = lfs_alloc_base(lfs, lookahead);
+    lfs_block_t zone = lfs_alloc_count(lfs, lookahead);
+    while (true) {
+        // find the first run that is long enough, or the longest run
+        lfs_block_t run = 0;
+        lfs_block_t runlen = 0;
+        lfs_block_t best = 0;
+        lfs_block_t bestlen = 0;
+        for (lfs_block_t i = lookahead->next; i < lookahead->size; i++) {
+            if (lookahead->buffer[i / 8] & (1U << (i % 8))) {
+                runlen = 0;
+                continue;
+            }
+
+            // runs can't wrap around the end of the zone
+            if (runlen == 0 || (lookahead->start + i) % zone == 0) {
+                run = i;
+                runlen = 0;
+            }
+
+            runlen += 1;
+            if (runlen > bestlen) {
+                best = run;
+                bestlen = runlen;
+                if (bestlen >= count) {
+                    break;
+                }
+            }
+        }
+
+        if (bestlen > 0 && bestlen >= min) {
+            for (lfs_block_t i = best; i < best + bestlen; i++) {
+                lookahead->buffer[i / 8] |= 1U << (i % 8);
+            }
+
+            *block = base + (lookahead->start + best) % zone;
+            return bestlen;
+        }
+
+        // no long enough run left in our lookahead buffer, same as
+        // lfs_alloc we either run out of space or need to scan the next
+        // window
+        lookahead->ckpoint -= lookahead->size - lookahead->next;
+        lookahead->next = lookahead->size;
+        if (lookahead->ckpoint <= 0) {
+            LFS_ERROR("No more free space 0x%"PRIx32,
+                    base + (lookahead->start + lookahead->next) % zone);
+            return LFS_ERR_NOSPC;
+        }
+
+        int err = lfs_alloc_scan(lfs, lookahead);
+        if (err) {
+            return err;
+        }
+    }
+}
+#endif
+
 /// Metadata pair and directory operations ///
 static lfs_stag_t lfs_dir_getslice(lfs_t *lfs, const lfs_mdir_t *dir,
         lfs_tag_t gmask, lfs_tag_t gtag,
@@ -780,7 +1237,7 @@ static int lfs_dir_getread(lfs_t *lfs, const lfs_mdir_t *dir,
         lfs_tag_t gmask, lfs_tag_t gtag,
         lfs_off_t off, void *buffer, lfs_size_t size) {
     uint8_t *data = buffer;
-    if (off+size > lfs->cfg->block_size) {
+    if (off+size > LFS_CFG_BLOCK_SIZE(lfs)) {
         return LFS_ERR_CORRUPT;
     }
 
@@ -823,9 +1280,9 @@ static int lfs_dir_getread(lfs_t *lfs, const lfs_mdir_t *dir,
 
         // load to cache, first condition can no longer fail
         rcache->block = LFS_BLOCK_INLINE;
-        rcache->off = lfs_aligndown(off, lfs->cfg->read_size);
-        rcache->size = lfs_min(lfs_alignup(off+hint, lfs->cfg->read_size),
-                lfs->cfg->cache_size);
+        rcache->off = lfs_aligndown(off, LFS_CFG_READ_SIZE(lfs));
+        rcache->size = lfs_min(lfs_alignup(off+hint, LFS_CFG_READ_SIZE(lfs)),
+                LFS_CFG_CACHE_SIZE(lfs));
         int err = lfs_dir_getslice(lfs, dir, gmask, gtag,
                 rcache->off, rcache->buffer, rcache->size);
         if (err < 0) {
@@ -918,7 +1375,7 @@ static int lfs_dir_traverse(lfs_t *lfs,
             if (off+lfs_tag_dsize(ptag) < dir->off) {
                 off += lfs_tag_dsize(ptag);
                 int err = lfs_bd_read(lfs,
-                        NULL, &lfs->rcache, sizeof(tag),
+                        NULL, &lfs->rcache, dir->off-off,
                         dir->pair[0], off, &tag, sizeof(tag));
                 if (err) {
                     return err;
@@ -1092,79 +1549,390 @@ popped:
 }
 #endif
 
-static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
-        lfs_mdir_t *dir, const lfs_block_t pair[2],
-        lfs_tag_t fmask, lfs_tag_t ftag, uint16_t *id,
-        int (*cb)(void *data, lfs_tag_t tag, const void *buffer), void *data) {
-    // we can find tag very efficiently during a fetch, since we're already
-    // scanning the entire directory
-    lfs_stag_t besttag = -1;
+#ifndef LFS_READONLY
+// Filtering each tag with lfs_dir_traverse_filter scans the rest of the
+// log, which makes compaction quadratic in the number of tags. Instead we
+// can index the log in a cache-sized buffer. One backward pass follows the
+// creates and deletes to find the final id of each tag and drops any tag
+// a later tag supersedes, after that each traversal is one forward pass.
+//
+// Userattrs can only be superseded by the same type, these are rare so we
+// just mark them and scan for them as before. If we can't get a buffer or
+// the log doesn't fit in one, traversals fall back to the filter.
+#define LFS_DIR_INDEX_DROP 0xffff
+#define LFS_DIR_INDEX_SCAN 0x8000
+#define LFS_DIR_INDEX_IDS  0x400
+
+struct lfs_dir_index {
+    // a bitset of final ids for names, then one for structs
+    uint8_t *buffer;
+
+    // final id of each tag, last tag first
+    uint16_t *fids;
+    lfs_size_t count;
+
+    // final id of each id at the current position while building, stored
+    // backwards from the end of the buffer, ids past len map to id+shift
+    uint16_t *map;
+    lfs_size_t len;
+    int shift;
+    lfs_size_t cap;
+
+    // has a later tag reached the filter?
+    bool followed;
+};
 
-    // if either block address is invalid we return LFS_ERR_CORRUPT here,
-    // otherwise later writes to the pair could fail
-    if (lfs->block_count 
-            && (pair[0] >= lfs->block_count || pair[1] >= lfs->block_count)) {
-        return LFS_ERR_CORRUPT;
-    }
+static inline uint16_t *lfs_dir_index_map(struct lfs_dir_index *index,
+        lfs_size_t id) {
+    return index->map - 1 - id;
+}
 
-    // find the block with the most recent revision
-    uint32_t revs[2] = {0, 0};
-    int r = 0;
-    for (int i = 0; i < 2; i++) {
-        int err = lfs_bd_read(lfs,
-                NULL, &lfs->rcache, sizeof(revs[i]),
-                pair[i], 0, &revs[i], sizeof(revs[i]));
-        revs[i] = lfs_fromle32(revs[i]);
-        if (err && err != LFS_ERR_CORRUPT) {
-            return err;
+static int lfs_dir_index_fill(struct lfs_dir_index *index, lfs_size_t len) {
+    while (index->len < len) {
+        if (index->count + index->len >= index->cap) {
+            return LFS_ERR_NOMEM;
         }
 
-        if (err != LFS_ERR_CORRUPT &&
-                lfs_scmp(revs[i], revs[(i+1)%2]) > 0) {
-            r = i;
-        }
+        *lfs_dir_index_map(index, index->len) = index->len + index->shift;
+        index->len += 1;
     }
 
-    dir->pair[0] = pair[(r+0)%2];
-    dir->pair[1] = pair[(r+1)%2];
-    dir->rev = revs[(r+0)%2];
-    dir->off = 0; // nonzero = found some commits
-
-    // now scan tags to fetch the actual dir and find possible match
-    for (int i = 0; i < 2; i++) {
-        lfs_off_t off = 0;
-        lfs_tag_t ptag = 0xffffffff;
-
-        uint16_t tempcount = 0;
-        lfs_block_t temptail[2] = {LFS_BLOCK_NULL, LFS_BLOCK_NULL};
-        bool tempsplit = false;
-        lfs_stag_t tempbesttag = besttag;
-
-        // assume not erased until proven otherwise
-        bool maybeerased = false;
-        bool hasfcrc = false;
-        struct lfs_fcrc fcrc;
-
-        dir->rev = lfs_tole32(dir->rev);
-        uint32_t crc = lfs_crc(0xffffffff, &dir->rev, sizeof(dir->rev));
-        dir->rev = lfs_fromle32(dir->rev);
+    return 0;
+}
 
-        while (true) {
-            // extract next tag
-            lfs_tag_t tag;
-            off += lfs_tag_dsize(ptag);
-            int err = lfs_bd_read(lfs,
-                    NULL, &lfs->rcache, lfs->cfg->block_size,
-                    dir->pair[0], off, &tag, sizeof(tag));
+static int lfs_dir_index_push(struct lfs_dir_index *index, lfs_tag_t tag) {
+    uint16_t id = lfs_tag_id(tag);
+    uint16_t fid = LFS_DIR_INDEX_DROP;
+    if (lfs_tag_type1(tag) == LFS_TYPE_SPLICE) {
+        // going backwards, a create removes its id from the map and a
+        // delete inserts an id that doesn't survive
+        if (lfs_tag_splice(tag) > 0) {
+            int err = lfs_dir_index_fill(index, id+1);
             if (err) {
-                if (err == LFS_ERR_CORRUPT) {
-                    // can't continue?
-                    break;
-                }
                 return err;
             }
 
-            crc = lfs_crc(crc, &tag, sizeof(tag));
+            memmove(lfs_dir_index_map(index, index->len-1) + 1,
+                    lfs_dir_index_map(index, index->len-1),
+                    (index->len-1 - id)*sizeof(uint16_t));
+            index->len -= 1;
+            index->shift += 1;
+        } else if (lfs_tag_splice(tag) < 0) {
+            int err = lfs_dir_index_fill(index, id);
+            if (err) {
+                return err;
+            }
+
+            if (index->count + index->len + 1 >= index->cap) {
+                return LFS_ERR_NOMEM;
+            }
+
+            memmove(lfs_dir_index_map(index, index->len),
+                    lfs_dir_index_map(index, index->len-1),
+                    (index->len - id)*sizeof(uint16_t));
+            *lfs_dir_index_map(index, id) = LFS_DIR_INDEX_DROP;
+            index->len += 1;
+            index->shift -= 1;
+        }
+    } else if (lfs_tag_type3(tag) == LFS_FROM_NOOP) {
+        // noops do nothing, and supersede nothing
+    } else if (!(lfs_tag_type1(tag) & 0x400)) {
+        uint16_t final = (id < index->len)
+                ? *lfs_dir_index_map(index, id)
+                : id + index->shift;
+        if (final != LFS_DIR_INDEX_DROP) {
+            if (final >= LFS_DIR_INDEX_IDS) {
+                return LFS_ERR_NOMEM;
+            }
+
+            if (tag & LFS_MKTAG(0x100, 0, 0)) {
+                fid = final | LFS_DIR_INDEX_SCAN;
+            } else {
+                // superseded by a later tag of the same type1?
+                uint8_t *seen = &index->buffer[
+                        (lfs_tag_type1(tag) >> 9)*(LFS_DIR_INDEX_IDS/8)];
+                if (!(seen[final/8] & (1 << (final%8)))) {
+                    seen[final/8] |= 1 << (final%8);
+                    fid = final;
+                }
+            }
+
+            // deletes are dropped, unless nothing follows to drop them
+            if (lfs_tag_isdelete(tag) && index->followed) {
+                fid = LFS_DIR_INDEX_DROP;
+            }
+        }
+    }
+
+    // the filter never sees noops or moves
+    if (lfs_tag_type3(tag) != LFS_FROM_NOOP
+            && lfs_tag_type3(tag) != LFS_FROM_MOVE
+            && !(lfs_tag_type3(tag) == LFS_FROM_USERATTRS
+                && lfs_tag_size(tag) == 0)) {
+        index->followed = true;
+    }
+
+    if (index->count + index->len >= index->cap) {
+        return LFS_ERR_NOMEM;
+    }
+
+    index->fids[index->count] = fid;
+    index->count += 1;
+    return 0;
+}
+
+static int lfs_dir_index_build(lfs_t *lfs, struct lfs_dir_index *index,
+        const lfs_mdir_t *source,
+        const struct lfs_mattr *attrs, int attrcount) {
+    index->buffer = NULL;
+    if (LFS_CFG_CACHE_SIZE(lfs) < 2*(LFS_DIR_INDEX_IDS/8) + 64) {
+        return 0;
+    }
+
+    index->buffer = lfs_buffer_alloc(lfs, LFS_CFG_CACHE_SIZE(lfs));
+    if (!index->buffer) {
+        return 0;
+    }
+
+    memset(index->buffer, 0, 2*(LFS_DIR_INDEX_IDS/8));
+    index->fids = (uint16_t*)&index->buffer[2*(LFS_DIR_INDEX_IDS/8)];
+    index->count = 0;
+    index->cap = (LFS_CFG_CACHE_SIZE(lfs) - 2*(LFS_DIR_INDEX_IDS/8))
+            / sizeof(uint16_t);
+    index->map = index->fids + index->cap;
+    index->len = 0;
+    index->shift = 0;
+    index->followed = false;
+
+    // attrs come last, so index them first
+    int err = 0;
+    for (int i = attrcount-1; i >= 0 && !err; i--) {
+        err = lfs_dir_index_push(index, attrs[i].tag);
+    }
+
+    // then the log, backwards
+    lfs_off_t off = source->off;
+    lfs_tag_t ntag = source->etag;
+    while (!err && off >= sizeof(ntag) + lfs_tag_dsize(ntag)) {
+        off -= lfs_tag_dsize(ntag);
+        lfs_tag_t tag = ntag;
+        err = lfs_bd_read(lfs,
+                NULL, &lfs->rcache, sizeof(ntag),
+                source->pair[0], off, &ntag, sizeof(ntag));
+        if (err) {
+            break;
+        }
+
+        ntag = (lfs_frombe32(ntag) ^ tag) & 0x7fffffff;
+        err = lfs_dir_index_push(index, tag);
+    }
+
+    if (err) {
+        lfs_buffer_free(lfs, index->buffer, LFS_CFG_CACHE_SIZE(lfs));
+        index->buffer = NULL;
+        // too big to index? filter instead
+        if (err == LFS_ERR_NOMEM) {
+            return 0;
+        }
+    }
+
+    return err;
+}
+
+static void lfs_dir_index_free(lfs_t *lfs, struct lfs_dir_index *index) {
+    if (index->buffer) {
+        lfs_buffer_free(lfs, index->buffer, LFS_CFG_CACHE_SIZE(lfs));
+        index->buffer = NULL;
+    }
+}
+
+// traverse the unique tags in [begin, end), same as a filtered
+// lfs_dir_traverse with tmask LFS_MKTAG(0x400, 0x3ff, 0)
+static int lfs_dir_index_traverse(lfs_t *lfs,
+        const struct lfs_dir_index *index, const lfs_mdir_t *source,
+        const struct lfs_mattr *attrs, int attrcount,
+        uint16_t begin, uint16_t end, int16_t diff,
+        int (*cb)(void *data, lfs_tag_t tag, const void *buffer), void *data) {
+    if (!index->buffer) {
+        return lfs_dir_traverse(lfs,
+                source, 0, 0xffffffff, attrs, attrcount,
+                LFS_MKTAG(0x400, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_NAME, 0, 0),
+                begin, end, diff,
+                cb, data);
+    }
+
+    lfs_off_t off = 0;
+    lfs_tag_t ptag = 0xffffffff;
+    struct lfs_diskoff disk = {.block = source->pair[0]};
+    lfs_size_t i = index->count;
+    while (i > 0) {
+        i -= 1;
+        lfs_tag_t tag;
+        const void *buffer;
+        if (off+lfs_tag_dsize(ptag) < source->off) {
+            off += lfs_tag_dsize(ptag);
+            int err = lfs_bd_read(lfs,
+                    NULL, &lfs->rcache, source->off-off,
+                    source->pair[0], off, &tag, sizeof(tag));
+            if (err) {
+                return err;
+            }
+
+            tag = (lfs_frombe32(tag) ^ ptag) | 0x80000000;
+            disk.off = off+sizeof(lfs_tag_t);
+            buffer = &disk;
+            ptag = tag;
+        } else {
+            LFS_ASSERT(attrcount > 0);
+            tag = attrs[0].tag;
+            buffer = attrs[0].buffer;
+            attrs += 1;
+            attrcount -= 1;
+        }
+
+        uint16_t fid = index->fids[i];
+        if (fid == LFS_DIR_INDEX_DROP) {
+            continue;
+        }
+
+        if (fid & LFS_DIR_INDEX_SCAN) {
+            lfs_tag_t ftag = tag;
+            int err = lfs_dir_traverse(lfs,
+                    source, off, ptag, attrs, attrcount,
+                    0, 0, 0, 0, 0,
+                    lfs_dir_traverse_filter, &ftag);
+            if (err < 0) {
+                return err;
+            }
+
+            if (lfs_tag_type3(ftag) == LFS_FROM_NOOP) {
+                continue;
+            }
+
+            fid &= ~LFS_DIR_INDEX_SCAN;
+        }
+
+        // in filter range?
+        if (!(fid >= begin && fid < end)) {
+            continue;
+        }
+
+        tag = (tag & ~LFS_MKTAG(0, 0x3ff, 0)) | LFS_MKTAG(0, fid, 0);
+
+        // handle special cases for mcu-side operations
+        int res;
+        if (lfs_tag_type3(tag) == LFS_FROM_NOOP) {
+            // do nothing
+        } else if (lfs_tag_type3(tag) == LFS_FROM_MOVE) {
+            uint16_t fromid = lfs_tag_size(tag);
+            res = lfs_dir_traverse(lfs,
+                    buffer, 0, 0xffffffff, NULL, 0,
+                    LFS_MKTAG(0x600, 0x3ff, 0),
+                    LFS_MKTAG(LFS_TYPE_STRUCT, 0, 0),
+                    fromid, fromid+1, fid-fromid+diff,
+                    cb, data);
+            if (res < 0) {
+                return res;
+            }
+        } else if (lfs_tag_type3(tag) == LFS_FROM_USERATTRS) {
+            for (unsigned j = 0; j < lfs_tag_size(tag); j++) {
+                const struct lfs_attr *a = buffer;
+                res = cb(data, LFS_MKTAG(LFS_TYPE_USERATTR + a[j].type,
+                        fid + diff, a[j].size), a[j].buffer);
+                if (res < 0) {
+                    return res;
+                }
+
+                if (res) {
+                    break;
+                }
+            }
+        } else {
+            res = cb(data, tag + LFS_MKTAG(0, diff, 0), buffer);
+            if (res) {
+                return res;
+            }
+        }
+    }
+
+    return 0;
+}
+#endif
+
+static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
+        lfs_mdir_t *dir, const lfs_block_t pair[2],
+        lfs_tag_t fmask, lfs_tag_t ftag, uint16_t *id,
+        int (*cb)(void *data, lfs_tag_t tag, const void *buffer), void *data) {
+    // we can find tag very efficiently during a fetch, since we're already
+    // scanning the entire directory
+    lfs_stag_t besttag = -1;
+
+    // if either block address is invalid we return LFS_ERR_CORRUPT here,
+    // otherwise later writes to the pair could fail
+    if (lfs->block_count 
+            && (pair[0] >= lfs->block_count || pair[1] >= lfs->block_count)) {
+        return LFS_ERR_CORRUPT;
+    }
+
+    // find the block with the most recent revision
+    uint32_t revs[2] = {0, 0};
+    int r = 0;
+    for (int i = 0; i < 2; i++) {
+        int err = lfs_bd_read(lfs,
+                NULL, &lfs->rcache, sizeof(revs[i]),
+                pair[i], 0, &revs[i], sizeof(revs[i]));
+        revs[i] = lfs_fromle32(revs[i]);
+        if (err && err != LFS_ERR_CORRUPT) {
+            return err;
+        }
+
+        if (err != LFS_ERR_CORRUPT &&
+                lfs_scmp(revs[i], revs[(i+1)%2]) > 0) {
+            r = i;
+        }
+    }
+
+    dir->pair[0] = pair[(r+0)%2];
+    dir->pair[1] = pair[(r+1)%2];
+    dir->rev = revs[(r+0)%2];
+    dir->off = 0; // nonzero = found some commits
+
+    // now scan tags to fetch the actual dir and find possible match
+    for (int i = 0; i < 2; i++) {
+        lfs_off_t off = 0;
+        lfs_tag_t ptag = 0xffffffff;
+
+        uint16_t tempcount = 0;
+        lfs_block_t temptail[2] = {LFS_BLOCK_NULL, LFS_BLOCK_NULL};
+        bool tempsplit = false;
+        lfs_stag_t tempbesttag = besttag;
+
+        // assume not erased until proven otherwise
+        bool maybeerased = false;
+        bool hasfcrc = false;
+        struct lfs_fcrc fcrc;
+
+        dir->rev = lfs_tole32(dir->rev);
+        uint32_t crc = lfs_crc(0xffffffff, &dir->rev, sizeof(dir->rev));
+        dir->rev = lfs_fromle32(dir->rev);
+
+        while (true) {
+            // extract next tag
+            lfs_tag_t tag;
+            off += lfs_tag_dsize(ptag);
+            int err = lfs_bd_read(lfs,
+                    NULL, &lfs->rcache, LFS_CFG_BLOCK_SIZE(lfs),
+                    dir->pair[0], off, &tag, sizeof(tag));
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    // can't continue?
+                    break;
+                }
+                return err;
+            }
+
+            crc = lfs_crc(crc, &tag, sizeof(tag));
             tag = lfs_frombe32(tag) ^ ptag;
 
             // next commit not yet programmed?
@@ -1173,7 +1941,7 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
                 maybeerased = (lfs_tag_type2(ptag) == LFS_TYPE_CCRC);
                 break;
             // out of range?
-            } else if (off + lfs_tag_dsize(tag) > lfs->cfg->block_size) {
+            } else if (off + lfs_tag_dsize(tag) > LFS_CFG_BLOCK_SIZE(lfs)) {
                 break;
             }
 
@@ -1183,7 +1951,7 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
                 // check the crc attr
                 uint32_t dcrc;
                 err = lfs_bd_read(lfs,
-                        NULL, &lfs->rcache, lfs->cfg->block_size,
+                        NULL, &lfs->rcache, LFS_CFG_BLOCK_SIZE(lfs),
                         dir->pair[0], off+sizeof(tag), &dcrc, sizeof(dcrc));
                 if (err) {
                     if (err == LFS_ERR_CORRUPT) {
@@ -1222,7 +1990,7 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
 
             // crc the entry first, hopefully leaving it in the cache
             err = lfs_bd_crc(lfs,
-                    NULL, &lfs->rcache, lfs->cfg->block_size,
+                    NULL, &lfs->rcache, LFS_CFG_BLOCK_SIZE(lfs),
                     dir->pair[0], off+sizeof(tag),
                     lfs_tag_dsize(tag)-sizeof(tag), &crc);
             if (err) {
@@ -1252,7 +2020,7 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
                 tempsplit = (lfs_tag_chunk(tag) & 1);
 
                 err = lfs_bd_read(lfs,
-                        NULL, &lfs->rcache, lfs->cfg->block_size,
+                        NULL, &lfs->rcache, LFS_CFG_BLOCK_SIZE(lfs),
                         dir->pair[0], off+sizeof(tag), &temptail, 8);
                 if (err) {
                     if (err == LFS_ERR_CORRUPT) {
@@ -1263,7 +2031,7 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
                 lfs_pair_fromle32(temptail);
             } else if (lfs_tag_type3(tag) == LFS_TYPE_FCRC) {
                 err = lfs_bd_read(lfs,
-                        NULL, &lfs->rcache, lfs->cfg->block_size,
+                        NULL, &lfs->rcache, LFS_CFG_BLOCK_SIZE(lfs),
                         dir->pair[0], off+sizeof(tag),
                         &fcrc, sizeof(fcrc));
                 if (err) {
@@ -1313,7 +2081,7 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
 
         // did we end on a valid commit? we may have an erased block
         dir->erased = false;
-        if (maybeerased && dir->off % lfs->cfg->prog_size == 0) {
+        if (maybeerased && dir->off % LFS_CFG_PROG_SIZE(lfs) == 0) {
         #ifdef LFS_MULTIVERSION
             // note versions < lfs2.1 did not have fcrc tags, if
             // we're < lfs2.1 treat missing fcrc as erased data
@@ -1331,7 +2099,7 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
                 // need a new erase
                 uint32_t fcrc_ = 0xffffffff;
                 int err = lfs_bd_crc(lfs,
-                        NULL, &lfs->rcache, lfs->cfg->block_size,
+                        NULL, &lfs->rcache, LFS_CFG_BLOCK_SIZE(lfs),
                         dir->pair[0], dir->off, fcrc.size, &fcrc_);
                 if (err && err != LFS_ERR_CORRUPT) {
                     return err;
@@ -1426,6 +2194,25 @@ static int lfs_dir_getinfo(lfs_t *lfs, lfs_mdir_t *dir,
         info->size = ctz.size;
     } else if (lfs_tag_type3(tag) == LFS_TYPE_INLINESTRUCT) {
         info->size = lfs_tag_size(tag);
+    } else if (lfs_tag_type3(tag) == LFS_TYPE_PACKSTRUCT) {
+        struct lfs_pack pack;
+        tag = lfs_dir_get(lfs, dir, LFS_MKTAG(0x7ff, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_PACKSTRUCT, id, sizeof(pack)), &pack);
+        if (tag < 0) {
+            return (int)tag;
+        }
+        lfs_pack_fromle32(&pack);
+        info->size = pack.size;
+    } else if (lfs_tag_type3(tag) == LFS_TYPE_SPARSESTRUCT) {
+        // the size of a sparse file follows its ctz reference
+        lfs_size_t size;
+        tag = lfs_dir_getslice(lfs, dir, LFS_MKTAG(0x7ff, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_SPARSESTRUCT, id, sizeof(size)),
+                sizeof(ctz), &size, sizeof(size));
+        if (tag < 0) {
+            return (int)tag;
+        }
+        info->size = lfs_fromle32(size);
     }
 
     return 0;
@@ -1645,8 +2432,8 @@ static int lfs_dir_commitcrc(lfs_t *lfs, struct lfs_commit *commit) {
     // - 5-word crc with fcrc to check following prog (middle of block)
     // - 2-word crc with no following prog (end of block)
     const lfs_off_t end = lfs_alignup(
-            lfs_min(commit->off + 5*sizeof(uint32_t), lfs->cfg->block_size),
-            lfs->cfg->prog_size);
+            lfs_min(commit->off + 5*sizeof(uint32_t), LFS_CFG_BLOCK_SIZE(lfs)),
+            LFS_CFG_PROG_SIZE(lfs));
 
     lfs_off_t off1 = 0;
     uint32_t crc1 = 0;
@@ -1665,11 +2452,11 @@ static int lfs_dir_commitcrc(lfs_t *lfs, struct lfs_commit *commit) {
 
         // space for fcrc?
         uint8_t eperturb = (uint8_t)-1;
-        if (noff >= end && noff <= lfs->cfg->block_size - lfs->cfg->prog_size) {
+        if (noff >= end && noff <= LFS_CFG_BLOCK_SIZE(lfs) - LFS_CFG_PROG_SIZE(lfs)) {
             // first read the leading byte, this always contains a bit
             // we can perturb to avoid writes that don't change the fcrc
             int err = lfs_bd_read(lfs,
-                    NULL, &lfs->rcache, lfs->cfg->prog_size,
+                    NULL, &lfs->rcache, LFS_CFG_PROG_SIZE(lfs),
                     commit->block, noff, &eperturb, 1);
             if (err && err != LFS_ERR_CORRUPT) {
                 return err;
@@ -1686,11 +2473,11 @@ static int lfs_dir_commitcrc(lfs_t *lfs, struct lfs_commit *commit) {
                 // find the expected fcrc, don't bother avoiding a reread
                 // of the eperturb, it should still be in our cache
                 struct lfs_fcrc fcrc = {
-                    .size = lfs->cfg->prog_size,
+                    .size = LFS_CFG_PROG_SIZE(lfs),
                     .crc = 0xffffffff
                 };
                 err = lfs_bd_crc(lfs,
-                        NULL, &lfs->rcache, lfs->cfg->prog_size,
+                        NULL, &lfs->rcache, LFS_CFG_PROG_SIZE(lfs),
                         commit->block, noff, fcrc.size, &fcrc.crc);
                 if (err && err != LFS_ERR_CORRUPT) {
                     return err;
@@ -1739,7 +2526,7 @@ static int lfs_dir_commitcrc(lfs_t *lfs, struct lfs_commit *commit) {
 
         // manually flush here since we don't prog the padding, this confuses
         // the caching layer
-        if (noff >= end || noff >= lfs->pcache.off + lfs->cfg->cache_size) {
+        if (noff >= end || noff >= lfs->pcache.off + LFS_CFG_CACHE_SIZE(lfs)) {
             // flush buffers
             int err = lfs_bd_sync(lfs, &lfs->pcache, &lfs->rcache, false);
             if (err) {
@@ -1787,7 +2574,7 @@ static int lfs_dir_commitcrc(lfs_t *lfs, struct lfs_commit *commit) {
 static int lfs_dir_alloc(lfs_t *lfs, lfs_mdir_t *dir) {
     // allocate pair of dir blocks (backwards, so we write block 1 first)
     for (int i = 0; i < 2; i++) {
-        int err = lfs_alloc(lfs, &dir->pair[(i+1)%2]);
+        int err = lfs_alloc_meta(lfs, &dir->pair[(i+1)%2]);
         if (err) {
             return err;
         }
@@ -1835,6 +2622,9 @@ static int lfs_dir_drop(lfs_t *lfs, lfs_mdir_t *dir, lfs_mdir_t *tail) {
         return err;
     }
 
+    // the tail's blocks are free once it's dropped
+    lfs_alloc_metafree(lfs);
+
     // steal tail
     lfs_pair_tole32(tail->tail);
     err = lfs_dir_commit(lfs, dir, LFS_MKATTRS(
@@ -1927,6 +2717,7 @@ static int lfs_dir_compact(lfs_t *lfs,
     // save some state in case block is bad
     bool relocated = false;
     bool tired = lfs_dir_needsrelocation(lfs, dir);
+    bool held = lfs_snapshot_ispinned(lfs, dir->pair[1]);
 
     // increment revision count
     dir->rev += 1;
@@ -1948,6 +2739,12 @@ static int lfs_dir_compact(lfs_t *lfs,
         goto relocate;
     }
 
+    // a snapshot still needs the block we would erase? then relocate, the
+    // superblock pair is never held by snapshots
+    if (held) {
+        goto relocate;
+    }
+
     // begin loop to commit compaction to blocks until a compact sticks
     while (true) {
         {
@@ -1960,7 +2757,7 @@ static int lfs_dir_compact(lfs_t *lfs,
 
                 .begin = 0,
                 .end = (lfs->cfg->metadata_max ?
-                    lfs->cfg->metadata_max : lfs->cfg->block_size) - 8,
+                    lfs->cfg->metadata_max : LFS_CFG_BLOCK_SIZE(lfs)) - 8,
             };
 
             // erase block to write to
@@ -1985,13 +2782,16 @@ static int lfs_dir_compact(lfs_t *lfs,
             }
 
             // traverse the directory, this time writing out all unique tags
-            err = lfs_dir_traverse(lfs,
-                    source, 0, 0xffffffff, attrs, attrcount,
-                    LFS_MKTAG(0x400, 0x3ff, 0),
-                    LFS_MKTAG(LFS_TYPE_NAME, 0, 0),
-                    begin, end, -begin,
-                    lfs_dir_commit_commit, &(struct lfs_dir_commit_commit){
-                        lfs, &commit});
+            struct lfs_dir_index index;
+            err = lfs_dir_index_build(lfs, &index, source, attrs, attrcount);
+            if (!err) {
+                err = lfs_dir_index_traverse(lfs, &index,
+                        source, attrs, attrcount,
+                        begin, end, -begin,
+                        lfs_dir_commit_commit, &(struct lfs_dir_commit_commit){
+                            lfs, &commit});
+                lfs_dir_index_free(lfs, &index);
+            }
             if (err) {
                 if (err == LFS_ERR_CORRUPT) {
                     goto relocate;
@@ -2051,11 +2851,14 @@ static int lfs_dir_compact(lfs_t *lfs,
             }
 
             // successful compaction, swap dir pair to indicate most recent
-            LFS_ASSERT(commit.off % lfs->cfg->prog_size == 0);
+            LFS_ASSERT(commit.off % LFS_CFG_PROG_SIZE(lfs) == 0);
             lfs_pair_swap(dir->pair);
             dir->count = end - begin;
             dir->off = commit.off;
             dir->etag = commit.ptag;
+            // we just erased the block, so the rest of it can be appended
+            // to without compacting again
+            dir->erased = true;
             // update gstate
             lfs->gdelta = (lfs_gstate_t){0};
             if (!relocated) {
@@ -2068,7 +2871,7 @@ relocate:
         // commit was corrupted, drop caches and prepare to relocate block
         relocated = true;
         lfs_cache_drop(lfs, &lfs->pcache);
-        if (!tired) {
+        if (!tired && !held) {
             LFS_DEBUG("Bad block at 0x%"PRIx32, dir->pair[1]);
         }
 
@@ -2080,12 +2883,13 @@ relocate:
         }
 
         // relocate half of pair
-        int err = lfs_alloc(lfs, &dir->pair[1]);
-        if (err && (err != LFS_ERR_NOSPC || !tired)) {
+        int err = lfs_alloc_meta(lfs, &dir->pair[1]);
+        if (err && (err != LFS_ERR_NOSPC || !tired || held)) {
             return err;
         }
 
         tired = false;
+        held = false;
         continue;
     }
 
@@ -2104,16 +2908,23 @@ static int lfs_dir_splittingcompact(lfs_t *lfs, lfs_mdir_t *dir,
         // Note that this isn't a true binary search, we never increase the
         // split size. This may result in poorly distributed metadata but isn't
         // worth the extra code size or performance hit to fix.
+        //
+        // The index is built once and shared by each size check.
+        struct lfs_dir_index index;
+        int err = lfs_dir_index_build(lfs, &index, source, attrs, attrcount);
+        if (err) {
+            return err;
+        }
+
         lfs_size_t split = begin;
         while (end - split > 1) {
             lfs_size_t size = 0;
-            int err = lfs_dir_traverse(lfs,
-                    source, 0, 0xffffffff, attrs, attrcount,
-                    LFS_MKTAG(0x400, 0x3ff, 0),
-                    LFS_MKTAG(LFS_TYPE_NAME, 0, 0),
+            err = lfs_dir_index_traverse(lfs, &index,
+                    source, attrs, attrcount,
                     split, end, -split,
                     lfs_dir_commit_size, &size);
             if (err) {
+                lfs_dir_index_free(lfs, &index);
                 return err;
             }
 
@@ -2130,25 +2941,27 @@ static int lfs_dir_splittingcompact(lfs_t *lfs, lfs_mdir_t *dir,
             //
             if (end - split < 0xff
                     && size <= lfs_min(
-                        lfs->cfg->block_size - 40,
+                        LFS_CFG_BLOCK_SIZE(lfs) - 40,
                         lfs_alignup(
                             (lfs->cfg->metadata_max
                                 ? lfs->cfg->metadata_max
-                                : lfs->cfg->block_size)/2,
-                            lfs->cfg->prog_size))) {
+                                : LFS_CFG_BLOCK_SIZE(lfs))/2,
+                            LFS_CFG_PROG_SIZE(lfs)))) {
                 break;
             }
 
             split = split + ((end - split) / 2);
         }
 
+        lfs_dir_index_free(lfs, &index);
+
         if (split == begin) {
             // no split needed
             break;
         }
 
         // split into two metadata pairs and continue
-        int err = lfs_dir_split(lfs, dir, attrs, attrcount,
+        err = lfs_dir_split(lfs, dir, attrs, attrcount,
                 source, split, end);
         if (err && err != LFS_ERR_NOSPC) {
             return err;
@@ -2239,7 +3052,9 @@ static int lfs_dir_relocatingcommit(lfs_t *lfs, lfs_mdir_t *dir,
         }
     }
 
-    if (dir->erased) {
+    // a snapshot may still need the block as it is, in that case compact,
+    // which moves the pair
+    if (dir->erased && !lfs_snapshot_ispinned(lfs, dir->pair[0])) {
         // try to commit
         struct lfs_commit commit = {
             .block = dir->pair[0],
@@ -2249,7 +3064,7 @@ static int lfs_dir_relocatingcommit(lfs_t *lfs, lfs_mdir_t *dir,
 
             .begin = dir->off,
             .end = (lfs->cfg->metadata_max ?
-                lfs->cfg->metadata_max : lfs->cfg->block_size) - 8,
+                lfs->cfg->metadata_max : LFS_CFG_BLOCK_SIZE(lfs)) - 8,
         };
 
         // traverse attrs that need to be written out
@@ -2301,7 +3116,7 @@ static int lfs_dir_relocatingcommit(lfs_t *lfs, lfs_mdir_t *dir,
         }
 
         // successful commit, update dir
-        LFS_ASSERT(commit.off % lfs->cfg->prog_size == 0);
+        LFS_ASSERT(commit.off % LFS_CFG_PROG_SIZE(lfs) == 0);
         dir->off = commit.off;
         dir->etag = commit.ptag;
         // and update gstate
@@ -2382,7 +3197,7 @@ static int lfs_dir_orphaningcommit(lfs_t *lfs, lfs_mdir_t *dir,
     for (lfs_file_t *f = (lfs_file_t*)lfs->mlist; f; f = f->next) {
         if (dir != &f->m && lfs_pair_cmp(f->m.pair, dir->pair) == 0 &&
                 f->type == LFS_TYPE_REG && (f->flags & LFS_F_INLINE) &&
-                f->ctz.size > lfs->cfg->cache_size) {
+                f->ctz.size > LFS_CFG_CACHE_SIZE(lfs)) {
             int err = lfs_file_outline(lfs, f);
             if (err) {
                 return err;
@@ -2404,6 +3219,11 @@ static int lfs_dir_orphaningcommit(lfs_t *lfs, lfs_mdir_t *dir,
         return state;
     }
 
+    // relocating or dropping a pair frees its old blocks
+    if (state == LFS_OK_RELOCATED || state == LFS_OK_DROPPED) {
+        lfs_alloc_metafree(lfs);
+    }
+
     // update if we're not in mlist, note we may have already been
     // updated if we are in mlist
     if (lfs_pair_cmp(dir->pair, lpair) == 0) {
@@ -2784,33 +3604,315 @@ static int lfs_dir_read_(lfs_t *lfs, lfs_dir_t *dir, struct lfs_info *info) {
     return true;
 }
 
-static int lfs_dir_seek_(lfs_t *lfs, lfs_dir_t *dir, lfs_off_t off) {
-    // simply walk from head dir
-    int err = lfs_dir_rewind_(lfs, dir);
-    if (err) {
-        return err;
+// entries resolved per scan of a metadata log in lfs_dir_readbatch_
+#define LFS_DIR_BATCH 16
+
+struct lfs_dir_batchslot {
+    uint16_t id;
+    bool done;
+    lfs_tag_t ntag;
+    lfs_off_t noff;
+    lfs_tag_t stag;
+    lfs_off_t soff;
+};
+
+// find the name and struct tags of the ids in slots with one scan of the
+// log, this follows lfs_dir_getslice for each id at the same time, slots
+// whose entries don't exist are left without a name tag
+static int lfs_dir_getbatch(lfs_t *lfs, const lfs_mdir_t *dir,
+        struct lfs_dir_batchslot *slots, lfs_size_t count) {
+    // synthetic moves
+    bool move = lfs_gstate_hasmovehere(&lfs->gdisk, dir->pair);
+    lfs_size_t pending = 0;
+    for (lfs_size_t i = 0; i < count; i++) {
+        if (move && lfs_tag_id(lfs->gdisk.tag) == slots[i].id) {
+            slots[i].done = true;
+            continue;
+        } else if (move && lfs_tag_id(lfs->gdisk.tag) < slots[i].id) {
+            slots[i].id += 1;
+        }
+
+        pending += 1;
     }
 
-    // first two for ./..
-    dir->pos = lfs_min(2, off);
-    off -= dir->pos;
+    // iterate over dir block backwards
+    lfs_off_t off = dir->off;
+    lfs_tag_t ntag = dir->etag;
+    while (pending > 0 && off >= sizeof(lfs_tag_t) + lfs_tag_dsize(ntag)) {
+        off -= lfs_tag_dsize(ntag);
+        lfs_tag_t tag = ntag;
+        int err = lfs_bd_read(lfs,
+                NULL, &lfs->rcache, sizeof(ntag),
+                dir->pair[0], off, &ntag, sizeof(ntag));
+        if (err) {
+            return err;
+        }
 
-    // skip superblock entry
-    dir->id = (off > 0 && lfs_pair_cmp(dir->head, lfs->root) == 0);
+        ntag = (lfs_frombe32(ntag) ^ tag) & 0x7fffffff;
 
-    while (off > 0) {
-        if (dir->id == dir->m.count) {
-            if (!dir->m.split) {
-                return LFS_ERR_INVAL;
+        bool splice = (lfs_tag_type1(tag) == LFS_TYPE_SPLICE);
+        bool name = ((LFS_MKTAG(0x780, 0, 0) & tag)
+                == LFS_MKTAG(LFS_TYPE_NAME, 0, 0));
+        bool strct = ((LFS_MKTAG(0x700, 0, 0) & tag)
+                == LFS_MKTAG(LFS_TYPE_STRUCT, 0, 0));
+        if (!splice && !name && !strct) {
+            continue;
+        }
+
+        for (lfs_size_t i = 0; i < count; i++) {
+            struct lfs_dir_batchslot *slot = &slots[i];
+            if (slot->done) {
+                continue;
             }
 
-            err = lfs_dir_fetch(lfs, &dir->m, dir->m.tail);
-            if (err) {
-                return err;
+            if (splice && lfs_tag_id(tag) <= slot->id) {
+                if (tag == LFS_MKTAG(LFS_TYPE_CREATE, slot->id, 0)) {
+                    // found where we were created
+                    slot->done = true;
+                    pending -= 1;
+                    continue;
+                }
+
+                // move around splices
+                slot->id -= lfs_tag_splice(tag);
             }
 
-            dir->id = 0;
-        }
+            if (lfs_tag_id(tag) != slot->id) {
+                continue;
+            }
+
+            if ((name && !slot->ntag) || (strct && !slot->stag)) {
+                if (lfs_tag_isdelete(tag)) {
+                    slot->ntag = 0;
+                    slot->done = true;
+                    pending -= 1;
+                    continue;
+                }
+
+                if (name) {
+                    slot->ntag = tag;
+                    slot->noff = off + sizeof(tag);
+                } else {
+                    slot->stag = tag;
+                    slot->soff = off + sizeof(tag);
+                }
+
+                if (slot->ntag && slot->stag) {
+                    slot->done = true;
+                    pending -= 1;
+                }
+            }
+        }
+    }
+
+    // an entry needs both tags
+    for (lfs_size_t i = 0; i < count; i++) {
+        if (!slots[i].stag) {
+            slots[i].ntag = 0;
+        }
+    }
+
+    return 0;
+}
+
+static int lfs_dir_batchmatch(lfs_t *lfs, const lfs_mdir_t *dir,
+        lfs_tag_t ntag, lfs_off_t noff, const char *name,
+        const struct lfs_dir_filter *filter) {
+    if (!filter) {
+        return true;
+    }
+
+    if (filter->types && !(filter->types & lfs_tag_type3(ntag))) {
+        return false;
+    }
+
+    if (filter->prefix) {
+        lfs_size_t size = strlen(filter->prefix);
+        if (name) {
+            return strncmp(name, filter->prefix, size) == 0;
+        }
+
+        if (lfs_tag_size(ntag) < size) {
+            return false;
+        }
+
+        int res = lfs_bd_cmp(lfs,
+                NULL, &lfs->rcache, size,
+                dir->pair[0], noff, filter->prefix, size);
+        if (res < 0) {
+            return res;
+        }
+
+        return res == LFS_CMP_EQ;
+    }
+
+    return true;
+}
+
+static lfs_ssize_t lfs_dir_readbatch_(lfs_t *lfs, lfs_dir_t *dir,
+        struct lfs_info *info, lfs_size_t count,
+        const struct lfs_dir_filter *filter) {
+    lfs_size_t n = 0;
+
+    // special offset for '.' and '..'
+    while (n < count && dir->pos < 2) {
+        const char *name = (dir->pos == 0) ? "." : "..";
+        dir->pos += 1;
+        int res = lfs_dir_batchmatch(lfs, &dir->m,
+                LFS_MKTAG(LFS_TYPE_DIR, 0, 0), 0, name, filter);
+        if (res) {
+            memset(&info[n], 0, sizeof(info[n]));
+            info[n].type = LFS_TYPE_DIR;
+            strcpy(info[n].name, name);
+            n += 1;
+        }
+    }
+
+    while (n < count) {
+        if (dir->id == dir->m.count) {
+            if (!dir->m.split) {
+                break;
+            }
+
+            int err = lfs_dir_fetch(lfs, &dir->m, dir->m.tail);
+            if (err) {
+                return err;
+            }
+
+            dir->id = 0;
+        }
+
+        // resolve a window of ids with one scan of the log, never more
+        // than we have room for, filtered entries are only skipped
+        struct lfs_dir_batchslot slots[LFS_DIR_BATCH];
+        lfs_size_t window = lfs_min(lfs_min(
+                    dir->m.count - dir->id,
+                    count - n),
+                LFS_DIR_BATCH);
+        if (filter) {
+            window = lfs_min(dir->m.count - dir->id, LFS_DIR_BATCH);
+        }
+
+        for (lfs_size_t i = 0; i < window; i++) {
+            slots[i].id = dir->id + i;
+            slots[i].done = false;
+            slots[i].ntag = 0;
+            slots[i].stag = 0;
+        }
+
+        int err = lfs_dir_getbatch(lfs, &dir->m, slots, window);
+        if (err) {
+            return err;
+        }
+
+        lfs_size_t i = 0;
+        for (; i < window && n < count; i++) {
+            struct lfs_dir_batchslot *slot = &slots[i];
+            if (!slot->ntag) {
+                continue;
+            }
+
+            dir->pos += 1;
+            int res = lfs_dir_batchmatch(lfs, &dir->m,
+                    slot->ntag, slot->noff, NULL, filter);
+            if (res < 0) {
+                return res;
+            }
+
+            if (!res) {
+                continue;
+            }
+
+            // only now read the name and struct
+            struct lfs_info *entry = &info[n];
+            memset(entry, 0, sizeof(*entry));
+            lfs_size_t diff = lfs_min(lfs_tag_size(slot->ntag),
+                    lfs->name_max+1);
+            err = lfs_bd_read(lfs,
+                    NULL, &lfs->rcache, diff,
+                    dir->m.pair[0], slot->noff, entry->name, diff);
+            if (err) {
+                return err;
+            }
+            entry->type = lfs_tag_type3(slot->ntag);
+
+            if (lfs_tag_type3(slot->stag) == LFS_TYPE_CTZSTRUCT) {
+                struct lfs_ctz ctz;
+                memset(&ctz, 0, sizeof(ctz));
+                diff = lfs_min(lfs_tag_size(slot->stag), sizeof(ctz));
+                err = lfs_bd_read(lfs,
+                        NULL, &lfs->rcache, diff,
+                        dir->m.pair[0], slot->soff, &ctz, diff);
+                if (err) {
+                    return err;
+                }
+                lfs_ctz_fromle32(&ctz);
+                entry->size = ctz.size;
+            } else if (lfs_tag_type3(slot->stag) == LFS_TYPE_INLINESTRUCT) {
+                entry->size = lfs_tag_size(slot->stag);
+            } else if (lfs_tag_type3(slot->stag) == LFS_TYPE_PACKSTRUCT) {
+                struct lfs_pack pack;
+                memset(&pack, 0, sizeof(pack));
+                diff = lfs_min(lfs_tag_size(slot->stag), sizeof(pack));
+                err = lfs_bd_read(lfs,
+                        NULL, &lfs->rcache, diff,
+                        dir->m.pair[0], slot->soff, &pack, diff);
+                if (err) {
+                    return err;
+                }
+                lfs_pack_fromle32(&pack);
+                entry->size = pack.size;
+            } else if (lfs_tag_type3(slot->stag) == LFS_TYPE_SPARSESTRUCT) {
+                // the size of a sparse file follows its ctz reference
+                lfs_size_t size = 0;
+                if (lfs_tag_size(slot->stag) >= LFS_SPARSE_HEADER) {
+                    err = lfs_bd_read(lfs,
+                            NULL, &lfs->rcache, sizeof(size),
+                            dir->m.pair[0], slot->soff+sizeof(struct lfs_ctz),
+                            &size, sizeof(size));
+                    if (err) {
+                        return err;
+                    }
+                }
+                entry->size = lfs_fromle32(size);
+            }
+
+            n += 1;
+        }
+
+        dir->id += i;
+    }
+
+    return n;
+}
+
+static int lfs_dir_seek_(lfs_t *lfs, lfs_dir_t *dir, lfs_off_t off) {
+    // simply walk from head dir
+    int err = lfs_dir_rewind_(lfs, dir);
+    if (err) {
+        return err;
+    }
+
+    // first two for ./..
+    dir->pos = lfs_min(2, off);
+    off -= dir->pos;
+
+    // skip superblock entry
+    dir->id = (off > 0 && lfs_pair_cmp(dir->head, lfs->root) == 0);
+
+    while (off > 0) {
+        if (dir->id == dir->m.count) {
+            if (!dir->m.split) {
+                return LFS_ERR_INVAL;
+            }
+
+            err = lfs_dir_fetch(lfs, &dir->m, dir->m.tail);
+            if (err) {
+                return err;
+            }
+
+            dir->id = 0;
+        }
 
         int diff = lfs_min(dir->m.count - dir->id, off);
         dir->id += diff;
@@ -2842,7 +3944,7 @@ static int lfs_dir_rewind_(lfs_t *lfs, lfs_dir_t *dir) {
 /// File index list operations ///
 static int lfs_ctz_index(lfs_t *lfs, lfs_off_t *off) {
     lfs_off_t size = *off;
-    lfs_off_t b = lfs->cfg->block_size - 2*4;
+    lfs_off_t b = LFS_CFG_BLOCK_SIZE(lfs) - 2*4;
     lfs_off_t i = size / b;
     if (i == 0) {
         return 0;
@@ -2853,6 +3955,30 @@ static int lfs_ctz_index(lfs_t *lfs, lfs_off_t *off) {
     return i;
 }
 
+// follow the skip list from head, the block with index current, down to
+// the block with index target
+static int lfs_ctz_skip(lfs_t *lfs,
+        const lfs_cache_t *pcache, lfs_cache_t *rcache,
+        lfs_block_t *head, lfs_off_t current, lfs_off_t target) {
+    while (current > target) {
+        lfs_size_t skip = lfs_min(
+                lfs_npw2(current-target+1) - 1,
+                lfs_ctz(current));
+
+        int err = lfs_bd_read(lfs,
+                pcache, rcache, sizeof(*head),
+                *head, 4*skip, head, sizeof(*head));
+        *head = lfs_fromle32(*head);
+        if (err) {
+            return err;
+        }
+
+        current -= 1 << skip;
+    }
+
+    return 0;
+}
+
 static int lfs_ctz_find(lfs_t *lfs,
         const lfs_cache_t *pcache, lfs_cache_t *rcache,
         lfs_block_t head, lfs_size_t size,
@@ -2866,20 +3992,9 @@ static int lfs_ctz_find(lfs_t *lfs,
     lfs_off_t current = lfs_ctz_index(lfs, &(lfs_off_t){size-1});
     lfs_off_t target = lfs_ctz_index(lfs, &pos);
 
-    while (current > target) {
-        lfs_size_t skip = lfs_min(
-                lfs_npw2(current-target+1) - 1,
-                lfs_ctz(current));
-
-        int err = lfs_bd_read(lfs,
-                pcache, rcache, sizeof(head),
-                head, 4*skip, &head, sizeof(head));
-        head = lfs_fromle32(head);
-        if (err) {
-            return err;
-        }
-
-        current -= 1 << skip;
+    int err = lfs_ctz_skip(lfs, pcache, rcache, &head, current, target);
+    if (err) {
+        return err;
     }
 
     *block = head;
@@ -2888,20 +4003,71 @@ static int lfs_ctz_find(lfs_t *lfs,
 }
 
 #ifndef LFS_READONLY
-static int lfs_ctz_extend(lfs_t *lfs,
+// allocate the next data block of a file, if the file has a size hint we
+// try to reserve a contiguous extent for the rest of the file and hand out
+// blocks from that, the size of a sparse file says nothing about how much
+// of it is stored so the hint is ignored there
+//
+// erased is set if the block was already erased when it was reserved
+static int lfs_file_alloc(lfs_t *lfs, lfs_file_t *file,
+        lfs_block_t *block, bool *erased) {
+    // extents are only for appending, blocks for rewriting existing data
+    // come from the allocator
+    *erased = false;
+    if (file->pos < file->ctz.size) {
+        return lfs_alloc(lfs, block);
+    }
+
+    if (file->extent.count == 0 && !(file->flags & LFS_F_SPARSE)
+            && file->cfg->size_hint > file->pos) {
+        lfs_off_t first = file->pos;
+        lfs_off_t last = file->cfg->size_hint-1;
+        lfs_block_t count = lfs_ctz_index(lfs, &last)
+                - lfs_ctz_index(lfs, &first) + 1;
+        lfs_ssize_t res = lfs_alloc_extent(lfs, count, 1,
+                &file->extent.runs[0].block);
+        if (res < 0) {
+            return res;
+        }
+
+        file->extent.runs[0].count = res;
+        file->extent.count = 1;
+        file->extent.erased = false;
+    }
+
+    if (file->extent.count > 0) {
+        struct lfs_extent_run *run = &file->extent.runs[0];
+        *block = run->block;
+        *erased = file->extent.erased;
+        run->block += 1;
+        run->count -= 1;
+        if (run->count == 0) {
+            file->extent.count -= 1;
+            memmove(run, run+1, file->extent.count*sizeof(*run));
+        }
+        return 0;
+    }
+
+    return lfs_alloc(lfs, block);
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_ctz_extend(lfs_t *lfs, lfs_file_t *file,
         lfs_cache_t *pcache, lfs_cache_t *rcache,
         lfs_block_t head, lfs_size_t size,
         lfs_block_t *block, lfs_off_t *off) {
     while (true) {
         // go ahead and grab a block
         lfs_block_t nblock;
-        int err = lfs_alloc(lfs, &nblock);
+        bool erased;
+        int err = lfs_file_alloc(lfs, file, &nblock, &erased);
         if (err) {
             return err;
         }
 
         {
-            err = lfs_bd_erase(lfs, nblock);
+            err = (erased) ? 0 : lfs_bd_erase(lfs, nblock);
             if (err) {
                 if (err == LFS_ERR_CORRUPT) {
                     goto relocate;
@@ -2920,7 +4086,7 @@ static int lfs_ctz_extend(lfs_t *lfs,
             noff = noff + 1;
 
             // just copy out the last block if it is incomplete
-            if (noff != lfs->cfg->block_size) {
+            if (noff != LFS_CFG_BLOCK_SIZE(lfs)) {
                 for (lfs_off_t i = 0; i < noff; i++) {
                     uint8_t data;
                     err = lfs_bd_read(lfs,
@@ -3032,56 +4198,398 @@ static int lfs_ctz_traverse(lfs_t *lfs,
 
 
 /// Top level file operations ///
-static int lfs_file_opencfg_(lfs_t *lfs, lfs_file_t *file,
-        const char *path, int flags,
-        const struct lfs_file_config *cfg) {
-#ifndef LFS_READONLY
-    // deorphan if we haven't yet, needed at most once after poweron
-    if ((flags & LFS_O_WRONLY) == LFS_O_WRONLY) {
-        int err = lfs_fs_forceconsistency(lfs);
-        if (err) {
-            return err;
+// load an inlined file into its cache, the cache holds the whole file
+static int lfs_file_loadinline(lfs_t *lfs, lfs_file_t *file) {
+    file->cache.block = file->ctz.head;
+    file->cache.off = 0;
+    file->cache.size = LFS_CFG_CACHE_SIZE(lfs);
+
+    // packed files are read from their pack block
+    if (file->flags & LFS_F_PACKED) {
+        return lfs_bd_read(lfs,
+                NULL, &lfs->rcache, file->pack.size,
+                file->pack.block, file->pack.off,
+                file->cache.buffer, file->pack.size);
+    }
+
+    // don't always read (may be new/trunc file)
+    if (file->ctz.size > 0) {
+        lfs_stag_t res = lfs_dir_get(lfs, &file->m,
+                LFS_MKTAG(0x700, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_STRUCT, file->id,
+                    lfs_min(file->cache.size, 0x3fe)),
+                file->cache.buffer);
+        if (res < 0) {
+            return res;
         }
     }
+
+    return 0;
+}
+
+// does the file's cache hold data that isn't on disk yet?
+static inline bool lfs_file_cachedirty(const lfs_file_t *file) {
+#ifndef LFS_READONLY
+    return (file->flags & LFS_F_WRITING)
+            || ((file->flags & LFS_F_INLINE) && (file->flags & LFS_F_DIRTY));
 #else
-    LFS_ASSERT((flags & LFS_O_RDONLY) == LFS_O_RDONLY);
+    (void)file;
+    return false;
 #endif
+}
 
-    // setup simple file details
-    int err;
-    file->cfg = cfg;
-    file->flags = flags;
-    file->pos = 0;
-    file->off = 0;
-    file->cache.buffer = NULL;
+#ifndef LFS_READONLY
+// largest file kept in the file's cache, either inlined or packed
+static inline lfs_size_t lfs_file_cachemax(lfs_t *lfs) {
+    return lfs_max(lfs->inline_max,
+            lfs_max(lfs->cfg->inline_adapt_max, lfs->cfg->pack_max));
+}
+#endif
 
-    // allocate entry for file if it doesn't exist
-    lfs_stag_t tag = lfs_dir_find(lfs, &file->m, &path, &file->id);
-    if (tag < 0 && !(tag == LFS_ERR_NOENT && file->id != 0x3ff)) {
-        err = tag;
-        goto cleanup;
+// largest struct a file can commit beyond its ctz reference, a sparse
+// file's chunk map or a file's seek index, needs to fit in the metadata
+static inline lfs_size_t lfs_file_structmax(lfs_t *lfs) {
+    return lfs_min(lfs_min(
+            LFS_CFG_CACHE_SIZE(lfs), lfs->attr_max),
+            ((lfs->cfg->metadata_max)
+                ? lfs->cfg->metadata_max
+                : LFS_CFG_BLOCK_SIZE(lfs))/8);
+}
+
+#ifndef LFS_READONLY
+// should a file larger than inline_max stay inlined? only if it isn't
+// synced often, since each sync appends the whole file to the metadata log,
+// and only if its metadata pair has room to spare, since splitting the pair
+// costs more than the block the file would take outlined
+//
+// a file that isn't adaptively inlined on disk yet needs a quarter of the
+// room left over, so files near the limit don't flip between inlined and
+// outlined
+static int lfs_file_keepinline(lfs_t *lfs, lfs_file_t *file) {
+    if (file->ctz.size > lfs->cfg->inline_adapt_max
+            || file->syncs >= LFS_INLINE_HOT_SYNCS
+            || lfs_pair_isnull(file->m.pair)) {
+        return false;
+    }
+
+    // same limit as when compacting
+    lfs_size_t thresh = lfs_min(
+            LFS_CFG_BLOCK_SIZE(lfs) - 40,
+            lfs_alignup(
+                (lfs->cfg->metadata_max
+                    ? lfs->cfg->metadata_max
+                    : LFS_CFG_BLOCK_SIZE(lfs))/2,
+                LFS_CFG_PROG_SIZE(lfs)));
+
+    struct lfs_ctz ctz;
+    lfs_stag_t tag = lfs_dir_get(lfs, &file->m, LFS_MKTAG(0x700, 0x3ff, 0),
+            LFS_MKTAG(LFS_TYPE_STRUCT, file->id, sizeof(ctz)), &ctz);
+    if (tag < 0 && tag != LFS_ERR_NOENT) {
+        return tag;
     }
 
-    // get id, add to list of mdirs to catch update changes
-    file->type = LFS_TYPE_REG;
-    lfs_mlist_append(lfs, (struct lfs_mlist *)file);
+    lfs_size_t old = 0;
+    if (tag >= 0 && lfs_tag_type3(tag) == LFS_TYPE_INLINESTRUCT
+            && lfs_tag_size(tag) > lfs->inline_max) {
+        old = lfs_tag_size(tag);
+    } else {
+        thresh -= thresh/4;
+    }
 
-#ifdef LFS_READONLY
-    if (tag == LFS_ERR_NOENT) {
-        err = LFS_ERR_NOENT;
-        goto cleanup;
-#else
-    if (tag == LFS_ERR_NOENT) {
-        if (!(flags & LFS_O_CREAT)) {
-            err = LFS_ERR_NOENT;
-            goto cleanup;
+    // the log is an upper bound on the compacted size, only work out the
+    // compacted size if the log doesn't fit
+    if (file->m.off + file->ctz.size <= thresh) {
+        return true;
+    }
+
+    struct lfs_dir_index index;
+    int err = lfs_dir_index_build(lfs, &index, &file->m, NULL, 0);
+    if (err) {
+        return err;
+    }
+
+    lfs_size_t size = 0;
+    err = lfs_dir_index_traverse(lfs, &index, &file->m, NULL, 0,
+            0, file->m.count, 0, lfs_dir_commit_size, &size);
+    lfs_dir_index_free(lfs, &index);
+    if (err) {
+        return err;
+    }
+
+    return size - old + file->ctz.size <= thresh;
+}
+#endif
+
+// take the least recently used shared file cache for file, clean caches
+// are preferred since dirty caches need to be written back first, and
+// inlined files last since they need a block to be written back to
+//
+// a dirty inlined or packed file is outlined into a new block but not
+// committed, the same as when it outgrows its cache, a file's data must
+// only be committed by its own sync or close
+static int lfs_file_evict(lfs_t *lfs, lfs_file_t *file) {
+    lfs_file_t *victim = NULL;
+    int victimcost = 0;
+    for (struct lfs_mlist *m = lfs->mlist; m; m = m->next) {
+        lfs_file_t *f = (lfs_file_t*)m;
+        if (m->type != LFS_TYPE_REG || f == file
+                || f->cfg->buffer || !f->cache.buffer) {
+            continue;
         }
 
-        // check that name fits
-        lfs_size_t nlen = strlen(path);
-        if (nlen > lfs->name_max) {
-            err = LFS_ERR_NAMETOOLONG;
-            goto cleanup;
+        int cost = 0;
+        if (lfs_file_cachedirty(f)) {
+#ifndef LFS_READONLY
+            // errored files can't be written back
+            if (f->flags & LFS_F_ERRED) {
+                continue;
+            }
+#endif
+            cost = (f->flags & LFS_F_INLINE) ? 2 : 1;
+        }
+
+        if (!victim
+                || cost < victimcost
+                || (cost == victimcost
+                    && (int32_t)(f->tick - victim->tick) < 0)) {
+            victim = f;
+            victimcost = cost;
+        }
+    }
+
+    if (!victim) {
+        return LFS_ERR_NOMEM;
+    }
+
+    int err = lfs_file_flush(lfs, victim);
+    if (err) {
+        return err;
+    }
+
+#ifndef LFS_READONLY
+    if (victimcost == 2) {
+        // outline all of the file, not just up to pos
+        lfs_off_t pos = victim->pos;
+        victim->pos = victim->ctz.size;
+        err = lfs_file_outline(lfs, victim);
+        if (!err) {
+            err = lfs_file_flush(lfs, victim);
+        }
+        victim->pos = pos;
+        if (err) {
+            return err;
+        }
+    }
+#endif
+
+    file->cache.buffer = victim->cache.buffer;
+    victim->cache.buffer = NULL;
+    lfs_cache_drop(lfs, &victim->cache);
+    lfs->pool.file_evictions += 1;
+    return 0;
+}
+
+// make sure a file has a cache before using it, with shared file caches
+// it may not have one yet or it may have been evicted
+static int lfs_file_getcache(lfs_t *lfs, lfs_file_t *file) {
+    if (!lfs->cfg->file_cache_max || file->cfg->buffer) {
+        return 0;
+    }
+
+    lfs->pool.file_tick += 1;
+    file->tick = lfs->pool.file_tick;
+    if (file->cache.buffer) {
+        return 0;
+    }
+
+    if (lfs->pool.file_caches < lfs->cfg->file_cache_max) {
+        file->cache.buffer = lfs_buffer_alloc(lfs, LFS_CFG_CACHE_SIZE(lfs));
+        if (!file->cache.buffer) {
+            return LFS_ERR_NOMEM;
+        }
+        lfs->pool.file_caches += 1;
+    } else {
+        int err = lfs_file_evict(lfs, file);
+        if (err) {
+            return err;
+        }
+    }
+
+    // zero to avoid information leak
+    lfs_cache_zero(lfs, &file->cache);
+
+    if (file->flags & LFS_F_INLINE) {
+        return lfs_file_loadinline(lfs, file);
+    }
+
+    return 0;
+}
+
+// load a sparse file's chunk map, tag is the file's struct, anything but a
+// sparse struct gives a new empty sparse file
+static int lfs_file_loadsparse(lfs_t *lfs, lfs_file_t *file, lfs_tag_t tag) {
+    if (file->cfg->sparse_buffer) {
+        file->sparse.buffer = file->cfg->sparse_buffer;
+    } else {
+        file->sparse.buffer = lfs_buffer_alloc(lfs, lfs_file_structmax(lfs));
+        if (!file->sparse.buffer) {
+            return LFS_ERR_NOMEM;
+        }
+    }
+
+    if (lfs_tag_type3(tag) != LFS_TYPE_SPARSESTRUCT) {
+        return 0;
+    }
+
+    lfs_size_t size = lfs_tag_size(tag);
+    if (size < LFS_SPARSE_HEADER || size > lfs_file_structmax(lfs)
+            || (size - LFS_SPARSE_HEADER) % 2 != 0) {
+        return LFS_ERR_CORRUPT;
+    }
+
+    lfs_stag_t res = lfs_dir_get(lfs, &file->m, LFS_MKTAG(0x7ff, 0x3ff, 0),
+            LFS_MKTAG(LFS_TYPE_SPARSESTRUCT, file->id, size),
+            file->sparse.buffer);
+    if (res < 0) {
+        return res;
+    }
+
+    // the ctz reference was already read with the struct
+    uint32_t header[2];
+    memcpy(header, &file->sparse.buffer[sizeof(struct lfs_ctz)],
+            sizeof(header));
+    if (lfs_fromle32(header[1]) != LFS_CFG_BLOCK_SIZE(lfs)) {
+        return LFS_ERR_CORRUPT;
+    }
+
+    file->sparse.size = lfs_fromle32(header[0]);
+    file->sparse.count = (size - LFS_SPARSE_HEADER) / 2;
+
+    // the last run can't run past the end of the map
+    lfs_size_t i = 0;
+    while (i < file->sparse.count) {
+        if (lfs_sparse_get(file, i) & LFS_SPARSE_RUN) {
+            i += 1;
+        }
+        i += 1;
+    }
+    if (i != file->sparse.count) {
+        return LFS_ERR_CORRUPT;
+    }
+
+    return 0;
+}
+
+// load a file's seek index, tag is the file's struct, anything but an
+// indexed ctz struct gives an empty index
+static int lfs_file_loadindex(lfs_t *lfs, lfs_file_t *file, lfs_tag_t tag) {
+    if (file->cfg->index_buffer) {
+        file->index.buffer = file->cfg->index_buffer;
+    } else {
+        file->index.buffer = lfs_buffer_alloc(lfs,
+                LFS_INDEX_BUFFER_SIZE(file->cfg->index_count));
+        if (!file->index.buffer) {
+            return LFS_ERR_NOMEM;
+        }
+    }
+
+    if (lfs_tag_type3(tag) != LFS_TYPE_CTZSTRUCT
+            || lfs_tag_size(tag) < LFS_INDEX_BUFFER_SIZE(1)) {
+        return 0;
+    }
+
+    lfs_size_t size = lfs_tag_size(tag);
+    if ((size - LFS_INDEX_BUFFER_SIZE(0)) % 4 != 0) {
+        return LFS_ERR_CORRUPT;
+    }
+
+    // we may have room for fewer entries than were stored, the first
+    // entries are still good
+    lfs_size_t count = lfs_min(
+            (size - LFS_INDEX_BUFFER_SIZE(0)) / 4,
+            file->cfg->index_count);
+    lfs_stag_t res = lfs_dir_get(lfs, &file->m, LFS_MKTAG(0x7ff, 0x3ff, 0),
+            LFS_MKTAG(LFS_TYPE_CTZSTRUCT, file->id,
+                LFS_INDEX_BUFFER_SIZE(count)),
+            file->index.buffer);
+    if (res < 0) {
+        return res;
+    }
+
+    uint32_t stride;
+    memcpy(&stride, &file->index.buffer[sizeof(struct lfs_ctz)],
+            sizeof(stride));
+    stride = lfs_fromle32(stride);
+    if (stride == 0 || (stride & (stride-1)) != 0) {
+        return LFS_ERR_CORRUPT;
+    }
+
+    file->index.stride = stride;
+    file->index.count = count;
+    file->index.from = (lfs_off_t)-1;
+    return 0;
+}
+
+static int lfs_file_opencfg_(lfs_t *lfs, lfs_file_t *file,
+        const char *path, int flags,
+        const struct lfs_file_config *cfg) {
+#ifndef LFS_READONLY
+    // deorphan if we haven't yet, needed at most once after poweron
+    if ((flags & LFS_O_WRONLY) == LFS_O_WRONLY) {
+        int err = lfs_fs_forceconsistency(lfs);
+        if (err) {
+            return err;
+        }
+    }
+#else
+    LFS_ASSERT((flags & LFS_O_RDONLY) == LFS_O_RDONLY);
+#endif
+
+    // setup simple file details
+    int err;
+    file->cfg = cfg;
+    file->flags = flags;
+    file->pos = 0;
+    file->off = 0;
+    file->cache.buffer = NULL;
+    file->extent.count = 0;
+    file->syncs = 0;
+    file->sparse.pos = 0;
+    file->sparse.size = 0;
+    file->sparse.count = 0;
+    file->sparse.buffer = NULL;
+    file->index.stride = 1;
+    file->index.count = 0;
+    file->index.from = 0;
+    file->index.buffer = NULL;
+
+    // allocate entry for file if it doesn't exist
+    lfs_stag_t tag = lfs_dir_find(lfs, &file->m, &path, &file->id);
+    if (tag < 0 && !(tag == LFS_ERR_NOENT && file->id != 0x3ff)) {
+        err = tag;
+        goto cleanup;
+    }
+
+    // get id, add to list of mdirs to catch update changes
+    file->type = LFS_TYPE_REG;
+    lfs_mlist_append(lfs, (struct lfs_mlist *)file);
+
+#ifdef LFS_READONLY
+    if (tag == LFS_ERR_NOENT) {
+        err = LFS_ERR_NOENT;
+        goto cleanup;
+#else
+    if (tag == LFS_ERR_NOENT) {
+        if (!(flags & LFS_O_CREAT)) {
+            err = LFS_ERR_NOENT;
+            goto cleanup;
+        }
+
+        // check that name fits
+        lfs_size_t nlen = strlen(path);
+        if (nlen > lfs->name_max) {
+            err = LFS_ERR_NAMETOOLONG;
+            goto cleanup;
         }
 
         // get next slot and create entry to remember name
@@ -3150,11 +4658,74 @@ static int lfs_file_opencfg_(lfs_t *lfs, lfs_file_t *file,
 #endif
     }
 
+    if (lfs_tag_type3(tag) == LFS_TYPE_INLINESTRUCT) {
+        file->ctz.head = LFS_BLOCK_INLINE;
+        file->ctz.size = lfs_tag_size(tag);
+        file->flags |= LFS_F_INLINE;
+    } else if (lfs_tag_type3(tag) == LFS_TYPE_PACKSTRUCT) {
+        // packed files live in the cache like inlined files
+        tag = lfs_dir_get(lfs, &file->m, LFS_MKTAG(0x7ff, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_PACKSTRUCT, file->id, sizeof(file->pack)),
+                &file->pack);
+        if (tag < 0) {
+            err = tag;
+            goto cleanup;
+        }
+        lfs_pack_fromle32(&file->pack);
+
+        if (file->pack.size > LFS_CFG_CACHE_SIZE(lfs)
+                || file->pack.block >= lfs->block_count
+                || file->pack.off + file->pack.size
+                    > LFS_CFG_BLOCK_SIZE(lfs)) {
+            err = LFS_ERR_CORRUPT;
+            goto cleanup;
+        }
+
+        file->ctz.head = LFS_BLOCK_INLINE;
+        file->ctz.size = file->pack.size;
+        file->flags |= LFS_F_INLINE | LFS_F_PACKED;
+    } else if (lfs_tag_type3(tag) == LFS_TYPE_SPARSESTRUCT) {
+        file->flags |= LFS_F_SPARSE;
+    }
+
+#ifndef LFS_READONLY
+    // new or empty files can be made sparse, their data is never inlined,
+    // sparse files need disk version 2.2
+    LFS_ASSERT(!(flags & LFS_O_SPARSE)
+            || lfs_fs_disk_version(lfs) >= 0x00020002);
+    if ((flags & LFS_O_SPARSE) && (flags & LFS_O_WRONLY) == LFS_O_WRONLY
+            && !(file->flags & LFS_F_SPARSE) && file->ctz.size == 0) {
+        file->ctz.head = LFS_BLOCK_NULL;
+        file->flags &= ~(LFS_F_INLINE | LFS_F_PACKED);
+        file->flags |= LFS_F_SPARSE | LFS_F_DIRTY;
+    }
+#endif
+
+    if (file->flags & LFS_F_SPARSE) {
+        err = lfs_file_loadsparse(lfs, file, tag);
+        if (err) {
+            goto cleanup;
+        }
+    } else if (file->cfg->index_count) {
+        err = lfs_file_loadindex(lfs, file, tag);
+        if (err) {
+            goto cleanup;
+        }
+    }
+
+    // with shared file caches the cache is taken on first use
+    if (lfs->cfg->file_cache_max && !file->cfg->buffer) {
+        file->cache.block = LFS_BLOCK_NULL;
+        file->cache.off = 0;
+        file->cache.size = 0;
+        return 0;
+    }
+
     // allocate buffer if needed
     if (file->cfg->buffer) {
         file->cache.buffer = file->cfg->buffer;
     } else {
-        file->cache.buffer = lfs_malloc(lfs->cfg->cache_size);
+        file->cache.buffer = lfs_buffer_alloc(lfs, LFS_CFG_CACHE_SIZE(lfs));
         if (!file->cache.buffer) {
             err = LFS_ERR_NOMEM;
             goto cleanup;
@@ -3164,26 +4735,11 @@ static int lfs_file_opencfg_(lfs_t *lfs, lfs_file_t *file,
     // zero to avoid information leak
     lfs_cache_zero(lfs, &file->cache);
 
-    if (lfs_tag_type3(tag) == LFS_TYPE_INLINESTRUCT) {
+    if (file->flags & LFS_F_INLINE) {
         // load inline files
-        file->ctz.head = LFS_BLOCK_INLINE;
-        file->ctz.size = lfs_tag_size(tag);
-        file->flags |= LFS_F_INLINE;
-        file->cache.block = file->ctz.head;
-        file->cache.off = 0;
-        file->cache.size = lfs->cfg->cache_size;
-
-        // don't always read (may be new/trunc file)
-        if (file->ctz.size > 0) {
-            lfs_stag_t res = lfs_dir_get(lfs, &file->m,
-                    LFS_MKTAG(0x700, 0x3ff, 0),
-                    LFS_MKTAG(LFS_TYPE_STRUCT, file->id,
-                        lfs_min(file->cache.size, 0x3fe)),
-                    file->cache.buffer);
-            if (res < 0) {
-                err = res;
-                goto cleanup;
-            }
+        err = lfs_file_loadinline(lfs, file);
+        if (err) {
+            goto cleanup;
         }
     }
 
@@ -3219,7 +4775,19 @@ static int lfs_file_close_(lfs_t *lfs, lfs_file_t *file) {
 
     // clean up memory
     if (!file->cfg->buffer) {
-        lfs_free(file->cache.buffer);
+        if (lfs->cfg->file_cache_max && file->cache.buffer) {
+            lfs->pool.file_caches -= 1;
+        }
+        lfs_buffer_free(lfs, file->cache.buffer, LFS_CFG_CACHE_SIZE(lfs));
+    }
+
+    if (!file->cfg->sparse_buffer) {
+        lfs_buffer_free(lfs, file->sparse.buffer, lfs_file_structmax(lfs));
+    }
+
+    if (!file->cfg->index_buffer) {
+        lfs_buffer_free(lfs, file->index.buffer,
+                LFS_INDEX_BUFFER_SIZE(file->cfg->index_count));
     }
 
     return err;
@@ -3231,12 +4799,13 @@ static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file) {
     while (true) {
         // just relocate what exists into new block
         lfs_block_t nblock;
-        int err = lfs_alloc(lfs, &nblock);
+        bool erased;
+        int err = lfs_file_alloc(lfs, file, &nblock, &erased);
         if (err) {
             return err;
         }
 
-        err = lfs_bd_erase(lfs, nblock);
+        err = (erased) ? 0 : lfs_bd_erase(lfs, nblock);
         if (err) {
             if (err == LFS_ERR_CORRUPT) {
                 goto relocate;
@@ -3278,7 +4847,7 @@ static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file) {
         }
 
         // copy over new state of file
-        memcpy(file->cache.buffer, lfs->pcache.buffer, lfs->cfg->cache_size);
+        memcpy(file->cache.buffer, lfs->pcache.buffer, LFS_CFG_CACHE_SIZE(lfs));
         file->cache.block = lfs->pcache.block;
         file->cache.off = lfs->pcache.off;
         file->cache.size = lfs->pcache.size;
@@ -3306,7 +4875,9 @@ static int lfs_file_outline(lfs_t *lfs, lfs_file_t *file) {
         return err;
     }
 
-    file->flags &= ~LFS_F_INLINE;
+    // every block is new
+    file->index.from = 0;
+    file->flags &= ~(LFS_F_INLINE | LFS_F_PACKED);
     return 0;
 }
 #endif
@@ -3343,191 +4914,1029 @@ static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file) {
                     return res;
                 }
 
-                res = lfs_file_flushedwrite(lfs, file, &data, 1);
+                res = lfs_file_flushedwrite(lfs, file, &data, 1);
+                if (res < 0) {
+                    return res;
+                }
+
+                // keep our reference to the rcache in sync
+                if (lfs->rcache.block != LFS_BLOCK_NULL) {
+                    lfs_cache_drop(lfs, &orig.cache);
+                    lfs_cache_drop(lfs, &lfs->rcache);
+                }
+            }
+
+            // write out what we have
+            while (true) {
+                int err = lfs_bd_flush(lfs, &file->cache, &lfs->rcache, true);
+                if (err) {
+                    if (err == LFS_ERR_CORRUPT) {
+                        goto relocate;
+                    }
+                    return err;
+                }
+
+                break;
+
+relocate:
+                LFS_DEBUG("Bad block at 0x%"PRIx32, file->block);
+                err = lfs_file_relocate(lfs, file);
+                if (err) {
+                    return err;
+                }
+            }
+        } else {
+            file->pos = lfs_max(file->pos, file->ctz.size);
+        }
+
+        // actual file updates
+        file->ctz.head = file->block;
+        file->ctz.size = file->pos;
+        file->flags &= ~LFS_F_WRITING;
+        file->flags |= LFS_F_DIRTY;
+
+        file->pos = pos;
+    }
+#endif
+
+    return 0;
+}
+
+#ifndef LFS_READONLY
+// append a packed file's data to the current pack block, starting a new
+// pack block if it doesn't fit, the data comes from buffer if there is one,
+// otherwise from where pack points, and pack is updated to the new copy
+static int lfs_pack_append(lfs_t *lfs, struct lfs_pack *pack,
+        const void *buffer) {
+    while (true) {
+        int err;
+        // we don't know how much of the last pack block was used before
+        // mounting, so packing always starts in a new block
+        if (lfs->packer.block == LFS_BLOCK_NULL
+                || lfs->packer.off + pack->size > LFS_CFG_BLOCK_SIZE(lfs)) {
+            lfs->packer.block = LFS_BLOCK_NULL;
+            lfs_alloc_ckpoint(lfs);
+            lfs_block_t nblock;
+            err = lfs_alloc(lfs, &nblock);
+            if (err) {
+                return err;
+            }
+
+            lfs->packer.block = nblock;
+            lfs->packer.off = 0;
+            err = lfs_bd_erase(lfs, nblock);
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+        }
+
+        lfs_off_t off = lfs->packer.off;
+        if (buffer) {
+            err = lfs_bd_prog(lfs, &lfs->pcache, &lfs->rcache, true,
+                    lfs->packer.block, off, buffer, pack->size);
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+        } else {
+            // copy a byte at a time, leave it up to caching to make this
+            // efficient
+            for (lfs_off_t i = 0; i < pack->size; i++) {
+                uint8_t data;
+                err = lfs_bd_read(lfs,
+                        NULL, &lfs->rcache, pack->size-i,
+                        pack->block, pack->off+i, &data, 1);
+                if (err) {
+                    return err;
+                }
+
+                err = lfs_bd_prog(lfs, &lfs->pcache, &lfs->rcache, true,
+                        lfs->packer.block, off+i, &data, 1);
+                if (err) {
+                    if (err == LFS_ERR_CORRUPT) {
+                        goto relocate;
+                    }
+                    return err;
+                }
+            }
+        }
+
+        // the data must be on disk before anything references it
+        err = lfs_bd_sync(lfs, &lfs->pcache, &lfs->rcache, true);
+        if (err) {
+            if (err == LFS_ERR_CORRUPT) {
+                goto relocate;
+            }
+            return err;
+        }
+
+        pack->block = lfs->packer.block;
+        pack->off = off;
+        lfs->packer.off = lfs_alignup(off + pack->size,
+                LFS_CFG_PROG_SIZE(lfs));
+        return 0;
+
+relocate:
+        LFS_DEBUG("Bad block at 0x%"PRIx32, lfs->packer.block);
+
+        // just clear cache and try a new block
+        lfs_cache_drop(lfs, &lfs->pcache);
+        lfs->packer.block = LFS_BLOCK_NULL;
+    }
+}
+#endif
+
+#ifndef LFS_READONLY
+// bring the file's seek index up to date with its ctz list, entries for
+// blocks before index.from haven't changed since the index was built
+static int lfs_file_reindex(lfs_t *lfs, lfs_file_t *file) {
+    lfs_size_t room = lfs_file_structmax(lfs);
+    lfs_size_t max = (room > LFS_INDEX_BUFFER_SIZE(0))
+            ? lfs_min(file->cfg->index_count,
+                (room - LFS_INDEX_BUFFER_SIZE(0)) / 4)
+            : 0;
+    lfs_size_t count = 0;
+    if (file->ctz.size > 0 && max > 0) {
+        lfs_off_t last = lfs_ctz_index(lfs,
+                &(lfs_off_t){file->ctz.size-1});
+
+        // out of entries? drop every other entry and double the stride
+        while (last / file->index.stride >= max) {
+            for (lfs_size_t k = 0; 2*k < file->index.count; k++) {
+                lfs_index_set(file, k, lfs_index_get(file, 2*k));
+            }
+            file->index.count = (file->index.count+1) / 2;
+            file->index.stride *= 2;
+        }
+
+        count = last / file->index.stride + 1;
+        lfs_size_t keep = 0;
+        while (keep < lfs_min(file->index.count, count)
+                && keep*file->index.stride < file->index.from) {
+            keep += 1;
+        }
+
+        // follow the skip list down from the head for the rest, since
+        // entries are on multiples of the stride this is usually a
+        // single read per entry
+        lfs_block_t head = file->ctz.head;
+        lfs_off_t current = last;
+        for (lfs_size_t k = count; k > keep; k--) {
+            int err = lfs_ctz_skip(lfs, NULL, &lfs->rcache,
+                    &head, current, (k-1)*file->index.stride);
+            if (err) {
+                return err;
+            }
+
+            current = (k-1)*file->index.stride;
+            lfs_index_set(file, k-1, head);
+        }
+    }
+
+    uint32_t header[3] = {
+        lfs_tole32(file->ctz.head),
+        lfs_tole32(file->ctz.size),
+        lfs_tole32(file->index.stride),
+    };
+    memcpy(file->index.buffer, header, sizeof(header));
+    file->index.count = count;
+    file->index.from = (lfs_off_t)-1;
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_file_sync_(lfs_t *lfs, lfs_file_t *file) {
+    if (file->flags & LFS_F_ERRED) {
+        // it's not safe to do anything if our file errored
+        return 0;
+    }
+
+    int err = lfs_file_flush(lfs, file);
+    if (err) {
+        file->flags |= LFS_F_ERRED;
+        return err;
+    }
+
+
+    if ((file->flags & LFS_F_DIRTY) &&
+            !lfs_pair_isnull(file->m.pair)) {
+        // before we commit metadata, we need sync the disk to make sure
+        // data writes don't complete after metadata writes
+        if (!(file->flags & LFS_F_INLINE)) {
+            err = lfs_bd_sync(lfs, &lfs->pcache, &lfs->rcache, false);
+            if (err) {
+                return err;
+            }
+        } else if (!(file->flags & LFS_F_PACKED)) {
+            // inlined data is committed from the file's cache
+            err = lfs_file_getcache(lfs, file);
+            if (err) {
+                return err;
+            }
+
+            // too big to inline? then it goes in a pack block or its own
+            // blocks
+            int res = (file->ctz.size > lfs->inline_max)
+                    ? lfs_file_keepinline(lfs, file)
+                    : true;
+            if (res < 0) {
+                file->flags |= LFS_F_ERRED;
+                return res;
+            }
+
+            if (!res && file->ctz.size <= lfs->cfg->pack_max) {
+                file->pack.size = file->ctz.size;
+                err = lfs_pack_append(lfs, &file->pack, file->cache.buffer);
+                if (err) {
+                    file->flags |= LFS_F_ERRED;
+                    return err;
+                }
+
+                file->flags |= LFS_F_PACKED;
+            } else if (!res) {
+                // outline the whole file, not just up to pos
+                lfs_off_t pos = file->pos;
+                file->pos = file->ctz.size;
+                err = lfs_file_outline(lfs, file);
+                if (!err) {
+                    err = lfs_file_flush(lfs, file);
+                }
+                file->pos = pos;
+                if (!err) {
+                    err = lfs_bd_sync(lfs, &lfs->pcache, &lfs->rcache, false);
+                }
+                if (err) {
+                    file->flags |= LFS_F_ERRED;
+                    return err;
+                }
+            }
+        }
+
+        // update dir entry
+        uint16_t type;
+        const void *buffer;
+        lfs_size_t size;
+        struct lfs_ctz ctz;
+        struct lfs_pack pack;
+        if (file->flags & LFS_F_PACKED) {
+            // reference the data in its pack block
+            type = LFS_TYPE_PACKSTRUCT;
+            pack = file->pack;
+            lfs_pack_tole32(&pack);
+            buffer = &pack;
+            size = sizeof(pack);
+        } else if (file->flags & LFS_F_INLINE) {
+            // inline the whole file
+            type = LFS_TYPE_INLINESTRUCT;
+            buffer = file->cache.buffer;
+            size = file->ctz.size;
+        } else if (file->flags & LFS_F_SPARSE) {
+            // the ctz reference and size go in front of the chunk map
+            type = LFS_TYPE_SPARSESTRUCT;
+            uint32_t header[4] = {
+                lfs_tole32(file->ctz.head),
+                lfs_tole32(file->ctz.size),
+                lfs_tole32(file->sparse.size),
+                lfs_tole32(LFS_CFG_BLOCK_SIZE(lfs)),
+            };
+            memcpy(file->sparse.buffer, header, sizeof(header));
+            buffer = file->sparse.buffer;
+            size = LFS_SPARSE_HEADER + 2*file->sparse.count;
+        } else if (file->index.buffer) {
+            // the seek index goes after the ctz reference, so it is always
+            // committed with the ctz list it indexes
+            type = LFS_TYPE_CTZSTRUCT;
+            err = lfs_file_reindex(lfs, file);
+            if (err) {
+                file->flags |= LFS_F_ERRED;
+                return err;
+            }
+            buffer = file->index.buffer;
+            size = LFS_INDEX_BUFFER_SIZE(file->index.count);
+        } else {
+            // update the ctz reference
+            type = LFS_TYPE_CTZSTRUCT;
+            // copy ctz so alloc will work during a relocate
+            ctz = file->ctz;
+            lfs_ctz_tole32(&ctz);
+            buffer = &ctz;
+            size = sizeof(ctz);
+        }
+
+        // older drivers don't know pack blocks or sparse chunks are in use
+        if (type == LFS_TYPE_PACKSTRUCT || type == LFS_TYPE_SPARSESTRUCT) {
+            err = lfs_fs_upgrade(lfs, 0x00020002);
+            if (err) {
+                file->flags |= LFS_F_ERRED;
+                return err;
+            }
+        }
+
+        // commit file data and attributes
+        err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
+                {LFS_MKTAG(type, file->id, size), buffer},
+                {LFS_MKTAG(LFS_FROM_USERATTRS, file->id,
+                    file->cfg->attr_count), file->cfg->attrs}));
+        if (err) {
+            file->flags |= LFS_F_ERRED;
+            return err;
+        }
+
+        file->flags &= ~LFS_F_DIRTY;
+        file->syncs += 1;
+    }
+
+    return 0;
+}
+#endif
+
+// find the block and offset of pos in a file's ctz list, starting from the
+// nearest entry in the file's seek index if it is still good
+static int lfs_file_find(lfs_t *lfs, lfs_file_t *file,
+        lfs_off_t pos, lfs_block_t *block, lfs_off_t *off) {
+    if (file->index.count > 0 && file->ctz.size > 0) {
+        lfs_off_t current = lfs_ctz_index(lfs,
+                &(lfs_off_t){file->ctz.size-1});
+        lfs_off_t target = lfs_ctz_index(lfs, &(lfs_off_t){pos});
+        lfs_size_t k = (target + file->index.stride-1) / file->index.stride;
+        if (k < file->index.count
+                && k*file->index.stride < file->index.from
+                && k*file->index.stride <= current) {
+            lfs_block_t head = lfs_index_get(file, k);
+            int err = lfs_ctz_skip(lfs, NULL, &file->cache,
+                    &head, k*file->index.stride, target);
+            if (err) {
+                return err;
+            }
+
+            *block = head;
+            *off = pos;
+            lfs_ctz_index(lfs, off);
+            return 0;
+        }
+    }
+
+    return lfs_ctz_find(lfs, NULL, &file->cache,
+            file->ctz.head, file->ctz.size,
+            pos, block, off);
+}
+
+// try to read a large region of a file with a single block device read,
+// this only works if the ctz blocks are physically contiguous
+//
+// returns the number of bytes read, or 0 if the caller should fall back to
+// reading block by block
+static lfs_ssize_t lfs_file_readspan(lfs_t *lfs, lfs_file_t *file,
+        void *buffer, lfs_size_t size) {
+    uint8_t *data = buffer;
+
+    // only worth it if we need at least the next whole block
+    lfs_off_t start = lfs_aligndown(file->off, LFS_CFG_READ_SIZE(lfs));
+    lfs_size_t span = lfs_aligndown(
+            lfs_min(size, lfs->cfg->read_span_max),
+            LFS_CFG_READ_SIZE(lfs));
+    if (start + span < 2*LFS_CFG_BLOCK_SIZE(lfs)) {
+        return 0;
+    }
+
+    // don't end the span in the last block's pointers
+    lfs_off_t index = lfs_ctz_index(lfs, &(lfs_off_t){file->pos});
+    lfs_block_t count = (start + span - 1) / LFS_CFG_BLOCK_SIZE(lfs);
+    if (start + span - count*LFS_CFG_BLOCK_SIZE(lfs)
+            <= 4*(lfs_ctz(index+count)+1)) {
+        count -= 1;
+        span = (count+1)*LFS_CFG_BLOCK_SIZE(lfs) - start;
+    }
+
+    // find the last block through the ctz list, if the blocks are
+    // contiguous it should be exactly count blocks after our block
+    lfs_off_t pos = file->pos + (LFS_CFG_BLOCK_SIZE(lfs) - file->off);
+    for (lfs_block_t i = 1; i < count; i++) {
+        pos += LFS_CFG_BLOCK_SIZE(lfs) - 4*(lfs_ctz(index+i)+1);
+    }
+
+    lfs_block_t last;
+    int err = lfs_file_find(lfs, file, pos, &last, &(lfs_off_t){0});
+    if (err) {
+        return err;
+    }
+
+    if (last != file->block + count
+            || (lfs->pcache.block >= file->block
+                && lfs->pcache.block <= last)) {
+        return 0;
+    }
+
+    err = lfs_bd_readspan(lfs, file->block, start, data, span);
+    if (err) {
+        return err;
+    }
+
+    // make sure the blocks in between really are in our ctz list, since
+    // the last block is, each block's pointer to the previous block can
+    // be trusted if the block itself is
+    for (lfs_block_t i = count; i > 0; i--) {
+        lfs_block_t prev;
+        memcpy(&prev, &data[i*LFS_CFG_BLOCK_SIZE(lfs) - start], sizeof(prev));
+        if (lfs_fromle32(prev) != file->block + i-1) {
+            return 0;
+        }
+    }
+
+    // squeeze out anything before our offset and the ctz pointers
+    lfs_size_t diff = LFS_CFG_BLOCK_SIZE(lfs) - file->off;
+    memmove(data, &data[file->off - start], diff);
+    lfs_size_t nsize = diff;
+    for (lfs_block_t i = 1; i <= count; i++) {
+        lfs_off_t skip = 4*(lfs_ctz(index+i)+1);
+        lfs_off_t off = i*LFS_CFG_BLOCK_SIZE(lfs) - start + skip;
+        diff = lfs_min(LFS_CFG_BLOCK_SIZE(lfs) - skip, span - off);
+        memmove(&data[nsize], &data[off], diff);
+        nsize += diff;
+        file->off = skip + diff;
+    }
+
+    file->pos += nsize;
+    file->block = last;
+    return nsize;
+}
+
+static lfs_ssize_t lfs_file_flushedread(lfs_t *lfs, lfs_file_t *file,
+        void *buffer, lfs_size_t size) {
+    uint8_t *data = buffer;
+    lfs_size_t nsize = size;
+
+    if (file->pos >= file->ctz.size) {
+        // eof if past end
+        return 0;
+    }
+
+    size = lfs_min(size, file->ctz.size - file->pos);
+    nsize = size;
+
+    while (nsize > 0) {
+        // check if we need a new block
+        if (!(file->flags & LFS_F_READING) ||
+                file->off == LFS_CFG_BLOCK_SIZE(lfs)) {
+            if (!(file->flags & LFS_F_INLINE)) {
+                int err = lfs_file_find(lfs, file,
+                        file->pos, &file->block, &file->off);
+                if (err) {
+                    return err;
+                }
+            } else {
+                file->block = LFS_BLOCK_INLINE;
+                file->off = file->pos;
+            }
+
+            file->flags |= LFS_F_READING;
+        }
+
+        // large reads over physically contiguous blocks can go to the
+        // block device as a single read
+        if (lfs->cfg->read_span_max && !(file->flags & LFS_F_INLINE)) {
+            lfs_ssize_t res = lfs_file_readspan(lfs, file, data, nsize);
+            if (res < 0) {
+                return res;
+            }
+
+            if (res > 0) {
+                data += res;
+                nsize -= res;
+                continue;
+            }
+        }
+
+        // read as much as we can in current block
+        lfs_size_t diff = lfs_min(nsize, LFS_CFG_BLOCK_SIZE(lfs) - file->off);
+        if (file->flags & LFS_F_INLINE) {
+            int err = lfs_dir_getread(lfs, &file->m,
+                    NULL, &file->cache, LFS_CFG_BLOCK_SIZE(lfs),
+                    LFS_MKTAG(0xfff, 0x1ff, 0),
+                    LFS_MKTAG(LFS_TYPE_INLINESTRUCT, file->id, 0),
+                    file->off, data, diff);
+            if (err) {
+                return err;
+            }
+        } else {
+            int err = lfs_bd_read(lfs,
+                    NULL, &file->cache, LFS_CFG_BLOCK_SIZE(lfs),
+                    file->block, file->off, data, diff);
+            if (err) {
+                return err;
+            }
+        }
+
+        file->pos += diff;
+        file->off += diff;
+        data += diff;
+        nsize -= diff;
+    }
+
+    return size;
+}
+
+// sparse files keep their data in block sized chunks, stored in a normal
+// ctz list in the order they are first written, the sparse struct maps runs
+// of stored chunks to the chunks of the file they hold, chunks that were
+// never written are holes that read as zeros and take no blocks
+//
+// returns the stored chunk holding chunk, or LFS_SPARSE_NULL for a hole
+static lfs_size_t lfs_file_sparsefind(lfs_file_t *file, lfs_size_t chunk) {
+    lfs_size_t stored = 0;
+    for (lfs_size_t i = 0; i < file->sparse.count;) {
+        struct lfs_sparse_run run;
+        i += lfs_sparse_getrun(file, i, &run);
+        if (run.chunk != LFS_SPARSE_NULL
+                && chunk >= run.chunk && chunk - run.chunk < run.count) {
+            return stored + (chunk - run.chunk);
+        }
+        stored += run.count;
+    }
+
+    return LFS_SPARSE_NULL;
+}
+
+static lfs_ssize_t lfs_file_sparseread(lfs_t *lfs, lfs_file_t *file,
+        void *buffer, lfs_size_t size) {
+    uint8_t *data = buffer;
+
+    if (file->sparse.pos >= file->sparse.size) {
+        // eof if past end
+        return 0;
+    }
+
+    size = lfs_min(size, file->sparse.size - file->sparse.pos);
+    lfs_size_t nsize = size;
+
+    while (nsize > 0) {
+        lfs_off_t off = file->sparse.pos % LFS_CFG_BLOCK_SIZE(lfs);
+        lfs_size_t diff = lfs_min(nsize, LFS_CFG_BLOCK_SIZE(lfs) - off);
+        lfs_size_t i = lfs_file_sparsefind(file,
+                file->sparse.pos / LFS_CFG_BLOCK_SIZE(lfs));
+        lfs_size_t n = 0;
+        if (i != LFS_SPARSE_NULL) {
+            lfs_off_t pos = i*LFS_CFG_BLOCK_SIZE(lfs) + off;
+            if (file->pos != pos) {
+                int err = lfs_file_flush(lfs, file);
+                if (err) {
+                    return err;
+                }
+                file->pos = pos;
+            }
+
+            lfs_ssize_t res = lfs_file_flushedread(lfs, file, data, diff);
+            if (res < 0) {
+                return res;
+            }
+            n = res;
+        }
+
+        // holes, and the unwritten end of the last stored chunk, are zeros
+        memset(data + n, 0, diff - n);
+
+        file->sparse.pos += diff;
+        data += diff;
+        nsize -= diff;
+    }
+
+    return size;
+}
+
+#ifndef LFS_READONLY
+// write to the stored chunks of a sparse file, zeros if buffer is NULL
+static int lfs_file_sparseprog(lfs_t *lfs, lfs_file_t *file,
+        lfs_off_t pos, const void *buffer, lfs_size_t size) {
+    // writes and appends in progress carry on from where they are, anything
+    // else starts over
+    if (!(file->flags & LFS_F_WRITING) || file->pos > pos
+            || (file->pos < pos && file->pos < file->ctz.size)) {
+        int err = lfs_file_flush(lfs, file);
+        if (err) {
+            return err;
+        }
+
+        file->pos = lfs_min(pos, file->ctz.size);
+    }
+
+    // the stored chunks before pos may not be written out yet
+    while (file->pos < pos) {
+        lfs_ssize_t res = lfs_file_flushedwrite(lfs, file, &(uint8_t){0}, 1);
+        if (res < 0) {
+            return res;
+        }
+    }
+
+    if (!buffer) {
+        for (lfs_size_t i = 0; i < size; i++) {
+            lfs_ssize_t res = lfs_file_flushedwrite(lfs, file,
+                    &(uint8_t){0}, 1);
+            if (res < 0) {
+                return res;
+            }
+        }
+
+        return 0;
+    }
+
+    lfs_ssize_t res = lfs_file_flushedwrite(lfs, file, buffer, size);
+    if (res < 0) {
+        return res;
+    }
+
+    return 0;
+}
+
+// replace the n entries of the chunk map at entry i with runs, the chunk
+// map needs to fit in the metadata
+static int lfs_file_sparsesplice(lfs_t *lfs, lfs_file_t *file,
+        lfs_size_t i, lfs_size_t n,
+        const struct lfs_sparse_run *runs, lfs_size_t count) {
+    lfs_size_t m = 0;
+    for (lfs_size_t j = 0; j < count; j++) {
+        m += lfs_sparse_runsize(&runs[j]);
+    }
+
+    if (LFS_SPARSE_HEADER + 2*(file->sparse.count - n + m)
+            > lfs_file_structmax(lfs)) {
+        return LFS_ERR_FBIG;
+    }
+
+    memmove(&file->sparse.buffer[LFS_SPARSE_HEADER + 2*(i+m)],
+            &file->sparse.buffer[LFS_SPARSE_HEADER + 2*(i+n)],
+            2*(file->sparse.count - i - n));
+    for (lfs_size_t j = 0; j < count; j++) {
+        i += lfs_sparse_setrun(file, i, &runs[j]);
+    }
+
+    file->sparse.count = file->sparse.count - n + m;
+    return 0;
+}
+
+// merge neighbouring runs that carry on from each other, a merged run never
+// takes more entries than the runs it replaces
+static void lfs_file_sparsemerge(lfs_file_t *file) {
+    struct lfs_sparse_run prev = {LFS_SPARSE_NULL, 0};
+    lfs_size_t j = 0;
+    for (lfs_size_t i = 0; i < file->sparse.count;) {
+        struct lfs_sparse_run run;
+        i += lfs_sparse_getrun(file, i, &run);
+        if (prev.count > 0 && ((prev.chunk == LFS_SPARSE_NULL)
+                ? run.chunk == LFS_SPARSE_NULL
+                : run.chunk != LFS_SPARSE_NULL
+                    && run.chunk == prev.chunk + prev.count)) {
+            prev.count += run.count;
+            continue;
+        }
+
+        if (prev.count > 0) {
+            j += lfs_sparse_setrun(file, j, &prev);
+        }
+        prev = run;
+    }
+
+    if (prev.count > 0) {
+        j += lfs_sparse_setrun(file, j, &prev);
+    }
+    file->sparse.count = j;
+}
+
+// rewrite a sparse file as a normal file, with its holes stored as zeros,
+// for when its chunk map no longer fits in the metadata
+static int lfs_file_sparsedense(lfs_t *lfs, lfs_file_t *file) {
+    int err = lfs_file_flush(lfs, file);
+    if (err) {
+        return err;
+    }
+
+    // the stored chunks stay the file's ctz list, and so out of the
+    // allocator's way, until the new ctz list is written
+    lfs_file_t orig = {
+        .ctz.head = file->ctz.head,
+        .ctz.size = file->ctz.size,
+        .flags = LFS_O_RDONLY,
+        .cache = lfs->rcache,
+    };
+    lfs_cache_drop(lfs, &lfs->rcache);
+
+    file->pos = 0;
+    file->flags |= LFS_F_DIRTY;
+    for (lfs_size_t chunk = 0; file->pos < file->sparse.size; chunk++) {
+        lfs_size_t i = lfs_file_sparsefind(file, chunk);
+        orig.pos = i*LFS_CFG_BLOCK_SIZE(lfs);
+        orig.flags &= ~LFS_F_READING;
+
+        lfs_off_t end = lfs_min(file->sparse.size,
+                (chunk+1)*LFS_CFG_BLOCK_SIZE(lfs));
+        while (file->pos < end) {
+            // copy over a byte at a time, leave it up to caching to make
+            // this efficient, holes and the unwritten end of the last
+            // stored chunk are zeros
+            uint8_t data = 0;
+            if (i != LFS_SPARSE_NULL) {
+                lfs_ssize_t res = lfs_file_flushedread(lfs, &orig, &data, 1);
                 if (res < 0) {
                     return res;
                 }
-
-                // keep our reference to the rcache in sync
-                if (lfs->rcache.block != LFS_BLOCK_NULL) {
-                    lfs_cache_drop(lfs, &orig.cache);
-                    lfs_cache_drop(lfs, &lfs->rcache);
-                }
             }
 
-            // write out what we have
-            while (true) {
-                int err = lfs_bd_flush(lfs, &file->cache, &lfs->rcache, true);
-                if (err) {
-                    if (err == LFS_ERR_CORRUPT) {
-                        goto relocate;
-                    }
-                    return err;
-                }
-
-                break;
+            lfs_ssize_t res = lfs_file_flushedwrite(lfs, file, &data, 1);
+            if (res < 0) {
+                return res;
+            }
 
-relocate:
-                LFS_DEBUG("Bad block at 0x%"PRIx32, file->block);
-                err = lfs_file_relocate(lfs, file);
-                if (err) {
-                    return err;
-                }
+            // keep our reference to the rcache in sync
+            if (lfs->rcache.block != LFS_BLOCK_NULL) {
+                lfs_cache_drop(lfs, &orig.cache);
+                lfs_cache_drop(lfs, &lfs->rcache);
             }
-        } else {
-            file->pos = lfs_max(file->pos, file->ctz.size);
         }
+    }
 
-        // actual file updates
-        file->ctz.head = file->block;
-        file->ctz.size = file->pos;
-        file->flags &= ~LFS_F_WRITING;
-        file->flags |= LFS_F_DIRTY;
-
-        file->pos = pos;
+    // and swap in the new ctz list
+    file->ctz.head = LFS_BLOCK_NULL;
+    file->ctz.size = 0;
+    err = lfs_file_flush(lfs, file);
+    if (err) {
+        return err;
     }
-#endif
 
+    file->flags &= ~LFS_F_SPARSE;
+    file->pos = file->sparse.pos;
     return 0;
 }
 
-#ifndef LFS_READONLY
-static int lfs_file_sync_(lfs_t *lfs, lfs_file_t *file) {
-    if (file->flags & LFS_F_ERRED) {
-        // it's not safe to do anything if our file errored
-        return 0;
+// find the stored chunk for a chunk of a sparse file, storing a new one if
+// the chunk is a hole, carrying on the run before it where it can
+//
+// stale is set if the stored chunk was freed by truncate and reused, what
+// isn't written of it needs zeroing
+static lfs_ssize_t lfs_file_sparsealloc(lfs_t *lfs, lfs_file_t *file,
+        lfs_size_t chunk, bool *stale) {
+    *stale = false;
+    lfs_size_t stored = lfs_file_sparsefind(file, chunk);
+    if (stored != LFS_SPARSE_NULL) {
+        return stored;
+    }
+
+    // reuse the first freed stored chunk, otherwise store a new chunk at
+    // the end
+    struct lfs_sparse_run prev = {LFS_SPARSE_NULL, 0};
+    struct lfs_sparse_run run = {LFS_SPARSE_NULL, 0};
+    lfs_size_t previ = 0;
+    lfs_size_t i = 0;
+    lfs_size_t n = 0;
+    stored = 0;
+    while (i < file->sparse.count) {
+        n = lfs_sparse_getrun(file, i, &run);
+        if (run.chunk == LFS_SPARSE_NULL) {
+            *stale = true;
+            break;
+        }
+
+        prev = run;
+        previ = i;
+        i += n;
+        stored += run.count;
     }
 
-    int err = lfs_file_flush(lfs, file);
+    struct lfs_sparse_run runs[2];
+    lfs_size_t count = 0;
+    lfs_size_t begin = i;
+    lfs_size_t end = (*stale) ? i + n : i;
+    if (prev.count > 0 && chunk == prev.chunk + prev.count) {
+        begin = previ;
+        runs[count++] = (struct lfs_sparse_run){prev.chunk, prev.count+1};
+    } else {
+        runs[count++] = (struct lfs_sparse_run){chunk, 1};
+    }
+
+    if (*stale && run.count > 1) {
+        runs[count++] = (struct lfs_sparse_run){
+                LFS_SPARSE_NULL, run.count-1};
+    }
+
+    int err = lfs_file_sparsesplice(lfs, file,
+            begin, end - begin, runs, count);
     if (err) {
-        file->flags |= LFS_F_ERRED;
         return err;
     }
 
+    // a reused chunk may carry on into the run after it
+    lfs_file_sparsemerge(file);
+    return stored;
+}
 
-    if ((file->flags & LFS_F_DIRTY) &&
-            !lfs_pair_isnull(file->m.pair)) {
-        // before we commit metadata, we need sync the disk to make sure
-        // data writes don't complete after metadata writes
-        if (!(file->flags & LFS_F_INLINE)) {
-            err = lfs_bd_sync(lfs, &lfs->pcache, &lfs->rcache, false);
+static lfs_ssize_t lfs_file_sparsewrite(lfs_t *lfs, lfs_file_t *file,
+        const void *buffer, lfs_size_t size) {
+    const uint8_t *data = buffer;
+    lfs_size_t nsize = size;
+
+    if (file->flags & LFS_O_APPEND) {
+        file->sparse.pos = file->sparse.size;
+    }
+
+    if (file->sparse.pos + size > lfs->file_max
+            || (file->sparse.pos + size) / LFS_CFG_BLOCK_SIZE(lfs)
+                >= LFS_SPARSE_NULL) {
+        // Larger than file limit?
+        return LFS_ERR_FBIG;
+    }
+
+    while (nsize > 0) {
+        lfs_off_t off = file->sparse.pos % LFS_CFG_BLOCK_SIZE(lfs);
+        lfs_size_t diff = lfs_min(nsize, LFS_CFG_BLOCK_SIZE(lfs) - off);
+        bool stale;
+        lfs_ssize_t i = lfs_file_sparsealloc(lfs, file,
+                file->sparse.pos / LFS_CFG_BLOCK_SIZE(lfs), &stale);
+        if (i == LFS_ERR_FBIG) {
+            // the chunk map is full, carry on as a normal file
+            int err = lfs_file_sparsedense(lfs, file);
             if (err) {
                 return err;
             }
-        }
 
-        // update dir entry
-        uint16_t type;
-        const void *buffer;
-        lfs_size_t size;
-        struct lfs_ctz ctz;
-        if (file->flags & LFS_F_INLINE) {
-            // inline the whole file
-            type = LFS_TYPE_INLINESTRUCT;
-            buffer = file->cache.buffer;
-            size = file->ctz.size;
-        } else {
-            // update the ctz reference
-            type = LFS_TYPE_CTZSTRUCT;
-            // copy ctz so alloc will work during a relocate
-            ctz = file->ctz;
-            lfs_ctz_tole32(&ctz);
-            buffer = &ctz;
-            size = sizeof(ctz);
+            lfs_ssize_t res = lfs_file_write_(lfs, file, data, nsize);
+            if (res < 0) {
+                return res;
+            }
+
+            return size;
+        } else if (i < 0) {
+            return i;
         }
 
-        // commit file data and attributes
-        err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
-                {LFS_MKTAG(type, file->id, size), buffer},
-                {LFS_MKTAG(LFS_FROM_USERATTRS, file->id,
-                    file->cfg->attr_count), file->cfg->attrs}));
+        lfs_off_t pos = i*LFS_CFG_BLOCK_SIZE(lfs);
+        int err = (stale)
+                ? lfs_file_sparseprog(lfs, file, pos, NULL, off)
+                : 0;
+        if (!err) {
+            err = lfs_file_sparseprog(lfs, file, pos + off, data, diff);
+        }
+        if (!err && stale) {
+            err = lfs_file_sparseprog(lfs, file, pos + off + diff, NULL,
+                    LFS_CFG_BLOCK_SIZE(lfs) - off - diff);
+        }
         if (err) {
-            file->flags |= LFS_F_ERRED;
             return err;
         }
 
-        file->flags &= ~LFS_F_DIRTY;
+        // like normal files, writing past the end leaves a hole
+        file->sparse.pos += diff;
+        file->sparse.size = lfs_max(file->sparse.size, file->sparse.pos);
+        data += diff;
+        nsize -= diff;
     }
 
-    return 0;
+    file->flags |= LFS_F_DIRTY;
+    file->flags &= ~LFS_F_ERRED;
+    return size;
 }
-#endif
-
-static lfs_ssize_t lfs_file_flushedread(lfs_t *lfs, lfs_file_t *file,
-        void *buffer, lfs_size_t size) {
-    uint8_t *data = buffer;
-    lfs_size_t nsize = size;
 
-    if (file->pos >= file->ctz.size) {
-        // eof if past end
-        return 0;
+static int lfs_file_sparsetruncate(lfs_t *lfs, lfs_file_t *file,
+        lfs_off_t size) {
+    if (size / LFS_CFG_BLOCK_SIZE(lfs) >= LFS_SPARSE_NULL) {
+        return LFS_ERR_FBIG;
     }
 
-    size = lfs_min(size, file->ctz.size - file->pos);
-    nsize = size;
+    if (size < file->sparse.size) {
+        // need to flush since directly changing metadata
+        int err = lfs_file_flush(lfs, file);
+        if (err) {
+            return err;
+        }
 
-    while (nsize > 0) {
-        // check if we need a new block
-        if (!(file->flags & LFS_F_READING) ||
-                file->off == lfs->cfg->block_size) {
-            if (!(file->flags & LFS_F_INLINE)) {
-                int err = lfs_ctz_find(lfs, NULL, &file->cache,
-                        file->ctz.head, file->ctz.size,
-                        file->pos, &file->block, &file->off);
-                if (err) {
+        // drop chunks past the new end, splitting the run the end falls in
+        lfs_size_t end = lfs_alignup(size, LFS_CFG_BLOCK_SIZE(lfs))
+                / LFS_CFG_BLOCK_SIZE(lfs);
+        for (lfs_size_t i = 0; i < file->sparse.count;) {
+            struct lfs_sparse_run run;
+            lfs_size_t n = lfs_sparse_getrun(file, i, &run);
+            if (run.chunk != LFS_SPARSE_NULL
+                    && run.chunk < end && run.chunk + run.count > end) {
+                const struct lfs_sparse_run runs[2] = {
+                    {run.chunk, end - run.chunk},
+                    {LFS_SPARSE_NULL, run.chunk + run.count - end},
+                };
+                err = lfs_file_sparsesplice(lfs, file, i, n, runs, 2);
+                if (err == LFS_ERR_FBIG) {
+                    // the chunk map is full, carry on as a normal file
+                    err = lfs_file_sparsedense(lfs, file);
+                    if (err) {
+                        return err;
+                    }
+
+                    return lfs_file_truncate_(lfs, file, size);
+                } else if (err) {
                     return err;
                 }
-            } else {
-                file->block = LFS_BLOCK_INLINE;
-                file->off = file->pos;
+                break;
             }
+            i += n;
+        }
 
-            file->flags |= LFS_F_READING;
+        for (lfs_size_t i = 0; i < file->sparse.count;) {
+            struct lfs_sparse_run run;
+            lfs_size_t n = lfs_sparse_getrun(file, i, &run);
+            if (run.chunk != LFS_SPARSE_NULL && run.chunk >= end) {
+                run.chunk = LFS_SPARSE_NULL;
+                lfs_sparse_setrun(file, i, &run);
+            }
+            i += n;
         }
+        lfs_file_sparsemerge(file);
 
-        // read as much as we can in current block
-        lfs_size_t diff = lfs_min(nsize, lfs->cfg->block_size - file->off);
-        if (file->flags & LFS_F_INLINE) {
-            int err = lfs_dir_getread(lfs, &file->m,
-                    NULL, &file->cache, lfs->cfg->block_size,
-                    LFS_MKTAG(0xfff, 0x1ff, 0),
-                    LFS_MKTAG(LFS_TYPE_INLINESTRUCT, file->id, 0),
-                    file->off, data, diff);
-            if (err) {
-                return err;
+        // zero the rest of the chunk the new end falls in, so it reads as
+        // zeros if the file grows again
+        lfs_off_t off = size % LFS_CFG_BLOCK_SIZE(lfs);
+        lfs_size_t i = lfs_file_sparsefind(file,
+                size / LFS_CFG_BLOCK_SIZE(lfs));
+        if (off != 0 && i != LFS_SPARSE_NULL) {
+            lfs_off_t pos = i*LFS_CFG_BLOCK_SIZE(lfs) + off;
+            lfs_off_t epos = lfs_min((i+1)*LFS_CFG_BLOCK_SIZE(lfs),
+                    file->ctz.size);
+            if (pos < epos) {
+                err = lfs_file_sparseprog(lfs, file, pos, NULL, epos - pos);
+                if (err) {
+                    return err;
+                }
+
+                err = lfs_file_flush(lfs, file);
+                if (err) {
+                    return err;
+                }
             }
-        } else {
-            int err = lfs_bd_read(lfs,
-                    NULL, &file->cache, lfs->cfg->block_size,
-                    file->block, file->off, data, diff);
+        }
+
+        // and give back any stored chunks left unused at the end
+        lfs_size_t stored = 0;
+        struct lfs_sparse_run run = {0, 0};
+        lfs_size_t last = 0;
+        for (lfs_size_t j = 0; j < file->sparse.count;) {
+            last = j;
+            j += lfs_sparse_getrun(file, j, &run);
+            stored += run.count;
+        }
+        if (run.chunk == LFS_SPARSE_NULL) {
+            file->sparse.count = last;
+            stored -= run.count;
+        }
+
+        lfs_off_t psize = stored*LFS_CFG_BLOCK_SIZE(lfs);
+        if (psize == 0) {
+            file->ctz.head = LFS_BLOCK_NULL;
+            file->ctz.size = 0;
+            file->pos = 0;
+        } else if (psize < file->ctz.size) {
+            // lookup new head in ctz skip list
+            err = lfs_file_find(lfs, file,
+                    psize-1, &file->block, &(lfs_off_t){0});
             if (err) {
                 return err;
             }
-        }
 
-        file->pos += diff;
-        file->off += diff;
-        data += diff;
-        nsize -= diff;
+            file->pos = psize;
+            file->ctz.head = file->block;
+            file->ctz.size = psize;
+            file->flags |= LFS_F_READING;
+        }
     }
 
-    return size;
+    file->sparse.size = size;
+    file->flags |= LFS_F_DIRTY;
+    return 0;
 }
+#endif
 
 static lfs_ssize_t lfs_file_read_(lfs_t *lfs, lfs_file_t *file,
         void *buffer, lfs_size_t size) {
     LFS_ASSERT((file->flags & LFS_O_RDONLY) == LFS_O_RDONLY);
 
+    int err = lfs_file_getcache(lfs, file);
+    if (err) {
+        return err;
+    }
+
 #ifndef LFS_READONLY
     if (file->flags & LFS_F_WRITING) {
         // flush out any writes
-        int err = lfs_file_flush(lfs, file);
+        err = lfs_file_flush(lfs, file);
         if (err) {
             return err;
         }
     }
 #endif
 
+    if (file->flags & LFS_F_SPARSE) {
+        return lfs_file_sparseread(lfs, file, buffer, size);
+    }
+
     return lfs_file_flushedread(lfs, file, buffer, size);
 }
 
@@ -3538,8 +5947,12 @@ static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
     const uint8_t *data = buffer;
     lfs_size_t nsize = size;
 
+    // the packed copy is stale once we write
+    file->flags &= ~LFS_F_PACKED;
+
     if ((file->flags & LFS_F_INLINE) &&
-            lfs_max(file->pos+nsize, file->ctz.size) > lfs->inline_max) {
+            lfs_max(file->pos+nsize, file->ctz.size)
+                > lfs_file_cachemax(lfs)) {
         // inline file doesn't fit anymore
         int err = lfs_file_outline(lfs, file);
         if (err) {
@@ -3551,12 +5964,11 @@ static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
     while (nsize > 0) {
         // check if we need a new block
         if (!(file->flags & LFS_F_WRITING) ||
-                file->off == lfs->cfg->block_size) {
+                file->off == LFS_CFG_BLOCK_SIZE(lfs)) {
             if (!(file->flags & LFS_F_INLINE)) {
                 if (!(file->flags & LFS_F_WRITING) && file->pos > 0) {
                     // find out which block we're extending from
-                    int err = lfs_ctz_find(lfs, NULL, &file->cache,
-                            file->ctz.head, file->ctz.size,
+                    int err = lfs_file_find(lfs, file,
                             file->pos-1, &file->block, &(lfs_off_t){0});
                     if (err) {
                         file->flags |= LFS_F_ERRED;
@@ -3567,9 +5979,20 @@ static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
                     lfs_cache_zero(lfs, &file->cache);
                 }
 
+                if (!(file->flags & LFS_F_WRITING)) {
+                    // the block we extend from and any after it are about
+                    // to change, the seek index can't be trusted for them
+                    file->index.from = lfs_min(file->index.from,
+                            (file->pos > 0)
+                                ? lfs_ctz_index(lfs,
+                                    &(lfs_off_t){file->pos-1})
+                                : 0);
+                }
+
                 // extend file with new blocks
                 lfs_alloc_ckpoint(lfs);
-                int err = lfs_ctz_extend(lfs, &file->cache, &lfs->rcache,
+                int err = lfs_ctz_extend(lfs, file,
+                        &file->cache, &lfs->rcache,
                         file->block, file->pos,
                         &file->block, &file->off);
                 if (err) {
@@ -3585,7 +6008,7 @@ static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
         }
 
         // program as much as we can in current block
-        lfs_size_t diff = lfs_min(nsize, lfs->cfg->block_size - file->off);
+        lfs_size_t diff = lfs_min(nsize, LFS_CFG_BLOCK_SIZE(lfs) - file->off);
         while (true) {
             int err = lfs_bd_prog(lfs, &file->cache, &lfs->rcache, true,
                     file->block, file->off, data, diff);
@@ -3621,14 +6044,23 @@ static lfs_ssize_t lfs_file_write_(lfs_t *lfs, lfs_file_t *file,
         const void *buffer, lfs_size_t size) {
     LFS_ASSERT((file->flags & LFS_O_WRONLY) == LFS_O_WRONLY);
 
+    int err = lfs_file_getcache(lfs, file);
+    if (err) {
+        return err;
+    }
+
     if (file->flags & LFS_F_READING) {
         // drop any reads
-        int err = lfs_file_flush(lfs, file);
+        err = lfs_file_flush(lfs, file);
         if (err) {
             return err;
         }
     }
 
+    if (file->flags & LFS_F_SPARSE) {
+        return lfs_file_sparsewrite(lfs, file, buffer, size);
+    }
+
     if ((file->flags & LFS_O_APPEND) && file->pos < file->ctz.size) {
         file->pos = file->ctz.size;
     }
@@ -3664,14 +6096,17 @@ static lfs_ssize_t lfs_file_write_(lfs_t *lfs, lfs_file_t *file,
 static lfs_soff_t lfs_file_seek_(lfs_t *lfs, lfs_file_t *file,
         lfs_soff_t off, int whence) {
     // find new pos
-    lfs_off_t npos = file->pos;
+    lfs_off_t pos = (file->flags & LFS_F_SPARSE)
+            ? file->sparse.pos
+            : file->pos;
+    lfs_off_t npos = pos;
     if (whence == LFS_SEEK_SET) {
         npos = off;
     } else if (whence == LFS_SEEK_CUR) {
-        if ((lfs_soff_t)file->pos + off < 0) {
+        if ((lfs_soff_t)pos + off < 0) {
             return LFS_ERR_INVAL;
         } else {
-            npos = file->pos + off;
+            npos = pos + off;
         }
     } else if (whence == LFS_SEEK_END) {
         lfs_soff_t res = lfs_file_size_(lfs, file) + off;
@@ -3687,6 +6122,12 @@ static lfs_soff_t lfs_file_seek_(lfs_t *lfs, lfs_file_t *file,
         return LFS_ERR_INVAL;
     }
 
+    if (file->flags & LFS_F_SPARSE) {
+        // sparse files only move their stored data when they need to
+        file->sparse.pos = npos;
+        return npos;
+    }
+
     if (file->pos == npos) {
         // noop - position has not changed
         return npos;
@@ -3701,10 +6142,13 @@ static lfs_soff_t lfs_file_seek_(lfs_t *lfs, lfs_file_t *file,
         true
 #endif
             ) {
+        // a read that stopped at the end of a block leaves pos in the next
+        // block, but the cache still holds the block read
         int oindex = lfs_ctz_index(lfs, &(lfs_off_t){file->pos});
         lfs_off_t noff = npos;
         int nindex = lfs_ctz_index(lfs, &noff);
         if (oindex == nindex
+                && file->off != LFS_CFG_BLOCK_SIZE(lfs)
                 && noff >= file->cache.off
                 && noff < file->cache.off + file->cache.size) {
             file->pos = npos;
@@ -3732,11 +6176,20 @@ static int lfs_file_truncate_(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
         return LFS_ERR_INVAL;
     }
 
+    int err = lfs_file_getcache(lfs, file);
+    if (err) {
+        return err;
+    }
+
+    if (file->flags & LFS_F_SPARSE) {
+        return lfs_file_sparsetruncate(lfs, file, size);
+    }
+
     lfs_off_t pos = file->pos;
     lfs_off_t oldsize = lfs_file_size_(lfs, file);
     if (size < oldsize) {
-        // revert to inline file?
-        if (size <= lfs->inline_max) {
+        // revert to inline or packed file?
+        if (size <= lfs_file_cachemax(lfs)) {
             // flush+seek to head
             lfs_soff_t res = lfs_file_seek_(lfs, file, 0, LFS_SEEK_SET);
             if (res < 0) {
@@ -3754,21 +6207,21 @@ static int lfs_file_truncate_(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
             file->ctz.head = LFS_BLOCK_INLINE;
             file->ctz.size = size;
             file->flags |= LFS_F_DIRTY | LFS_F_READING | LFS_F_INLINE;
+            file->flags &= ~LFS_F_PACKED;
             file->cache.block = file->ctz.head;
             file->cache.off = 0;
-            file->cache.size = lfs->cfg->cache_size;
+            file->cache.size = LFS_CFG_CACHE_SIZE(lfs);
             memcpy(file->cache.buffer, lfs->rcache.buffer, size);
 
         } else {
             // need to flush since directly changing metadata
-            int err = lfs_file_flush(lfs, file);
+            err = lfs_file_flush(lfs, file);
             if (err) {
                 return err;
             }
 
             // lookup new head in ctz skip list
-            err = lfs_ctz_find(lfs, NULL, &file->cache,
-                    file->ctz.head, file->ctz.size,
+            err = lfs_file_find(lfs, file,
                     size-1, &file->block, &(lfs_off_t){0});
             if (err) {
                 return err;
@@ -3788,19 +6241,96 @@ static int lfs_file_truncate_(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
             return (int)res;
         }
 
-        // fill with zeros
-        while (file->pos < size) {
-            res = lfs_file_write_(lfs, file, &(uint8_t){0}, 1);
-            if (res < 0) {
-                return (int)res;
+        // fill with zeros
+        while (file->pos < size) {
+            res = lfs_file_write_(lfs, file, &(uint8_t){0}, 1);
+            if (res < 0) {
+                return (int)res;
+            }
+        }
+    }
+
+    // restore pos
+    lfs_soff_t res = lfs_file_seek_(lfs, file, pos, LFS_SEEK_SET);
+    if (res < 0) {
+      return (int)res;
+    }
+
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_file_reserve_(lfs_t *lfs, lfs_file_t *file,
+        lfs_off_t size, int flags) {
+    LFS_ASSERT((file->flags & LFS_O_WRONLY) == LFS_O_WRONLY);
+
+    if (size > lfs->file_max) {
+        return LFS_ERR_FBIG;
+    }
+
+    // nothing to reserve if the file stays inlined or packed, or is sparse
+    // and only stores what is written
+    lfs_off_t first = lfs_file_size_(lfs, file);
+    if (size <= first || size <= lfs_file_cachemax(lfs)
+            || (file->flags & LFS_F_SPARSE)) {
+        return 0;
+    }
+
+    // we need blocks from the current last block, which may need to be
+    // copied when appending, up to the new last block
+    lfs_off_t last = size-1;
+    lfs_block_t count = lfs_ctz_index(lfs, &last)
+            - lfs_ctz_index(lfs, &first) + 1;
+    lfs_block_t held = 0;
+    for (lfs_size_t i = 0; i < file->extent.count; i++) {
+        held += file->extent.runs[i].count;
+    }
+
+    if (held >= count
+            && (file->extent.erased || !(flags & LFS_R_ERASE))) {
+        return 0;
+    }
+
+    // any previous extent is dropped, it is returned to the allocator at
+    // the next lookahead scan
+    //
+    // the longest runs in each lookahead window are taken until we have
+    // enough, the runs we hold are tracked by the traversal so moving on to
+    // the next window doesn't free them
+    file->extent.count = 0;
+    file->extent.erased = false;
+    lfs_alloc_ckpoint(lfs);
+    while (count > 0) {
+        if (file->extent.count == LFS_EXTENT_RUNS) {
+            file->extent.count = 0;
+            return LFS_ERR_NOSPC;
+        }
+
+        struct lfs_extent_run *run = &file->extent.runs[file->extent.count];
+        lfs_ssize_t res = lfs_alloc_extent(lfs, count, 1, &run->block);
+        if (res < 0) {
+            file->extent.count = 0;
+            return res;
+        }
+
+        run->count = res;
+        file->extent.count += 1;
+        count -= res;
+    }
+
+    if (flags & LFS_R_ERASE) {
+        for (lfs_size_t i = 0; i < file->extent.count; i++) {
+            for (lfs_block_t j = 0; j < file->extent.runs[i].count; j++) {
+                int err = lfs_bd_erase(lfs,
+                        file->extent.runs[i].block + j);
+                if (err) {
+                    return err;
+                }
             }
         }
-    }
 
-    // restore pos
-    lfs_soff_t res = lfs_file_seek_(lfs, file, pos, LFS_SEEK_SET);
-    if (res < 0) {
-      return (int)res;
+        file->extent.erased = true;
     }
 
     return 0;
@@ -3809,6 +6339,10 @@ static int lfs_file_truncate_(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
 
 static lfs_soff_t lfs_file_tell_(lfs_t *lfs, lfs_file_t *file) {
     (void)lfs;
+    if (file->flags & LFS_F_SPARSE) {
+        return file->sparse.pos;
+    }
+
     return file->pos;
 }
 
@@ -3823,6 +6357,9 @@ static int lfs_file_rewind_(lfs_t *lfs, lfs_file_t *file) {
 
 static lfs_soff_t lfs_file_size_(lfs_t *lfs, lfs_file_t *file) {
     (void)lfs;
+    if (file->flags & LFS_F_SPARSE) {
+        return file->sparse.size;
+    }
 
 #ifndef LFS_READONLY
     if (file->flags & LFS_F_WRITING) {
@@ -3833,6 +6370,44 @@ static lfs_soff_t lfs_file_size_(lfs_t *lfs, lfs_file_t *file) {
     return file->ctz.size;
 }
 
+struct lfs_file_extents {
+    lfs_block_t prev;
+    lfs_ssize_t count;
+};
+
+static int lfs_file_extents_count(void *p, lfs_block_t block) {
+    struct lfs_file_extents *extents = p;
+    // ctz lists are traversed backwards, so contiguous blocks count down
+    if (extents->count == 0 || block != extents->prev - 1) {
+        extents->count += 1;
+    }
+
+    extents->prev = block;
+    return 0;
+}
+
+static lfs_ssize_t lfs_file_extents_(lfs_t *lfs, lfs_file_t *file) {
+    // flush out any writes/reads so the ctz list is up to date
+    int err = lfs_file_flush(lfs, file);
+    if (err) {
+        return err;
+    }
+
+    if (file->flags & LFS_F_INLINE) {
+        return 0;
+    }
+
+    struct lfs_file_extents extents = {LFS_BLOCK_NULL, 0};
+    err = lfs_ctz_traverse(lfs, NULL, &lfs->rcache,
+            file->ctz.head, file->ctz.size,
+            lfs_file_extents_count, &extents);
+    if (err) {
+        return err;
+    }
+
+    return extents.count;
+}
+
 
 /// General fs operations ///
 static int lfs_stat_(lfs_t *lfs, const char *path, struct lfs_info *info) {
@@ -4062,6 +6637,54 @@ static int lfs_rename_(lfs_t *lfs, const char *oldpath, const char *newpath) {
 }
 #endif
 
+#ifndef LFS_READONLY
+static int lfs_file_clone_(lfs_t *lfs,
+        const char *oldpath, const char *newpath) {
+    // deorphan if we haven't yet, needed at most once after poweron
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    // find old entry, only regular files can share their blocks
+    lfs_mdir_t oldcwd;
+    lfs_stag_t oldtag = lfs_dir_find(lfs, &oldcwd, &oldpath, NULL);
+    if (oldtag < 0) {
+        return oldtag;
+    }
+
+    if (lfs_tag_id(oldtag) == 0x3ff
+            || lfs_tag_type3(oldtag) != LFS_TYPE_REG) {
+        return LFS_ERR_ISDIR;
+    }
+
+    // find new entry, which must not exist
+    lfs_mdir_t newcwd;
+    uint16_t newid;
+    lfs_stag_t prevtag = lfs_dir_find(lfs, &newcwd, &newpath, &newid);
+    if (!(prevtag == LFS_ERR_NOENT && newid != 0x3ff)) {
+        return (prevtag < 0) ? (int)prevtag : LFS_ERR_EXIST;
+    }
+
+    // check that name fits
+    lfs_size_t nlen = strlen(newpath);
+    if (nlen > lfs->name_max) {
+        return LFS_ERR_NAMETOOLONG;
+    }
+
+    // copy over the struct and all attributes, the ctz blocks are never
+    // written once committed, appending or truncating either file gives it
+    // a new head, so both files can point at the same list
+    //
+    // unlike rename the old entry stays, so there is no move to fix if
+    // we lose power
+    return lfs_dir_commit(lfs, &newcwd, LFS_MKATTRS(
+            {LFS_MKTAG(LFS_TYPE_CREATE, newid, 0), NULL},
+            {LFS_MKTAG(LFS_TYPE_REG, newid, nlen), newpath},
+            {LFS_MKTAG(LFS_FROM_MOVE, newid, lfs_tag_id(oldtag)), &oldcwd}));
+}
+#endif
+
 static lfs_ssize_t lfs_getattr_(lfs_t *lfs, const char *path,
         uint8_t type, void *buffer, lfs_size_t size) {
     lfs_mdir_t cwd;
@@ -4173,24 +6796,48 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
     // which littlefs currently does not support
     LFS_ASSERT((bool)0x80000000);
 
+    // if the geometry is fixed at compile time, the runtime config must
+    // agree with it
+#ifdef LFS_READ_SIZE
+    LFS_ASSERT(lfs->cfg->read_size == LFS_READ_SIZE);
+#endif
+#ifdef LFS_PROG_SIZE
+    LFS_ASSERT(lfs->cfg->prog_size == LFS_PROG_SIZE);
+#endif
+#ifdef LFS_BLOCK_SIZE
+    LFS_ASSERT(lfs->cfg->block_size == LFS_BLOCK_SIZE);
+#endif
+#ifdef LFS_CACHE_SIZE
+    LFS_ASSERT(lfs->cfg->cache_size == LFS_CACHE_SIZE);
+#endif
+
     // validate that the lfs-cfg sizes were initiated properly before
     // performing any arithmetic logics with them
-    LFS_ASSERT(lfs->cfg->read_size != 0);
-    LFS_ASSERT(lfs->cfg->prog_size != 0);
-    LFS_ASSERT(lfs->cfg->cache_size != 0);
+    LFS_ASSERT(LFS_CFG_READ_SIZE(lfs) != 0);
+    LFS_ASSERT(LFS_CFG_PROG_SIZE(lfs) != 0);
+    LFS_ASSERT(LFS_CFG_CACHE_SIZE(lfs) != 0);
 
     // check that block size is a multiple of cache size is a multiple
     // of prog and read sizes
-    LFS_ASSERT(lfs->cfg->cache_size % lfs->cfg->read_size == 0);
-    LFS_ASSERT(lfs->cfg->cache_size % lfs->cfg->prog_size == 0);
-    LFS_ASSERT(lfs->cfg->block_size % lfs->cfg->cache_size == 0);
+    LFS_ASSERT(LFS_CFG_CACHE_SIZE(lfs) % LFS_CFG_READ_SIZE(lfs) == 0);
+    LFS_ASSERT(LFS_CFG_CACHE_SIZE(lfs) % LFS_CFG_PROG_SIZE(lfs) == 0);
+    LFS_ASSERT(LFS_CFG_BLOCK_SIZE(lfs) % LFS_CFG_CACHE_SIZE(lfs) == 0);
+
+    // check that multi-block reads are a multiple of read size
+    LFS_ASSERT(lfs->cfg->read_span_max % LFS_CFG_READ_SIZE(lfs) == 0);
+
+    // check that fetch size is a multiple of read size and a factor of
+    // cache size
+    LFS_ASSERT(lfs->cfg->fetch_size % LFS_CFG_READ_SIZE(lfs) == 0);
+    LFS_ASSERT(!lfs->cfg->fetch_size
+            || LFS_CFG_CACHE_SIZE(lfs) % lfs->cfg->fetch_size == 0);
 
     // check that the block size is large enough to fit all ctz pointers
-    LFS_ASSERT(lfs->cfg->block_size >= 128);
+    LFS_ASSERT(LFS_CFG_BLOCK_SIZE(lfs) >= 128);
     // this is the exact calculation for all ctz pointers, if this fails
     // and the simpler assert above does not, math must be broken
-    LFS_ASSERT(4*lfs_npw2(0xffffffff / (lfs->cfg->block_size-2*4))
-            <= lfs->cfg->block_size);
+    LFS_ASSERT(4*lfs_npw2(0xffffffff / (LFS_CFG_BLOCK_SIZE(lfs)-2*4))
+            <= LFS_CFG_BLOCK_SIZE(lfs));
 
     // block_cycles = 0 is no longer supported.
     //
@@ -4205,15 +6852,38 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
     // metadata can't be compacted below block_size/2, and metadata can't
     // exceed a block_size
     LFS_ASSERT(lfs->cfg->compact_thresh == 0
-            || lfs->cfg->compact_thresh >= lfs->cfg->block_size/2);
+            || lfs->cfg->compact_thresh >= LFS_CFG_BLOCK_SIZE(lfs)/2);
     LFS_ASSERT(lfs->cfg->compact_thresh == (lfs_size_t)-1
-            || lfs->cfg->compact_thresh <= lfs->cfg->block_size);
+            || lfs->cfg->compact_thresh <= LFS_CFG_BLOCK_SIZE(lfs));
+
+    // setup buffer pool, this comes first so the other buffers can use it
+    lfs->pool = (struct lfs_pool){0};
+    if (lfs->cfg->cache_pool_count) {
+        LFS_ASSERT(LFS_CFG_CACHE_SIZE(lfs) >= sizeof(void*));
+        uint8_t *buffer = lfs->cfg->cache_pool_buffer;
+        if (!buffer) {
+            buffer = lfs_buffer_alloc(lfs,
+                    lfs->cfg->cache_pool_count*LFS_CFG_CACHE_SIZE(lfs));
+            if (!buffer) {
+                err = LFS_ERR_NOMEM;
+                goto cleanup;
+            }
+        }
+
+        // thread the free list through the buffers, lowest address first
+        lfs->pool.buffer = buffer;
+        for (lfs_size_t i = lfs->cfg->cache_pool_count; i > 0; i--) {
+            uint8_t *b = &buffer[(i-1)*LFS_CFG_CACHE_SIZE(lfs)];
+            memcpy(b, &lfs->pool.free, sizeof(void*));
+            lfs->pool.free = b;
+        }
+    }
 
     // setup read cache
     if (lfs->cfg->read_buffer) {
         lfs->rcache.buffer = lfs->cfg->read_buffer;
     } else {
-        lfs->rcache.buffer = lfs_malloc(lfs->cfg->cache_size);
+        lfs->rcache.buffer = lfs_buffer_alloc(lfs, LFS_CFG_CACHE_SIZE(lfs));
         if (!lfs->rcache.buffer) {
             err = LFS_ERR_NOMEM;
             goto cleanup;
@@ -4224,30 +6894,62 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
     if (lfs->cfg->prog_buffer) {
         lfs->pcache.buffer = lfs->cfg->prog_buffer;
     } else {
-        lfs->pcache.buffer = lfs_malloc(lfs->cfg->cache_size);
+        lfs->pcache.buffer = lfs_buffer_alloc(lfs, LFS_CFG_CACHE_SIZE(lfs));
         if (!lfs->pcache.buffer) {
             err = LFS_ERR_NOMEM;
             goto cleanup;
         }
     }
 
+#ifdef LFS_THREADSAFE
+    // setup reader caches for shared locking
+    if (lfs->cfg->lock_shared) {
+        LFS_ASSERT(lfs->cfg->unlock_shared);
+        LFS_ASSERT(lfs->cfg->shared_max > 0);
+        if (lfs->cfg->shared_buffer) {
+            lfs->shared_buffer = lfs->cfg->shared_buffer;
+        } else {
+            lfs->shared_buffer = lfs_buffer_alloc(lfs,
+                    lfs->cfg->shared_max*LFS_CFG_CACHE_SIZE(lfs));
+            if (!lfs->shared_buffer) {
+                err = LFS_ERR_NOMEM;
+                goto cleanup;
+            }
+        }
+    }
+#endif
+
     // zero to avoid information leaks
     lfs_cache_zero(lfs, &lfs->rcache);
     lfs_cache_zero(lfs, &lfs->pcache);
 
     // setup lookahead buffer, note mount finishes initializing this after
     // we establish a decent pseudo-random seed
+    //
+    // the metadata zone's window is carved out of the front of the
+    // lookahead buffer and always covers the whole zone, the superblock
+    // pair {0, 1} must fit in the zone
     LFS_ASSERT(lfs->cfg->lookahead_size > 0);
     if (lfs->cfg->lookahead_buffer) {
-        lfs->lookahead.buffer = lfs->cfg->lookahead_buffer;
+        lfs->mlookahead.buffer = lfs->cfg->lookahead_buffer;
     } else {
-        lfs->lookahead.buffer = lfs_malloc(lfs->cfg->lookahead_size);
-        if (!lfs->lookahead.buffer) {
+        lfs->mlookahead.buffer = lfs_buffer_alloc(lfs,
+                lfs->cfg->lookahead_size);
+        if (!lfs->mlookahead.buffer) {
             err = LFS_ERR_NOMEM;
             goto cleanup;
         }
     }
 
+    LFS_ASSERT(lfs->cfg->metadata_zone == 0
+            || lfs->cfg->metadata_zone >= 2);
+    lfs->mlookahead.buffer_size = (lfs->cfg->metadata_zone+7) / 8;
+    LFS_ASSERT(lfs->mlookahead.buffer_size < lfs->cfg->lookahead_size);
+    lfs->lookahead.buffer = lfs->mlookahead.buffer
+            + lfs->mlookahead.buffer_size;
+    lfs->lookahead.buffer_size = lfs->cfg->lookahead_size
+            - lfs->mlookahead.buffer_size;
+
     // check that the size limits are sane
     LFS_ASSERT(lfs->cfg->name_max <= LFS_NAME_MAX);
     lfs->name_max = lfs->cfg->name_max;
@@ -4267,29 +6969,36 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
         lfs->attr_max = LFS_ATTR_MAX;
     }
 
-    LFS_ASSERT(lfs->cfg->metadata_max <= lfs->cfg->block_size);
+    LFS_ASSERT(lfs->cfg->metadata_max <= LFS_CFG_BLOCK_SIZE(lfs));
 
     LFS_ASSERT(lfs->cfg->inline_max == (lfs_size_t)-1
-            || lfs->cfg->inline_max <= lfs->cfg->cache_size);
+            || lfs->cfg->inline_max <= LFS_CFG_CACHE_SIZE(lfs));
     LFS_ASSERT(lfs->cfg->inline_max == (lfs_size_t)-1
             || lfs->cfg->inline_max <= lfs->attr_max);
     LFS_ASSERT(lfs->cfg->inline_max == (lfs_size_t)-1
             || lfs->cfg->inline_max <= ((lfs->cfg->metadata_max)
                 ? lfs->cfg->metadata_max
-                : lfs->cfg->block_size)/8);
+                : LFS_CFG_BLOCK_SIZE(lfs))/8);
     lfs->inline_max = lfs->cfg->inline_max;
     if (lfs->inline_max == (lfs_size_t)-1) {
         lfs->inline_max = 0;
     } else if (lfs->inline_max == 0) {
         lfs->inline_max = lfs_min(
-                lfs->cfg->cache_size,
+                LFS_CFG_CACHE_SIZE(lfs),
                 lfs_min(
                     lfs->attr_max,
                     ((lfs->cfg->metadata_max)
                         ? lfs->cfg->metadata_max
-                        : lfs->cfg->block_size)/8));
+                        : LFS_CFG_BLOCK_SIZE(lfs))/8));
     }
 
+    LFS_ASSERT(lfs->cfg->inline_adapt_max <= LFS_CFG_CACHE_SIZE(lfs));
+    LFS_ASSERT(lfs->cfg->inline_adapt_max <= lfs->attr_max);
+    LFS_ASSERT(lfs->cfg->pack_max <= LFS_CFG_CACHE_SIZE(lfs));
+    // packed files need disk version 2.2
+    LFS_ASSERT(!lfs->cfg->pack_max
+            || lfs_fs_disk_version(lfs) >= 0x00020002);
+
     // setup default state
     lfs->root[0] = LFS_BLOCK_NULL;
     lfs->root[1] = LFS_BLOCK_NULL;
@@ -4298,6 +7007,10 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
     lfs->gdisk = (lfs_gstate_t){0};
     lfs->gstate = (lfs_gstate_t){0};
     lfs->gdelta = (lfs_gstate_t){0};
+    lfs->packer.block = LFS_BLOCK_NULL;
+    lfs->packer.off = 0;
+    lfs->packer.gc = 0;
+    lfs->snapshots = NULL;
 #ifdef LFS_MIGRATE
     lfs->lfs1 = NULL;
 #endif
@@ -4312,15 +7025,31 @@ cleanup:
 static int lfs_deinit(lfs_t *lfs) {
     // free allocated memory
     if (!lfs->cfg->read_buffer) {
-        lfs_free(lfs->rcache.buffer);
+        lfs_buffer_free(lfs, lfs->rcache.buffer, LFS_CFG_CACHE_SIZE(lfs));
     }
 
     if (!lfs->cfg->prog_buffer) {
-        lfs_free(lfs->pcache.buffer);
+        lfs_buffer_free(lfs, lfs->pcache.buffer, LFS_CFG_CACHE_SIZE(lfs));
     }
 
     if (!lfs->cfg->lookahead_buffer) {
-        lfs_free(lfs->lookahead.buffer);
+        lfs_buffer_free(lfs, lfs->mlookahead.buffer,
+                lfs->cfg->lookahead_size);
+    }
+
+#ifdef LFS_THREADSAFE
+    if (lfs->cfg->lock_shared && !lfs->cfg->shared_buffer) {
+        lfs_buffer_free(lfs, lfs->shared_buffer,
+                lfs->cfg->shared_max*LFS_CFG_CACHE_SIZE(lfs));
+    }
+#endif
+
+    // the pool goes last, after everything has been returned to it
+    if (lfs->cfg->cache_pool_count && !lfs->cfg->cache_pool_buffer) {
+        uint8_t *buffer = lfs->pool.buffer;
+        lfs->pool.buffer = NULL;
+        lfs_buffer_free(lfs, buffer,
+                lfs->cfg->cache_pool_count*LFS_CFG_CACHE_SIZE(lfs));
     }
 
     return 0;
@@ -4338,13 +7067,18 @@ static int lfs_format_(lfs_t *lfs, const struct lfs_config *cfg) {
         }
 
         LFS_ASSERT(cfg->block_count != 0);
+        LFS_ASSERT(lfs->cfg->metadata_zone < lfs->block_count);
 
         // create free lookahead
-        memset(lfs->lookahead.buffer, 0, lfs->cfg->lookahead_size);
+        memset(lfs->mlookahead.buffer, 0, lfs->cfg->lookahead_size);
         lfs->lookahead.start = 0;
-        lfs->lookahead.size = lfs_min(8*lfs->cfg->lookahead_size,
-                lfs->block_count);
+        lfs->lookahead.size = lfs_min(8*lfs->lookahead.buffer_size,
+                lfs_alloc_count(lfs, &lfs->lookahead));
         lfs->lookahead.next = 0;
+        lfs->mlookahead.start = 0;
+        lfs->mlookahead.size = lfs_min(8*lfs->mlookahead.buffer_size,
+                lfs_alloc_count(lfs, &lfs->mlookahead));
+        lfs->mlookahead.next = 0;
         lfs_alloc_ckpoint(lfs);
 
         // create root dir
@@ -4355,9 +7089,10 @@ static int lfs_format_(lfs_t *lfs, const struct lfs_config *cfg) {
         }
 
         // write one superblock
+        lfs->disk_version = lfs_fs_disk_version_base(lfs);
         lfs_superblock_t superblock = {
-            .version     = lfs_fs_disk_version(lfs),
-            .block_size  = lfs->cfg->block_size,
+            .version     = lfs->disk_version,
+            .block_size  = LFS_CFG_BLOCK_SIZE(lfs),
             .block_count = lfs->block_count,
             .name_max    = lfs->name_max,
             .file_max    = lfs->file_max,
@@ -4466,17 +7201,21 @@ static int lfs_mount_(lfs_t *lfs, const struct lfs_config *cfg) {
                 goto cleanup;
             }
 
-            // found older minor version? set an in-device only bit in the
-            // gstate so we know we need to rewrite the superblock before
-            // the first write
+            // found a minor version older than the base version? set an
+            // in-device only bit in the gstate so we know we need to rewrite
+            // the superblock before the first write, newer minor versions
+            // are only written when a struct that needs them is committed
             bool needssuperblock = false;
-            if (minor_version < lfs_fs_disk_version_minor(lfs)) {
+            uint32_t base_version = lfs_fs_disk_version_base(lfs);
+            lfs->disk_version = superblock.version;
+            if (superblock.version < base_version) {
                 LFS_DEBUG("Found older minor version "
                         "v%"PRIu16".%"PRIu16" < v%"PRIu16".%"PRIu16,
                         major_version,
                         minor_version,
-                        lfs_fs_disk_version_major(lfs),
-                        lfs_fs_disk_version_minor(lfs));
+                        (uint16_t)(0xffff & (base_version >> 16)),
+                        (uint16_t)(0xffff & (base_version >>  0)));
+                lfs->disk_version = base_version;
                 needssuperblock = true;
             }
             // note this bit is reserved on disk, so fetching more gstate
@@ -4531,9 +7270,9 @@ static int lfs_mount_(lfs_t *lfs, const struct lfs_config *cfg) {
 
             lfs->block_count = superblock.block_count;
 
-            if (superblock.block_size != lfs->cfg->block_size) {
+            if (superblock.block_size != LFS_CFG_BLOCK_SIZE(lfs)) {
                 LFS_ERROR("Invalid block size (%"PRIu32" != %"PRIu32")",
-                        superblock.block_size, lfs->cfg->block_size);
+                        superblock.block_size, LFS_CFG_BLOCK_SIZE(lfs));
                 err = LFS_ERR_INVAL;
                 goto cleanup;
             }
@@ -4558,7 +7297,13 @@ static int lfs_mount_(lfs_t *lfs, const struct lfs_config *cfg) {
 
     // setup free lookahead, to distribute allocations uniformly across
     // boots, we start the allocator at a random location
-    lfs->lookahead.start = lfs->seed % lfs->block_count;
+    LFS_ASSERT(lfs->cfg->metadata_zone < lfs->block_count);
+    lfs->lookahead.start = lfs->seed
+            % lfs_alloc_count(lfs, &lfs->lookahead);
+    if (lfs->cfg->metadata_zone) {
+        lfs->mlookahead.start = lfs->seed
+                % lfs_alloc_count(lfs, &lfs->mlookahead);
+    }
     lfs_alloc_drop(lfs);
 
     return 0;
@@ -4569,16 +7314,17 @@ cleanup:
 }
 
 static int lfs_unmount_(lfs_t *lfs) {
+    // snapshots must be released first, their pins would be lost
+    LFS_ASSERT(!lfs->snapshots);
     return lfs_deinit(lfs);
 }
 
 
 /// Filesystem filesystem operations ///
 static int lfs_fs_stat_(lfs_t *lfs, struct lfs_fsinfo *fsinfo) {
-    // if the superblock is up-to-date, we must be on the most recent
-    // minor version of littlefs
+    // if the superblock is up-to-date, it holds the version we track
     if (!lfs_gstate_needssuperblock(&lfs->gstate)) {
-        fsinfo->disk_version = lfs_fs_disk_version(lfs);
+        fsinfo->disk_version = lfs->disk_version;
 
     // otherwise we need to read the minor version on disk
     } else {
@@ -4603,7 +7349,7 @@ static int lfs_fs_stat_(lfs_t *lfs, struct lfs_fsinfo *fsinfo) {
     }
 
     // filesystem geometry
-    fsinfo->block_size = lfs->cfg->block_size;
+    fsinfo->block_size = LFS_CFG_BLOCK_SIZE(lfs);
     fsinfo->block_count = lfs->block_count;
 
     // other on-disk configuration, we cache all of these for internal use
@@ -4614,7 +7360,8 @@ static int lfs_fs_stat_(lfs_t *lfs, struct lfs_fsinfo *fsinfo) {
     return 0;
 }
 
-int lfs_fs_traverse_(lfs_t *lfs,
+// traverse the blocks of the filesystem as it is on disk
+static int lfs_fs_traversedisk(lfs_t *lfs,
         int (*cb)(void *data, lfs_block_t block), void *data,
         bool includeorphans) {
     // iterate over metadata pairs
@@ -4663,6 +7410,9 @@ int lfs_fs_traverse_(lfs_t *lfs,
             return err;
         }
 
+        // files packed together tend to be next to each other, so only
+        // report a pack block when it changes
+        lfs_block_t pblock = LFS_BLOCK_NULL;
         for (uint16_t id = 0; id < dir.count; id++) {
             struct lfs_ctz ctz;
             lfs_stag_t tag = lfs_dir_get(lfs, &dir, LFS_MKTAG(0x700, 0x3ff, 0),
@@ -4675,12 +7425,23 @@ int lfs_fs_traverse_(lfs_t *lfs,
             }
             lfs_ctz_fromle32(&ctz);
 
-            if (lfs_tag_type3(tag) == LFS_TYPE_CTZSTRUCT) {
+            // sparse structs start with a ctz reference
+            if (lfs_tag_type3(tag) == LFS_TYPE_CTZSTRUCT
+                    || lfs_tag_type3(tag) == LFS_TYPE_SPARSESTRUCT) {
                 err = lfs_ctz_traverse(lfs, NULL, &lfs->rcache,
                         ctz.head, ctz.size, cb, data);
                 if (err) {
                     return err;
                 }
+            } else if (lfs_tag_type3(tag) == LFS_TYPE_PACKSTRUCT) {
+                // the pack struct starts with its block
+                if (ctz.head != pblock) {
+                    pblock = ctz.head;
+                    err = cb(data, pblock);
+                    if (err) {
+                        return err;
+                    }
+                }
             } else if (includeorphans &&
                     lfs_tag_type3(tag) == LFS_TYPE_DIRSTRUCT) {
                 for (int i = 0; i < 2; i++) {
@@ -4693,6 +7454,17 @@ int lfs_fs_traverse_(lfs_t *lfs,
         }
     }
 
+    return 0;
+}
+
+int lfs_fs_traverse_(lfs_t *lfs,
+        int (*cb)(void *data, lfs_block_t block), void *data,
+        bool includeorphans) {
+    int err = lfs_fs_traversedisk(lfs, cb, data, includeorphans);
+    if (err) {
+        return err;
+    }
+
 #ifndef LFS_READONLY
     // iterate over any open files
     for (lfs_file_t *f = (lfs_file_t*)lfs->mlist; f; f = f->next) {
@@ -4701,7 +7473,7 @@ int lfs_fs_traverse_(lfs_t *lfs,
         }
 
         if ((f->flags & LFS_F_DIRTY) && !(f->flags & LFS_F_INLINE)) {
-            int err = lfs_ctz_traverse(lfs, &f->cache, &lfs->rcache,
+            err = lfs_ctz_traverse(lfs, &f->cache, &lfs->rcache,
                     f->ctz.head, f->ctz.size, cb, data);
             if (err) {
                 return err;
@@ -4709,12 +7481,37 @@ int lfs_fs_traverse_(lfs_t *lfs,
         }
 
         if ((f->flags & LFS_F_WRITING) && !(f->flags & LFS_F_INLINE)) {
-            int err = lfs_ctz_traverse(lfs, &f->cache, &lfs->rcache,
+            err = lfs_ctz_traverse(lfs, &f->cache, &lfs->rcache,
                     f->block, f->pos, cb, data);
             if (err) {
                 return err;
             }
         }
+
+        if (f->flags & LFS_F_PACKED) {
+            err = cb(data, f->pack.block);
+            if (err) {
+                return err;
+            }
+        }
+
+        // blocks reserved for the file but not yet written
+        for (lfs_size_t i = 0; i < f->extent.count; i++) {
+            for (lfs_block_t j = 0; j < f->extent.runs[i].count; j++) {
+                err = cb(data, f->extent.runs[i].block + j);
+                if (err) {
+                    return err;
+                }
+            }
+        }
+    }
+
+    // the pack block we're filling may not be referenced yet
+    if (lfs->packer.block != LFS_BLOCK_NULL) {
+        err = cb(data, lfs->packer.block);
+        if (err) {
+            return err;
+        }
     }
 #endif
 
@@ -4775,7 +7572,7 @@ static int lfs_fs_parent_match(void *data,
 
     lfs_block_t child[2];
     int err = lfs_bd_read(lfs,
-            &lfs->pcache, &lfs->rcache, lfs->cfg->block_size,
+            &lfs->pcache, &lfs->rcache, LFS_CFG_BLOCK_SIZE(lfs),
             disk->block, disk->off, &child, sizeof(child));
     if (err) {
         return err;
@@ -4869,8 +7666,8 @@ static int lfs_fs_desuperblock(lfs_t *lfs) {
 
     // write a new superblock
     lfs_superblock_t superblock = {
-        .version     = lfs_fs_disk_version(lfs),
-        .block_size  = lfs->cfg->block_size,
+        .version     = lfs->disk_version,
+        .block_size  = LFS_CFG_BLOCK_SIZE(lfs),
         .block_count = lfs->block_count,
         .name_max    = lfs->name_max,
         .file_max    = lfs->file_max,
@@ -4890,6 +7687,27 @@ static int lfs_fs_desuperblock(lfs_t *lfs) {
 }
 #endif
 
+#ifndef LFS_READONLY
+// mark the filesystem as at least version before committing a struct that
+// older drivers can't read, they would allocate over its blocks
+static int lfs_fs_upgrade(lfs_t *lfs, uint32_t version) {
+    if (lfs->disk_version >= version) {
+        return 0;
+    }
+
+    LFS_ASSERT(version <= lfs_fs_disk_version(lfs));
+    LFS_DEBUG("Upgrading disk version "
+            "v%"PRIu16".%"PRIu16" -> v%"PRIu16".%"PRIu16,
+            (uint16_t)(0xffff & (lfs->disk_version >> 16)),
+            (uint16_t)(0xffff & (lfs->disk_version >>  0)),
+            (uint16_t)(0xffff & (version >> 16)),
+            (uint16_t)(0xffff & (version >>  0)));
+    lfs->disk_version = version;
+    lfs_fs_prepsuperblock(lfs, true);
+    return lfs_fs_desuperblock(lfs);
+}
+#endif
+
 #ifndef LFS_READONLY
 static int lfs_fs_demove(lfs_t *lfs) {
     if (!lfs_gstate_hasmove(&lfs->gdisk)) {
@@ -4940,6 +7758,9 @@ static int lfs_fs_deorphan(lfs_t *lfs, bool powerloss) {
     // references to full-orphans, effectively hiding them from the deorphan
     // search.
     //
+    // Fixing either frees blocks of metadata pairs.
+    //
+    lfs_alloc_metafree(lfs);
     int pass = 0;
     while (pass < 2) {
         // Fix any orphans
@@ -5074,56 +7895,265 @@ static int lfs_fs_forceconsistency(lfs_t *lfs) {
         return err;
     }
 
-    return 0;
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_fs_mkconsistent_(lfs_t *lfs) {
+    // lfs_fs_forceconsistency does most of the work here
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    // do we have any pending gstate?
+    lfs_gstate_t delta = {0};
+    lfs_gstate_xor(&delta, &lfs->gdisk);
+    lfs_gstate_xor(&delta, &lfs->gstate);
+    if (!lfs_gstate_iszero(&delta)) {
+        // lfs_dir_commit will implicitly write out any pending gstate
+        lfs_mdir_t root;
+        err = lfs_dir_fetch(lfs, &root, lfs->root);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_dir_commit(lfs, &root, NULL, 0);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+static int lfs_fs_size_count(void *p, lfs_block_t block) {
+    (void)block;
+    lfs_size_t *size = p;
+    *size += 1;
+    return 0;
+}
+
+static int lfs_fs_allocstat_(lfs_t *lfs, struct lfs_allocstat *stat) {
+    stat->pool_count = lfs->cfg->cache_pool_count;
+    stat->pool_used = lfs->pool.used;
+    stat->pool_peak = lfs->pool.peak;
+    stat->heap_used = lfs->pool.heap_used;
+    stat->heap_peak = lfs->pool.heap_peak;
+    stat->allocs = lfs->pool.allocs;
+    stat->heap_allocs = lfs->pool.heap_allocs;
+    stat->file_caches = lfs->pool.file_caches;
+    stat->file_evictions = lfs->pool.file_evictions;
+    return 0;
+}
+
+static lfs_ssize_t lfs_fs_size_(lfs_t *lfs) {
+    lfs_size_t size = 0;
+    int err = lfs_fs_traverse_(lfs, lfs_fs_size_count, &size, false);
+    if (err) {
+        return err;
+    }
+
+    return size;
+}
+
+#ifndef LFS_READONLY
+// number of pack blocks considered by each repacking pass if we can't get
+// a buffer for a bigger window
+#define LFS_PACK_GC_COUNT 16
+
+struct lfs_fs_repack {
+    lfs_t *lfs;
+    lfs_size_t count;
+    lfs_size_t size;
+    struct lfs_packslot {
+        lfs_block_t block;
+        lfs_size_t live;
+    } *window;
+};
+
+// iterate over all packed files in the filesystem, cb may commit to dir
+static int lfs_fs_packtraverse(lfs_t *lfs,
+        int (*cb)(void *data, lfs_mdir_t *dir, uint16_t id,
+            const struct lfs_pack *pack),
+        void *data) {
+    lfs_mdir_t dir = {.tail = {0, 1}};
+    while (!lfs_pair_isnull(dir.tail)) {
+        int err = lfs_dir_fetch(lfs, &dir, dir.tail);
+        if (err) {
+            return err;
+        }
+
+        for (uint16_t id = 0; id < dir.count; id++) {
+            struct lfs_pack pack;
+            lfs_stag_t tag = lfs_dir_get(lfs, &dir, LFS_MKTAG(0x700, 0x3ff, 0),
+                    LFS_MKTAG(LFS_TYPE_STRUCT, id, sizeof(pack)), &pack);
+            if (tag < 0) {
+                if (tag == LFS_ERR_NOENT) {
+                    continue;
+                }
+                return tag;
+            }
+
+            if (lfs_tag_type3(tag) != LFS_TYPE_PACKSTRUCT) {
+                continue;
+            }
+            lfs_pack_fromle32(&pack);
+
+            err = cb(data, &dir, id, &pack);
+            if (err) {
+                return err;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// how far a block is after the repacking cursor
+static inline lfs_block_t lfs_fs_repackdist(lfs_t *lfs, lfs_block_t block) {
+    return (block + lfs->block_count - lfs->packer.gc) % lfs->block_count;
+}
+
+// tally the live bytes in the pack blocks nearest after the cursor, once
+// the window is full nearer blocks push out the farthest, which can't come
+// back since the farthest distance only shrinks
+static int lfs_fs_repacktally(void *data, lfs_mdir_t *dir, uint16_t id,
+        const struct lfs_pack *pack) {
+    (void)dir;
+    (void)id;
+    struct lfs_fs_repack *repack = data;
+    lfs_t *lfs = repack->lfs;
+    lfs_size_t live = lfs_alignup(pack->size, LFS_CFG_PROG_SIZE(lfs));
+
+    lfs_size_t far = 0;
+    for (lfs_size_t i = 0; i < repack->count; i++) {
+        if (repack->window[i].block == pack->block) {
+            repack->window[i].live += live;
+            return 0;
+        }
+
+        if (lfs_fs_repackdist(lfs, repack->window[i].block)
+                > lfs_fs_repackdist(lfs, repack->window[far].block)) {
+            far = i;
+        }
+    }
+
+    if (repack->count < repack->size) {
+        far = repack->count;
+        repack->count += 1;
+    } else if (lfs_fs_repackdist(lfs, pack->block)
+            > lfs_fs_repackdist(lfs, repack->window[far].block)) {
+        return 0;
+    }
+
+    repack->window[far].block = pack->block;
+    repack->window[far].live = live;
+    return 0;
+}
+
+// move a packed file out of a sparse pack block
+static int lfs_fs_repackmove(void *data, lfs_mdir_t *dir, uint16_t id,
+        const struct lfs_pack *pack) {
+    struct lfs_fs_repack *repack = data;
+    lfs_t *lfs = repack->lfs;
+
+    bool sparse = false;
+    for (lfs_size_t i = 0; i < repack->count; i++) {
+        if (repack->window[i].block == pack->block) {
+            sparse = true;
+            break;
+        }
+    }
+
+    if (!sparse) {
+        return 0;
+    }
+
+    struct lfs_pack npack = *pack;
+    int err = lfs_pack_append(lfs, &npack, NULL);
+    if (err) {
+        return err;
+    }
+
+    // open files still reading the old copy should follow it
+    for (lfs_file_t *f = (lfs_file_t*)lfs->mlist; f; f = f->next) {
+        if (f->type == LFS_TYPE_REG && (f->flags & LFS_F_PACKED)
+                && f->id == id && lfs_pair_cmp(f->m.pair, dir->pair) == 0
+                && f->pack.block == pack->block && f->pack.off == pack->off) {
+            f->pack = npack;
+        }
+    }
+
+    lfs_pack_tole32(&npack);
+    return lfs_dir_commit(lfs, dir, LFS_MKATTRS(
+            {LFS_MKTAG(LFS_TYPE_PACKSTRUCT, id, sizeof(npack)), &npack}));
 }
-#endif
 
-#ifndef LFS_READONLY
-static int lfs_fs_mkconsistent_(lfs_t *lfs) {
-    // lfs_fs_forceconsistency does most of the work here
-    int err = lfs_fs_forceconsistency(lfs);
+// one repacking pass, tally a window of pack blocks and empty the sparse ones
+static int lfs_fs_repackpass(lfs_t *lfs, struct lfs_fs_repack *repack) {
+    int err = lfs_fs_packtraverse(lfs, lfs_fs_repacktally, repack);
     if (err) {
         return err;
     }
 
-    // do we have any pending gstate?
-    lfs_gstate_t delta = {0};
-    lfs_gstate_xor(&delta, &lfs->gdisk);
-    lfs_gstate_xor(&delta, &lfs->gstate);
-    if (!lfs_gstate_iszero(&delta)) {
-        // lfs_dir_commit will implicitly write out any pending gstate
-        lfs_mdir_t root;
-        err = lfs_dir_fetch(lfs, &root, lfs->root);
-        if (err) {
-            return err;
+    // next pass starts after the blocks we've seen, if the window isn't
+    // full we've seen them all and start over from the same place
+    if (repack->count == repack->size) {
+        lfs_block_t far = 0;
+        for (lfs_size_t i = 0; i < repack->count; i++) {
+            far = lfs_max(far,
+                    lfs_fs_repackdist(lfs, repack->window[i].block));
         }
+        lfs->packer.gc = (lfs->packer.gc + far + 1) % lfs->block_count;
+    }
 
-        err = lfs_dir_commit(lfs, &root, NULL, 0);
-        if (err) {
-            return err;
+    // keep only the sparse blocks, never the one we're filling
+    lfs_size_t thresh = (lfs->cfg->pack_compact_thresh)
+            ? lfs->cfg->pack_compact_thresh
+            : LFS_CFG_BLOCK_SIZE(lfs)/2;
+    lfs_size_t count = 0;
+    for (lfs_size_t i = 0; i < repack->count; i++) {
+        if (repack->window[i].live < thresh
+                && repack->window[i].block != lfs->packer.block) {
+            repack->window[count] = repack->window[i];
+            count += 1;
         }
     }
+    repack->count = count;
 
-    return 0;
-}
-#endif
+    if (repack->count == 0) {
+        return 0;
+    }
 
-static int lfs_fs_size_count(void *p, lfs_block_t block) {
-    (void)block;
-    lfs_size_t *size = p;
-    *size += 1;
-    return 0;
+    return lfs_fs_packtraverse(lfs, lfs_fs_repackmove, repack);
 }
 
-static lfs_ssize_t lfs_fs_size_(lfs_t *lfs) {
-    lfs_size_t size = 0;
-    int err = lfs_fs_traverse_(lfs, lfs_fs_size_count, &size, false);
-    if (err) {
-        return err;
+// repack files out of pack blocks with few live bytes left, each pass looks
+// at the next window of pack blocks so the RAM per pass is bounded
+static int lfs_fs_repack(lfs_t *lfs) {
+    struct lfs_packslot slots[LFS_PACK_GC_COUNT];
+    struct lfs_fs_repack repack = {
+        .lfs = lfs,
+        .count = 0,
+        .size = LFS_PACK_GC_COUNT,
+        .window = slots,
+    };
+
+    // a cache_size buffer gives us a much bigger window
+    void *buffer = lfs_buffer_alloc(lfs, LFS_CFG_CACHE_SIZE(lfs));
+    if (buffer) {
+        repack.window = buffer;
+        repack.size = LFS_CFG_CACHE_SIZE(lfs) / sizeof(struct lfs_packslot);
     }
 
-    return size;
+    int err = lfs_fs_repackpass(lfs, &repack);
+    lfs_buffer_free(lfs, buffer, LFS_CFG_CACHE_SIZE(lfs));
+    return err;
 }
+#endif
 
 // explicit garbage collection
 #ifndef LFS_READONLY
@@ -5140,7 +8170,7 @@ static int lfs_fs_gc_(lfs_t *lfs) {
     // anything if compact_thresh doesn't at least leave a prog_size
     // available
     if (lfs->cfg->compact_thresh
-            < lfs->cfg->block_size - lfs->cfg->prog_size) {
+            < LFS_CFG_BLOCK_SIZE(lfs) - LFS_CFG_PROG_SIZE(lfs)) {
         // iterate over all mdirs
         lfs_mdir_t mdir = {.tail = {0, 1}};
         while (!lfs_pair_isnull(mdir.tail)) {
@@ -5151,7 +8181,7 @@ static int lfs_fs_gc_(lfs_t *lfs) {
 
             // not erased? exceeds our compaction threshold?
             if (!mdir.erased || ((lfs->cfg->compact_thresh == 0)
-                    ? mdir.off > lfs->cfg->block_size - lfs->cfg->block_size/8
+                    ? mdir.off > LFS_CFG_BLOCK_SIZE(lfs) - LFS_CFG_BLOCK_SIZE(lfs)/8
                     : mdir.off > lfs->cfg->compact_thresh)) {
                 // the easiest way to trigger a compaction is to mark
                 // the mdir as unerased and add an empty commit
@@ -5164,9 +8194,26 @@ static int lfs_fs_gc_(lfs_t *lfs) {
         }
     }
 
-    // try to populate the lookahead buffer, unless it's already full
-    if (lfs->lookahead.size < 8*lfs->cfg->lookahead_size) {
-        err = lfs_alloc_scan(lfs);
+    // try to repack sparse pack blocks
+    if (lfs->cfg->pack_max
+            && lfs->cfg->pack_compact_thresh != (lfs_size_t)-1) {
+        err = lfs_fs_repack(lfs);
+        if (err) {
+            return err;
+        }
+    }
+
+    // try to populate the lookahead buffers, unless they're already full
+    if (lfs->lookahead.size < 8*lfs->lookahead.buffer_size) {
+        err = lfs_alloc_scan(lfs, &lfs->lookahead);
+        if (err) {
+            return err;
+        }
+    }
+
+    if (lfs->cfg->metadata_zone
+            && lfs->mlookahead.size < 8*lfs->mlookahead.buffer_size) {
+        err = lfs_alloc_scan(lfs, &lfs->mlookahead);
         if (err) {
             return err;
         }
@@ -5215,6 +8262,146 @@ static int lfs_fs_grow_(lfs_t *lfs, lfs_size_t block_count) {
 }
 #endif
 
+
+/// Snapshots ///
+#ifndef LFS_READONLY
+static int lfs_snapshot_pinblock(void *p, lfs_block_t block) {
+    lfs_snapshot_t *snap = p;
+    // the superblock pair is copied instead, it needs to stay writable
+    if (block < 2 || block >= snap->block_count) {
+        return 0;
+    }
+
+    if (!(snap->pins[block / 8] & (1U << (block % 8)))) {
+        snap->pins[block / 8] |= 1U << (block % 8);
+        snap->count += 1;
+    }
+
+    return 0;
+}
+
+static int lfs_snapshot_create_(lfs_t *lfs, lfs_snapshot_t *snap,
+        const struct lfs_snapshot_config *cfg) {
+    // a snapshot of a consistent filesystem mounts without repairs
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    snap->cfg = cfg;
+    snap->block_count = lfs->block_count;
+    snap->count = 1;
+
+    // allocate buffer?
+    if (snap->cfg && snap->cfg->buffer) {
+        snap->buffer = snap->cfg->buffer;
+    } else {
+        snap->buffer = lfs_malloc(LFS_SNAPSHOT_BUFFER_SIZE(
+                LFS_CFG_BLOCK_SIZE(lfs), lfs->block_count));
+        if (!snap->buffer) {
+            return LFS_ERR_NOMEM;
+        }
+    }
+    snap->pins = snap->buffer + LFS_CFG_BLOCK_SIZE(lfs);
+    memset(snap->pins, 0, (lfs->block_count+7)/8);
+
+    // copy the superblock's metadata block up to its last commit
+    lfs_mdir_t root;
+    err = lfs_dir_fetch(lfs, &root, (const lfs_block_t[2]){0, 1});
+    if (err) {
+        goto cleanup;
+    }
+
+    snap->root = root.pair[0];
+    snap->root_size = root.off;
+    err = lfs_bd_read(lfs,
+            NULL, &lfs->rcache, root.off,
+            root.pair[0], 0, snap->buffer, root.off);
+    if (err) {
+        goto cleanup;
+    }
+
+    // hold every other block the metadata on disk refers to, unsynced
+    // writes of open files aren't part of the snapshot
+    err = lfs_fs_traversedisk(lfs, lfs_snapshot_pinblock, snap, false);
+    if (err) {
+        goto cleanup;
+    }
+
+    snap->next = lfs->snapshots;
+    lfs->snapshots = snap;
+
+    // the lookahead windows were scanned without the snapshot, anything in
+    // them that was in use still is, but mark the held blocks anyways
+    lfs_alloc_pin(lfs, &lfs->lookahead);
+    lfs_alloc_pin(lfs, &lfs->mlookahead);
+    return 0;
+
+cleanup:
+    if (!(snap->cfg && snap->cfg->buffer)) {
+        lfs_free(snap->buffer);
+    }
+    return err;
+}
+
+static int lfs_snapshot_release_(lfs_t *lfs, lfs_snapshot_t *snap) {
+    for (lfs_snapshot_t **p = &lfs->snapshots; *p; p = &(*p)->next) {
+        if (*p == snap) {
+            *p = (*p)->next;
+            break;
+        }
+    }
+
+    // the blocks are picked up by the next lookahead scan
+    lfs_alloc_metafree(lfs);
+    if (!(snap->cfg && snap->cfg->buffer)) {
+        lfs_free(snap->buffer);
+    }
+
+    return 0;
+}
+
+static int lfs_snapshot_next_(lfs_t *lfs, lfs_snapshot_t *snap,
+        lfs_block_t *block) {
+    (void)lfs;
+    for (lfs_block_t b = *block; b < snap->block_count; b++) {
+        if (b == snap->root || (snap->pins[b / 8] & (1U << (b % 8)))) {
+            *block = b;
+            return 0;
+        }
+    }
+
+    return LFS_ERR_NOENT;
+}
+
+static int lfs_snapshot_read_(lfs_t *lfs, lfs_snapshot_t *snap,
+        lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size) {
+    if (off + size > LFS_CFG_BLOCK_SIZE(lfs)) {
+        return LFS_ERR_INVAL;
+    }
+
+    if (block == snap->root) {
+        uint8_t *data = buffer;
+        lfs_size_t diff = (off < snap->root_size)
+                ? lfs_min(size, snap->root_size - off)
+                : 0;
+        memcpy(data, &snap->buffer[off], diff);
+        memset(data + diff, 0xff, size - diff);
+        return 0;
+    }
+
+    if (block >= snap->block_count
+            || !(snap->pins[block / 8] & (1U << (block % 8)))) {
+        return LFS_ERR_INVAL;
+    }
+
+    // held blocks aren't written, except past the end of a pack block
+    return lfs_bd_read(lfs,
+            NULL, &lfs->rcache, size,
+            block, off, buffer, size);
+}
+#endif
+
 #ifdef LFS_MIGRATE
 ////// Migration from littelfs v1 below this //////
 
@@ -5389,7 +8576,7 @@ static int lfs1_dir_fetch(lfs_t *lfs,
         }
 
         if ((0x7fffffff & test.size) < sizeof(test)+4 ||
-            (0x7fffffff & test.size) > lfs->cfg->block_size) {
+            (0x7fffffff & test.size) > LFS_CFG_BLOCK_SIZE(lfs)) {
             continue;
         }
 
@@ -5585,6 +8772,9 @@ static int lfs1_mount(lfs_t *lfs, struct lfs1 *lfs1,
         lfs->lookahead.start = 0;
         lfs->lookahead.size = 0;
         lfs->lookahead.next = 0;
+        lfs->mlookahead.start = 0;
+        lfs->mlookahead.size = 0;
+        lfs->mlookahead.next = 0;
         lfs_alloc_ckpoint(lfs);
 
         // load superblock
@@ -5825,9 +9015,10 @@ static int lfs_migrate_(lfs_t *lfs, const struct lfs_config *cfg) {
         dir2.erased = false;
         dir2.split = true;
 
+        lfs->disk_version = lfs_fs_disk_version_base(lfs);
         lfs_superblock_t superblock = {
-            .version     = LFS_DISK_VERSION,
-            .block_size  = lfs->cfg->block_size,
+            .version     = lfs->disk_version,
+            .block_size  = LFS_CFG_BLOCK_SIZE(lfs),
             .block_count = lfs->cfg->block_count,
             .name_max    = lfs->name_max,
             .file_max    = lfs->file_max,
@@ -5879,6 +9070,85 @@ cleanup:
 #define LFS_UNLOCK(cfg) ((void)cfg)
 #endif
 
+// Read-only operations may run under a shared lock, this gives the
+// filesystem to run them against
+struct lfs_shared {
+    lfs_t *lfs;
+#ifdef LFS_THREADSAFE
+    lfs_t view;
+    int slot;
+#endif
+};
+
+#ifdef LFS_THREADSAFE
+// Under a shared lock the operation runs against a shallow copy of the
+// filesystem state with the slot's read cache swapped in. The read-only
+// paths don't write to lfs_t other than the read cache and the seed, so
+// this keeps readers from racing on either. The reader cache is dropped
+// on every lock since writers don't know about it.
+//
+// The copy lives in the caller's frame, so a shared operation costs
+// sizeof(lfs_t) more stack than an exclusive one, about 240 bytes on a
+// 32-bit MCU. This is bounded by the one struct lfs_shared per public
+// call, the internal functions only ever see a pointer to it.
+//
+// Falls back to the exclusive lock if shared locking isn't configured or
+// the operation may write.
+static int lfs_lock_shared(lfs_t *lfs, struct lfs_shared *shared,
+        bool exclusive) {
+    if (exclusive || !lfs->cfg->lock_shared) {
+        shared->lfs = lfs;
+        shared->slot = -1;
+        return LFS_LOCK(lfs->cfg);
+    }
+
+    int slot = lfs->cfg->lock_shared(lfs->cfg);
+    if (slot < 0) {
+        return slot;
+    }
+    LFS_ASSERT((lfs_size_t)slot < lfs->cfg->shared_max);
+
+    memcpy(&shared->view, lfs, sizeof(lfs_t));
+    shared->view.rcache.buffer = &lfs->shared_buffer[
+            slot*LFS_CFG_CACHE_SIZE(lfs)];
+    lfs_cache_drop(lfs, &shared->view.rcache);
+    shared->lfs = &shared->view;
+    shared->slot = slot;
+    return 0;
+}
+
+#ifndef LFS_NO_ASSERT
+// Checks the read-only paths kept to the read cache and the seed, the
+// rest of the view must still match the filesystem it was copied from
+static bool lfs_shared_isclean(const lfs_t *lfs, const lfs_t *view) {
+    const uint8_t *a = (const uint8_t*)lfs;
+    const uint8_t *b = (const uint8_t*)view;
+    lfs_size_t pcache = (const uint8_t*)&lfs->pcache - a;
+    lfs_size_t seed = (const uint8_t*)&lfs->seed - a;
+    lfs_size_t gstate = (const uint8_t*)&lfs->gstate - a;
+    return memcmp(&a[pcache], &b[pcache], seed - pcache) == 0
+            && memcmp(&a[gstate], &b[gstate], sizeof(lfs_t) - gstate) == 0;
+}
+#endif
+
+static void lfs_unlock_shared(lfs_t *lfs, struct lfs_shared *shared) {
+    if (shared->slot < 0) {
+        LFS_UNLOCK(lfs->cfg);
+    } else {
+        LFS_ASSERT(lfs_shared_isclean(lfs, &shared->view));
+        lfs->cfg->unlock_shared(lfs->cfg, shared->slot);
+    }
+}
+
+#define LFS_LOCK_SHARED(lfs, shared, exclusive) \
+    lfs_lock_shared(lfs, shared, exclusive)
+#define LFS_UNLOCK_SHARED(lfs, shared) lfs_unlock_shared(lfs, shared)
+#else
+#define LFS_LOCK_SHARED(lfs, shared, exclusive) \
+    ((void)(exclusive), (shared)->lfs = (lfs), 0)
+#define LFS_UNLOCK_SHARED(lfs, shared) ((void)(lfs), (void)(shared))
+#endif
+
 // Public API
 #ifndef LFS_READONLY
 int lfs_format(lfs_t *lfs, const struct lfs_config *cfg) {
@@ -5986,33 +9256,52 @@ int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
 }
 #endif
 
-int lfs_stat(lfs_t *lfs, const char *path, struct lfs_info *info) {
+#ifndef LFS_READONLY
+int lfs_file_clone(lfs_t *lfs, const char *oldpath, const char *newpath) {
     int err = LFS_LOCK(lfs->cfg);
     if (err) {
         return err;
     }
+    LFS_TRACE("lfs_file_clone(%p, \"%s\", \"%s\")",
+            (void*)lfs, oldpath, newpath);
+
+    err = lfs_file_clone_(lfs, oldpath, newpath);
+
+    LFS_TRACE("lfs_file_clone -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
+int lfs_stat(lfs_t *lfs, const char *path, struct lfs_info *info) {
+    struct lfs_shared shared;
+    int err = LFS_LOCK_SHARED(lfs, &shared, false);
+    if (err) {
+        return err;
+    }
     LFS_TRACE("lfs_stat(%p, \"%s\", %p)", (void*)lfs, path, (void*)info);
 
-    err = lfs_stat_(lfs, path, info);
+    err = lfs_stat_(shared.lfs, path, info);
 
     LFS_TRACE("lfs_stat -> %d", err);
-    LFS_UNLOCK(lfs->cfg);
+    LFS_UNLOCK_SHARED(lfs, &shared);
     return err;
 }
 
 lfs_ssize_t lfs_getattr(lfs_t *lfs, const char *path,
         uint8_t type, void *buffer, lfs_size_t size) {
-    int err = LFS_LOCK(lfs->cfg);
+    struct lfs_shared shared;
+    int err = LFS_LOCK_SHARED(lfs, &shared, false);
     if (err) {
         return err;
     }
     LFS_TRACE("lfs_getattr(%p, \"%s\", %"PRIu8", %p, %"PRIu32")",
             (void*)lfs, path, type, buffer, size);
 
-    lfs_ssize_t res = lfs_getattr_(lfs, path, type, buffer, size);
+    lfs_ssize_t res = lfs_getattr_(shared.lfs, path, type, buffer, size);
 
     LFS_TRACE("lfs_getattr -> %"PRId32, res);
-    LFS_UNLOCK(lfs->cfg);
+    LFS_UNLOCK_SHARED(lfs, &shared);
     return res;
 }
 
@@ -6122,7 +9411,15 @@ int lfs_file_sync(lfs_t *lfs, lfs_file_t *file) {
 
 lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
         void *buffer, lfs_size_t size) {
-    int err = LFS_LOCK(lfs->cfg);
+    // pending writes need to be flushed under the exclusive lock, as does
+    // taking a shared file cache
+    struct lfs_shared shared;
+#ifndef LFS_READONLY
+    int err = LFS_LOCK_SHARED(lfs, &shared, (file->flags & LFS_F_WRITING)
+            || lfs->cfg->file_cache_max);
+#else
+    int err = LFS_LOCK_SHARED(lfs, &shared, lfs->cfg->file_cache_max);
+#endif
     if (err) {
         return err;
     }
@@ -6130,10 +9427,10 @@ lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
             (void*)lfs, (void*)file, buffer, size);
     LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
 
-    lfs_ssize_t res = lfs_file_read_(lfs, file, buffer, size);
+    lfs_ssize_t res = lfs_file_read_(shared.lfs, file, buffer, size);
 
     LFS_TRACE("lfs_file_read -> %"PRId32, res);
-    LFS_UNLOCK(lfs->cfg);
+    LFS_UNLOCK_SHARED(lfs, &shared);
     return res;
 }
 
@@ -6191,18 +9488,37 @@ int lfs_file_truncate(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
 }
 #endif
 
-lfs_soff_t lfs_file_tell(lfs_t *lfs, lfs_file_t *file) {
+#ifndef LFS_READONLY
+int lfs_file_reserve(lfs_t *lfs, lfs_file_t *file, lfs_off_t size, int flags) {
     int err = LFS_LOCK(lfs->cfg);
     if (err) {
         return err;
     }
+    LFS_TRACE("lfs_file_reserve(%p, %p, %"PRIu32", %x)",
+            (void*)lfs, (void*)file, size, (unsigned)flags);
+    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+
+    err = lfs_file_reserve_(lfs, file, size, flags);
+
+    LFS_TRACE("lfs_file_reserve -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
+lfs_soff_t lfs_file_tell(lfs_t *lfs, lfs_file_t *file) {
+    struct lfs_shared shared;
+    int err = LFS_LOCK_SHARED(lfs, &shared, false);
+    if (err) {
+        return err;
+    }
     LFS_TRACE("lfs_file_tell(%p, %p)", (void*)lfs, (void*)file);
     LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
 
-    lfs_soff_t res = lfs_file_tell_(lfs, file);
+    lfs_soff_t res = lfs_file_tell_(shared.lfs, file);
 
     LFS_TRACE("lfs_file_tell -> %"PRId32, res);
-    LFS_UNLOCK(lfs->cfg);
+    LFS_UNLOCK_SHARED(lfs, &shared);
     return res;
 }
 
@@ -6221,16 +9537,32 @@ int lfs_file_rewind(lfs_t *lfs, lfs_file_t *file) {
 }
 
 lfs_soff_t lfs_file_size(lfs_t *lfs, lfs_file_t *file) {
-    int err = LFS_LOCK(lfs->cfg);
+    struct lfs_shared shared;
+    int err = LFS_LOCK_SHARED(lfs, &shared, false);
     if (err) {
         return err;
     }
     LFS_TRACE("lfs_file_size(%p, %p)", (void*)lfs, (void*)file);
     LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
 
-    lfs_soff_t res = lfs_file_size_(lfs, file);
+    lfs_soff_t res = lfs_file_size_(shared.lfs, file);
 
     LFS_TRACE("lfs_file_size -> %"PRId32, res);
+    LFS_UNLOCK_SHARED(lfs, &shared);
+    return res;
+}
+
+lfs_ssize_t lfs_file_extents(lfs_t *lfs, lfs_file_t *file) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_file_extents(%p, %p)", (void*)lfs, (void*)file);
+    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+
+    lfs_ssize_t res = lfs_file_extents_(lfs, file);
+
+    LFS_TRACE("lfs_file_extents -> %"PRId32, res);
     LFS_UNLOCK(lfs->cfg);
     return res;
 }
@@ -6281,20 +9613,40 @@ int lfs_dir_close(lfs_t *lfs, lfs_dir_t *dir) {
 }
 
 int lfs_dir_read(lfs_t *lfs, lfs_dir_t *dir, struct lfs_info *info) {
-    int err = LFS_LOCK(lfs->cfg);
+    struct lfs_shared shared;
+    int err = LFS_LOCK_SHARED(lfs, &shared, false);
     if (err) {
         return err;
     }
     LFS_TRACE("lfs_dir_read(%p, %p, %p)",
             (void*)lfs, (void*)dir, (void*)info);
 
-    err = lfs_dir_read_(lfs, dir, info);
+    err = lfs_dir_read_(shared.lfs, dir, info);
 
     LFS_TRACE("lfs_dir_read -> %d", err);
-    LFS_UNLOCK(lfs->cfg);
+    LFS_UNLOCK_SHARED(lfs, &shared);
     return err;
 }
 
+lfs_ssize_t lfs_dir_readbatch(lfs_t *lfs, lfs_dir_t *dir,
+        struct lfs_info *info, lfs_size_t count,
+        const struct lfs_dir_filter *filter) {
+    struct lfs_shared shared;
+    int err = LFS_LOCK_SHARED(lfs, &shared, false);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_dir_readbatch(%p, %p, %p, %"PRIu32", %p)",
+            (void*)lfs, (void*)dir, (void*)info, count, (void*)filter);
+
+    lfs_ssize_t res = lfs_dir_readbatch_(shared.lfs, dir, info, count,
+            filter);
+
+    LFS_TRACE("lfs_dir_readbatch -> %"PRId32, res);
+    LFS_UNLOCK_SHARED(lfs, &shared);
+    return res;
+}
+
 int lfs_dir_seek(lfs_t *lfs, lfs_dir_t *dir, lfs_off_t off) {
     int err = LFS_LOCK(lfs->cfg);
     if (err) {
@@ -6311,16 +9663,17 @@ int lfs_dir_seek(lfs_t *lfs, lfs_dir_t *dir, lfs_off_t off) {
 }
 
 lfs_soff_t lfs_dir_tell(lfs_t *lfs, lfs_dir_t *dir) {
-    int err = LFS_LOCK(lfs->cfg);
+    struct lfs_shared shared;
+    int err = LFS_LOCK_SHARED(lfs, &shared, false);
     if (err) {
         return err;
     }
     LFS_TRACE("lfs_dir_tell(%p, %p)", (void*)lfs, (void*)dir);
 
-    lfs_soff_t res = lfs_dir_tell_(lfs, dir);
+    lfs_soff_t res = lfs_dir_tell_(shared.lfs, dir);
 
     LFS_TRACE("lfs_dir_tell -> %"PRId32, res);
-    LFS_UNLOCK(lfs->cfg);
+    LFS_UNLOCK_SHARED(lfs, &shared);
     return res;
 }
 
@@ -6366,6 +9719,20 @@ lfs_ssize_t lfs_fs_size(lfs_t *lfs) {
     return res;
 }
 
+int lfs_fs_allocstat(lfs_t *lfs, struct lfs_allocstat *stat) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_allocstat(%p, %p)", (void*)lfs, (void*)stat);
+
+    err = lfs_fs_allocstat_(lfs, stat);
+
+    LFS_TRACE("lfs_fs_allocstat -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
 int lfs_fs_traverse(lfs_t *lfs, int (*cb)(void *, lfs_block_t), void *data) {
     int err = LFS_LOCK(lfs->cfg);
     if (err) {
@@ -6429,6 +9796,70 @@ int lfs_fs_grow(lfs_t *lfs, lfs_size_t block_count) {
 }
 #endif
 
+#ifndef LFS_READONLY
+int lfs_snapshot_create(lfs_t *lfs, lfs_snapshot_t *snap,
+        const struct lfs_snapshot_config *config) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_snapshot_create(%p, %p, %p {.buffer=%p})",
+            (void*)lfs, (void*)snap, (void*)config,
+            (config) ? config->buffer : NULL);
+
+    err = lfs_snapshot_create_(lfs, snap, config);
+
+    LFS_TRACE("lfs_snapshot_create -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
+int lfs_snapshot_release(lfs_t *lfs, lfs_snapshot_t *snap) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_snapshot_release(%p, %p)", (void*)lfs, (void*)snap);
+
+    err = lfs_snapshot_release_(lfs, snap);
+
+    LFS_TRACE("lfs_snapshot_release -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
+int lfs_snapshot_next(lfs_t *lfs, lfs_snapshot_t *snap, lfs_block_t *block) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_snapshot_next(%p, %p, %"PRIu32")",
+            (void*)lfs, (void*)snap, *block);
+
+    err = lfs_snapshot_next_(lfs, snap, block);
+
+    LFS_TRACE("lfs_snapshot_next -> %d, %"PRIu32, err, *block);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
+int lfs_snapshot_read(lfs_t *lfs, lfs_snapshot_t *snap,
+        lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_snapshot_read(%p, %p, %"PRIu32", %"PRIu32", %p, %"PRIu32")",
+            (void*)lfs, (void*)snap, block, off, buffer, size);
+
+    err = lfs_snapshot_read_(lfs, snap, block, off, buffer, size);
+
+    LFS_TRACE("lfs_snapshot_read -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
 #ifdef LFS_MIGRATE
 int lfs_migrate(lfs_t *lfs, const struct lfs_config *cfg) {
     int err = LFS_LOCK(cfg);
@@ -28,7 +28,10 @@ extern "C"
 // Version of On-disk data structures
 // Major (top-nibble), incremented on backwards incompatible changes
 // Minor (bottom-nibble), incremented on feature additions
-#define LFS_DISK_VERSION 0x00020001
+//
+// v2.2 adds packed and sparse files, volumes are only marked v2.2 once one
+// of these is committed, until then older v2.x drivers can still mount them
+#define LFS_DISK_VERSION 0x00020002
 #define LFS_DISK_VERSION_MAJOR (0xffff & (LFS_DISK_VERSION >> 16))
 #define LFS_DISK_VERSION_MINOR (0xffff & (LFS_DISK_VERSION >>  0))
 
@@ -65,6 +68,13 @@ typedef uint32_t lfs_block_t;
 #define LFS_ATTR_MAX 1022
 #endif
 
+// Maximum number of physically contiguous runs of blocks a file's
+// reservation is gathered from, may be redefined. Each run takes 8 bytes in
+// the file struct.
+#ifndef LFS_EXTENT_RUNS
+#define LFS_EXTENT_RUNS 8
+#endif
+
 // Possible error codes, these are negative to allow
 // valid positive return values
 enum lfs_error {
@@ -108,6 +118,8 @@ enum lfs_type {
     LFS_TYPE_DIRSTRUCT      = 0x200,
     LFS_TYPE_CTZSTRUCT      = 0x202,
     LFS_TYPE_INLINESTRUCT   = 0x201,
+    LFS_TYPE_PACKSTRUCT     = 0x203,
+    LFS_TYPE_SPARSESTRUCT   = 0x204,
     LFS_TYPE_SOFTTAIL       = 0x600,
     LFS_TYPE_HARDTAIL       = 0x601,
     LFS_TYPE_MOVESTATE      = 0x7ff,
@@ -131,6 +143,7 @@ enum lfs_open_flags {
     LFS_O_EXCL   = 0x0200,    // Fail if a file already exists
     LFS_O_TRUNC  = 0x0400,    // Truncate the existing file to zero size
     LFS_O_APPEND = 0x0800,    // Move to end of file on every write
+    LFS_O_SPARSE = 0x1000,    // Create the file sparse, holes take no space
 #endif
 
     // internally used flags
@@ -143,6 +156,13 @@ enum lfs_open_flags {
     LFS_F_ERRED   = 0x080000, // An error occurred during write
 #endif
     LFS_F_INLINE  = 0x100000, // Currently inlined in directory entry
+    LFS_F_PACKED  = 0x200000, // Stored in a shared pack block
+    LFS_F_SPARSE  = 0x400000, // Holes are not stored
+};
+
+// File reserve flags
+enum lfs_reserve_flags {
+    LFS_R_ERASE = 0x1,  // Erase the reserved blocks up front
 };
 
 // File seek flags
@@ -188,6 +208,27 @@ struct lfs_config {
     // Unlock the underlying block device. Negative error codes
     // are propagated to the user.
     int (*unlock)(const struct lfs_config *c);
+
+    // Optionally lock the filesystem for a read-only operation, such as
+    // lfs_file_read, lfs_stat or lfs_dir_read. Any number of shared locks
+    // may be held at once, but never while the lock above is held. Must
+    // return a reader slot from 0 to shared_max-1 that no other holder of a
+    // shared lock is using, each slot has its own read cache. Negative error
+    // codes are propagated to the user.
+    //
+    // Note the block device read may then be called by several threads at
+    // once. Read-only operations take the lock above when this is NULL.
+    // Each shared operation keeps a copy of lfs_t on the caller's stack,
+    // so size reader stacks for sizeof(lfs_t) more, about 240 bytes on a
+    // 32-bit target.
+    int (*lock_shared)(const struct lfs_config *c);
+
+    // Unlock a shared lock given the reader slot returned by lock_shared.
+    // Negative error codes are propagated to the user.
+    int (*unlock_shared)(const struct lfs_config *c, int slot);
+
+    // Number of reader slots handed out by lock_shared.
+    lfs_size_t shared_max;
 #endif
 
     // Minimum size of a block read in bytes. All read operations will be a
@@ -252,6 +293,43 @@ struct lfs_config {
     // By default lfs_malloc is used to allocate this buffer.
     void *lookahead_buffer;
 
+    // Optional number of cache_size buffers in the buffer pool. Buffers
+    // littlefs would otherwise allocate with lfs_malloc are taken from the
+    // pool if they are cache_size, this includes file caches, the read and
+    // program caches, the lookahead buffer if it is cache_size, and the
+    // tag index used while compacting metadata. Alloc
+    // and free are O(1) and the pool doesn't fragment, so opening and
+    // closing files doesn't churn the heap. If the pool runs out littlefs
+    // falls back to lfs_malloc. Must be cache_size >= sizeof(void*).
+    //
+    // Disabled when zero.
+    lfs_size_t cache_pool_count;
+
+    // Optional statically allocated buffer pool. Must be
+    // cache_pool_count*cache_size. By default lfs_malloc is used to
+    // allocate the pool once when mounting.
+    void *cache_pool_buffer;
+
+    // Optional upper limit on file caches. If non-zero, open files without
+    // their own buffer share up to file_cache_max caches, taking one when
+    // first read or written. Once all are in use the least recently used
+    // cache is evicted, writing back any dirty data first, so RAM scales
+    // with the files in use rather than the files open. Evicting a file
+    // that is being written costs a partial block copy on its next write.
+    // Evicting an inlined or packed file with unsynced writes moves it
+    // into a block of its own, as if it had outgrown its cache, without
+    // committing it.
+    //
+    // Disabled when zero.
+    lfs_size_t file_cache_max;
+
+#ifdef LFS_THREADSAFE
+    // Optional statically allocated buffer for the read caches of the reader
+    // slots. Must be shared_max*cache_size. By default lfs_malloc is used to
+    // allocate this buffer.
+    void *shared_buffer;
+#endif
+
     // Optional upper limit on length of file names in bytes. No downside for
     // larger names except the size of the info struct which is controlled by
     // the LFS_NAME_MAX define. Defaults to LFS_NAME_MAX or name_max stored on
@@ -283,6 +361,64 @@ struct lfs_config {
     // Set to -1 to disable inlined files.
     lfs_size_t inline_max;
 
+    // Optional upper limit on adaptively inlined files in bytes. Files
+    // larger than inline_max but no larger than inline_adapt_max stay
+    // inlined when synced if their metadata pair has room to spare after
+    // compaction and they haven't been synced often since being opened,
+    // otherwise they are packed or outlined. Outlined files are only
+    // inlined again when truncated. Must be <= cache_size and <= attr_max.
+    //
+    // Disabled when zero.
+    lfs_size_t inline_adapt_max;
+
+    // Optional upper limit on packed files in bytes. Files too large to be
+    // inlined but no larger than pack_max are kept in their cache like
+    // inlined files, and on sync are appended to a shared pack block
+    // instead of taking a whole block each. Must be <= cache_size.
+    //
+    // Note committing the first packed file marks the filesystem as disk
+    // version 2.2, which littlefs versions without packing refuse to mount.
+    //
+    // Disabled when zero.
+    lfs_size_t pack_max;
+
+    // Threshold for repacking during lfs_fs_gc in bytes. Pack blocks with
+    // fewer live bytes than this have their files moved to the current pack
+    // block so the block can be reused. Defaults to block_size/2 when zero.
+    //
+    // Set to -1 to disable repacking during lfs_fs_gc.
+    lfs_size_t pack_compact_thresh;
+
+    // Optional number of blocks at the start of the device reserved for
+    // metadata pairs. Metadata pairs are allocated from this zone while it
+    // has free blocks, and file data is never allocated from it, which keeps
+    // file data contiguous and metadata close together. The zone's allocator
+    // window takes (metadata_zone+7)/8 bytes from the lookahead buffer.
+    // Must be at least 2 and less than block_count.
+    //
+    // Disabled when zero.
+    lfs_size_t metadata_zone;
+
+    // Optional upper limit on block device reads that span multiple blocks
+    // in bytes. If non-zero, read may be called with off+size > block_size,
+    // in which case the read continues into the physically following
+    // blocks. Large file reads over contiguous blocks are then issued as a
+    // single read. Must be a multiple of read_size.
+    //
+    // Disabled when zero.
+    lfs_size_t read_span_max;
+
+    // Optional lower limit on read cache fetches in bytes. A read cache
+    // miss fetches what the read is hinted to need, which is a small window
+    // for one-off reads with a small read_size, fetch_size rounds this up
+    // and aligns it so nearby reads in either direction hit the cache.
+    // Ideally the number of bytes the bus moves in the time of one
+    // command's overhead. Must be a multiple of read_size and a factor of
+    // cache_size.
+    //
+    // Disabled when zero.
+    lfs_size_t fetch_size;
+
 #ifdef LFS_MULTIVERSION
     // On-disk version to use when writing in the form of 16-bit major version
     // + 16-bit minor version. This limiting metadata to what is supported by
@@ -292,6 +428,26 @@ struct lfs_config {
 #endif
 };
 
+// Buffer allocation statistics, see lfs_fs_allocstat
+struct lfs_allocstat {
+    // Buffers in the buffer pool, and the number in use now and at most
+    lfs_size_t pool_count;
+    lfs_size_t pool_used;
+    lfs_size_t pool_peak;
+
+    // Bytes allocated with lfs_malloc now and at most, including the pool
+    lfs_size_t heap_used;
+    lfs_size_t heap_peak;
+
+    // Number of buffer allocations, and how many used lfs_malloc
+    uint32_t allocs;
+    uint32_t heap_allocs;
+
+    // Shared file caches in use, and the number of evictions
+    lfs_size_t file_caches;
+    uint32_t file_evictions;
+};
+
 // File info structure
 struct lfs_info {
     // Type of the file, either LFS_TYPE_REG or LFS_TYPE_DIR
@@ -307,6 +463,16 @@ struct lfs_info {
     char name[LFS_NAME_MAX+1];
 };
 
+// Filter for lfs_dir_readbatch, entries that don't match are skipped
+struct lfs_dir_filter {
+    // Only entries whose name starts with this prefix. Any name when NULL.
+    const char *prefix;
+
+    // Only entries of these types, a mask of LFS_TYPE_REG and LFS_TYPE_DIR.
+    // Any type when zero.
+    uint8_t types;
+};
+
 // Filesystem info structure
 struct lfs_fsinfo {
     // On-disk version.
@@ -363,6 +529,56 @@ struct lfs_file_config {
 
     // Number of custom attributes in the list
     lfs_size_t attr_count;
+
+    // Optional hint of the final size of the file in bytes. When writing,
+    // the allocator tries to reserve physically contiguous blocks for the
+    // rest of the file up to this size, which keeps large sequentially
+    // written files unfragmented. The reserved blocks are held until the
+    // file is closed.
+    //
+    // Disabled when zero.
+    lfs_size_t size_hint;
+
+    // Optional statically allocated buffer for the chunk map of a sparse
+    // file. Must be the largest chunk map that fits in the metadata,
+    // min(cache_size, attr_max, metadata_max/8) bytes, with metadata_max
+    // defaulting to block_size. By default lfs_malloc is used to allocate
+    // this buffer, and only if the file is sparse.
+    void *sparse_buffer;
+
+    // Optional number of entries in a seek index kept with the file. The
+    // index holds the address of every stride'th block of the file and is
+    // updated on sync, so a seek after opening the file starts from the
+    // nearest entry instead of walking the file's skip list from the end.
+    // When the index fills up every other entry is dropped and the stride
+    // doubles. The index is stored with the file's metadata, counts larger
+    // than fit in the inline size limit are reduced. Sparse files are not
+    // indexed.
+    //
+    // Disabled when zero.
+    lfs_size_t index_count;
+
+    // Optional statically allocated seek index buffer. Must be
+    // LFS_INDEX_BUFFER_SIZE(index_count). By default lfs_malloc is used to
+    // allocate this buffer.
+    void *index_buffer;
+};
+
+// Size of the buffer a file's seek index needs, the ctz reference and
+// stride followed by the entries
+#define LFS_INDEX_BUFFER_SIZE(index_count) (12 + 4*(index_count))
+
+// Size of the buffer a snapshot needs, a copy of the superblock's metadata
+// block and a bitmap of the blocks the snapshot holds
+#define LFS_SNAPSHOT_BUFFER_SIZE(block_size, block_count) \
+    ((block_size) + ((block_count)+7)/8)
+
+// Optional configuration provided when taking a snapshot
+struct lfs_snapshot_config {
+    // Optional statically allocated buffer. Must be
+    // LFS_SNAPSHOT_BUFFER_SIZE(block_size, block_count). By default
+    // lfs_malloc is used to allocate this buffer.
+    void *buffer;
 };
 
 
@@ -408,15 +624,61 @@ typedef struct lfs_file {
         lfs_size_t size;
     } ctz;
 
+    struct lfs_pack {
+        lfs_block_t block;
+        lfs_off_t off;
+        lfs_size_t size;
+    } pack;
+
     uint32_t flags;
     lfs_off_t pos;
     lfs_block_t block;
     lfs_off_t off;
     lfs_cache_t cache;
+    uint32_t tick;
+    uint32_t syncs;
+
+    struct lfs_extent {
+        struct lfs_extent_run {
+            lfs_block_t block;
+            lfs_block_t count;
+        } runs[LFS_EXTENT_RUNS];
+        lfs_size_t count;
+        bool erased;
+    } extent;
+
+    struct lfs_sparse {
+        lfs_off_t pos;
+        lfs_size_t size;
+        lfs_size_t count;
+        uint8_t *buffer;
+    } sparse;
+
+    struct lfs_index {
+        lfs_size_t stride;
+        lfs_size_t count;
+        lfs_off_t from;
+        uint8_t *buffer;
+    } index;
 
     const struct lfs_file_config *cfg;
 } lfs_file_t;
 
+// littlefs snapshot type
+typedef struct lfs_snapshot {
+    struct lfs_snapshot *next;
+    lfs_block_t block_count;
+    lfs_size_t count;
+
+    // the superblock pair can't move, so its block is copied instead
+    lfs_block_t root;
+    lfs_size_t root_size;
+
+    uint8_t *buffer;
+    uint8_t *pins;
+    const struct lfs_snapshot_config *cfg;
+} lfs_snapshot_t;
+
 typedef struct lfs_superblock {
     uint32_t version;
     lfs_size_t block_size;
@@ -455,7 +717,9 @@ typedef struct lfs {
         lfs_block_t next;
         lfs_block_t ckpoint;
         uint8_t *buffer;
-    } lookahead;
+        lfs_size_t buffer_size;
+        bool full;
+    } lookahead, mlookahead;
 
     const struct lfs_config *cfg;
     lfs_size_t block_count;
@@ -463,6 +727,33 @@ typedef struct lfs {
     lfs_size_t file_max;
     lfs_size_t attr_max;
     lfs_size_t inline_max;
+    uint32_t disk_version;
+
+    struct lfs_pool {
+        uint8_t *buffer;
+        void *free;
+        lfs_size_t used;
+        lfs_size_t peak;
+        lfs_size_t heap_used;
+        lfs_size_t heap_peak;
+        uint32_t allocs;
+        uint32_t heap_allocs;
+        lfs_size_t file_caches;
+        uint32_t file_evictions;
+        uint32_t file_tick;
+    } pool;
+
+    struct lfs_packer {
+        lfs_block_t block;
+        lfs_off_t off;
+        lfs_block_t gc;
+    } packer;
+
+    struct lfs_snapshot *snapshots;
+
+#ifdef LFS_THREADSAFE
+    uint8_t *shared_buffer;
+#endif
 
 #ifdef LFS_MIGRATE
     struct lfs1 *lfs1;
@@ -519,6 +810,20 @@ int lfs_remove(lfs_t *lfs, const char *path);
 int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath);
 #endif
 
+#ifndef LFS_READONLY
+// Clone a file without copying its data
+//
+// The new file shares the data blocks of the old one and gets a copy of its
+// custom attributes, in a single commit. Either file can then be written
+// independently, only the blocks written to are copied. If the old
+// file is open, the clone is of the last synced contents.
+//
+// The destination must not exist, directories can't be cloned.
+//
+// Returns a negative error code on failure.
+int lfs_file_clone(lfs_t *lfs, const char *oldpath, const char *newpath);
+#endif
+
 // Find info about a file or directory
 //
 // Fills out the info structure, based on the specified file or directory.
@@ -570,6 +875,16 @@ int lfs_removeattr(lfs_t *lfs, const char *path, uint8_t type);
 // The mode that the file is opened in is determined by the flags, which
 // are values from the enum lfs_open_flags that are bitwise-ored together.
 //
+// With LFS_O_SPARSE a new, empty, or truncated file is made sparse. Only
+// the block sized chunks of a sparse file that are written are stored,
+// holes read as zeros and take no blocks. The map of stored chunks lives
+// in the file's metadata as runs of consecutive chunks, once a write or
+// truncate needs more runs than fit the file is rewritten as a normal file
+// with its holes stored as zeros. Sparse files stay sparse until then, or
+// until truncated on open.
+// Committing the first sparse file marks the filesystem as disk version
+// 2.2, which littlefs versions without sparse files refuse to mount.
+//
 // Returns a negative error code on failure.
 int lfs_file_open(lfs_t *lfs, lfs_file_t *file,
         const char *path, int flags);
@@ -636,6 +951,24 @@ lfs_soff_t lfs_file_seek(lfs_t *lfs, lfs_file_t *file,
 //
 // Returns a negative error code on failure.
 int lfs_file_truncate(lfs_t *lfs, lfs_file_t *file, lfs_off_t size);
+
+// Reserve space for the file to grow to the specified size
+//
+// The blocks needed to append up to size are allocated up front, so
+// appending writes up to size can't run out of space. The blocks are kept
+// physically contiguous where the free space allows, gathered from up to
+// LFS_EXTENT_RUNS runs otherwise. With LFS_R_ERASE the blocks are also
+// erased, leaving only programs for the writes. The reservation is released
+// when the file is closed.
+//
+// Only writes at or past the end of the file take blocks from the
+// reservation. Writes that rewrite existing data allocate their blocks as
+// usual and can still run out of space.
+//
+// Returns a negative error code on failure, LFS_ERR_NOSPC if there is not
+// enough free space or it is split into more than LFS_EXTENT_RUNS runs.
+int lfs_file_reserve(lfs_t *lfs, lfs_file_t *file, lfs_off_t size,
+        int flags);
 #endif
 
 // Return the position of the file
@@ -656,6 +989,13 @@ int lfs_file_rewind(lfs_t *lfs, lfs_file_t *file);
 // Returns the size of the file, or a negative error code on failure.
 lfs_soff_t lfs_file_size(lfs_t *lfs, lfs_file_t *file);
 
+// Return the number of physically contiguous extents the file is stored in
+//
+// This is a measure of fragmentation, 1 means the file's blocks are fully
+// contiguous on disk. Inlined and empty files have no extents.
+// Returns the number of extents, or a negative error code on failure.
+lfs_ssize_t lfs_file_extents(lfs_t *lfs, lfs_file_t *file);
+
 
 /// Directory operations ///
 
@@ -685,6 +1025,19 @@ int lfs_dir_close(lfs_t *lfs, lfs_dir_t *dir);
 // or a negative error code on failure.
 int lfs_dir_read(lfs_t *lfs, lfs_dir_t *dir, struct lfs_info *info);
 
+// Read a batch of entries in the directory
+//
+// Fills out up to count info structures with the entries that match the
+// optional filter, in the same order as lfs_dir_read. Each metadata log
+// is scanned once for a window of entries instead of twice per entry, and
+// only entries that match have their name and size read.
+//
+// Returns the number of entries read, 0 at the end of directory, or a
+// negative error code on failure.
+lfs_ssize_t lfs_dir_readbatch(lfs_t *lfs, lfs_dir_t *dir,
+        struct lfs_info *info, lfs_size_t count,
+        const struct lfs_dir_filter *filter);
+
 // Change the position of the directory
 //
 // The new off must be a value previous returned from tell and specifies
@@ -717,12 +1070,18 @@ int lfs_fs_stat(lfs_t *lfs, struct lfs_fsinfo *fsinfo);
 
 // Finds the current size of the filesystem
 //
-// Note: Result is best effort. If files share COW structures, the returned
-// size may be larger than the filesystem actually is.
+// Note: Result is best effort. If files share COW structures or pack blocks,
+// the returned size may be larger than the filesystem actually is.
 //
 // Returns the number of allocated blocks, or a negative error code on failure.
 lfs_ssize_t lfs_fs_size(lfs_t *lfs);
 
+// Get statistics on the buffers allocated since mount
+//
+// Fills out the allocstat structure. Returns a negative error code on
+// failure.
+int lfs_fs_allocstat(lfs_t *lfs, struct lfs_allocstat *stat);
+
 // Traverse through all blocks in use by the filesystem
 //
 // The provided callback will be called with each block address that is
@@ -750,7 +1109,8 @@ int lfs_fs_mkconsistent(lfs_t *lfs);
 // This currently:
 // 1. Calls mkconsistent if not already consistent
 // 2. Compacts metadata > compact_thresh
-// 3. Populates the block allocator
+// 3. Repacks pack blocks < pack_compact_thresh
+// 4. Populates the block allocator
 //
 // Though additional janitorial work may be added in the future.
 //
@@ -772,6 +1132,62 @@ int lfs_fs_gc(lfs_t *lfs);
 int lfs_fs_grow(lfs_t *lfs, lfs_size_t block_count);
 #endif
 
+
+/// Snapshot operations ///
+
+// A snapshot freezes the filesystem as it is on disk so it can be read out,
+// for example for a backup, while the filesystem is still being written.
+//
+// File data is never written in place, so the snapshot only needs to keep
+// its blocks from being reused. Metadata pairs are, so a metadata pair held
+// by a snapshot is moved to new blocks the next time it is written, and its
+// parent with it. The superblock pair can't move, its metadata block is
+// copied into the snapshot's buffer instead.
+//
+// Snapshots live in RAM, a snapshot is lost on power loss, which frees its
+// blocks.
+
+#ifndef LFS_READONLY
+// Take a snapshot of the filesystem
+//
+// The config may be NULL for the defaults, and must be allocated while the
+// snapshot is held. Files that are open see no change, any unsynced writes
+// are not part of the snapshot.
+//
+// Returns a negative error code on failure.
+int lfs_snapshot_create(lfs_t *lfs, lfs_snapshot_t *snap,
+        const struct lfs_snapshot_config *config);
+
+// Release a snapshot
+//
+// Its blocks that are no longer used by the filesystem become free. All
+// snapshots must be released before unmounting.
+//
+// Returns a negative error code on failure.
+int lfs_snapshot_release(lfs_t *lfs, lfs_snapshot_t *snap);
+
+// Find the next block of a snapshot
+//
+// Updates block to the first block of the snapshot at or after block.
+// Writing every block of the snapshot to the same address of an erased
+// device gives an image of the filesystem as it was when the snapshot was
+// taken.
+//
+// Returns LFS_ERR_NOENT past the last block, or a negative error code on
+// failure.
+int lfs_snapshot_next(lfs_t *lfs, lfs_snapshot_t *snap, lfs_block_t *block);
+
+// Read a block of a snapshot as it was when the snapshot was taken
+//
+// Parts of blocks past what the snapshot uses may have been written since,
+// the unused rest of the superblock's block reads as 0xff.
+//
+// Returns a negative error code on failure, LFS_ERR_INVAL if the block is
+// not part of the snapshot.
+int lfs_snapshot_read(lfs_t *lfs, lfs_snapshot_t *snap,
+        lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size);
+#endif
+
 #ifndef LFS_READONLY
 #ifdef LFS_MIGRATE
 // Attempts to migrate a previous version of littlefs
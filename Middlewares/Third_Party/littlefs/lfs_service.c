@@ -0,0 +1,250 @@
+/*
+ * lfs service, runs filesystem requests on a dedicated worker
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "lfs_service.h"
+
+
+/// Request queue ///
+
+// The queue is a bounded ring where each slot carries a sequence number,
+// producers claim a position with a compare-and-swap on head and publish
+// the request by bumping the slot's sequence, the single consumer frees
+// the slot by bumping the sequence again by a full lap
+//
+// seq == pos      slot is free for the producer at pos
+// seq == pos+1    slot holds the request posted at pos
+int lfs_service_post(lfs_service_t *svc, struct lfs_request *req) {
+    LFS_ASSERT(req->type >= LFS_REQ_OPEN && req->type <= LFS_REQ_CALL);
+    req->res = 0;
+    req->done = false;
+    req->merged = NULL;
+
+    uint32_t mask = svc->cfg->queue_size - 1;
+    uint32_t pos = __atomic_load_n(&svc->head, __ATOMIC_RELAXED);
+    struct lfs_service_slot *slot;
+    while (true) {
+        slot = &svc->queue[pos & mask];
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int32_t diff = (int32_t)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&svc->head, &pos, pos+1,
+                    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // queue is full
+            return LFS_ERR_NOMEM;
+        } else {
+            pos = __atomic_load_n(&svc->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->req = req;
+    __atomic_store_n(&slot->seq, pos+1, __ATOMIC_RELEASE);
+
+    if (svc->cfg->wake) {
+        svc->cfg->wake(svc->cfg);
+    }
+
+    return 0;
+}
+
+static struct lfs_request *lfs_service_pop(lfs_service_t *svc) {
+    uint32_t mask = svc->cfg->queue_size - 1;
+    struct lfs_service_slot *slot = &svc->queue[svc->tail & mask];
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq != svc->tail+1) {
+        return NULL;
+    }
+
+    struct lfs_request *req = slot->req;
+    __atomic_store_n(&slot->seq, svc->tail+mask+1, __ATOMIC_RELEASE);
+    svc->tail += 1;
+    return req;
+}
+
+
+/// Request handling ///
+
+static int32_t lfs_service_do(lfs_service_t *svc, struct lfs_request *req) {
+    lfs_t *lfs = svc->lfs;
+    switch (req->type) {
+        case LFS_REQ_OPEN: {
+            static const struct lfs_file_config defaults = {0};
+            return lfs_file_opencfg(lfs, req->file, req->path, req->flags,
+                    (req->fcfg) ? req->fcfg : &defaults);
+        }
+        case LFS_REQ_CLOSE:
+            return lfs_file_close(lfs, req->file);
+        case LFS_REQ_READ:
+            return lfs_file_read(lfs, req->file, req->buffer, req->size);
+#ifndef LFS_READONLY
+        case LFS_REQ_WRITE:
+            return lfs_file_write(lfs, req->file, req->buffer, req->size);
+#endif
+        case LFS_REQ_SEEK:
+            return lfs_file_seek(lfs, req->file, req->off, req->whence);
+        case LFS_REQ_SYNC:
+            return lfs_file_sync(lfs, req->file);
+        case LFS_REQ_CALL:
+            return req->call(lfs, req->buffer);
+        default:
+            return LFS_ERR_INVAL;
+    }
+}
+
+// complete a request and any requests merged into it, the client may
+// reuse a request as soon as it is done, so don't touch it after
+//
+// merged syncs keep an earlier error of their file, see lfs_service_fail
+static int lfs_service_complete(struct lfs_request *req, int32_t res) {
+    int count = 0;
+    while (req) {
+        struct lfs_request *merged = req->merged;
+        if (req->res == 0) {
+            req->res = res;
+        }
+        if (req->cb) {
+            req->cb(req);
+        }
+        __atomic_store_n(&req->done, true, __ATOMIC_RELEASE);
+
+        req = merged;
+        count += 1;
+    }
+
+    return count;
+}
+
+// find a later sync or close of the same file in the batch that a sync
+// can be merged into, the data it makes durable is a superset
+//
+// calls may depend on the file being synced, so we don't look past them
+static struct lfs_request *lfs_service_mergeable(struct lfs_request *req) {
+    for (struct lfs_request *r = req->next; r; r = r->next) {
+        if (r->type == LFS_REQ_CALL) {
+            return NULL;
+        }
+
+        if (r->file == req->file
+                && (r->type == LFS_REQ_SYNC || r->type == LFS_REQ_CLOSE)) {
+            return r;
+        }
+    }
+
+    return NULL;
+}
+
+// a failed request may leave its file erred, littlefs then skips the
+// flush in later syncs and closes of the file and returns 0, so syncs
+// merged into one of those would report data as durable that never was,
+// give them the earliest error instead
+//
+// syncs only merge into the next sync or close of their file, so any
+// sync posted before the failed request and still pending is merged into
+// the first one after it
+static void lfs_service_fail(struct lfs_request *req, int32_t res) {
+    struct lfs_request *into = lfs_service_mergeable(req);
+    if (!into) {
+        return;
+    }
+
+    for (struct lfs_request *m = into->merged; m; m = m->merged) {
+        if (m->res == 0) {
+            m->res = res;
+        }
+    }
+}
+
+int lfs_service_run(lfs_service_t *svc) {
+    lfs_size_t batch_max = (svc->cfg->batch_max)
+            ? svc->cfg->batch_max
+            : svc->cfg->queue_size;
+
+    int count = 0;
+    while (true) {
+        // grab a batch of requests, keeping them in order
+        struct lfs_request *batch = NULL;
+        struct lfs_request **tail = &batch;
+        for (lfs_size_t i = 0; i < batch_max; i++) {
+            struct lfs_request *req = lfs_service_pop(svc);
+            if (!req) {
+                break;
+            }
+
+            req->next = NULL;
+            *tail = req;
+            tail = &req->next;
+        }
+
+        if (!batch) {
+            return count;
+        }
+
+        for (struct lfs_request *req = batch; req; ) {
+            struct lfs_request *next = req->next;
+            if (req->type == LFS_REQ_SYNC) {
+                struct lfs_request *into = lfs_service_mergeable(req);
+                if (into) {
+                    // completes with the later request
+                    struct lfs_request **last = &req->merged;
+                    while (*last) {
+                        last = &(*last)->merged;
+                    }
+                    *last = into->merged;
+                    into->merged = req;
+                    req = next;
+                    continue;
+                }
+            }
+
+            int32_t res = lfs_service_do(svc, req);
+            if (res < 0 && req->type != LFS_REQ_CALL) {
+                lfs_service_fail(req, res);
+            }
+            count += lfs_service_complete(req, res);
+            req = next;
+        }
+    }
+}
+
+
+/// Service setup ///
+
+int lfs_service_init(lfs_service_t *svc, lfs_t *lfs,
+        const struct lfs_service_config *cfg) {
+    // queue_size must be a power of two
+    LFS_ASSERT(cfg->queue_size > 0);
+    LFS_ASSERT((cfg->queue_size & (cfg->queue_size - 1)) == 0);
+
+    svc->lfs = lfs;
+    svc->cfg = cfg;
+    if (cfg->queue_buffer) {
+        svc->queue = cfg->queue_buffer;
+    } else {
+        svc->queue = lfs_malloc(
+                cfg->queue_size*sizeof(struct lfs_service_slot));
+        if (!svc->queue) {
+            return LFS_ERR_NOMEM;
+        }
+    }
+
+    for (lfs_size_t i = 0; i < cfg->queue_size; i++) {
+        svc->queue[i].seq = i;
+        svc->queue[i].req = NULL;
+    }
+    svc->head = 0;
+    svc->tail = 0;
+    return 0;
+}
+
+int lfs_service_deinit(lfs_service_t *svc) {
+    LFS_ASSERT(svc->head == svc->tail);
+    if (!svc->cfg->queue_buffer) {
+        lfs_free(svc->queue);
+    }
+
+    return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * lfs service, runs filesystem requests on a dedicated worker
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef LFS_SERVICE_H
+#define LFS_SERVICE_H
+
+#include "lfs.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/// Service definitions ///
+
+// A single worker owns the lfs_t and runs requests that any number of
+// client threads post to a lock-free queue. Clients never block on the
+// block device, they either poll the request as a future or get a
+// callback on completion.
+//
+// The worker may reorder and merge queued requests as long as the result
+// is the same as running them in order, currently syncs of a file are
+// merged into a later sync or close of the same file in the same batch.
+// If a request on the file fails in between, the merged syncs complete
+// with its error, as the later sync or close won't flush an erred file.
+//
+// Writes are not merged. Back-to-back writes to a file already land in
+// its cache and are programmed a whole cache at a time, so merging them
+// would only save the call, at the cost of copying the client buffers
+// into a worker buffer to make them contiguous.
+//
+// The queue relies on the __atomic builtins of GCC and Clang.
+
+// Request types
+enum lfs_request_type {
+    LFS_REQ_OPEN  = 1,  // lfs_file_opencfg(file, path, flags, fcfg)
+    LFS_REQ_CLOSE = 2,  // lfs_file_close(file)
+    LFS_REQ_READ  = 3,  // lfs_file_read(file, buffer, size)
+    LFS_REQ_WRITE = 4,  // lfs_file_write(file, buffer, size)
+    LFS_REQ_SEEK  = 5,  // lfs_file_seek(file, off, whence)
+    LFS_REQ_SYNC  = 6,  // lfs_file_sync(file)
+    LFS_REQ_CALL  = 7,  // call(lfs, buffer), for anything else
+};
+
+// A filesystem request, owned by the client until it completes
+//
+// Fill in the fields for the type, the rest are ignored. The request must
+// not be touched between posting it and its completion.
+struct lfs_request {
+    uint8_t type;
+    lfs_file_t *file;
+
+    const char *path;
+    int flags;
+    const struct lfs_file_config *fcfg;
+
+    void *buffer;
+    lfs_size_t size;
+    lfs_soff_t off;
+    int whence;
+    int (*call)(lfs_t *lfs, void *buffer);
+
+    // Optional completion callback, called by the worker with the result
+    // in res before the request is marked as done.
+    void (*cb)(struct lfs_request *req);
+    void *data;
+
+    // Result of the request, valid once done is set
+    int32_t res;
+    uint8_t done;
+
+    // Used internally by the worker
+    struct lfs_request *next;
+    struct lfs_request *merged;
+};
+
+// Configuration provided during initialization of the service
+struct lfs_service_config {
+    // Opaque user provided context that can be used to pass
+    // information to the wake callback
+    void *context;
+
+    // Optional wakeup of the worker, called by clients after posting a
+    // request, for example to give a semaphore the worker is waiting on.
+    void (*wake)(const struct lfs_service_config *c);
+
+    // Number of requests the queue can hold. Must be a power of two.
+    lfs_size_t queue_size;
+
+    // Optional upper limit on requests run in one batch, requests are only
+    // merged within a batch. Defaults to queue_size when zero.
+    lfs_size_t batch_max;
+
+    // Optional statically allocated queue buffer. Must be
+    // queue_size*sizeof(struct lfs_service_slot). By default lfs_malloc is
+    // used to allocate this buffer.
+    void *queue_buffer;
+};
+
+// Queue slot, exposed for static allocation of the queue buffer
+struct lfs_service_slot {
+    uint32_t seq;
+    struct lfs_request *req;
+};
+
+// The service type
+typedef struct lfs_service {
+    lfs_t *lfs;
+    const struct lfs_service_config *cfg;
+
+    struct lfs_service_slot *queue;
+    uint32_t head;
+    uint32_t tail;
+} lfs_service_t;
+
+
+/// Service functions ///
+
+// Initialize a service for an already mounted filesystem
+//
+// From here on the filesystem must only be used through the service.
+//
+// Returns a negative error code on failure.
+int lfs_service_init(lfs_service_t *svc, lfs_t *lfs,
+        const struct lfs_service_config *cfg);
+
+// Release the resources of a service
+//
+// The queue must be empty and the worker stopped.
+//
+// Returns a negative error code on failure.
+int lfs_service_deinit(lfs_service_t *svc);
+
+// Post a request to the service, safe to call from any thread
+//
+// Returns LFS_ERR_NOMEM if the queue is full, or a negative error code
+// on failure.
+int lfs_service_post(lfs_service_t *svc, struct lfs_request *req);
+
+// Run all queued requests, must only be called from the worker
+//
+// Returns the number of requests completed, or a negative error code
+// on failure.
+int lfs_service_run(lfs_service_t *svc);
+
+// Check if a request has completed, the result is then in req->res
+static inline bool lfs_request_done(const struct lfs_request *req) {
+    return __atomic_load_n(&req->done, __ATOMIC_ACQUIRE);
+}
+
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
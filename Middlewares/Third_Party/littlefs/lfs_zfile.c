@@ -0,0 +1,707 @@
+/*
+ * lfs zfile, transparently compressed append-only files
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "lfs_zfile.h"
+
+
+// zfile flags, kept with the open flags
+enum {
+    LFS_ZF_PLAIN   = 0x01000000,  // file has no index, pass through
+    LFS_ZF_FRAME   = 0x02000000,  // buffer holds a frame
+    LFS_ZF_DIRTY   = 0x04000000,  // frame has data that isn't written
+    LFS_ZF_ALLOCED = 0x08000000,  // buffer was allocated
+};
+
+#define LFS_ZFILE_VERSION 1
+
+
+/// LZ4 block format ///
+
+static inline uint32_t lfs_zfile_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lfs_zfile_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LFS_ZFILE_HASH_BITS);
+}
+
+#ifndef LFS_READONLY
+// append one sequence, or only literals if there is no match, returns
+// NULL if it doesn't fit
+static uint8_t *lfs_zfile_emit(uint8_t *op, const uint8_t *oend,
+        const uint8_t *lit, lfs_size_t litlen,
+        lfs_size_t offset, lfs_size_t mlen) {
+    if ((lfs_size_t)(oend - op) < 1 + litlen + litlen/255+1 + 2 + mlen/255+1) {
+        return NULL;
+    }
+
+    uint8_t *token = op++;
+    if (litlen >= 15) {
+        *token = 15 << 4;
+        lfs_size_t n = litlen - 15;
+        for (; n >= 255; n -= 255) {
+            *op++ = 255;
+        }
+        *op++ = n;
+    } else {
+        *token = litlen << 4;
+    }
+
+    memcpy(op, lit, litlen);
+    op += litlen;
+
+    if (offset) {
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        if (mlen >= 15) {
+            *token |= 15;
+            lfs_size_t n = mlen - 15;
+            for (; n >= 255; n -= 255) {
+                *op++ = 255;
+            }
+            *op++ = n;
+        } else {
+            *token |= mlen;
+        }
+    }
+
+    return op;
+}
+
+// greedy single-pass compressor, returns the compressed size or 0 if it
+// doesn't fit in cap
+static lfs_size_t lfs_zfile_compress(uint16_t *hash,
+        const uint8_t *src, lfs_size_t size,
+        uint8_t *dst, lfs_size_t cap) {
+    memset(hash, 0, LFS_ZFILE_HASH_SIZE*sizeof(uint16_t));
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + size;
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + cap;
+
+    // the format ends with at least 5 literals, and no match may start in
+    // the last 12 bytes
+    if (size > 12) {
+        const uint8_t *mflimit = end - 12;
+        const uint8_t *mlimit = end - 5;
+        while (ip < mflimit) {
+            uint32_t v = lfs_zfile_read32(ip);
+            uint32_t h = lfs_zfile_hash(v);
+            const uint8_t *ref = src + hash[h];
+            hash[h] = ip - src;
+            if (ref >= ip || lfs_zfile_read32(ref) != v) {
+                ip += 1;
+                continue;
+            }
+
+            const uint8_t *m = ip + 4;
+            ref += 4;
+            while (m < mlimit && *m == *ref) {
+                m += 1;
+                ref += 1;
+            }
+
+            op = lfs_zfile_emit(op, oend, anchor, ip - anchor,
+                    m - ref, (m - ip) - 4);
+            if (!op) {
+                return 0;
+            }
+
+            ip = m;
+            anchor = m;
+        }
+    }
+
+    op = lfs_zfile_emit(op, oend, anchor, end - anchor, 0, 0);
+    if (!op) {
+        return 0;
+    }
+
+    return op - dst;
+}
+#endif
+
+// returns the decompressed size or LFS_ERR_CORRUPT
+static lfs_ssize_t lfs_zfile_decompress(const uint8_t *src, lfs_size_t size,
+        uint8_t *dst, lfs_size_t cap) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + size;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + cap;
+    while (true) {
+        if (ip >= iend) {
+            return LFS_ERR_CORRUPT;
+        }
+
+        uint8_t token = *ip++;
+        lfs_size_t litlen = token >> 4;
+        if (litlen == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) {
+                    return LFS_ERR_CORRUPT;
+                }
+                b = *ip++;
+                litlen += b;
+            } while (b == 255);
+        }
+
+        if (litlen > (lfs_size_t)(iend - ip)
+                || litlen > (lfs_size_t)(oend - op)) {
+            return LFS_ERR_CORRUPT;
+        }
+
+        memcpy(op, ip, litlen);
+        ip += litlen;
+        op += litlen;
+
+        // last sequence has no match
+        if (ip == iend) {
+            return op - dst;
+        }
+
+        if (iend - ip < 2) {
+            return LFS_ERR_CORRUPT;
+        }
+
+        lfs_size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (lfs_size_t)(op - dst)) {
+            return LFS_ERR_CORRUPT;
+        }
+
+        lfs_size_t mlen = token & 15;
+        if (mlen == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) {
+                    return LFS_ERR_CORRUPT;
+                }
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += 4;
+
+        if (mlen > (lfs_size_t)(oend - op)) {
+            return LFS_ERR_CORRUPT;
+        }
+
+        // matches may overlap themselves
+        const uint8_t *ref = op - offset;
+        for (lfs_size_t i = 0; i < mlen; i++) {
+            op[i] = ref[i];
+        }
+        op += mlen;
+    }
+}
+
+
+/// Frames and the seek index ///
+
+static inline lfs_size_t lfs_zfile_frames(const lfs_zfile_t *zfile) {
+    return (zfile->size + zfile->frame_size-1) / zfile->frame_size;
+}
+
+static inline uint8_t *lfs_zfile_entry(const lfs_zfile_t *zfile,
+        lfs_size_t i) {
+    return &zfile->index[8 + 4*i];
+}
+
+// find the stored offset of a frame
+static lfs_soff_t lfs_zfile_locate(lfs_t *lfs, lfs_zfile_t *zfile,
+        lfs_size_t index) {
+    uint32_t off;
+    memcpy(&off, lfs_zfile_entry(zfile, index / zfile->stride), 4);
+    off = lfs_fromle32(off);
+
+    // walk the frame headers from the nearest entry
+    for (lfs_size_t i = index - index % zfile->stride; i < index; i++) {
+        lfs_soff_t res = lfs_file_seek(lfs, &zfile->file, off, LFS_SEEK_SET);
+        if (res < 0) {
+            return res;
+        }
+
+        uint8_t header[2];
+        lfs_ssize_t n = lfs_file_read(lfs, &zfile->file,
+                header, sizeof(header));
+        if (n < 0) {
+            return n;
+        }
+
+        if (n != sizeof(header)) {
+            return LFS_ERR_CORRUPT;
+        }
+
+        off += sizeof(header) + (header[0] | (header[1] << 8));
+    }
+
+    return off;
+}
+
+// load a frame into the buffer
+static int lfs_zfile_load(lfs_t *lfs, lfs_zfile_t *zfile, lfs_size_t index) {
+    lfs_soff_t off = lfs_zfile_locate(lfs, zfile, index);
+    if (off < 0) {
+        return off;
+    }
+
+    lfs_soff_t res = lfs_file_seek(lfs, &zfile->file, off, LFS_SEEK_SET);
+    if (res < 0) {
+        return res;
+    }
+
+    uint8_t header[2];
+    lfs_ssize_t n = lfs_file_read(lfs, &zfile->file, header, sizeof(header));
+    if (n < 0) {
+        return n;
+    }
+
+    lfs_size_t size = lfs_min(zfile->frame_size,
+            zfile->size - index*zfile->frame_size);
+    lfs_size_t stored = header[0] | (header[1] << 8);
+    if (n != sizeof(header) || stored > size) {
+        return LFS_ERR_CORRUPT;
+    }
+
+    // frames that didn't compress are stored as is
+    zfile->flags &= ~LFS_ZF_FRAME;
+    n = lfs_file_read(lfs, &zfile->file,
+            (stored == size) ? zfile->buffer : zfile->zbuffer, stored);
+    if (n < 0) {
+        return n;
+    }
+
+    if ((lfs_size_t)n != stored) {
+        return LFS_ERR_CORRUPT;
+    }
+
+    if (stored < size) {
+        n = lfs_zfile_decompress(zfile->zbuffer, stored,
+                zfile->buffer, zfile->frame_size);
+        if (n < 0) {
+            return n;
+        }
+
+        if ((lfs_size_t)n != size) {
+            return LFS_ERR_CORRUPT;
+        }
+    }
+
+    zfile->frame = (struct lfs_zframe){
+        .index = index,
+        .off = off,
+        .size = size,
+        .stored = sizeof(header) + stored,
+    };
+    zfile->flags |= LFS_ZF_FRAME;
+    return 0;
+}
+
+// describe the first size bytes in the index header, the attribute is
+// committed whenever the file is, so it has to match what is written
+static void lfs_zfile_setsize(lfs_zfile_t *zfile, lfs_size_t size) {
+    uint8_t *header = zfile->index;
+    uint32_t le = lfs_tole32(size);
+    memcpy(&header[0], &le, 4);
+    header[6] = zfile->stride & 0xff;
+    header[7] = zfile->stride >> 8;
+
+    lfs_size_t frames = (size + zfile->frame_size-1) / zfile->frame_size;
+    zfile->attr.size = 8 + 4*((frames + zfile->stride-1) / zfile->stride);
+}
+
+#ifndef LFS_READONLY
+static void lfs_zfile_indexframe(lfs_zfile_t *zfile,
+        lfs_size_t index, lfs_off_t off) {
+    if (index % zfile->stride != 0) {
+        return;
+    }
+
+    // out of entries? drop every other one and double the stride
+    if (index / zfile->stride == zfile->index_count) {
+        for (lfs_size_t i = 0; i < zfile->index_count/2; i++) {
+            memcpy(lfs_zfile_entry(zfile, i),
+                    lfs_zfile_entry(zfile, 2*i), 4);
+        }
+        zfile->stride *= 2;
+    }
+
+    uint32_t entry = lfs_tole32(off);
+    memcpy(lfs_zfile_entry(zfile, index / zfile->stride), &entry, 4);
+}
+
+// write out the frame in the buffer, replacing it if it was written before
+static int lfs_zfile_flush(lfs_t *lfs, lfs_zfile_t *zfile) {
+    if (!(zfile->flags & LFS_ZF_DIRTY)) {
+        return 0;
+    }
+
+    lfs_size_t stored = lfs_zfile_compress(zfile->hash,
+            zfile->buffer, zfile->frame.size,
+            zfile->zbuffer, zfile->frame.size-1);
+    const uint8_t *data = zfile->zbuffer;
+    if (!stored) {
+        stored = zfile->frame.size;
+        data = zfile->buffer;
+    }
+
+    int err;
+    if (zfile->frame.stored) {
+        lfs_zfile_setsize(zfile, zfile->frame.index*zfile->frame_size);
+        err = lfs_file_truncate(lfs, &zfile->file, zfile->frame.off);
+        if (err) {
+            return err;
+        }
+    }
+
+    lfs_soff_t res = lfs_file_seek(lfs, &zfile->file,
+            zfile->frame.off, LFS_SEEK_SET);
+    if (res < 0) {
+        return res;
+    }
+
+    uint8_t header[2] = {stored & 0xff, stored >> 8};
+    lfs_ssize_t n = lfs_file_write(lfs, &zfile->file,
+            header, sizeof(header));
+    if (n < 0) {
+        return n;
+    }
+
+    n = lfs_file_write(lfs, &zfile->file, data, stored);
+    if (n < 0) {
+        return n;
+    }
+
+    if (!zfile->frame.stored) {
+        lfs_zfile_indexframe(zfile, zfile->frame.index, zfile->frame.off);
+    }
+
+    zfile->frame.stored = sizeof(header) + stored;
+    zfile->flags &= ~LFS_ZF_DIRTY;
+    lfs_zfile_setsize(zfile,
+            zfile->frame.index*zfile->frame_size + zfile->frame.size);
+    return 0;
+}
+#endif
+
+
+/// Compressed file functions ///
+
+int lfs_zfile_opencfg(lfs_t *lfs, lfs_zfile_t *zfile,
+        const char *path, int flags,
+        const struct lfs_zfile_config *cfg) {
+    static const struct lfs_zfile_config defaults = {0};
+    if (!cfg) {
+        cfg = &defaults;
+    }
+
+    zfile->cfg = cfg;
+    zfile->flags = flags;
+    zfile->pos = 0;
+    zfile->frame_size = (cfg->frame_size)
+            ? cfg->frame_size
+            : lfs->cfg->cache_size;
+    zfile->index_count = (cfg->index_count)
+            ? cfg->index_count
+            : LFS_ZFILE_INDEX_COUNT;
+    LFS_ASSERT(zfile->frame_size >= 64 && zfile->frame_size <= 32768);
+    LFS_ASSERT((zfile->frame_size & (zfile->frame_size-1)) == 0);
+    LFS_ASSERT(zfile->index_count >= 2 && zfile->index_count % 2 == 0);
+
+    lfs_size_t frame_size = zfile->frame_size;
+    if (cfg->buffer) {
+        zfile->buffer = cfg->buffer;
+    } else {
+        zfile->buffer = lfs_malloc(
+                LFS_ZFILE_BUFFER_SIZE(frame_size, zfile->index_count));
+        if (!zfile->buffer) {
+            return LFS_ERR_NOMEM;
+        }
+        zfile->flags |= LFS_ZF_ALLOCED;
+    }
+    zfile->zbuffer = &zfile->buffer[frame_size];
+    zfile->hash = (uint16_t*)&zfile->buffer[2*frame_size];
+    zfile->index = &zfile->buffer[2*frame_size + 2*LFS_ZFILE_HASH_SIZE];
+
+    // the index is read with the file, a missing attr leaves it zeroed
+    memset(zfile->index, 0, 8 + 4*zfile->index_count);
+    zfile->attr = (struct lfs_attr){
+        .type = (cfg->attr_type) ? cfg->attr_type : LFS_ZFILE_ATTR,
+        .buffer = zfile->index,
+        .size = 8 + 4*zfile->index_count,
+    };
+    zfile->fcfg = (struct lfs_file_config){
+        .buffer = cfg->file_buffer,
+        .attrs = &zfile->attr,
+        .attr_count = 1,
+    };
+
+    // we need to read back frames to append to them, frames are always
+    // written at the end so LFS_O_APPEND is harmless
+    int oflags = flags;
+#ifndef LFS_READONLY
+    if ((oflags & LFS_O_WRONLY) == LFS_O_WRONLY) {
+        oflags |= LFS_O_RDWR;
+    }
+#endif
+
+    int err = lfs_file_opencfg(lfs, &zfile->file, path, oflags,
+            &zfile->fcfg);
+    if (err) {
+        goto cleanup;
+    }
+
+    lfs_soff_t stored = lfs_file_size(lfs, &zfile->file);
+    if (stored < 0) {
+        err = stored;
+        goto cleanup_file;
+    }
+
+    uint8_t *header = zfile->index;
+#ifndef LFS_READONLY
+    if ((flags & LFS_O_WRONLY) == LFS_O_WRONLY && stored == 0) {
+        // new zfile
+        zfile->size = 0;
+        zfile->stride = 1;
+        header[4] = LFS_ZFILE_VERSION;
+        header[5] = lfs_npw2(frame_size);
+        lfs_zfile_setsize(zfile, 0);
+    } else
+#endif
+    if (header[4] == LFS_ZFILE_VERSION) {
+        uint32_t size;
+        memcpy(&size, &header[0], 4);
+        zfile->size = lfs_fromle32(size);
+        zfile->frame_size = (lfs_size_t)1 << header[5];
+        zfile->stride = header[6] | (header[7] << 8);
+        if (zfile->frame_size > frame_size
+                || zfile->stride == 0
+                || (lfs_zfile_frames(zfile) + zfile->stride-1)/zfile->stride
+                    > zfile->index_count) {
+            err = LFS_ERR_INVAL;
+            goto cleanup_file;
+        }
+
+        lfs_zfile_setsize(zfile, zfile->size);
+    } else {
+        // not a zfile, don't write an index to it
+        zfile->flags |= LFS_ZF_PLAIN;
+        zfile->fcfg.attr_count = 0;
+    }
+
+    return 0;
+
+cleanup_file:
+    lfs_file_close(lfs, &zfile->file);
+cleanup:
+    if (zfile->flags & LFS_ZF_ALLOCED) {
+        lfs_free(zfile->buffer);
+    }
+    return err;
+}
+
+int lfs_zfile_close(lfs_t *lfs, lfs_zfile_t *zfile) {
+    int err = 0;
+#ifndef LFS_READONLY
+    if (!(zfile->flags & LFS_ZF_PLAIN)) {
+        err = lfs_zfile_sync(lfs, zfile);
+    }
+#endif
+
+    int cerr = lfs_file_close(lfs, &zfile->file);
+    if (zfile->flags & LFS_ZF_ALLOCED) {
+        lfs_free(zfile->buffer);
+    }
+
+    return (err) ? err : cerr;
+}
+
+lfs_ssize_t lfs_zfile_read(lfs_t *lfs, lfs_zfile_t *zfile,
+        void *buffer, lfs_size_t size) {
+    if (zfile->flags & LFS_ZF_PLAIN) {
+        return lfs_file_read(lfs, &zfile->file, buffer, size);
+    }
+
+    if ((zfile->flags & LFS_O_RDONLY) != LFS_O_RDONLY) {
+        return LFS_ERR_BADF;
+    }
+
+    if (zfile->pos >= zfile->size) {
+        return 0;
+    }
+
+    uint8_t *data = buffer;
+    size = lfs_min(size, zfile->size - zfile->pos);
+    lfs_size_t nsize = size;
+    while (nsize > 0) {
+        lfs_size_t index = zfile->pos / zfile->frame_size;
+        if (!(zfile->flags & LFS_ZF_FRAME) || zfile->frame.index != index) {
+            int err;
+#ifndef LFS_READONLY
+            err = lfs_zfile_flush(lfs, zfile);
+            if (err) {
+                return err;
+            }
+#endif
+
+            err = lfs_zfile_load(lfs, zfile, index);
+            if (err) {
+                return err;
+            }
+        }
+
+        lfs_off_t off = zfile->pos - index*zfile->frame_size;
+        lfs_size_t diff = lfs_min(nsize, zfile->frame.size - off);
+        memcpy(data, &zfile->buffer[off], diff);
+
+        zfile->pos += diff;
+        data += diff;
+        nsize -= diff;
+    }
+
+    return size;
+}
+
+#ifndef LFS_READONLY
+lfs_ssize_t lfs_zfile_write(lfs_t *lfs, lfs_zfile_t *zfile,
+        const void *buffer, lfs_size_t size) {
+    if (zfile->flags & LFS_ZF_PLAIN) {
+        return lfs_file_write(lfs, &zfile->file, buffer, size);
+    }
+
+    if ((zfile->flags & LFS_O_WRONLY) != LFS_O_WRONLY) {
+        return LFS_ERR_BADF;
+    }
+
+    if (zfile->flags & LFS_O_APPEND) {
+        zfile->pos = zfile->size;
+    }
+
+    // compressed data can't be overwritten
+    if (zfile->pos != zfile->size) {
+        return LFS_ERR_INVAL;
+    }
+
+    if (size > LFS_FILE_MAX - zfile->size) {
+        return LFS_ERR_FBIG;
+    }
+
+    const uint8_t *data = buffer;
+    lfs_size_t nsize = size;
+    while (nsize > 0) {
+        // append to the last frame, loading it if it is partial
+        lfs_size_t index = zfile->size / zfile->frame_size;
+        if (!(zfile->flags & LFS_ZF_FRAME) || zfile->frame.index != index) {
+            int err = lfs_zfile_flush(lfs, zfile);
+            if (err) {
+                return err;
+            }
+
+            if (zfile->size % zfile->frame_size) {
+                err = lfs_zfile_load(lfs, zfile, index);
+                if (err) {
+                    return err;
+                }
+            } else {
+                lfs_soff_t off = lfs_file_size(lfs, &zfile->file);
+                if (off < 0) {
+                    return off;
+                }
+
+                zfile->frame = (struct lfs_zframe){
+                    .index = index,
+                    .off = off,
+                };
+                zfile->flags |= LFS_ZF_FRAME;
+            }
+        }
+
+        lfs_size_t diff = lfs_min(nsize,
+                zfile->frame_size - zfile->frame.size);
+        memcpy(&zfile->buffer[zfile->frame.size], data, diff);
+        zfile->frame.size += diff;
+        zfile->flags |= LFS_ZF_DIRTY;
+
+        zfile->size += diff;
+        zfile->pos += diff;
+        data += diff;
+        nsize -= diff;
+
+        if (zfile->frame.size == zfile->frame_size) {
+            int err = lfs_zfile_flush(lfs, zfile);
+            if (err) {
+                return err;
+            }
+        }
+    }
+
+    return size;
+}
+
+int lfs_zfile_sync(lfs_t *lfs, lfs_zfile_t *zfile) {
+    if (zfile->flags & LFS_ZF_PLAIN) {
+        return lfs_file_sync(lfs, &zfile->file);
+    }
+
+    if ((zfile->flags & LFS_O_WRONLY) != LFS_O_WRONLY) {
+        return 0;
+    }
+
+    // the index is committed with the file
+    int err = lfs_zfile_flush(lfs, zfile);
+    if (err) {
+        return err;
+    }
+
+    return lfs_file_sync(lfs, &zfile->file);
+}
+#endif
+
+lfs_soff_t lfs_zfile_seek(lfs_t *lfs, lfs_zfile_t *zfile,
+        lfs_soff_t off, int whence) {
+    if (zfile->flags & LFS_ZF_PLAIN) {
+        return lfs_file_seek(lfs, &zfile->file, off, whence);
+    }
+
+    lfs_soff_t npos = zfile->pos;
+    if (whence == LFS_SEEK_SET) {
+        npos = off;
+    } else if (whence == LFS_SEEK_CUR) {
+        npos = zfile->pos + off;
+    } else if (whence == LFS_SEEK_END) {
+        npos = zfile->size + off;
+    }
+
+    if (npos < 0 || npos > (lfs_soff_t)LFS_FILE_MAX) {
+        return LFS_ERR_INVAL;
+    }
+
+    zfile->pos = npos;
+    return npos;
+}
+
+lfs_soff_t lfs_zfile_tell(lfs_t *lfs, lfs_zfile_t *zfile) {
+    if (zfile->flags & LFS_ZF_PLAIN) {
+        return lfs_file_tell(lfs, &zfile->file);
+    }
+
+    return zfile->pos;
+}
+
+lfs_soff_t lfs_zfile_size(lfs_t *lfs, lfs_zfile_t *zfile) {
+    if (zfile->flags & LFS_ZF_PLAIN) {
+        return lfs_file_size(lfs, &zfile->file);
+    }
+
+    return zfile->size;
+}
+
+lfs_soff_t lfs_zfile_storedsize(lfs_t *lfs, lfs_zfile_t *zfile) {
+    return lfs_file_size(lfs, &zfile->file);
+}
@@ -0,0 +1,184 @@
+/*
+ * lfs zfile, transparently compressed append-only files
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef LFS_ZFILE_H
+#define LFS_ZFILE_H
+
+#include "lfs.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/// Compressed file definitions ///
+
+// A zfile is a regular littlefs file holding a sequence of independently
+// compressed frames of frame_size bytes in the LZ4 block format. Each frame
+// starts with a 2 byte little-endian stored size, frames that don't
+// compress are stored as is.
+//
+// A seek index with the offset of every stride'th frame is kept in a custom
+// attribute of the file, so it is committed atomically with the data. When
+// the index fills up every other entry is dropped and the stride doubles,
+// so finding a frame costs one index lookup plus at most stride-1 frame
+// header reads.
+//
+// Writes can only append, reads and seeks work anywhere. On sync a partial
+// last frame is written out, later appends recompress it with the rest of
+// its frame, so frequent syncs cost rewrites but not compression ratio.
+//
+// Files opened for writing that are new or empty become zfiles. Files
+// without the attribute are read and written as is, so plain files can be
+// opened through the same API.
+
+// Default attribute type of the seek index
+#ifndef LFS_ZFILE_ATTR
+#define LFS_ZFILE_ATTR 0x7a
+#endif
+
+// Default number of seek index entries
+#ifndef LFS_ZFILE_INDEX_COUNT
+#define LFS_ZFILE_INDEX_COUNT 64
+#endif
+
+// Entries in the compressor's hash table
+#define LFS_ZFILE_HASH_BITS 10
+#define LFS_ZFILE_HASH_SIZE (1 << LFS_ZFILE_HASH_BITS)
+
+// Size of the buffer a zfile needs, the frame, the compressed frame, the
+// hash table and the seek index
+#define LFS_ZFILE_BUFFER_SIZE(frame_size, index_count) \
+    (2*(frame_size) + 2*LFS_ZFILE_HASH_SIZE + 8 + 4*(index_count))
+
+// Configuration provided when opening a zfile
+struct lfs_zfile_config {
+    // Custom attribute type of the seek index. Defaults to LFS_ZFILE_ATTR
+    // when zero.
+    uint8_t attr_type;
+
+    // Uncompressed size of each frame, must be a power of two between 64
+    // and 32768. Larger frames compress better but cost more RAM and more
+    // decompression per random read. Existing files keep the frame size
+    // they were created with, which must not be larger. Defaults to
+    // cache_size when zero.
+    lfs_size_t frame_size;
+
+    // Number of seek index entries, must be even and the attribute,
+    // 8+4*index_count bytes, must fit in attr_max. Must not be smaller
+    // than when the file was written. Defaults to LFS_ZFILE_INDEX_COUNT
+    // when zero.
+    lfs_size_t index_count;
+
+    // Optional statically allocated buffer. Must be
+    // LFS_ZFILE_BUFFER_SIZE(frame_size, index_count). By default lfs_malloc
+    // is used to allocate this buffer.
+    void *buffer;
+
+    // Optional statically allocated cache of the underlying file, see
+    // struct lfs_file_config.
+    void *file_buffer;
+};
+
+// The zfile type
+typedef struct lfs_zfile {
+    lfs_file_t file;
+    struct lfs_file_config fcfg;
+    struct lfs_attr attr;
+    const struct lfs_zfile_config *cfg;
+
+    uint32_t flags;
+    lfs_off_t pos;
+    lfs_size_t size;
+    lfs_size_t frame_size;
+    lfs_size_t index_count;
+    lfs_size_t stride;
+
+    // frame in the buffer, stored is 0 until it is written
+    struct lfs_zframe {
+        lfs_size_t index;
+        lfs_off_t off;
+        lfs_size_t size;
+        lfs_size_t stored;
+    } frame;
+
+    uint8_t *buffer;
+    uint8_t *zbuffer;
+    uint16_t *hash;
+    uint8_t *index;
+} lfs_zfile_t;
+
+
+/// Compressed file functions ///
+
+// Open a zfile
+//
+// The flags are the same as lfs_file_open. The config must be allocated
+// while the file is open, and may be NULL for the defaults.
+//
+// Returns a negative error code on failure.
+int lfs_zfile_opencfg(lfs_t *lfs, lfs_zfile_t *zfile,
+        const char *path, int flags,
+        const struct lfs_zfile_config *config);
+
+// Close a zfile
+//
+// Any pending writes are written out to storage as though sync had been
+// called and releases any allocated resources.
+//
+// Returns a negative error code on failure.
+int lfs_zfile_close(lfs_t *lfs, lfs_zfile_t *zfile);
+
+// Read uncompressed data from a zfile
+//
+// Returns the number of bytes read, or a negative error code on failure.
+lfs_ssize_t lfs_zfile_read(lfs_t *lfs, lfs_zfile_t *zfile,
+        void *buffer, lfs_size_t size);
+
+#ifndef LFS_READONLY
+// Append data to a zfile
+//
+// Writes must start at the end of the file, LFS_ERR_INVAL is returned
+// otherwise.
+//
+// Returns the number of bytes written, or a negative error code on failure.
+lfs_ssize_t lfs_zfile_write(lfs_t *lfs, lfs_zfile_t *zfile,
+        const void *buffer, lfs_size_t size);
+
+// Synchronize a zfile on storage, writing out a partial last frame and the
+// seek index
+//
+// Returns a negative error code on failure.
+int lfs_zfile_sync(lfs_t *lfs, lfs_zfile_t *zfile);
+#endif
+
+// Change the position of a zfile
+//
+// Returns the new position, or a negative error code on failure.
+lfs_soff_t lfs_zfile_seek(lfs_t *lfs, lfs_zfile_t *zfile,
+        lfs_soff_t off, int whence);
+
+// Return the position of a zfile
+//
+// Returns the position, or a negative error code on failure.
+lfs_soff_t lfs_zfile_tell(lfs_t *lfs, lfs_zfile_t *zfile);
+
+// Return the uncompressed size of a zfile
+//
+// Returns the size, or a negative error code on failure.
+lfs_soff_t lfs_zfile_size(lfs_t *lfs, lfs_zfile_t *zfile);
+
+// Return the size a zfile takes in storage
+//
+// Returns the size, or a negative error code on failure.
+lfs_soff_t lfs_zfile_storedsize(lfs_t *lfs, lfs_zfile_t *zfile);
+
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
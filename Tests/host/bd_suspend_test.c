@@ -0,0 +1,220 @@
+/*
+ * Timing test of the erase suspend/resume in the littlefs block device.
+ *
+ * Builds Core/Src/littlefs_bd.c against the NOR simulator and runs reads
+ * against a background erase in a few patterns: a lone read, a burst of
+ * reads, a steady stream of reads, and a read of the sector being erased.
+ * Checks the memory is never accessed while busy, the read data, that
+ * the block device never busy-waits on the cycle counter, and that the
+ * erase still finishes in time. Prints the read latency and when the
+ * erase finished for each pattern.
+ */
+#include "nor_sim.h"
+#include "littlefs_bd.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK_SIZE 4096
+#define US 1000ULL
+#define MS 1000000ULL
+
+// typical MX66UW1G45G timing, the 4K erase is the part that matters
+static const struct nor_sim_timing timing = {
+    .erase      = 25*MS,
+    .suspend    = 20*US,
+    .command    = 1*US,
+    .read_byte  = 3,
+    .prog_page  = 150*US,
+    .dwt_read   = 10,
+};
+
+static const struct lfs_config cfg = {
+    .block_size = BLOCK_SIZE,
+};
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures += 1; \
+    } \
+} while (0)
+
+struct result {
+    uint32_t reads;
+    uint64_t latency_max;
+    uint64_t latency_sum;
+};
+
+static uint8_t pattern(lfs_block_t block, lfs_off_t off) {
+    return (uint8_t)(block*17 + off);
+}
+
+static void setup(void) {
+    nor_sim_reset(&timing);
+
+    // fill a few blocks to read back during the erases
+    uint8_t buffer[BLOCK_SIZE];
+    for (lfs_block_t block = 0; block < 8; block++) {
+        for (lfs_off_t off = 0; off < BLOCK_SIZE; off++) {
+            buffer[off] = pattern(block, off);
+        }
+        CHECK(user_provided_block_device_prog(&cfg, block, 0,
+                buffer, BLOCK_SIZE) == 0);
+    }
+}
+
+static void start_erase(lfs_block_t block) {
+    CHECK(user_provided_block_device_erase(&cfg, block) == 0);
+    CHECK(nor_sim_erasing());
+}
+
+static void timed_read(struct result *r, lfs_block_t block, lfs_off_t off,
+        lfs_size_t size) {
+    uint8_t buffer[BLOCK_SIZE];
+    uint32_t dwt_reads = nor_sim_stats()->dwt_reads;
+    uint64_t start = nor_sim_now();
+    CHECK(user_provided_block_device_read(&cfg, block, off,
+            buffer, size) == 0);
+    uint64_t latency = nor_sim_now() - start;
+
+    // one look at the counter to suspend and one when resuming, a
+    // busy-wait would take thousands
+    CHECK(nor_sim_stats()->dwt_reads - dwt_reads <= 2);
+
+    for (lfs_size_t i = 0; i < size; i++) {
+        if (buffer[i] != pattern(block, off+i)) {
+            CHECK(buffer[i] == pattern(block, off+i));
+            break;
+        }
+    }
+
+    r->reads += 1;
+    r->latency_sum += latency;
+    if (latency > r->latency_max) {
+        r->latency_max = latency;
+    }
+}
+
+// wait for the erase the way the next prog does
+static void finish_erase(lfs_block_t block) {
+    uint8_t data[16] = {0};
+    CHECK(user_provided_block_device_prog(&cfg, block, 0,
+            data, sizeof(data)) == 0);
+    CHECK(!nor_sim_erasing());
+    CHECK(nor_sim_stats()->violations == 0);
+}
+
+static void report(const char *name, const struct result *r,
+        uint64_t start) {
+    const struct nor_sim_stats *s = nor_sim_stats();
+    printf("%-8s %3"PRIu32" reads, %2"PRIu32" suspends, "
+            "latency avg %7.1f us max %7.1f us, "
+            "erase took %5.2f ms, slept %5.2f ms\n",
+            name, r->reads, s->suspends,
+            (r->reads) ? r->latency_sum / (double)r->reads / US : 0.0,
+            r->latency_max / (double)US,
+            (s->erase_done - start) / (double)MS,
+            s->sleep / (double)MS);
+}
+
+// a lone read a while into the erase suspends it and gets served at once
+static void test_lone(void) {
+    struct result r = {0};
+    setup();
+    uint64_t start = nor_sim_now();
+    start_erase(10);
+    nor_sim_idle(2*MS);
+    timed_read(&r, 3, 0, 256);
+    finish_erase(10);
+    report("lone", &r, start);
+
+    CHECK(nor_sim_stats()->suspends == 1);
+    CHECK(r.latency_max < 50*US);
+    // the erase only lost the time it was suspended
+    CHECK(nor_sim_stats()->erase_done - start < timing.erase + 50*US);
+}
+
+// a burst suspends once, the rest of the burst waits for the erase
+// instead of spinning until it may suspend again
+static void test_burst(void) {
+    struct result r = {0};
+    setup();
+    uint64_t start = nor_sim_now();
+    start_erase(10);
+    nor_sim_idle(1*MS);
+    for (int i = 0; i < 16; i++) {
+        timed_read(&r, i % 8, (i/8)*256, 256);
+        nor_sim_idle(5*US);
+    }
+    finish_erase(10);
+    report("burst", &r, start);
+
+    CHECK(nor_sim_stats()->suspends == 1);
+    CHECK(nor_sim_stats()->sleep > 0);
+    CHECK(nor_sim_stats()->erase_done - start < timing.erase + 50*US);
+}
+
+// reads spaced further apart than the resume gap each suspend the erase,
+// which still makes progress between them
+static void test_stream(void) {
+    struct result r = {0};
+    setup();
+    uint64_t start = nor_sim_now();
+    start_erase(10);
+    while (nor_sim_erasing()) {
+        nor_sim_idle(500*US);
+        timed_read(&r, r.reads % 8, 0, 64);
+    }
+    finish_erase(10);
+    report("stream", &r, start);
+
+    CHECK(nor_sim_stats()->sleep == 0);
+    CHECK(r.latency_max < 50*US);
+    // every suspended read delays the erase by about its own latency
+    CHECK(nor_sim_stats()->erase_done - start
+            < timing.erase + nor_sim_stats()->suspends*50*US);
+}
+
+// reads of the sector being erased, or right after the erase started,
+// wait for the erase
+static void test_wait(void) {
+    struct result r = {0};
+    setup();
+    start_erase(2);
+    nor_sim_idle(2*MS);
+    uint8_t buffer[256];
+    uint64_t start = nor_sim_now();
+    CHECK(user_provided_block_device_read(&cfg, 2, 0,
+            buffer, sizeof(buffer)) == 0);
+    CHECK(nor_sim_now() - start >= timing.erase - 2*MS);
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        CHECK(buffer[i] == 0xff);
+    }
+    CHECK(!nor_sim_erasing());
+
+    start = nor_sim_now();
+    start_erase(10);
+    nor_sim_idle(100*US);
+    timed_read(&r, 3, 0, 256);
+    CHECK(!nor_sim_erasing());
+    finish_erase(10);
+    report("wait", &r, start);
+
+    CHECK(nor_sim_stats()->suspends == 0);
+}
+
+int main(void) {
+    test_lone();
+    test_burst();
+    test_stream();
+    test_wait();
+
+    if (failures) {
+        printf("FAIL: %d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
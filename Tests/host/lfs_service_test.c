@@ -0,0 +1,426 @@
+/*
+ * Host test for the littlefs service and its request queue.
+ *
+ * First runs a single batch where a write fails between two syncs of the
+ * same file, and checks the earlier sync, which the worker merges into
+ * the later one, completes with the write's error rather than 0. The same
+ * requests run one at a time show what running them in order gives.
+ *
+ * Then a number of producer threads post bursts of writes and syncs to
+ * their own files through the lock-free queue while a worker thread runs
+ * it, and the latency from post to completion of every request is
+ * reported as p50/p99/max. The files are checked afterwards.
+ */
+#include "lfs.h"
+#include "lfs_service.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BLOCK_SIZE      4096
+#define BLOCK_COUNT     256
+#define CACHE_SIZE      256
+#define QUEUE_SIZE      64
+#define PRODUCERS       4
+#define BURSTS          100
+#define BURST_WRITES    4
+#define WRITE_SIZE      64
+
+// modelled bus time per access, in microseconds
+#define READ_US         5
+#define PROG_US         60
+#define ERASE_US        400
+
+static uint8_t bd_image[BLOCK_SIZE*BLOCK_COUNT];
+static atomic_bool prog_fail;
+
+static sem_t worker_wake;
+static atomic_bool worker_stop;
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures += 1; \
+    } \
+} while (0)
+
+
+// Block device
+
+static void bd_delay(long us) {
+    struct timespec ts = {.tv_sec = us/1000000, .tv_nsec = (us%1000000)*1000};
+    nanosleep(&ts, NULL);
+}
+
+static int bd_read(const struct lfs_config *c, lfs_block_t block,
+        lfs_off_t off, void *buffer, lfs_size_t size) {
+    bd_delay(READ_US);
+    memcpy(buffer, &bd_image[block*c->block_size + off], size);
+    return 0;
+}
+
+static int bd_prog(const struct lfs_config *c, lfs_block_t block,
+        lfs_off_t off, const void *buffer, lfs_size_t size) {
+    // only data blocks fail, the root pair at 0 and 1 still programs
+    if (atomic_load(&prog_fail) && block >= 2) {
+        return LFS_ERR_IO;
+    }
+
+    bd_delay(PROG_US);
+    memcpy(&bd_image[block*c->block_size + off], buffer, size);
+    return 0;
+}
+
+static int bd_erase(const struct lfs_config *c, lfs_block_t block) {
+    bd_delay(ERASE_US);
+    memset(&bd_image[block*c->block_size], 0xff, c->block_size);
+    return 0;
+}
+
+static int bd_sync(const struct lfs_config *c) {
+    return 0;
+}
+
+static const struct lfs_config cfg = {
+    .read           = bd_read,
+    .prog           = bd_prog,
+    .erase          = bd_erase,
+    .sync           = bd_sync,
+    .read_size      = 16,
+    .prog_size      = 256,
+    .block_size     = BLOCK_SIZE,
+    .block_count    = BLOCK_COUNT,
+    .block_cycles   = 500,
+    .cache_size     = CACHE_SIZE,
+    .lookahead_size = 32,
+};
+
+static void mount(lfs_t *lfs) {
+    memset(bd_image, 0xff, sizeof(bd_image));
+    if (lfs_format(lfs, &cfg) || lfs_mount(lfs, &cfg)) {
+        fprintf(stderr, "FAIL: format/mount\n");
+        exit(1);
+    }
+}
+
+static lfs_soff_t file_size(lfs_t *lfs, const char *path) {
+    struct lfs_info info;
+    int err = lfs_stat(lfs, path, &info);
+    return (err) ? err : (lfs_soff_t)info.size;
+}
+
+
+// A write failing between two syncs
+
+static void test_erred_sync(lfs_size_t batch_max) {
+    lfs_t lfs;
+    mount(&lfs);
+
+    struct lfs_service_config scfg = {
+        .queue_size = QUEUE_SIZE,
+        .batch_max  = batch_max,
+    };
+    lfs_service_t svc;
+    CHECK(lfs_service_init(&svc, &lfs, &scfg) == 0);
+
+    lfs_file_t file;
+    static uint8_t small[16];
+    static uint8_t large[2*BLOCK_SIZE];
+    memset(small, 'a', sizeof(small));
+    memset(large, 'b', sizeof(large));
+
+    struct lfs_request reqs[] = {
+        {.type = LFS_REQ_OPEN, .file = &file, .path = "erred",
+            .flags = LFS_O_WRONLY | LFS_O_CREAT},
+        {.type = LFS_REQ_WRITE, .file = &file,
+            .buffer = small, .size = sizeof(small)},
+        {.type = LFS_REQ_SYNC, .file = &file},
+        {.type = LFS_REQ_WRITE, .file = &file,
+            .buffer = large, .size = sizeof(large)},
+        {.type = LFS_REQ_SYNC, .file = &file},
+        {.type = LFS_REQ_CLOSE, .file = &file},
+    };
+    enum {OPEN, WRITE1, SYNC1, WRITE2, SYNC2, CLOSE};
+
+    // the small write stays inline, so only the large write needs a data
+    // block and hits the failing prog
+    CHECK(lfs_service_post(&svc, &reqs[OPEN]) == 0);
+    CHECK(lfs_service_run(&svc) == 1);
+    for (size_t i = WRITE1; i <= CLOSE; i++) {
+        CHECK(lfs_service_post(&svc, &reqs[i]) == 0);
+    }
+
+    atomic_store(&prog_fail, true);
+    CHECK(lfs_service_run(&svc) == CLOSE);
+    atomic_store(&prog_fail, false);
+
+    for (size_t i = OPEN; i <= CLOSE; i++) {
+        CHECK(lfs_request_done(&reqs[i]));
+    }
+    CHECK(reqs[OPEN].res == 0);
+    CHECK(reqs[WRITE1].res == sizeof(small));
+    CHECK(reqs[WRITE2].res == LFS_ERR_IO);
+
+    // the later sync and close don't flush an erred file and return 0
+    CHECK(reqs[SYNC2].res == 0);
+    CHECK(reqs[CLOSE].res == 0);
+
+    lfs_soff_t size = file_size(&lfs, "erred");
+    if (batch_max == 1) {
+        // in order the first sync ran before the failure, its data is
+        // on disk
+        CHECK(reqs[SYNC1].res == 0);
+        CHECK(size == sizeof(small));
+    } else {
+        // merged the first sync never flushed, it must not report
+        // success
+        CHECK(reqs[SYNC1].res == LFS_ERR_IO);
+        CHECK(size == 0);
+    }
+
+    printf("erred sync, batch_max %-3"PRIu32" sync1 %"PRId32", "
+            "on disk %"PRId32" bytes\n",
+            batch_max, reqs[SYNC1].res, size);
+
+    CHECK(lfs_service_deinit(&svc) == 0);
+    CHECK(lfs_unmount(&lfs) == 0);
+}
+
+
+// Producers against the queue
+
+struct timed_request {
+    struct lfs_request req;
+    struct timespec posted;
+    struct timespec completed;
+};
+
+struct producer {
+    lfs_service_t *svc;
+    int id;
+    lfs_file_t file;
+    uint64_t *latencies;
+    size_t count;
+    int errors;
+};
+
+static uint64_t ns_between(const struct timespec *a,
+        const struct timespec *b) {
+    return (uint64_t)(b->tv_sec - a->tv_sec)*1000000000
+            + (b->tv_nsec - a->tv_nsec);
+}
+
+static void on_complete(struct lfs_request *req) {
+    struct timed_request *t = (struct timed_request*)req;
+    clock_gettime(CLOCK_MONOTONIC, &t->completed);
+}
+
+static void post(lfs_service_t *svc, struct timed_request *t) {
+    t->req.cb = on_complete;
+    clock_gettime(CLOCK_MONOTONIC, &t->posted);
+    while (lfs_service_post(svc, &t->req) == LFS_ERR_NOMEM) {
+        sched_yield();
+    }
+}
+
+// post the requests back-to-back, then wait for all of them
+static void post_all(struct producer *p, struct timed_request *t, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        post(p->svc, &t[i]);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        while (!lfs_request_done(&t[i].req)) {
+            sched_yield();
+        }
+
+        p->latencies[p->count++] = ns_between(&t[i].posted, &t[i].completed);
+        if (t[i].req.res < 0) {
+            p->errors += 1;
+        }
+    }
+}
+
+static uint8_t producer_byte(int id, lfs_off_t off) {
+    return (uint8_t)(id*61 + off*3);
+}
+
+static void *producer(void *arg) {
+    struct producer *p = arg;
+    char path[16];
+    snprintf(path, sizeof(path), "p%d", p->id);
+
+    struct timed_request t[2*BURST_WRITES];
+    uint8_t data[BURST_WRITES][WRITE_SIZE];
+
+    memset(t, 0, sizeof(t));
+    t[0].req.type = LFS_REQ_OPEN;
+    t[0].req.file = &p->file;
+    t[0].req.path = path;
+    t[0].req.flags = LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC;
+    post_all(p, t, 1);
+
+    // a burst of writes each followed by a sync, the worker merges the
+    // syncs of a burst if it sees them in one batch
+    lfs_off_t off = 0;
+    for (int b = 0; b < BURSTS; b++) {
+        memset(t, 0, sizeof(t));
+        for (int i = 0; i < BURST_WRITES; i++) {
+            for (int j = 0; j < WRITE_SIZE; j++) {
+                data[i][j] = producer_byte(p->id, off + j);
+            }
+            off += WRITE_SIZE;
+
+            t[2*i+0].req.type = LFS_REQ_WRITE;
+            t[2*i+0].req.file = &p->file;
+            t[2*i+0].req.buffer = data[i];
+            t[2*i+0].req.size = WRITE_SIZE;
+            t[2*i+1].req.type = LFS_REQ_SYNC;
+            t[2*i+1].req.file = &p->file;
+        }
+        post_all(p, t, 2*BURST_WRITES);
+    }
+
+    memset(t, 0, sizeof(t));
+    t[0].req.type = LFS_REQ_CLOSE;
+    t[0].req.file = &p->file;
+    post_all(p, t, 1);
+    return NULL;
+}
+
+static void wake(const struct lfs_service_config *c) {
+    sem_post(&worker_wake);
+}
+
+static void *worker(void *arg) {
+    lfs_service_t *svc = arg;
+    while (true) {
+        sem_wait(&worker_wake);
+        if (atomic_load(&worker_stop)) {
+            break;
+        }
+
+        int res = lfs_service_run(svc);
+        if (res < 0) {
+            fprintf(stderr, "FAIL: lfs_service_run (%d)\n", res);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void test_producers(void) {
+    lfs_t lfs;
+    mount(&lfs);
+
+    struct lfs_service_config scfg = {
+        .wake       = wake,
+        .queue_size = QUEUE_SIZE,
+    };
+    lfs_service_t svc;
+    CHECK(lfs_service_init(&svc, &lfs, &scfg) == 0);
+
+    sem_init(&worker_wake, 0, 0);
+    atomic_store(&worker_stop, false);
+    pthread_t worker_thread;
+    pthread_create(&worker_thread, NULL, worker, &svc);
+
+    size_t per_producer = 2 + BURSTS*2*BURST_WRITES;
+    struct producer producers[PRODUCERS];
+    pthread_t threads[PRODUCERS];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < PRODUCERS; i++) {
+        producers[i] = (struct producer){
+            .svc = &svc,
+            .id = i,
+            .latencies = malloc(per_producer*sizeof(uint64_t)),
+        };
+        pthread_create(&threads[i], NULL, producer, &producers[i]);
+    }
+
+    for (int i = 0; i < PRODUCERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    atomic_store(&worker_stop, true);
+    sem_post(&worker_wake);
+    pthread_join(worker_thread, NULL);
+    sem_destroy(&worker_wake);
+
+    // gather the latencies of all producers
+    size_t total = 0;
+    uint64_t *all = malloc(PRODUCERS*per_producer*sizeof(uint64_t));
+    for (int i = 0; i < PRODUCERS; i++) {
+        CHECK(producers[i].errors == 0);
+        CHECK(producers[i].count == per_producer);
+        memcpy(&all[total], producers[i].latencies,
+                producers[i].count*sizeof(uint64_t));
+        total += producers[i].count;
+        free(producers[i].latencies);
+    }
+    qsort(all, total, sizeof(uint64_t), compare_u64);
+
+    printf("%d producers, %zu requests in %.0f ms\n",
+            PRODUCERS, total, ns_between(&start, &end) / 1e6);
+    printf("latency p50 %.0f us, p99 %.0f us, max %.0f us\n",
+            all[total/2] / 1e3,
+            all[total*99/100] / 1e3,
+            all[total-1] / 1e3);
+    free(all);
+
+    // every producer's writes must have landed in order
+    for (int i = 0; i < PRODUCERS; i++) {
+        char path[16];
+        snprintf(path, sizeof(path), "p%d", i);
+
+        lfs_file_t file;
+        CHECK(lfs_file_open(&lfs, &file, path, LFS_O_RDONLY) == 0);
+        CHECK(lfs_file_size(&lfs, &file) == BURSTS*BURST_WRITES*WRITE_SIZE);
+
+        uint8_t buffer[WRITE_SIZE];
+        for (lfs_off_t off = 0; off < BURSTS*BURST_WRITES*WRITE_SIZE;
+                off += WRITE_SIZE) {
+            CHECK(lfs_file_read(&lfs, &file, buffer, WRITE_SIZE)
+                    == WRITE_SIZE);
+            for (int j = 0; j < WRITE_SIZE; j++) {
+                if (buffer[j] != producer_byte(i, off + j)) {
+                    CHECK(buffer[j] == producer_byte(i, off + j));
+                    break;
+                }
+            }
+        }
+        CHECK(lfs_file_close(&lfs, &file) == 0);
+    }
+
+    CHECK(lfs_service_deinit(&svc) == 0);
+    CHECK(lfs_unmount(&lfs) == 0);
+}
+
+int main(void) {
+    test_erred_sync(1);
+    test_erred_sync(0);
+    test_producers();
+
+    if (failures) {
+        printf("FAIL: %d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,360 @@
+/*
+ * Host stress test for the littlefs shared (reader) lock.
+ *
+ * A few reader threads read back and verify a set of files, stat them and
+ * list the root directory, while one writer thread keeps creating, writing
+ * and removing files in a subdirectory. The block device is a RAM image
+ * that sleeps on every access to model bus time, so readers that don't
+ * serialise on each other show up as read throughput.
+ *
+ * Runs once with lock_shared left NULL, where every operation takes the
+ * exclusive lock, and once with a reader-writer lock behind lock_shared,
+ * then prints the read throughput of both. Built with LFS_THREADSAFE and
+ * asserts enabled, so each shared unlock also checks that the read paths
+ * only touched the read cache and the seed of their view.
+ */
+#define _GNU_SOURCE
+#include "lfs.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BLOCK_SIZE      4096
+#define BLOCK_COUNT     256
+#define CACHE_SIZE      256
+#define READERS         4
+#define FILES           8
+#define FILE_SIZE       (8*1024)
+#define CHUNK_SIZE      512
+#define RUN_MS          1000
+
+// modelled bus time per access, in microseconds
+#define READ_US         20
+#define PROG_US         60
+#define ERASE_US        400
+
+// the writer logs a record every few milliseconds rather than flat out,
+// so the readers have a lock to share between its writes
+#define WRITER_PAUSE_US 2000
+
+static uint8_t bd_image[BLOCK_SIZE*BLOCK_COUNT];
+
+static pthread_rwlock_t fs_lock;
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned slot_used;
+
+static atomic_bool stop;
+static atomic_int failures;
+static atomic_ullong read_bytes;
+static atomic_ullong write_ops;
+
+
+// Block device
+
+static void bd_delay(long us) {
+    struct timespec ts = {.tv_sec = us/1000000, .tv_nsec = (us%1000000)*1000};
+    nanosleep(&ts, NULL);
+}
+
+static int bd_read(const struct lfs_config *c, lfs_block_t block,
+        lfs_off_t off, void *buffer, lfs_size_t size) {
+    bd_delay(READ_US);
+    memcpy(buffer, &bd_image[block*c->block_size + off], size);
+    return 0;
+}
+
+static int bd_prog(const struct lfs_config *c, lfs_block_t block,
+        lfs_off_t off, const void *buffer, lfs_size_t size) {
+    bd_delay(PROG_US);
+    memcpy(&bd_image[block*c->block_size + off], buffer, size);
+    return 0;
+}
+
+static int bd_erase(const struct lfs_config *c, lfs_block_t block) {
+    bd_delay(ERASE_US);
+    memset(&bd_image[block*c->block_size], 0xff, c->block_size);
+    return 0;
+}
+
+static int bd_sync(const struct lfs_config *c) {
+    return 0;
+}
+
+
+// Locks
+
+static int fs_lock_exclusive(const struct lfs_config *c) {
+    return pthread_rwlock_wrlock(&fs_lock) ? LFS_ERR_IO : 0;
+}
+
+static int fs_unlock_exclusive(const struct lfs_config *c) {
+    return pthread_rwlock_unlock(&fs_lock) ? LFS_ERR_IO : 0;
+}
+
+static int fs_lock_shared(const struct lfs_config *c) {
+    if (pthread_rwlock_rdlock(&fs_lock)) {
+        return LFS_ERR_IO;
+    }
+
+    // at most READERS threads hold the lock, so a slot is always free
+    pthread_mutex_lock(&slot_lock);
+    int slot = __builtin_ctz(~slot_used);
+    slot_used |= 1u << slot;
+    pthread_mutex_unlock(&slot_lock);
+    return slot;
+}
+
+static int fs_unlock_shared(const struct lfs_config *c, int slot) {
+    pthread_mutex_lock(&slot_lock);
+    slot_used &= ~(1u << slot);
+    pthread_mutex_unlock(&slot_lock);
+    return pthread_rwlock_unlock(&fs_lock) ? LFS_ERR_IO : 0;
+}
+
+
+// Workload
+
+static uint8_t file_byte(int file, lfs_off_t off) {
+    return (uint8_t)(file*31 + off*7 + (off >> 8));
+}
+
+static void fail(const char *what, int file, int err) {
+    fprintf(stderr, "FAIL: %s r%d (%d)\n", what, file, err);
+    atomic_fetch_add(&failures, 1);
+    atomic_store(&stop, true);
+}
+
+static void *reader(void *arg) {
+    lfs_t *lfs = arg;
+    uint8_t buffer[CHUNK_SIZE];
+    unsigned seed = (unsigned)(uintptr_t)pthread_self();
+
+    while (!atomic_load(&stop)) {
+        int n = rand_r(&seed) % FILES;
+        char path[16];
+        snprintf(path, sizeof(path), "r%d", n);
+
+        struct lfs_info info;
+        int err = lfs_stat(lfs, path, &info);
+        if (err || info.size != FILE_SIZE) {
+            fail("stat", n, err);
+            break;
+        }
+
+        lfs_file_t file;
+        err = lfs_file_open(lfs, &file, path, LFS_O_RDONLY);
+        if (err) {
+            fail("open", n, err);
+            break;
+        }
+
+        for (lfs_off_t off = 0; off < FILE_SIZE; off += CHUNK_SIZE) {
+            lfs_ssize_t res = lfs_file_read(lfs, &file, buffer, CHUNK_SIZE);
+            if (res != CHUNK_SIZE) {
+                fail("read", n, res);
+                break;
+            }
+
+            for (lfs_size_t i = 0; i < CHUNK_SIZE; i++) {
+                if (buffer[i] != file_byte(n, off+i)) {
+                    fail("verify", n, off+i);
+                    break;
+                }
+            }
+            atomic_fetch_add(&read_bytes, CHUNK_SIZE);
+        }
+
+        err = lfs_file_close(lfs, &file);
+        if (err) {
+            fail("close", n, err);
+            break;
+        }
+
+        // every stable file must show up in the listing, whatever the
+        // writer is doing next to them
+        lfs_dir_t dir;
+        err = lfs_dir_open(lfs, &dir, "/");
+        if (err) {
+            fail("dir_open", n, err);
+            break;
+        }
+
+        int found = 0;
+        while ((err = lfs_dir_read(lfs, &dir, &info)) > 0) {
+            found += (info.name[0] == 'r');
+        }
+        lfs_dir_close(lfs, &dir);
+        if (err < 0 || found != FILES) {
+            fail("dir_read", found, err);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void *writer(void *arg) {
+    lfs_t *lfs = arg;
+    uint8_t buffer[1024];
+    memset(buffer, 0x5a, sizeof(buffer));
+
+    for (unsigned i = 0; !atomic_load(&stop); i++) {
+        char path[16];
+        snprintf(path, sizeof(path), "w/%u", i % 16);
+
+        lfs_file_t file;
+        int err = lfs_file_open(lfs, &file, path,
+                LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+        if (err) {
+            fail("writer open", i, err);
+            break;
+        }
+
+        for (unsigned j = 0; j < 1 + i % 4; j++) {
+            lfs_ssize_t res = lfs_file_write(lfs, &file,
+                    buffer, sizeof(buffer));
+            if (res < 0) {
+                err = res;
+                break;
+            }
+        }
+
+        int cerr = lfs_file_close(lfs, &file);
+        err = err ? err : cerr;
+        if (err) {
+            fail("writer close", i, err);
+            break;
+        }
+
+        if (i % 3 == 0) {
+            snprintf(path, sizeof(path), "w/%u", (i/3) % 16);
+            err = lfs_remove(lfs, path);
+            if (err && err != LFS_ERR_NOENT) {
+                fail("writer remove", i, err);
+                break;
+            }
+        }
+
+        atomic_fetch_add(&write_ops, 1);
+        bd_delay(WRITER_PAUSE_US);
+    }
+
+    return NULL;
+}
+
+static void setup(lfs_t *lfs, const struct lfs_config *cfg) {
+    memset(bd_image, 0xff, sizeof(bd_image));
+    if (lfs_format(lfs, cfg) || lfs_mount(lfs, cfg)) {
+        fprintf(stderr, "FAIL: format/mount\n");
+        exit(1);
+    }
+
+    uint8_t buffer[CHUNK_SIZE];
+    for (int n = 0; n < FILES; n++) {
+        char path[16];
+        snprintf(path, sizeof(path), "r%d", n);
+
+        lfs_file_t file;
+        lfs_file_open(lfs, &file, path, LFS_O_WRONLY | LFS_O_CREAT);
+        for (lfs_off_t off = 0; off < FILE_SIZE; off += CHUNK_SIZE) {
+            for (lfs_size_t i = 0; i < CHUNK_SIZE; i++) {
+                buffer[i] = file_byte(n, off+i);
+            }
+            lfs_file_write(lfs, &file, buffer, CHUNK_SIZE);
+        }
+        lfs_file_close(lfs, &file);
+    }
+
+    lfs_mkdir(lfs, "w");
+}
+
+static double run(bool shared, unsigned long long *writes) {
+    struct lfs_config cfg = {
+        .read           = bd_read,
+        .prog           = bd_prog,
+        .erase          = bd_erase,
+        .sync           = bd_sync,
+        .lock           = fs_lock_exclusive,
+        .unlock         = fs_unlock_exclusive,
+        .lock_shared    = shared ? fs_lock_shared : NULL,
+        .unlock_shared  = shared ? fs_unlock_shared : NULL,
+        .shared_max     = shared ? READERS : 0,
+        .read_size      = 16,
+        .prog_size      = 256,
+        .block_size     = BLOCK_SIZE,
+        .block_count    = BLOCK_COUNT,
+        .block_cycles   = 500,
+        .cache_size     = CACHE_SIZE,
+        .lookahead_size = 32,
+    };
+
+    // prefer the writer, or a steady stream of readers starves it
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+            PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&fs_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    lfs_t lfs;
+    setup(&lfs, &cfg);
+
+    atomic_store(&stop, false);
+    atomic_store(&read_bytes, 0);
+    atomic_store(&write_ops, 0);
+
+    pthread_t readers[READERS];
+    pthread_t writer_thread;
+    for (int i = 0; i < READERS; i++) {
+        pthread_create(&readers[i], NULL, reader, &lfs);
+    }
+    pthread_create(&writer_thread, NULL, writer, &lfs);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bd_delay(RUN_MS*1000L);
+    atomic_store(&stop, true);
+
+    for (int i = 0; i < READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    pthread_join(writer_thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    int err = lfs_unmount(&lfs);
+    if (err) {
+        fail("unmount", 0, err);
+    }
+    pthread_rwlock_destroy(&fs_lock);
+
+    double secs = (end.tv_sec - start.tv_sec)
+            + (end.tv_nsec - start.tv_nsec) / 1e9;
+    *writes = atomic_load(&write_ops);
+    return atomic_load(&read_bytes) / 1024.0 / secs;
+}
+
+int main(void) {
+    unsigned long long excl_writes, shared_writes;
+    double excl = run(false, &excl_writes);
+    double shared = run(true, &shared_writes);
+
+    printf("%d readers, 1 writer, %d ms each\n", READERS, RUN_MS);
+    printf("exclusive: %8.1f KiB/s read, %llu writer ops\n",
+            excl, excl_writes);
+    printf("shared:    %8.1f KiB/s read, %llu writer ops (x%.2f)\n",
+            shared, shared_writes, shared / excl);
+
+    if (atomic_load(&failures)) {
+        printf("FAIL: %d failures\n", atomic_load(&failures));
+        return 1;
+    }
+    if (shared_writes == 0) {
+        printf("FAIL: writer starved under the shared lock\n");
+        return 1;
+    }
+    return 0;
+}
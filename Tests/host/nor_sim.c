@@ -0,0 +1,178 @@
+/*
+ * NOR flash simulator with an erase suspend/resume timing model.
+ */
+#include "nor_sim.h"
+#include "main.h"
+#include "stm32u5g9j_discovery_hspi.h"
+
+#include <string.h>
+
+#define SECTOR_SIZE 4096
+
+uint32_t SystemCoreClock = 160000000;
+
+static uint8_t image[NOR_SIM_SIZE];
+static struct nor_sim_timing timing;
+static struct nor_sim_stats stats;
+static DWT_Type dwt;
+
+static uint64_t now;
+static int erasing;
+static int suspended;
+static uint32_t erase_addr;
+static uint64_t erase_left;
+
+
+// Clock
+
+// advance the clock, a resumed erase progresses meanwhile
+static void advance(uint64_t ns) {
+    if (erasing && !suspended) {
+        if (ns >= erase_left) {
+            erasing = 0;
+            stats.erase_done = now + erase_left;
+        } else {
+            erase_left -= ns;
+        }
+    }
+
+    now += ns;
+}
+
+void nor_sim_reset(const struct nor_sim_timing *t) {
+    memset(image, 0xff, sizeof(image));
+    memset(&stats, 0, sizeof(stats));
+    timing = *t;
+    now = 0;
+    erasing = 0;
+    suspended = 0;
+}
+
+uint64_t nor_sim_now(void) {
+    return now;
+}
+
+void nor_sim_idle(uint64_t ns) {
+    advance(ns);
+}
+
+int nor_sim_erasing(void) {
+    return erasing;
+}
+
+const struct nor_sim_stats *nor_sim_stats(void) {
+    return &stats;
+}
+
+DWT_Type *nor_sim_dwt(void) {
+    // a busy-wait on the counter shows up as many reads
+    stats.dwt_reads += 1;
+    advance(timing.dwt_read);
+    dwt.CYCCNT = (uint32_t)(now * (SystemCoreClock / 1000000) / 1000);
+    return &dwt;
+}
+
+
+// BSP
+
+static int overlaps_erase(uint32_t addr, uint32_t size) {
+    return erasing && addr < erase_addr + SECTOR_SIZE
+            && erase_addr < addr + size;
+}
+
+int32_t BSP_HSPI_NOR_Read(uint32_t Instance, uint8_t *pData,
+        uint32_t ReadAddr, uint32_t Size) {
+    // reads need the erase suspended, and not in the sector being erased
+    if ((erasing && !suspended) || overlaps_erase(ReadAddr, Size)) {
+        stats.violations += 1;
+    }
+
+    advance(timing.command + Size*timing.read_byte);
+    memcpy(pData, &image[ReadAddr], Size);
+    return BSP_ERROR_NONE;
+}
+
+int32_t BSP_HSPI_NOR_Write(uint32_t Instance, uint8_t *pData,
+        uint32_t WriteAddr, uint32_t Size) {
+    if (erasing) {
+        stats.violations += 1;
+    }
+
+    uint32_t pages = (WriteAddr % MX66UW1G45G_PAGE_SIZE + Size
+            + MX66UW1G45G_PAGE_SIZE - 1) / MX66UW1G45G_PAGE_SIZE;
+    advance(pages*(timing.command + timing.prog_page));
+    // programming only clears bits
+    for (uint32_t i = 0; i < Size; i++) {
+        image[WriteAddr + i] &= pData[i];
+    }
+    return BSP_ERROR_NONE;
+}
+
+int32_t BSP_HSPI_NOR_Erase_Block(uint32_t Instance, uint32_t BlockAddress,
+        BSP_HSPI_NOR_Erase_t BlockSize) {
+    if (erasing || BlockSize != MX66UW1G45G_ERASE_4K) {
+        stats.violations += 1;
+        return BSP_ERROR_COMPONENT_FAILURE;
+    }
+
+    advance(timing.command);
+    memset(&image[BlockAddress], 0xff, SECTOR_SIZE);
+    erasing = 1;
+    suspended = 0;
+    erase_addr = BlockAddress;
+    erase_left = timing.erase;
+    stats.erases += 1;
+    return BSP_ERROR_NONE;
+}
+
+int32_t BSP_HSPI_NOR_WaitForMemoryReady(uint32_t Instance) {
+    advance(timing.command);
+    if (erasing && suspended) {
+        // the memory reads ready while suspended, the erase is not done
+        stats.violations += 1;
+    } else if (erasing) {
+        // sleeps in BSP_HSPI_NOR_WaitCallback until the status match
+        uint64_t left = erase_left;
+        stats.sleep += left;
+        advance(left);
+    }
+    return BSP_ERROR_NONE;
+}
+
+int32_t BSP_HSPI_NOR_GetStatus(uint32_t Instance) {
+    advance(timing.command);
+    if (erasing && suspended) {
+        return BSP_ERROR_HSPI_SUSPENDED;
+    } else if (erasing) {
+        return BSP_ERROR_BUSY;
+    }
+    return BSP_ERROR_NONE;
+}
+
+int32_t BSP_HSPI_NOR_SuspendErase(uint32_t Instance) {
+    if (BSP_HSPI_NOR_GetStatus(Instance) != BSP_ERROR_BUSY) {
+        return BSP_ERROR_COMPONENT_FAILURE;
+    }
+
+    // the erase keeps going until the suspend takes effect, and may
+    // finish meanwhile
+    advance(timing.command + timing.suspend);
+    if (!erasing) {
+        return BSP_ERROR_COMPONENT_FAILURE;
+    }
+
+    suspended = 1;
+    stats.suspends += 1;
+    return BSP_ERROR_NONE;
+}
+
+int32_t BSP_HSPI_NOR_ResumeErase(uint32_t Instance) {
+    if (BSP_HSPI_NOR_GetStatus(Instance) != BSP_ERROR_HSPI_SUSPENDED) {
+        return BSP_ERROR_COMPONENT_FAILURE;
+    }
+
+    advance(timing.command);
+    suspended = 0;
+    stats.resumes += 1;
+    return BSP_ERROR_NONE;
+}
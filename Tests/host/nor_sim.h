@@ -0,0 +1,52 @@
+/*
+ * NOR flash simulator with an erase suspend/resume timing model.
+ *
+ * Implements the HSPI NOR BSP calls the littlefs block device makes on a
+ * RAM image and a virtual clock. An erase runs in the background and only
+ * makes progress while the clock advances with it resumed. Accesses the
+ * memory would reject, such as a read while an erase is running, are
+ * counted as violations rather than failing, so a test can check for them.
+ */
+#ifndef NOR_SIM_H
+#define NOR_SIM_H
+
+#include <stdint.h>
+
+#define NOR_SIM_SIZE (1024*1024)
+
+// Timing of the simulated memory, in nanoseconds
+struct nor_sim_timing {
+    uint64_t erase;         // 4K sector erase
+    uint64_t suspend;       // erase suspend latency
+    uint64_t command;       // any command, such as a status read
+    uint64_t read_byte;     // per byte read
+    uint64_t prog_page;     // page program
+    uint64_t dwt_read;      // CPU time of one cycle counter read
+};
+
+struct nor_sim_stats {
+    uint32_t erases;
+    uint32_t suspends;
+    uint32_t resumes;
+    uint32_t violations;
+    uint32_t dwt_reads;
+    uint64_t sleep;         // time the CPU slept waiting for the memory
+    uint64_t erase_done;    // time the last erase finished
+};
+
+// Reset the simulator to an erased memory at time 0
+void nor_sim_reset(const struct nor_sim_timing *timing);
+
+// Current time of the virtual clock
+uint64_t nor_sim_now(void);
+
+// Let the CPU do other work for a while, a running erase progresses
+void nor_sim_idle(uint64_t ns);
+
+// Whether an erase is still running or suspended
+int nor_sim_erasing(void);
+
+// Counters since the last reset
+const struct nor_sim_stats *nor_sim_stats(void);
+
+#endif
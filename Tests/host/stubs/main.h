@@ -0,0 +1,21 @@
+/*
+ * Host stand-in for Core/Inc/main.h, only what the block device uses.
+ * The DWT cycle counter follows the clock of the NOR simulator.
+ */
+#ifndef MAIN_H
+#define MAIN_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct
+{
+  uint32_t CYCCNT;
+} DWT_Type;
+
+DWT_Type *nor_sim_dwt(void);
+#define DWT (nor_sim_dwt())
+
+extern uint32_t SystemCoreClock;
+
+#endif
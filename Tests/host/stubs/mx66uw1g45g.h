@@ -0,0 +1,17 @@
+/*
+ * Host stand-in for the MX66UW1G45G component header, only what the
+ * block device uses.
+ */
+#ifndef MX66UW1G45G_H
+#define MX66UW1G45G_H
+
+#define MX66UW1G45G_PAGE_SIZE                    (uint32_t)256
+
+typedef enum
+{
+  MX66UW1G45G_ERASE_4K = 0,
+  MX66UW1G45G_ERASE_64K,
+  MX66UW1G45G_ERASE_BULK
+} MX66UW1G45G_Erase_t;
+
+#endif
@@ -0,0 +1,28 @@
+/*
+ * Host stand-in for the HSPI NOR BSP, implemented by the NOR simulator.
+ * Only what the block device uses.
+ */
+#ifndef STM32U5G9J_DISCOVERY_HSPI_H
+#define STM32U5G9J_DISCOVERY_HSPI_H
+
+#include <stdint.h>
+#include "mx66uw1g45g.h"
+
+#define BSP_ERROR_NONE                    0
+#define BSP_ERROR_WRONG_PARAM            -2
+#define BSP_ERROR_BUSY                   -3
+#define BSP_ERROR_PERIPH_FAILURE         -4
+#define BSP_ERROR_COMPONENT_FAILURE      -5
+#define BSP_ERROR_HSPI_SUSPENDED         -20
+
+typedef MX66UW1G45G_Erase_t BSP_HSPI_NOR_Erase_t;
+
+int32_t BSP_HSPI_NOR_Read(uint32_t Instance, uint8_t *pData, uint32_t ReadAddr, uint32_t Size);
+int32_t BSP_HSPI_NOR_Write(uint32_t Instance, uint8_t *pData, uint32_t WriteAddr, uint32_t Size);
+int32_t BSP_HSPI_NOR_Erase_Block(uint32_t Instance, uint32_t BlockAddress, BSP_HSPI_NOR_Erase_t BlockSize);
+int32_t BSP_HSPI_NOR_WaitForMemoryReady(uint32_t Instance);
+int32_t BSP_HSPI_NOR_GetStatus(uint32_t Instance);
+int32_t BSP_HSPI_NOR_SuspendErase(uint32_t Instance);
+int32_t BSP_HSPI_NOR_ResumeErase(uint32_t Instance);
+
+#endif